@@ -0,0 +1,361 @@
+//
+// asset_cooker.cpp : Command line tool that cooks all the models and textures of a
+// directory (the WorkingDir by default) into WorkingDir/Cooked, which is what the
+// engine loads (see cooked_assets.h).
+//
+// Cooking is incremental: Cooked/manifest.txt keeps, for every asset, the content
+// hash of all the files its output was built from (e.g. .obj -> .mtl -> textures).
+// Only assets whose output is missing or that have a dependency whose contents
+// changed are cooked again, in parallel on all the cores. A report with the time
+// spent on every asset is written to Cooked/build_report.txt.
+//
+// Usage: AssetCooker [working directory] [-f (cook everything)]
+//
+
+#include "cooked_assets.h"
+#include "model_import.h"
+#include "file_system.h"
+#include "hashing.h"
+#include "job_system.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string.h>
+
+#define MANIFEST_FILENAME COOKED_DIRECTORY "/manifest.txt"
+#define REPORT_FILENAME   COOKED_DIRECTORY "/build_report.txt"
+
+static std::mutex LogMutex;
+
+void LogString(const char* str)
+{
+    std::lock_guard<std::mutex> lock(LogMutex);
+    fprintf(stdout, "%s\n", str);
+}
+
+enum AssetType
+{
+    AssetType_Model,
+    AssetType_Texture
+};
+
+enum CookStatus
+{
+    CookStatus_UpToDate,
+    CookStatus_Cooked,
+    CookStatus_Failed
+};
+
+struct Dependency
+{
+    std::string path;
+    u64         contentHash; // 0 if the file does not exist
+};
+
+struct AssetNode
+{
+    std::string             source;
+    std::string             output;
+    AssetType               type;
+    std::vector<Dependency> dependencies;
+    CookStatus              status;
+    f64                     cookTime; // Seconds
+    u64                     outputSize;
+};
+
+static bool HasExtension(const std::string& path, const char* const* extensions, u32 count)
+{
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos)
+        return false;
+
+    std::string extension = path.substr(dot);
+    for (char& c : extension)
+        c = (char)tolower(c);
+
+    for (u32 i = 0; i < count; ++i)
+        if (extension == extensions[i])
+            return true;
+    return false;
+}
+
+static u64 HashFile(const std::string& path)
+{
+    if (!FileExists(path.c_str()))
+        return 0;
+
+    FileData file = ReadBinaryFile(path.c_str());
+    u64 hash = HashBytes(file.data, file.size);
+    FreeFileData(file);
+    return hash;
+}
+
+static u64 GetFileSize(const char* path)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return 0;
+    fseek(fp, 0, SEEK_END);
+    u64 size = (u64)ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+// Manifest format, the version of the cooked formats and one block per asset:
+//   version <COOKED_ASSET_VERSION>
+//   asset <source path>
+//   dep <content hash> <dependency path>
+//   ...
+static std::map<std::string, std::vector<Dependency>> ReadManifest()
+{
+    std::map<std::string, std::vector<Dependency>> manifest;
+
+    FILE* fp = fopen(MANIFEST_FILENAME, "rb");
+    if (!fp)
+        return manifest;
+
+    char line[1024];
+    u32 version = 0;
+    std::vector<Dependency>* dependencies = NULL;
+    while (fgets(line, sizeof(line), fp))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+
+        unsigned long long hash;
+        int pathStart = 0;
+        if (sscanf(line, "version %u", &version) == 1)
+        {
+            continue;
+        }
+        else if (strncmp(line, "asset ", 6) == 0)
+        {
+            dependencies = &manifest[line + 6];
+        }
+        else if (dependencies && sscanf(line, "dep %llx %n", &hash, &pathStart) == 1 && pathStart > 0)
+        {
+            dependencies->push_back(Dependency{ line + pathStart, (u64)hash });
+        }
+    }
+
+    fclose(fp);
+
+    // Everything is cooked again for a new version of the cooked formats
+    if (version != COOKED_ASSET_VERSION)
+        manifest.clear();
+    return manifest;
+}
+
+static void WriteManifest(const std::vector<AssetNode>& assets)
+{
+    FILE* fp = fopen(MANIFEST_FILENAME, "wb");
+    if (!fp)
+    {
+        ELOG("fopen() failed writing %s", MANIFEST_FILENAME);
+        return;
+    }
+
+    fprintf(fp, "version %u\n", COOKED_ASSET_VERSION);
+    for (const AssetNode& asset : assets)
+    {
+        // Failed assets are left out so they are cooked again next time
+        if (asset.status == CookStatus_Failed)
+            continue;
+
+        fprintf(fp, "asset %s\n", asset.source.c_str());
+        for (const Dependency& dependency : asset.dependencies)
+            fprintf(fp, "dep %016llx %s\n", (unsigned long long)dependency.contentHash, dependency.path.c_str());
+    }
+
+    fclose(fp);
+}
+
+static void WriteReport(const std::vector<AssetNode>& assets, f64 totalTime)
+{
+    static const char* statusNames[] = { "up to date", "cooked", "FAILED" };
+
+    FILE* fp = fopen(REPORT_FILENAME, "wb");
+    if (!fp)
+    {
+        ELOG("fopen() failed writing %s", REPORT_FILENAME);
+        return;
+    }
+
+    u32 counts[3] = {};
+    f64 cookTime = 0.0;
+    fprintf(fp, "%-12s %10s %12s %5s  %s\n", "Status", "Time (ms)", "Output (KB)", "Deps", "Asset");
+    for (const AssetNode& asset : assets)
+    {
+        counts[asset.status]++;
+        cookTime += asset.cookTime;
+        fprintf(fp, "%-12s %10.2f %12.2f %5u  %s\n", statusNames[asset.status], asset.cookTime * 1000.0,
+                asset.outputSize / 1024.0, (u32)asset.dependencies.size(), asset.source.c_str());
+    }
+
+    fprintf(fp, "\n%u assets: %u cooked, %u up to date, %u failed\n", (u32)assets.size(),
+            counts[CookStatus_Cooked], counts[CookStatus_UpToDate], counts[CookStatus_Failed]);
+    fprintf(fp, "Cook time: %.2f ms (sum of all assets), %.2f ms wall clock on %u threads\n",
+            cookTime * 1000.0, totalTime * 1000.0, GetJobThreadCount());
+    fclose(fp);
+
+    ILOG("%u assets: %u cooked, %u up to date, %u failed in %.2f ms. Report written to %s", (u32)assets.size(),
+         counts[CookStatus_Cooked], counts[CookStatus_UpToDate], counts[CookStatus_Failed], totalTime * 1000.0, REPORT_FILENAME);
+}
+
+static bool CookAsset(AssetNode& asset)
+{
+    std::vector<std::string> dependencies;
+
+    if (asset.type == AssetType_Model)
+    {
+        ImportedModel model;
+        if (!ImportModel(asset.source.c_str(), model, &dependencies) || !WriteCookedModel(asset.output.c_str(), model))
+            return false;
+    }
+    else
+    {
+        CookedTexture texture;
+        if (!CookTexture(asset.source.c_str(), texture) || !WriteCookedTexture(asset.output.c_str(), texture))
+            return false;
+        dependencies.push_back(asset.source);
+    }
+
+    asset.dependencies.clear();
+    for (const std::string& dependency : dependencies)
+        asset.dependencies.push_back(Dependency{ dependency, HashFile(dependency) });
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    const char* workingDirectory = "WorkingDir";
+    bool forceCook = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-f") == 0)
+            forceCook = true;
+        else
+            workingDirectory = argv[i];
+    }
+
+    // Asset paths are relative to the WorkingDir, as in the engine
+    if (!ChangeWorkingDirectory(workingDirectory))
+    {
+        ELOG("Could not open directory %s", workingDirectory);
+        return 1;
+    }
+
+    static const char* modelExtensions[] = { ".obj", ".fbx", ".dae", ".3ds", ".gltf", ".glb" };
+    static const char* textureExtensions[] = { ".png", ".jpg", ".jpeg", ".tga", ".bmp" };
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    InitJobSystem();
+    CreateDirectories(COOKED_DIRECTORY);
+
+    std::vector<std::string> files;
+    ListFilesRecursive(".", files);
+
+    std::vector<AssetNode> assets;
+    for (const std::string& file : files)
+    {
+        if (file.compare(0, strlen(COOKED_DIRECTORY "/"), COOKED_DIRECTORY "/") == 0)
+            continue;
+
+        AssetNode asset = {};
+        asset.source = file;
+        if (HasExtension(file, modelExtensions, ARRAY_COUNT(modelExtensions)))
+        {
+            asset.type = AssetType_Model;
+            asset.output = GetCookedModelPath(file.c_str());
+        }
+        else if (HasExtension(file, textureExtensions, ARRAY_COUNT(textureExtensions)))
+        {
+            asset.type = AssetType_Texture;
+            asset.output = GetCookedTexturePath(file.c_str());
+        }
+        else
+        {
+            continue;
+        }
+        assets.push_back(asset);
+    }
+    std::sort(assets.begin(), assets.end(), [](const AssetNode& a, const AssetNode& b) { return a.source < b.source; });
+
+    // An asset is stale if its output is missing or any of the files it was cooked
+    // from changed (or appeared/disappeared) since the last cook
+    std::map<std::string, std::vector<Dependency>> manifest = forceCook ? std::map<std::string, std::vector<Dependency>>() : ReadManifest();
+
+    std::map<std::string, u64> fileHashes;
+    for (auto& entry : manifest)
+        for (const Dependency& dependency : entry.second)
+            fileHashes[dependency.path] = 0;
+
+    std::vector<std::map<std::string, u64>::iterator> hashesToCompute;
+    for (auto it = fileHashes.begin(); it != fileHashes.end(); ++it)
+        hashesToCompute.push_back(it);
+
+    ParallelFor((u32)hashesToCompute.size(), 4, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i)
+            hashesToCompute[i]->second = HashFile(hashesToCompute[i]->first);
+    });
+
+    std::vector<u32> staleAssets;
+    for (u32 i = 0; i < assets.size(); ++i)
+    {
+        AssetNode& asset = assets[i];
+        auto it = manifest.find(asset.source);
+
+        bool isStale = (it == manifest.end()) || !FileExists(asset.output.c_str());
+        if (!isStale)
+        {
+            asset.dependencies = it->second;
+            for (const Dependency& dependency : asset.dependencies)
+                isStale |= fileHashes[dependency.path] != dependency.contentHash;
+        }
+
+        if (isStale)
+            staleAssets.push_back(i);
+        else
+            asset.outputSize = GetFileSize(asset.output.c_str());
+    }
+
+    ILOG("%u of %u assets need to be cooked", (u32)staleAssets.size(), (u32)assets.size());
+
+    ParallelFor((u32)staleAssets.size(), 1, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i)
+        {
+            AssetNode& asset = assets[staleAssets[i]];
+
+            auto assetStartTime = std::chrono::high_resolution_clock::now();
+            bool success = CookAsset(asset);
+            auto assetEndTime = std::chrono::high_resolution_clock::now();
+
+            asset.status = success ? CookStatus_Cooked : CookStatus_Failed;
+            asset.cookTime = std::chrono::duration<f64>(assetEndTime - assetStartTime).count();
+            asset.outputSize = success ? GetFileSize(asset.output.c_str()) : 0;
+
+            if (success)
+            {
+                ILOG("Cooked %s (%.2f ms)", asset.source.c_str(), asset.cookTime * 1000.0);
+            }
+            else
+            {
+                ELOG("Failed to cook %s", asset.source.c_str());
+            }
+        }
+    });
+
+    WriteManifest(assets);
+
+    auto endTime = std::chrono::high_resolution_clock::now();
+    WriteReport(assets, std::chrono::duration<f64>(endTime - startTime).count());
+
+    ShutdownJobSystem();
+
+    for (const AssetNode& asset : assets)
+        if (asset.status == CookStatus_Failed)
+            return 1;
+    return 0;
+}
@@ -0,0 +1,64 @@
+//
+// asset_packer.cpp : Command line tool that packs all the assets of a directory (the
+// WorkingDir by default) into a single asset pack file. At startup the engine opens
+// WorkingDir/assets.pack if present and reads every packed file from it.
+//
+// Usage: AssetPacker [input directory] [output pack file]
+//
+
+#include "asset_pack.h"
+#include "file_system.h"
+#include "job_system.h"
+
+#include <string.h>
+
+void LogString(const char* str)
+{
+    fprintf(stdout, "%s\n", str);
+}
+
+static bool ShouldPackFile(const std::string& path)
+{
+    // Binaries and editor/debugger files are not assets. Shaders stay loose so
+    // they can still be hot reloaded.
+    static const char* excludedExtensions[] = {
+        ".dll", ".exe", ".pdb", ".ilk", ".ini", ".rdbg", ".pack", ".glsl", ".txt"
+    };
+
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos)
+        return true;
+
+    std::string extension = path.substr(dot);
+    for (u32 i = 0; i < ARRAY_COUNT(excludedExtensions); ++i)
+        if (extension == excludedExtensions[i])
+            return false;
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    const char* inputDirectory = argc > 1 ? argv[1] : "WorkingDir";
+    std::string outputFile = argc > 2 ? argv[2] : std::string(inputDirectory) + "/" + ASSET_PACK_FILENAME;
+
+    std::vector<std::string> allFiles;
+    ListFilesRecursive(inputDirectory, allFiles);
+
+    std::vector<std::string> files;
+    for (const std::string& file : allFiles)
+        if (ShouldPackFile(file))
+            files.push_back(file);
+
+    if (files.empty())
+    {
+        ELOG("No files to pack found in %s", inputDirectory);
+        return 1;
+    }
+
+    InitJobSystem();
+    bool success = WriteAssetPack(outputFile.c_str(), inputDirectory, files);
+    ShutdownJobSystem();
+
+    return success ? 0 : 1;
+}
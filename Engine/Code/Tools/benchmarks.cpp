@@ -0,0 +1,347 @@
+//
+// benchmarks.cpp : Command line tool with micro benchmarks of engine systems that can
+// run without a window or an OpenGL context.
+//
+// Usage: Benchmarks <benchmark> [working directory]
+//
+// Benchmarks:
+//   obj   Parse throughput (MB/s) of the native OBJ loader against the Assimp import,
+//         for every .obj in the working directory plus a large generated grid.
+//   bvh   Build and refit time of the BVH over 100k random boxes, and throughput of its
+//         frustum and ray queries against a linear scan of the boxes.
+//
+
+#include "model_import.h"
+#include "obj_loader.h"
+#include "bvh.h"
+#include "file_system.h"
+#include "frustum_culling.h"
+#include "job_system.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <chrono>
+#include <string.h>
+
+#define OBJ_BENCHMARK_ITERATIONS 5
+#define OBJ_BENCHMARK_GRID_SIZE  1024
+#define OBJ_BENCHMARK_GRID_FILE  "benchmark_grid.obj"
+
+#define BVH_BENCHMARK_ITEMS       100000
+#define BVH_BENCHMARK_WORLD_SIZE  2000.0f
+#define BVH_BENCHMARK_FRUSTUMS    200
+#define BVH_BENCHMARK_RAYS        20000
+
+void LogString(const char* str)
+{
+    fprintf(stdout, "%s\n", str);
+}
+
+typedef bool (*ImportFunction)(const char* filename, ImportedModel& model, std::vector<std::string>* dependencies);
+
+struct ImportResult
+{
+    f64 seconds; // Best of all the iterations
+    u32 vertexCount;
+    u32 indexCount;
+    bool success;
+};
+
+static ImportResult BenchmarkImport(ImportFunction import, const char* filename)
+{
+    ImportResult result = {};
+    result.seconds = 1e30;
+
+    for (u32 i = 0; i < OBJ_BENCHMARK_ITERATIONS; ++i)
+    {
+        ImportedModel model;
+        auto startTime = std::chrono::high_resolution_clock::now();
+        result.success = import(filename, model, NULL);
+        auto endTime = std::chrono::high_resolution_clock::now();
+
+        if (!result.success)
+            return result;
+
+        result.seconds = glm::min(result.seconds, std::chrono::duration<f64>(endTime - startTime).count());
+        result.vertexCount = 0;
+        result.indexCount = 0;
+        for (const ImportedSubmesh& submesh : model.submeshes)
+        {
+            result.vertexCount += (u32)(submesh.vertices.size() * sizeof(float) / submesh.vertexBufferLayout.stride);
+            result.indexCount += (u32)submesh.indices.size();
+        }
+    }
+    return result;
+}
+
+// Heightfield with positions, texture coordinates and normals, written as quads
+static bool WriteGridObj(const char* filename, u32 size)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (!fp)
+        return false;
+
+    for (u32 y = 0; y < size; ++y)
+    {
+        for (u32 x = 0; x < size; ++x)
+        {
+            const f32 height = 0.1f * sinf(x * 0.05f) * cosf(y * 0.05f);
+            fprintf(fp, "v %f %f %f\n", x * 0.01f, height, y * -0.01f);
+            fprintf(fp, "vt %f %f\n", (f32)x / size, (f32)y / size);
+            fprintf(fp, "vn %f %f %f\n", 0.0f, 1.0f, 0.0f);
+        }
+    }
+
+    for (u32 y = 0; y + 1 < size; ++y)
+    {
+        for (u32 x = 0; x + 1 < size; ++x)
+        {
+            const u32 a = y * size + x + 1;
+            const u32 b = a + 1;
+            const u32 c = a + size + 1;
+            const u32 d = a + size;
+            fprintf(fp, "f %u/%u/%u %u/%u/%u %u/%u/%u %u/%u/%u\n", a, a, a, b, b, b, c, c, c, d, d, d);
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+static u64 GetFileSize(const char* path)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return 0;
+    fseek(fp, 0, SEEK_END);
+    u64 size = (u64)ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+static void BenchmarkObj()
+{
+    std::vector<std::string> files;
+    ListFilesRecursive(".", files);
+
+    std::vector<std::string> objFiles;
+    for (const std::string& file : files)
+    {
+        if (file.size() > 4 && file.compare(file.size() - 4, 4, ".obj") == 0 && file != OBJ_BENCHMARK_GRID_FILE)
+            objFiles.push_back(file);
+    }
+
+    ILOG("Generating %ux%u grid...", OBJ_BENCHMARK_GRID_SIZE, OBJ_BENCHMARK_GRID_SIZE);
+    if (WriteGridObj(OBJ_BENCHMARK_GRID_FILE, OBJ_BENCHMARK_GRID_SIZE))
+    {
+        objFiles.push_back(OBJ_BENCHMARK_GRID_FILE);
+    }
+    else
+    {
+        ELOG("Could not write %s", OBJ_BENCHMARK_GRID_FILE);
+    }
+
+    ILOG("Best of %u imports on %u threads", OBJ_BENCHMARK_ITERATIONS, GetJobThreadCount());
+    ILOG("%-32s %10s %12s %12s %12s %12s %8s", "File", "Size (MB)", "Native (ms)", "Native MB/s", "Assimp (ms)", "Assimp MB/s", "Speedup");
+
+    for (const std::string& file : objFiles)
+    {
+        const f64 megabytes = GetFileSize(file.c_str()) / (1024.0 * 1024.0);
+        ImportResult native = BenchmarkImport(ImportObjModel, file.c_str());
+        ImportResult assimp = BenchmarkImport(ImportModelAssimp, file.c_str());
+
+        if (!native.success || !assimp.success)
+        {
+            ELOG("%-32s import failed (native %s, Assimp %s)", file.c_str(), native.success ? "ok" : "failed", assimp.success ? "ok" : "failed");
+            continue;
+        }
+
+        ILOG("%-32s %10.2f %12.2f %12.2f %12.2f %12.2f %7.2fx", file.c_str(), megabytes,
+             native.seconds * 1000.0, megabytes / native.seconds,
+             assimp.seconds * 1000.0, megabytes / assimp.seconds,
+             assimp.seconds / native.seconds);
+
+        // Both should weld to a similar number of vertices, Assimp also reorders them
+        if (native.indexCount != assimp.indexCount)
+        {
+            ELOG("%-32s index count mismatch: native %u, Assimp %u", file.c_str(), native.indexCount, assimp.indexCount);
+        }
+    }
+
+    remove(OBJ_BENCHMARK_GRID_FILE);
+}
+
+static f32 RandomFloat(u32& state)
+{
+    // xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state & 0xFFFFFF) / (f32)0x1000000;
+}
+
+static glm::vec3 RandomVec3(u32& state, f32 scale)
+{
+    return glm::vec3(RandomFloat(state), RandomFloat(state), RandomFloat(state)) * scale;
+}
+
+static f64 SecondsSince(std::chrono::high_resolution_clock::time_point startTime)
+{
+    return std::chrono::duration<f64>(std::chrono::high_resolution_clock::now() - startTime).count();
+}
+
+static void BenchmarkBvh()
+{
+    u32 seed = 0x2545F491;
+
+    // Boxes of sizes between 1 and 10 spread over the world, as entities of a large scene
+    std::vector<glm::vec3> aabbMin(BVH_BENCHMARK_ITEMS), aabbMax(BVH_BENCHMARK_ITEMS);
+    for (u32 i = 0; i < BVH_BENCHMARK_ITEMS; ++i)
+    {
+        aabbMin[i] = RandomVec3(seed, BVH_BENCHMARK_WORLD_SIZE);
+        aabbMax[i] = aabbMin[i] + glm::vec3(1.0f) + RandomVec3(seed, 9.0f);
+    }
+
+    Bvh bvh = {};
+    auto startTime = std::chrono::high_resolution_clock::now();
+    BuildBvh(bvh, aabbMin.data(), aabbMax.data(), BVH_BENCHMARK_ITEMS);
+    const f64 buildSeconds = SecondsSince(startTime);
+
+    // Move a tenth of the boxes and refit
+    for (u32 i = 0; i < BVH_BENCHMARK_ITEMS; i += 10)
+    {
+        const glm::vec3 offset = RandomVec3(seed, 20.0f) - glm::vec3(10.0f);
+        SetBvhItemBounds(bvh, i, aabbMin[i] + offset, aabbMax[i] + offset);
+        aabbMin[i] += offset;
+        aabbMax[i] += offset;
+    }
+    startTime = std::chrono::high_resolution_clock::now();
+    RefitBvh(bvh);
+    const f64 refitSeconds = SecondsSince(startTime);
+
+    ILOG("%u items, %u nodes", BVH_BENCHMARK_ITEMS, (u32)bvh.nodes.size());
+    ILOG("Build: %.2f ms, refit: %.2f ms (cost %.1f after build, %.1f after refit)",
+         buildSeconds * 1000.0, refitSeconds * 1000.0, bvh.buildCost, GetBvhCost(bvh));
+
+    // Frustums of cameras inside the world looking in random directions
+    std::vector<Frustum> frustums(BVH_BENCHMARK_FRUSTUMS);
+    const glm::mat4 projection = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 500.0f);
+    for (Frustum& frustum : frustums)
+    {
+        const glm::vec3 eye = RandomVec3(seed, BVH_BENCHMARK_WORLD_SIZE);
+        const glm::vec3 target = eye + RandomVec3(seed, 2.0f) - glm::vec3(1.0f);
+        frustum = MakeFrustum(projection * glm::lookAt(eye, target, glm::vec3(0.0f, 1.0f, 0.0f)));
+    }
+
+    std::vector<u32> items;
+    u64 bvhFrustumHits = 0;
+    startTime = std::chrono::high_resolution_clock::now();
+    for (const Frustum& frustum : frustums)
+    {
+        items.clear();
+        QueryBvhFrustum(bvh, frustum, items);
+        bvhFrustumHits += items.size();
+    }
+    const f64 bvhFrustumSeconds = SecondsSince(startTime);
+
+    u64 linearFrustumHits = 0;
+    startTime = std::chrono::high_resolution_clock::now();
+    for (const Frustum& frustum : frustums)
+    {
+        for (u32 i = 0; i < BVH_BENCHMARK_ITEMS; ++i)
+            linearFrustumHits += TestFrustumBox(frustum, aabbMin[i], aabbMax[i]) != FrustumOverlap_Outside;
+    }
+    const f64 linearFrustumSeconds = SecondsSince(startTime);
+
+    // Rays from random points to random points, as long picking rays
+    std::vector<glm::vec3> rayOrigins(BVH_BENCHMARK_RAYS), rayDirections(BVH_BENCHMARK_RAYS);
+    for (u32 i = 0; i < BVH_BENCHMARK_RAYS; ++i)
+    {
+        rayOrigins[i] = RandomVec3(seed, BVH_BENCHMARK_WORLD_SIZE);
+        rayDirections[i] = glm::normalize(RandomVec3(seed, 2.0f) - glm::vec3(1.0f));
+    }
+
+    std::vector<u32> bvhRayHits(BVH_BENCHMARK_RAYS);
+    startTime = std::chrono::high_resolution_clock::now();
+    for (u32 i = 0; i < BVH_BENCHMARK_RAYS; ++i)
+    {
+        f32 distance;
+        if (!RaycastBvh(bvh, rayOrigins[i], rayDirections[i], BVH_BENCHMARK_WORLD_SIZE, bvhRayHits[i], distance))
+            bvhRayHits[i] = UINT32_MAX;
+    }
+    const f64 bvhRaySeconds = SecondsSince(startTime);
+
+    std::vector<u32> linearRayHits(BVH_BENCHMARK_RAYS);
+    startTime = std::chrono::high_resolution_clock::now();
+    for (u32 i = 0; i < BVH_BENCHMARK_RAYS; ++i)
+    {
+        const glm::vec3 inverseDirection = 1.0f / rayDirections[i];
+        f32 nearest = BVH_BENCHMARK_WORLD_SIZE;
+        linearRayHits[i] = UINT32_MAX;
+        for (u32 j = 0; j < BVH_BENCHMARK_ITEMS; ++j)
+        {
+            f32 distance;
+            if (IntersectRayBox(rayOrigins[i], inverseDirection, aabbMin[j], aabbMax[j], nearest, distance) && distance < nearest)
+            {
+                nearest = distance;
+                linearRayHits[i] = j;
+            }
+        }
+    }
+    const f64 linearRaySeconds = SecondsSince(startTime);
+
+    ILOG("%-16s %14s %14s %8s", "Query", "BVH (q/s)", "Linear (q/s)", "Speedup");
+    ILOG("%-16s %14.0f %14.0f %7.1fx", "Frustum", BVH_BENCHMARK_FRUSTUMS / bvhFrustumSeconds,
+         BVH_BENCHMARK_FRUSTUMS / linearFrustumSeconds, linearFrustumSeconds / bvhFrustumSeconds);
+    ILOG("%-16s %14.0f %14.0f %7.1fx", "Nearest ray hit", BVH_BENCHMARK_RAYS / bvhRaySeconds,
+         BVH_BENCHMARK_RAYS / linearRaySeconds, linearRaySeconds / bvhRaySeconds);
+
+    // Both must find the same items (rays may hit a different box at the same distance)
+    if (bvhFrustumHits != linearFrustumHits)
+    {
+        ELOG("Frustum query mismatch: BVH %llu, linear %llu", bvhFrustumHits, linearFrustumHits);
+    }
+    u32 rayMismatches = 0;
+    for (u32 i = 0; i < BVH_BENCHMARK_RAYS; ++i)
+        rayMismatches += (bvhRayHits[i] == UINT32_MAX) != (linearRayHits[i] == UINT32_MAX);
+    if (rayMismatches > 0)
+    {
+        ELOG("Ray query mismatch in %u rays", rayMismatches);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        ELOG("Usage: Benchmarks <obj|bvh> [working directory]");
+        return 1;
+    }
+
+    const char* workingDirectory = argc > 2 ? argv[2] : "WorkingDir";
+    if (!ChangeWorkingDirectory(workingDirectory))
+    {
+        ELOG("Could not open directory %s", workingDirectory);
+        return 1;
+    }
+
+    InitJobSystem();
+
+    int result = 0;
+    if (strcmp(argv[1], "obj") == 0)
+    {
+        BenchmarkObj();
+    }
+    else if (strcmp(argv[1], "bvh") == 0)
+    {
+        BenchmarkBvh();
+    }
+    else
+    {
+        ELOG("Unknown benchmark %s", argv[1]);
+        result = 1;
+    }
+
+    ShutdownJobSystem();
+    return result;
+}
@@ -0,0 +1,338 @@
+#include "asset_pack.h"
+#include "file_system.h"
+#include "compression.h"
+#include "hashing.h"
+#include "job_system.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string.h>
+
+struct AssetPack
+{
+    MappedFile             file;
+    const AssetPackHeader* header;
+    const AssetPackEntry*  entries;
+    const AssetPackBlock*  blocks;
+    const char*            strings;
+};
+
+static AssetPack GlobalAssetPack = {};
+
+static int ComparePaths(const char* a, u32 aLength, const char* b, u32 bLength)
+{
+    int cmp = memcmp(a, b, aLength < bLength ? aLength : bLength);
+    if (cmp != 0)
+        return cmp;
+    return (aLength < bLength) ? -1 : (aLength > bLength ? 1 : 0);
+}
+
+std::string NormalizeAssetPath(const char* filepath)
+{
+    std::vector<std::string> parts;
+    std::string part;
+
+    for (const char* c = filepath; ; ++c)
+    {
+        if (*c == '/' || *c == '\\' || *c == 0)
+        {
+            if (part == "..")
+            {
+                if (!parts.empty() && parts.back() != "..")
+                    parts.pop_back();
+                else
+                    parts.push_back(part);
+            }
+            else if (!part.empty() && part != ".")
+            {
+                parts.push_back(part);
+            }
+            part.clear();
+
+            if (*c == 0)
+                break;
+        }
+        else
+        {
+            part += *c;
+        }
+    }
+
+    std::string path = (filepath[0] == '/') ? "/" : "";
+    for (u32 i = 0; i < parts.size(); ++i)
+    {
+        if (i > 0)
+            path += '/';
+        path += parts[i];
+    }
+    return path;
+}
+
+bool OpenAssetPack(const char* filepath)
+{
+    CloseAssetPack();
+
+    MappedFile file = MapFile(filepath);
+    if (!file.data)
+        return false;
+
+    const AssetPackHeader* header = (const AssetPackHeader*)file.data;
+    if (file.size < sizeof(AssetPackHeader) || header->magic != ASSET_PACK_MAGIC || header->version != ASSET_PACK_VERSION)
+    {
+        ELOG("%s is not a valid asset pack", filepath);
+        UnmapFile(file);
+        return false;
+    }
+
+    const u64 tocSize = (u64)header->entryCount * sizeof(AssetPackEntry) + (u64)header->blockCount * sizeof(AssetPackBlock) + header->stringsSize;
+    if (header->tocOffset + tocSize > file.size)
+    {
+        ELOG("Asset pack %s is truncated", filepath);
+        UnmapFile(file);
+        return false;
+    }
+
+    GlobalAssetPack.file    = file;
+    GlobalAssetPack.header  = header;
+    GlobalAssetPack.entries = (const AssetPackEntry*)(file.data + header->tocOffset);
+    GlobalAssetPack.blocks  = (const AssetPackBlock*)(GlobalAssetPack.entries + header->entryCount);
+    GlobalAssetPack.strings = (const char*)(GlobalAssetPack.blocks + header->blockCount);
+
+    ILOG("Asset pack %s opened: %u files, %u blocks", filepath, header->entryCount, header->blockCount);
+    return true;
+}
+
+void CloseAssetPack()
+{
+    UnmapFile(GlobalAssetPack.file);
+    GlobalAssetPack = {};
+}
+
+bool IsAssetPackOpen()
+{
+    return GlobalAssetPack.header != NULL;
+}
+
+const AssetPackEntry* FindAssetPackEntry(const char* filepath)
+{
+    if (!IsAssetPackOpen())
+        return NULL;
+
+    std::string path = NormalizeAssetPath(filepath);
+
+    u32 first = 0;
+    u32 count = GlobalAssetPack.header->entryCount;
+    while (count > 0)
+    {
+        u32 step = count / 2;
+        const AssetPackEntry& entry = GlobalAssetPack.entries[first + step];
+        int cmp = ComparePaths(GlobalAssetPack.strings + entry.pathOffset, entry.pathLength, path.c_str(), (u32)path.size());
+        if (cmp == 0)
+            return &entry;
+
+        if (cmp < 0)
+        {
+            first += step + 1;
+            count -= step + 1;
+        }
+        else
+        {
+            count = step;
+        }
+    }
+
+    return NULL;
+}
+
+bool ReadAssetPackEntry(const AssetPackEntry* entry, void* dst)
+{
+    ASSERT(IsAssetPackOpen(), "The asset pack must be open");
+
+    const u32 blockSize = GlobalAssetPack.header->blockSize;
+    std::atomic<bool> success(true);
+
+    ParallelFor(entry->blockCount, 1, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i)
+        {
+            const AssetPackBlock& block = GlobalAssetPack.blocks[entry->firstBlock + i];
+            const u8* src = GlobalAssetPack.file.data + block.offset;
+            u8* blockDst = (u8*)dst + (u64)i * blockSize;
+
+            if (block.offset + block.compressedSize > GlobalAssetPack.file.size)
+            {
+                success = false;
+            }
+            else if (block.compressedSize == block.size)
+            {
+                memcpy(blockDst, src, block.size);
+            }
+            else if (LZ4Decompress(src, block.compressedSize, blockDst, block.size) != (i32)block.size)
+            {
+                success = false;
+            }
+        }
+    });
+
+    if (!success)
+        ELOG("Corrupted data in asset pack entry %.*s", entry->pathLength, GlobalAssetPack.strings + entry->pathOffset);
+
+    return success;
+}
+
+bool WriteAssetPack(const char* packFilepath, const char* rootDirectory, const std::vector<std::string>& files)
+{
+    struct PackFile
+    {
+        std::string path;
+        FileData    data;
+        u64         contentHash;
+        u32         firstBlock;
+        u32         blockCount;
+    };
+
+    struct CompressedBlock
+    {
+        u32             file;
+        u32             offset;
+        std::vector<u8> data;
+        u32             size;
+    };
+
+    std::vector<PackFile> packFiles(files.size());
+    for (u32 i = 0; i < files.size(); ++i)
+        packFiles[i].path = NormalizeAssetPath(files[i].c_str());
+
+    // The table of contents is sorted so lookups are a binary search
+    std::sort(packFiles.begin(), packFiles.end(), [](const PackFile& a, const PackFile& b) { return a.path < b.path; });
+
+    std::string root = rootDirectory;
+    ParallelFor((u32)packFiles.size(), 1, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i)
+        {
+            packFiles[i].data = ReadBinaryFile((root + "/" + packFiles[i].path).c_str());
+            packFiles[i].contentHash = HashBytes(packFiles[i].data.data, packFiles[i].data.size);
+        }
+    });
+
+    // Split every unique file in blocks, identical files point to the same blocks
+    std::vector<CompressedBlock> blocks;
+    std::map<u64, u32> uniqueFiles;
+    for (u32 i = 0; i < packFiles.size(); ++i)
+    {
+        PackFile& packFile = packFiles[i];
+
+        auto it = uniqueFiles.find(packFile.contentHash);
+        if (it != uniqueFiles.end() && packFiles[it->second].data.size == packFile.data.size)
+        {
+            packFile.firstBlock = packFiles[it->second].firstBlock;
+            packFile.blockCount = packFiles[it->second].blockCount;
+            continue;
+        }
+        uniqueFiles[packFile.contentHash] = i;
+
+        packFile.firstBlock = (u32)blocks.size();
+        packFile.blockCount = (u32)((packFile.data.size + ASSET_PACK_BLOCK_SIZE - 1) / ASSET_PACK_BLOCK_SIZE);
+        for (u32 b = 0; b < packFile.blockCount; ++b)
+        {
+            CompressedBlock block = {};
+            block.file = i;
+            block.offset = b * ASSET_PACK_BLOCK_SIZE;
+            block.size = (u32)std::min<u64>(ASSET_PACK_BLOCK_SIZE, packFile.data.size - block.offset);
+            blocks.push_back(block);
+        }
+    }
+
+    ParallelFor((u32)blocks.size(), 4, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i)
+        {
+            CompressedBlock& block = blocks[i];
+            const u8* src = packFiles[block.file].data.data + block.offset;
+
+            block.data.resize(LZ4CompressBound(block.size));
+            u32 compressedSize = LZ4Compress(src, block.size, block.data.data(), (u32)block.data.size());
+
+            // Already compressed data (png, jpg...) is stored as is
+            if (compressedSize == 0 || compressedSize >= block.size)
+                block.data.assign(src, src + block.size);
+            else
+                block.data.resize(compressedSize);
+        }
+    });
+
+    FILE* fp = fopen(packFilepath, "wb");
+    if (!fp)
+    {
+        ELOG("fopen() failed writing asset pack %s", packFilepath);
+        for (PackFile& packFile : packFiles)
+            FreeFileData(packFile.data);
+        return false;
+    }
+
+    AssetPackHeader header = {};
+    header.magic = ASSET_PACK_MAGIC;
+    header.version = ASSET_PACK_VERSION;
+    header.blockSize = ASSET_PACK_BLOCK_SIZE;
+    header.entryCount = (u32)packFiles.size();
+    header.blockCount = (u32)blocks.size();
+    fwrite(&header, sizeof(header), 1, fp);
+
+    // Every block starts at a multiple of the block size, so a block never straddles
+    // more pages or disk sectors than needed and can be read with aligned I/O
+    const std::vector<u8> blockPadding(ASSET_PACK_BLOCK_SIZE, 0);
+    std::vector<AssetPackBlock> blockTable(blocks.size());
+    u64 offset = sizeof(header);
+    for (u32 i = 0; i < blocks.size(); ++i)
+    {
+        const u64 blockOffset = (offset + ASSET_PACK_BLOCK_SIZE - 1) & ~(u64)(ASSET_PACK_BLOCK_SIZE - 1);
+        fwrite(blockPadding.data(), 1, blockOffset - offset, fp);
+        offset = blockOffset;
+
+        blockTable[i].offset = offset;
+        blockTable[i].compressedSize = (u32)blocks[i].data.size();
+        blockTable[i].size = blocks[i].size;
+        fwrite(blocks[i].data.data(), 1, blocks[i].data.size(), fp);
+        offset += blocks[i].data.size();
+    }
+
+    std::string strings;
+    std::vector<AssetPackEntry> entries(packFiles.size());
+    for (u32 i = 0; i < packFiles.size(); ++i)
+    {
+        entries[i].pathOffset = (u32)strings.size();
+        entries[i].pathLength = (u32)packFiles[i].path.size();
+        entries[i].size = packFiles[i].data.size;
+        entries[i].contentHash = packFiles[i].contentHash;
+        entries[i].firstBlock = packFiles[i].firstBlock;
+        entries[i].blockCount = packFiles[i].blockCount;
+        strings += packFiles[i].path;
+    }
+
+    // Keep the table of contents aligned, it is read in place from the mapped file
+    const u8 padding[8] = {};
+    const u64 alignedOffset = (offset + 7) & ~7ULL;
+    fwrite(padding, 1, alignedOffset - offset, fp);
+
+    header.tocOffset = alignedOffset;
+    header.stringsSize = (u32)strings.size();
+    fwrite(entries.data(), sizeof(AssetPackEntry), entries.size(), fp);
+    fwrite(blockTable.data(), sizeof(AssetPackBlock), blockTable.size(), fp);
+    fwrite(strings.data(), 1, strings.size(), fp);
+    const u64 packSize = (u64)ftell(fp);
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+    bool success = ferror(fp) == 0;
+    fclose(fp);
+
+    u64 totalSize = 0;
+    for (PackFile& packFile : packFiles)
+    {
+        totalSize += packFile.data.size;
+        FreeFileData(packFile.data);
+    }
+
+    ILOG("Asset pack %s written: %u files, %llu bytes -> %llu bytes", packFilepath, header.entryCount, totalSize, packSize);
+
+    return success;
+}
@@ -0,0 +1,84 @@
+//
+// asset_pack.h: Single-file archive with all the assets of the WorkingDir.
+//
+// Layout of the file:
+//   AssetPackHeader
+//   Compressed blocks (LZ4, every block holds up to blockSize bytes of a single file
+//   and starts at a multiple of blockSize)
+//   AssetPackEntry[entryCount]  (table of contents, sorted by path)
+//   AssetPackBlock[blockCount]
+//   Path strings
+//
+// Every file is split in blocks of 64 KB of uncompressed data that are compressed
+// independently, so block i of a file always decompresses to offset i * blockSize and
+// all the blocks of a file can be decompressed in parallel.
+//
+
+#pragma once
+
+#include "platform.h"
+
+#define ASSET_PACK_MAGIC      0x4B504553 // "SEPK"
+#define ASSET_PACK_VERSION    2
+#define ASSET_PACK_BLOCK_SIZE KB(64)
+#define ASSET_PACK_FILENAME   "assets.pack"
+
+struct AssetPackHeader
+{
+    u32 magic;
+    u32 version;
+    u32 blockSize;
+    u32 entryCount;
+    u32 blockCount;
+    u32 stringsSize;
+    u64 tocOffset;
+};
+
+struct AssetPackEntry
+{
+    u32 pathOffset;
+    u32 pathLength;
+    u64 size;
+    u64 contentHash;
+    u32 firstBlock;
+    u32 blockCount;
+};
+
+struct AssetPackBlock
+{
+    u64 offset;
+    u32 compressedSize; // Equal to size when the block is stored uncompressed
+    u32 size;
+};
+
+/**
+ * Maps the pack file in memory. While it is open, ReadBinaryFile and ReadTextFile
+ * read the files it contains from it instead of from disk.
+ */
+bool OpenAssetPack(const char* filepath);
+
+void CloseAssetPack();
+
+bool IsAssetPackOpen();
+
+/**
+ * Binary search of a path in the table of contents. Returns NULL if the pack is not
+ * open or does not contain the file.
+ */
+const AssetPackEntry* FindAssetPackEntry(const char* filepath);
+
+/**
+ * Decompresses the whole entry into dst, which must have room for entry->size bytes.
+ */
+bool ReadAssetPackEntry(const AssetPackEntry* entry, void* dst);
+
+/**
+ * Creates a pack with the given files (relative to rootDirectory). Files with the
+ * same contents are stored only once.
+ */
+bool WriteAssetPack(const char* packFilepath, const char* rootDirectory, const std::vector<std::string>& files);
+
+/**
+ * Paths stored in the pack use '/' as separator and have no "." or ".." components.
+ */
+std::string NormalizeAssetPath(const char* filepath);
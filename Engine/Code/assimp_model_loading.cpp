@@ -1,275 +1,259 @@
 
-#include <assimp/cimport.h>
-#include <assimp/scene.h>
-#include <assimp/postprocess.h>
-
 #include "assimp_model_loading.h"
 #include "engine.h"
+#include "cooked_assets.h"
+#include "geometry_storage.h"
+#include "hashing.h"
 
-void ProcessAssimpMesh(const aiScene* scene, aiMesh *mesh, Mesh *myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
+u64 HashSubmesh(const Submesh& submesh)
 {
-    std::vector<float> vertices;
-    std::vector<u32> indices;
-
-    bool hasTexCoords = false;
-    bool hasTangentSpace = false;
+    u64 hash = HashValue(submesh.vertexBufferLayout.stride);
+    for (const VertexBufferAttribute& attribute : submesh.vertexBufferLayout.attributes)
+        hash = HashCombine(hash, HashValue(attribute));
+    hash = HashCombine(hash, HashBytes(submesh.vertices.data(), submesh.vertices.size() * sizeof(float)));
+    hash = HashCombine(hash, HashBytes(submesh.indices.data(), submesh.indices.size() * sizeof(u32)));
+    return hash;
+}
 
-    // process vertices
-    for(unsigned int i = 0; i < mesh->mNumVertices; i++)
+u64 HashMaterial(App* app, const Material& material)
+{
+    // Hash the GL handles instead of the indices: different texture entries may share
+    // the same handle after the texture deduplication
+    const u32 textureIndices[] = {
+        material.albedoTextureIdx, material.emissiveTextureIdx, material.specularTextureIdx,
+        material.normalsTextureIdx, material.bumpTextureIdx
+    };
+
+    u64 hash = HashValue(material.albedo);
+    hash = HashCombine(hash, HashValue(material.emissive));
+    hash = HashCombine(hash, HashValue(material.smoothness));
+    hash = HashCombine(hash, HashValue(material.hasBumpText));
+    hash = HashCombine(hash, HashValue(material.hasNormalText));
+    for (u32 i = 0; i < ARRAY_COUNT(textureIndices); ++i)
     {
-        vertices.push_back(mesh->mVertices[i].x);
-        vertices.push_back(mesh->mVertices[i].y);
-        vertices.push_back(mesh->mVertices[i].z);
-        vertices.push_back(mesh->mNormals[i].x);
-        vertices.push_back(mesh->mNormals[i].y);
-        vertices.push_back(mesh->mNormals[i].z);
-
-        if(mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
-        {
-            hasTexCoords = true;
-            vertices.push_back(mesh->mTextureCoords[0][i].x);
-            vertices.push_back(mesh->mTextureCoords[0][i].y);
-        }
-
-        if(mesh->mTangents != nullptr && mesh->mBitangents)
-        {
-            hasTangentSpace = true;
-            vertices.push_back(mesh->mTangents[i].x);
-            vertices.push_back(mesh->mTangents[i].y);
-            vertices.push_back(mesh->mTangents[i].z);
-
-            // For some reason ASSIMP gives me the bitangents flipped.
-            // Maybe it's my fault, but when I generate my own geometry
-            // in other files (see the generation of standard assets)
-            // and all the bitangents have the orientation I expect,
-            // everything works ok.
-            // I think that (even if the documentation says the opposite)
-            // it returns a left-handed tangent space matrix.
-            // SOLUTION: I invert the components of the bitangent here.
-            vertices.push_back(-mesh->mBitangents[i].x);
-            vertices.push_back(-mesh->mBitangents[i].y);
-            vertices.push_back(-mesh->mBitangents[i].z);
-        }
-
+        u32 texHandle = textureIndices[i] < app->textures.size() ? app->textures[textureIndices[i]].handle : UINT32_MAX;
+        hash = HashCombine(hash, HashValue(texHandle));
     }
+    return hash;
+}
+
+u32 AddMaterial(App* app, const Material& material)
+{
+    u64 hash = HashMaterial(app, material);
 
-    // process indices
-    for(unsigned int i = 0; i < mesh->mNumFaces; i++)
+    auto it = app->materialHashes.find(hash);
+    if (it != app->materialHashes.end())
     {
-        aiFace face = mesh->mFaces[i];
-        for(unsigned int j = 0; j < face.mNumIndices; j++)
-        {
-            indices.push_back(face.mIndices[j]);
-        }
+        app->dedupStats.sharedMaterials++;
+        app->dedupStats.materialBytesSaved += sizeof(Material);
+        return it->second;
     }
 
-    // store the proper (previously proceessed) material for this mesh
-    submeshMaterialIndices.push_back(baseMeshMaterialIndex + mesh->mMaterialIndex);
+    u32 materialIdx = (u32)app->materials.size();
+    app->materials.push_back(material);
+    app->materialHashes[hash] = materialIdx;
+    return materialIdx;
+}
+
+u32 AddMesh(App* app, Mesh& mesh)
+{
+    u32 vertexBufferSize = 0;
+    u32 indexBufferSize = 0;
 
-    // create the vertex format
-    VertexBufferLayout vertexBufferLayout = {};
-    vertexBufferLayout.attributes.push_back( VertexBufferAttribute{ 0, 3, 0 } );
-    vertexBufferLayout.attributes.push_back( VertexBufferAttribute{ 1, 3, 3*sizeof(float) } );
-    vertexBufferLayout.stride = 6 * sizeof(float);
-    if (hasTexCoords)
+    mesh.contentHash = 0;
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
     {
-        vertexBufferLayout.attributes.push_back( VertexBufferAttribute{ 2, 2, vertexBufferLayout.stride } );
-        vertexBufferLayout.stride += 2 * sizeof(float);
+        mesh.submeshes[i].contentHash = HashSubmesh(mesh.submeshes[i]);
+        mesh.contentHash = HashCombine(mesh.contentHash, mesh.submeshes[i].contentHash);
+
+        vertexBufferSize += mesh.submeshes[i].vertices.size() * sizeof(float);
+        indexBufferSize  += mesh.submeshes[i].indices.size()  * sizeof(u32);
     }
-    if (hasTangentSpace)
-    {
-        vertexBufferLayout.attributes.push_back( VertexBufferAttribute{ 3, 3, vertexBufferLayout.stride } );
-        vertexBufferLayout.stride += 3 * sizeof(float);
 
-        vertexBufferLayout.attributes.push_back( VertexBufferAttribute{ 4, 3, vertexBufferLayout.stride } );
-        vertexBufferLayout.stride += 3 * sizeof(float);
+    auto it = app->meshHashes.find(mesh.contentHash);
+    if (it != app->meshHashes.end())
+    {
+        app->dedupStats.sharedMeshes++;
+        app->dedupStats.meshBytesSaved += vertexBufferSize + indexBufferSize;
+        return it->second;
     }
 
-    // add the submesh into the mesh
-    Submesh submesh = {};
-    submesh.vertexBufferLayout = vertexBufferLayout;
-    submesh.vertices.swap(vertices);
-    submesh.indices.swap(indices);
-    myMesh->submeshes.push_back( submesh );
+    for (Submesh& submesh : mesh.submeshes)
+        AddSubmeshGeometry(app, submesh);
+
+    u32 meshIdx = (u32)app->meshes.size();
+    app->meshes.push_back(mesh);
+    app->meshHashes[mesh.contentHash] = meshIdx;
+    return meshIdx;
 }
 
-void ProcessAssimpMaterial(App* app, aiMaterial *material, Material& myMaterial, String directory)
+u32 LoadTextureIfAny(App* app, const std::string& filepath)
 {
-    aiString name;
-    aiColor3D diffuseColor;
-    aiColor3D emissiveColor;
-    aiColor3D specularColor;
-    ai_real shininess;
-    material->Get(AI_MATKEY_NAME, name);
-    material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuseColor);
-    material->Get(AI_MATKEY_COLOR_EMISSIVE, emissiveColor);
-    material->Get(AI_MATKEY_COLOR_SPECULAR, specularColor);
-    material->Get(AI_MATKEY_SHININESS, shininess);
-
-    myMaterial.name = name.C_Str();
-    myMaterial.albedo = vec3(diffuseColor.r, diffuseColor.g, diffuseColor.b);
-    myMaterial.emissive = vec3(emissiveColor.r, emissiveColor.g, emissiveColor.b);
-    myMaterial.smoothness = shininess / 256.0f;
-
-    aiString aiFilename;
-    if (material->GetTextureCount(aiTextureType_DIFFUSE) > 0)
-    {
-        material->GetTexture(aiTextureType_DIFFUSE, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.albedoTextureIdx = LoadTexture2D(app, filepath.str);
-    }
-    if (material->GetTextureCount(aiTextureType_EMISSIVE) > 0)
-    {
-        material->GetTexture(aiTextureType_EMISSIVE, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.emissiveTextureIdx = LoadTexture2D(app, filepath.str);
-    }
-     if (material->GetTextureCount(aiTextureType_SPECULAR) > 0)
-    {
-        material->GetTexture(aiTextureType_SPECULAR, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.specularTextureIdx = LoadTexture2D(app, filepath.str);
-    }
-    if (material->GetTextureCount(aiTextureType_NORMALS) > 0)
-    {   
-        material->GetTexture(aiTextureType_NORMALS, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.hasNormalText = 1;
-        myMaterial.normalsTextureIdx = LoadTexture2D(app, filepath.str);
-    }else{
-        String filename = MakeString("Normal.png");
-        String filepath = MakePath(directory, filename);
-
-        myMaterial.normalsTextureIdx = LoadTexture2D(app, filepath.str);
-        if (myMaterial.normalsTextureIdx != UINT32_MAX) {
-            myMaterial.hasNormalText = 1;
-        }
+    return filepath.empty() ? UINT32_MAX : LoadTexture2D(app, filepath.c_str());
+}
 
-    }
-   
-    if (material->GetTextureCount(aiTextureType_HEIGHT) > 0)
-    {
-        material->GetTexture(aiTextureType_HEIGHT, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.hasBumpText = 1;
-        myMaterial.bumpTextureIdx = LoadTexture2D(app, filepath.str);
-    }
-    else {
-        String filename = MakeString("Height.png");
-        String filepath = MakePath(directory, filename);
+void CreateMaterial(App* app, const ImportedMaterial& importedMaterial, Material& myMaterial)
+{
+    myMaterial.name = importedMaterial.name;
+    myMaterial.albedo = importedMaterial.albedo;
+    myMaterial.emissive = importedMaterial.emissive;
+    myMaterial.smoothness = importedMaterial.smoothness;
 
-        myMaterial.bumpTextureIdx = LoadTexture2D(app, filepath.str);
-        if (myMaterial.bumpTextureIdx != UINT32_MAX) {
-            myMaterial.hasBumpText = 1;
-        }
+    if (!importedMaterial.albedoTexture.empty())
+        myMaterial.albedoTextureIdx = LoadTexture2D(app, importedMaterial.albedoTexture.c_str());
+    if (!importedMaterial.emissiveTexture.empty())
+        myMaterial.emissiveTextureIdx = LoadTexture2D(app, importedMaterial.emissiveTexture.c_str());
+    if (!importedMaterial.specularTexture.empty())
+        myMaterial.specularTextureIdx = LoadTexture2D(app, importedMaterial.specularTexture.c_str());
 
-    }
+    myMaterial.normalsTextureIdx = LoadTextureIfAny(app, importedMaterial.normalsTexture);
+    myMaterial.hasNormalText = (myMaterial.normalsTextureIdx != UINT32_MAX) ? 1 : 0;
+
+    myMaterial.bumpTextureIdx = LoadTextureIfAny(app, importedMaterial.bumpTexture);
+    myMaterial.hasBumpText = (myMaterial.bumpTextureIdx != UINT32_MAX) ? 1 : 0;
 
     //myMaterial.createNormalFromBump();
 }
 
-void ProcessAssimpNode(const aiScene* scene, aiNode *node, Mesh *myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
+static bool ReadModel(const char* filename, ImportedModel& importedModel)
 {
-    // process all the node's meshes (if any)
-    for(unsigned int i = 0; i < node->mNumMeshes; i++)
+    // Models are cooked offline by the AssetCooker, importing the source file is
+    // only a fallback for models that have not been cooked yet
+    std::string cookedPath = GetCookedModelPath(filename);
+    if (!ReadCookedModel(cookedPath.c_str(), importedModel))
     {
-        aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-        ProcessAssimpMesh(scene, mesh, myMesh, baseMeshMaterialIndex, submeshMaterialIndices);
+        ILOG("Model %s has not been cooked (run the AssetCooker), importing the source file", filename);
+        if (!ImportModel(filename, importedModel))
+            return false;
     }
+    return true;
+}
 
-    // then do the same for each of its children
-    for(unsigned int i = 0; i < node->mNumChildren; i++)
+// Create a list of materials (identical ones are shared with other models)
+static std::vector<u32> CreateMaterials(App* app, const ImportedModel& importedModel)
+{
+    std::vector<u32> materialIndices(importedModel.materials.size());
+    for (u32 i = 0; i < importedModel.materials.size(); ++i)
     {
-        ProcessAssimpNode(scene, node->mChildren[i], myMesh, baseMeshMaterialIndex, submeshMaterialIndices);
+        Material material = {};
+        CreateMaterial(app, importedModel.materials[i], material);
+        materialIndices[i] = AddMaterial(app, material);
     }
+    return materialIndices;
 }
 
-u32 LoadModel(App* app, const char* filename)
+// Creates a model with the given submeshes (their data is moved into the mesh)
+static u32 CreateModel(App* app, const char* filename, ImportedModel& importedModel, const std::vector<u32>& submeshIndices, const std::vector<u32>& materialIndices)
 {
-    const aiScene* scene = aiImportFile(filename,
-                                        aiProcess_Triangulate           |
-                                        aiProcess_GenSmoothNormals      |
-                                        aiProcess_CalcTangentSpace      |
-                                        aiProcess_JoinIdenticalVertices |
-                                        aiProcess_PreTransformVertices  |
-                                        aiProcess_ImproveCacheLocality  |
-                                        aiProcess_OptimizeMeshes        |
-                                        aiProcess_SortByPType);
-
-    if (!scene)
+    Mesh mesh = {};
+    Model model = {};
+    for (u32 submeshIdx : submeshIndices)
     {
-        ELOG("Error loading mesh %s: %s", filename, aiGetErrorString());
-        return UINT32_MAX;
-    }
+        ImportedSubmesh& importedSubmesh = importedModel.submeshes[submeshIdx];
 
-    app->meshes.push_back(Mesh{});
-    Mesh& mesh = app->meshes.back();
-    u32 meshIdx = (u32)app->meshes.size() - 1u;
+        Submesh submesh = {};
+        submesh.vertexBufferLayout = importedSubmesh.vertexBufferLayout;
+        submesh.vertices.swap(importedSubmesh.vertices);
+        submesh.indices.swap(importedSubmesh.indices);
+        mesh.submeshes.push_back(submesh);
 
-    app->models.push_back(Model{});
-    Model& model = app->models.back();
-    model.meshIdx = meshIdx;
-    u32 modelIdx = (u32)app->models.size() - 1u;
+        // store the proper (previously proceessed) material for this submesh
+        model.materialIdx.push_back(materialIndices[importedSubmesh.materialIdx]);
+    }
 
-    String directory = GetDirectoryPart(MakeString(filename));
+    model.meshIdx = AddMesh(app, mesh);
 
-    // Create a list of materials
-    u32 baseMeshMaterialIndex = (u32)app->materials.size();
-    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+    for (u32 i = 0; i < app->models.size(); ++i)
     {
-        app->materials.push_back(Material{});
-        Material& material = app->materials.back();
-        ProcessAssimpMaterial(app, scene->mMaterials[i], material, directory);
+        if (app->models[i].meshIdx == model.meshIdx && app->models[i].materialIdx == model.materialIdx)
+        {
+            app->dedupStats.sharedModels++;
+            ILOG("Model %s shares its content with an already loaded model", filename);
+            return i;
+        }
     }
 
-    ProcessAssimpNode(scene, scene->mRootNode, &mesh, baseMeshMaterialIndex, model.materialIdx);
+    u32 modelIdx = (u32)app->models.size();
+    app->models.push_back(model);
 
-    aiReleaseImport(scene);
+    return modelIdx;
+}
 
-    u32 vertexBufferSize = 0;
-    u32 indexBufferSize = 0;
+u32 LoadModel(App* app, const char* filename)
+{
+    ImportedModel importedModel;
+    if (!ReadModel(filename, importedModel))
+        return UINT32_MAX;
 
-    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-    {
-        vertexBufferSize += mesh.submeshes[i].vertices.size() * sizeof(float);
-        indexBufferSize  += mesh.submeshes[i].indices.size()  * sizeof(u32);
-    }
+    PreTransformModel(importedModel);
 
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
+    std::vector<u32> materialIndices = CreateMaterials(app, importedModel);
 
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
+    std::vector<u32> submeshIndices(importedModel.submeshes.size());
+    for (u32 i = 0; i < submeshIndices.size(); ++i)
+        submeshIndices[i] = i;
 
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
+    return CreateModel(app, filename, importedModel, submeshIndices, materialIndices);
+}
 
-    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+u32 LoadModelHierarchy(App* app, const char* filename, const glm::mat4& transform)
+{
+    auto it = app->modelHierarchies.find(filename);
+    if (it == app->modelHierarchies.end())
     {
-        const void* verticesData = mesh.submeshes[i].vertices.data();
-        const u32   verticesSize = mesh.submeshes[i].vertices.size() * sizeof(float);
-        glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-        mesh.submeshes[i].vertexOffset = verticesOffset;
-        verticesOffset += verticesSize;
-
-        const void* indicesData = mesh.submeshes[i].indices.data();
-        const u32   indicesSize = mesh.submeshes[i].indices.size() * sizeof(u32);
-        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-        mesh.submeshes[i].indexOffset = indicesOffset;
-        indicesOffset += indicesSize;
+        ImportedModel importedModel;
+        if (!ReadModel(filename, importedModel) || importedModel.nodes.empty())
+            return UINT32_MAX;
+
+        std::vector<u32> materialIndices = CreateMaterials(app, importedModel);
+
+        // One model per mesh of the file, no matter how many nodes reference it
+        std::vector<u32> submeshModels(importedModel.submeshes.size());
+        for (u32 i = 0; i < submeshModels.size(); ++i)
+            submeshModels[i] = CreateModel(app, filename, importedModel, std::vector<u32>(1, i), materialIndices);
+
+        std::vector<ModelHierarchyNode> hierarchy(importedModel.nodes.size());
+        u32 meshReferences = 0;
+        for (u32 i = 0; i < hierarchy.size(); ++i)
+        {
+            const ImportedNode& importedNode = importedModel.nodes[i];
+            hierarchy[i].name = importedNode.name;
+            hierarchy[i].parent = importedNode.parent;
+            hierarchy[i].transform = importedNode.transform;
+            for (u32 submeshIdx : importedNode.submeshes)
+                hierarchy[i].models.push_back(submeshModels[submeshIdx]);
+            meshReferences += (u32)importedNode.submeshes.size();
+        }
+
+        ILOG("Model %s: %u nodes, %u meshes referenced %u times", filename, (u32)hierarchy.size(),
+             (u32)importedModel.submeshes.size(), meshReferences);
+
+        it = app->modelHierarchies.insert(std::make_pair(std::string(filename), hierarchy)).first;
     }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // Instantiate the hierarchy: nodes keep their order, so parents stay before children
+    const std::vector<ModelHierarchyNode>& hierarchy = it->second;
+    const u32 firstNode = (u32)app->sceneNodes.size();
+    for (const ModelHierarchyNode& hierarchyNode : hierarchy)
+    {
+        SceneNode node;
+        node.name = hierarchyNode.name;
+        node.parent = (hierarchyNode.parent == UINT32_MAX) ? UINT32_MAX : firstNode + hierarchyNode.parent;
+        node.localTransform = (hierarchyNode.parent == UINT32_MAX) ? transform * hierarchyNode.transform : hierarchyNode.transform;
+        node.worldTransform = (node.parent == UINT32_MAX) ? node.localTransform : app->sceneNodes[node.parent].worldTransform * node.localTransform;
 
-    return modelIdx;
+        const u32 nodeIdx = (u32)app->sceneNodes.size();
+        app->sceneNodes.push_back(node);
+
+        for (u32 modelIdx : hierarchyNode.models)
+        {
+            Entity entity(node.worldTransform, modelIdx);
+            entity.node = nodeIdx;
+            app->entities.push_back(entity);
+        }
+    }
+
+    return firstNode;
 }
 
 /*u32 LoadSphere(App* app)
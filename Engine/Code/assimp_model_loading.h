@@ -8,5 +8,18 @@
 
 struct App;
 
+/**
+ * Loads a model with all its node transforms baked into the vertices. Returns the
+ * index of the model in App::models.
+ */
 u32 LoadModel(App* app, const char* filename);
+
+/**
+ * Loads a model keeping its node hierarchy: every node becomes a SceneNode (the root
+ * is placed at transform) and every mesh it references an Entity that follows it.
+ * Each mesh of the file is uploaded once, so all the entities of a repeated mesh
+ * share its Model. Returns the index of the root node in App::sceneNodes or
+ * UINT32_MAX if the model could not be loaded.
+ */
+u32 LoadModelHierarchy(App* app, const char* filename, const glm::mat4& transform = glm::mat4(1.0f));
 //u32 LoadSphere(App* app);
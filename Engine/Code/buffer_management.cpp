@@ -47,6 +47,21 @@ void UnmapBuffer(Buffer& buffer)
     glBindBuffer(buffer.type, 0);
 }
 
+void UploadBufferData(Buffer& buffer, GLenum type, const void* data, u32 size)
+{
+    if (buffer.size < size)
+    {
+        if (buffer.handle)
+            glDeleteBuffers(1, &buffer.handle);
+        buffer = CreateBuffer(glm::max(size, buffer.size * 2), type, GL_STREAM_DRAW);
+    }
+
+    glBindBuffer(type, buffer.handle);
+    glBufferData(type, buffer.size, NULL, GL_STREAM_DRAW);
+    glBufferSubData(type, 0, size, data);
+    glBindBuffer(type, 0);
+}
+
 void AlignHead(Buffer& buffer, u32 alignment)
 {
     ASSERT(IsPowerOf2(alignment), "The alignment must be a power of 2");
@@ -57,7 +72,15 @@ void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment)
 {
     ASSERT(buffer.data != NULL, "The buffer must be mapped first");
     AlignHead(buffer, alignment);
-    memcpy((u8*)buffer.data + buffer.head, data, size);
+    // Data that does not fit is dropped, the head still advances so the owner can tell
+    // how much room was needed
+    if (buffer.head + size <= buffer.size)
+        memcpy((u8*)buffer.data + buffer.head, data, size);
     buffer.head += size;
 }
 
+bool IsRangeInBuffer(const Buffer& buffer, u32 offset, u32 size)
+{
+    return offset + size <= buffer.size;
+}
+
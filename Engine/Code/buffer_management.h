@@ -19,8 +19,15 @@ void UnmapBuffer(Buffer& buffer);
 
 void AlignHead(Buffer& buffer, u32 alignment);
 
+// Replaces the whole content of a stream buffer, orphaning it or growing it to fit size
+void UploadBufferData(Buffer& buffer, GLenum type, const void* data, u32 size);
+
 void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment);
 
+// Whether a range pushed to the buffer fits in it (in the region, for the view of a ring
+// buffer frame), so its data was written and it can be bound
+bool IsRangeInBuffer(const Buffer& buffer, u32 offset, u32 size);
+
 #define PushData(buffer, data, size) PushAlignedData(buffer, data, size, 1)
 #define PushUInt(buffer, value) { u32 v = value; PushAlignedData(buffer, &v, sizeof(v), 4); }
 #define PushFloat(buffer, value) { float v = value; PushAlignedData(buffer, &v, sizeof(v), 4); }
@@ -0,0 +1,454 @@
+//
+// bvh.cpp: Binned SAH build, refit and traversal of the BVH.
+//
+
+#include "bvh.h"
+
+#include <float.h>
+#include <math.h>
+
+#define BVH_SAH_BINS       16
+#define BVH_MAX_LEAF_SIZE  4
+#define BVH_MAX_DEPTH      48
+#define BVH_STACK_SIZE     (BVH_MAX_DEPTH + 2)
+
+static f32 GetSurfaceArea(const glm::vec3& aabbMin, const glm::vec3& aabbMax)
+{
+    const glm::vec3 extent = aabbMax - aabbMin;
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+static bool BoxesOverlap(const glm::vec3& minA, const glm::vec3& maxA, const glm::vec3& minB, const glm::vec3& maxB)
+{
+    return minA.x <= maxB.x && maxA.x >= minB.x &&
+           minA.y <= maxB.y && maxA.y >= minB.y &&
+           minA.z <= maxB.z && maxA.z >= minB.z;
+}
+
+static void UpdateNodeBounds(Bvh& bvh, BvhNode& node)
+{
+    node.aabbMin = glm::vec3(FLT_MAX);
+    node.aabbMax = glm::vec3(-FLT_MAX);
+    for (u32 i = 0; i < node.count; ++i)
+    {
+        const u32 item = bvh.itemIndices[node.leftFirst + i];
+        node.aabbMin = glm::min(node.aabbMin, bvh.itemMin[item]);
+        node.aabbMax = glm::max(node.aabbMax, bvh.itemMax[item]);
+    }
+}
+
+struct SahBin
+{
+    glm::vec3 aabbMin;
+    glm::vec3 aabbMax;
+    u32       count;
+};
+
+// Best split plane of a node by the SAH evaluated at the bin boundaries of the item centroids
+static f32 FindBestSplit(const Bvh& bvh, const BvhNode& node, u32& bestAxis, f32& bestPosition)
+{
+    glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+    for (u32 i = 0; i < node.count; ++i)
+    {
+        const u32 item = bvh.itemIndices[node.leftFirst + i];
+        const glm::vec3 centroid = (bvh.itemMin[item] + bvh.itemMax[item]) * 0.5f;
+        centroidMin = glm::min(centroidMin, centroid);
+        centroidMax = glm::max(centroidMax, centroid);
+    }
+
+    f32 bestCost = FLT_MAX;
+    for (u32 axis = 0; axis < 3; ++axis)
+    {
+        if (centroidMax[axis] <= centroidMin[axis])
+            continue;
+
+        SahBin bins[BVH_SAH_BINS];
+        for (SahBin& bin : bins)
+            bin = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX), 0 };
+
+        const f32 binScale = BVH_SAH_BINS / (centroidMax[axis] - centroidMin[axis]);
+        for (u32 i = 0; i < node.count; ++i)
+        {
+            const u32 item = bvh.itemIndices[node.leftFirst + i];
+            const f32 centroid = (bvh.itemMin[item][axis] + bvh.itemMax[item][axis]) * 0.5f;
+            const u32 binIdx = glm::min((u32)((centroid - centroidMin[axis]) * binScale), (u32)BVH_SAH_BINS - 1);
+            SahBin& bin = bins[binIdx];
+            bin.count++;
+            bin.aabbMin = glm::min(bin.aabbMin, bvh.itemMin[item]);
+            bin.aabbMax = glm::max(bin.aabbMax, bvh.itemMax[item]);
+        }
+
+        // Area and count at the left and right of every boundary, in one sweep from each side
+        f32 leftArea[BVH_SAH_BINS - 1], rightArea[BVH_SAH_BINS - 1];
+        u32 leftCount[BVH_SAH_BINS - 1], rightCount[BVH_SAH_BINS - 1];
+        glm::vec3 leftMin(FLT_MAX), leftMax(-FLT_MAX), rightMin(FLT_MAX), rightMax(-FLT_MAX);
+        u32 leftSum = 0, rightSum = 0;
+        for (u32 i = 0; i < BVH_SAH_BINS - 1; ++i)
+        {
+            leftSum += bins[i].count;
+            leftCount[i] = leftSum;
+            leftMin = glm::min(leftMin, bins[i].aabbMin);
+            leftMax = glm::max(leftMax, bins[i].aabbMax);
+            leftArea[i] = leftSum ? GetSurfaceArea(leftMin, leftMax) : 0.0f;
+
+            const u32 j = BVH_SAH_BINS - 1 - i;
+            rightSum += bins[j].count;
+            rightCount[j - 1] = rightSum;
+            rightMin = glm::min(rightMin, bins[j].aabbMin);
+            rightMax = glm::max(rightMax, bins[j].aabbMax);
+            rightArea[j - 1] = rightSum ? GetSurfaceArea(rightMin, rightMax) : 0.0f;
+        }
+
+        for (u32 i = 0; i < BVH_SAH_BINS - 1; ++i)
+        {
+            const f32 cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestPosition = centroidMin[axis] + (i + 1) / binScale;
+            }
+        }
+    }
+    return bestCost;
+}
+
+void BuildBvh(Bvh& bvh, const glm::vec3* aabbMin, const glm::vec3* aabbMax, u32 count)
+{
+    bvh.itemMin.assign(aabbMin, aabbMin + count);
+    bvh.itemMax.assign(aabbMax, aabbMax + count);
+    bvh.itemIndices.resize(count);
+    for (u32 i = 0; i < count; ++i)
+        bvh.itemIndices[i] = i;
+
+    bvh.nodes.clear();
+    bvh.nodes.reserve(count > 0 ? 2 * count - 1 : 1);
+
+    BvhNode root = {};
+    root.leftFirst = 0;
+    root.count = count;
+    bvh.nodes.push_back(root);
+    UpdateNodeBounds(bvh, bvh.nodes[0]);
+
+    // Nodes to split and their depth, which is limited so the traversal stacks never overflow
+    std::vector<std::pair<u32, u32>> pending;
+    pending.push_back({ 0, 0 });
+    while (!pending.empty())
+    {
+        const u32 nodeIdx = pending.back().first;
+        const u32 depth = pending.back().second;
+        pending.pop_back();
+
+        BvhNode node = bvh.nodes[nodeIdx];
+        if (node.count <= BVH_MAX_LEAF_SIZE || depth == BVH_MAX_DEPTH)
+            continue;
+
+        u32 axis = 0;
+        f32 position = 0.0f;
+        const f32 splitCost = FindBestSplit(bvh, node, axis, position);
+        const f32 leafCost = node.count * GetSurfaceArea(node.aabbMin, node.aabbMax);
+        if (splitCost >= leafCost)
+            continue;
+
+        // Partition the items of the node around the split plane
+        u32 i = node.leftFirst;
+        u32 j = node.leftFirst + node.count - 1;
+        while (i <= j)
+        {
+            const u32 item = bvh.itemIndices[i];
+            if ((bvh.itemMin[item][axis] + bvh.itemMax[item][axis]) * 0.5f < position)
+            {
+                i++;
+            }
+            else
+            {
+                std::swap(bvh.itemIndices[i], bvh.itemIndices[j]);
+                if (j == 0)
+                    break;
+                j--;
+            }
+        }
+
+        const u32 leftCount = i - node.leftFirst;
+        if (leftCount == 0 || leftCount == node.count)
+            continue;
+
+        const u32 leftIdx = (u32)bvh.nodes.size();
+        BvhNode left = {};
+        left.leftFirst = node.leftFirst;
+        left.count = leftCount;
+        BvhNode right = {};
+        right.leftFirst = i;
+        right.count = node.count - leftCount;
+        bvh.nodes.push_back(left);
+        bvh.nodes.push_back(right);
+        UpdateNodeBounds(bvh, bvh.nodes[leftIdx]);
+        UpdateNodeBounds(bvh, bvh.nodes[leftIdx + 1]);
+
+        bvh.nodes[nodeIdx].leftFirst = leftIdx;
+        bvh.nodes[nodeIdx].count = 0;
+
+        pending.push_back({ leftIdx, depth + 1 });
+        pending.push_back({ leftIdx + 1, depth + 1 });
+    }
+
+    bvh.buildCost = GetBvhCost(bvh);
+}
+
+u32 GetBvhItemCount(const Bvh& bvh)
+{
+    return (u32)bvh.itemMin.size();
+}
+
+void SetBvhItemBounds(Bvh& bvh, u32 item, const glm::vec3& aabbMin, const glm::vec3& aabbMax)
+{
+    bvh.itemMin[item] = aabbMin;
+    bvh.itemMax[item] = aabbMax;
+}
+
+void RefitBvh(Bvh& bvh)
+{
+    // Children are always after their parent
+    for (u32 i = (u32)bvh.nodes.size(); i-- > 0; )
+    {
+        BvhNode& node = bvh.nodes[i];
+        if (node.count > 0)
+        {
+            UpdateNodeBounds(bvh, node);
+        }
+        else
+        {
+            const BvhNode& left = bvh.nodes[node.leftFirst];
+            const BvhNode& right = bvh.nodes[node.leftFirst + 1];
+            node.aabbMin = glm::min(left.aabbMin, right.aabbMin);
+            node.aabbMax = glm::max(left.aabbMax, right.aabbMax);
+        }
+    }
+}
+
+f32 GetBvhCost(const Bvh& bvh)
+{
+    if (bvh.nodes.empty())
+        return 0.0f;
+
+    const f32 rootArea = GetSurfaceArea(bvh.nodes[0].aabbMin, bvh.nodes[0].aabbMax);
+    if (rootArea <= 0.0f)
+        return 0.0f;
+
+    // Traversal steps of the inner nodes plus tests of the items in the leaves
+    f32 cost = 0.0f;
+    for (const BvhNode& node : bvh.nodes)
+    {
+        const f32 area = GetSurfaceArea(node.aabbMin, node.aabbMax);
+        cost += (node.count > 0) ? area * node.count : area;
+    }
+    return cost / rootArea;
+}
+
+// Adds all the items under a node
+static void AddSubtreeItems(const Bvh& bvh, u32 nodeIdx, std::vector<u32>& items)
+{
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    stack[stackSize++] = nodeIdx;
+
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+        if (node.count > 0)
+        {
+            items.insert(items.end(), bvh.itemIndices.begin() + node.leftFirst, bvh.itemIndices.begin() + node.leftFirst + node.count);
+        }
+        else
+        {
+            stack[stackSize++] = node.leftFirst;
+            stack[stackSize++] = node.leftFirst + 1;
+        }
+    }
+}
+
+void QueryBvhFrustum(const Bvh& bvh, const Frustum& frustum, std::vector<u32>& items)
+{
+    if (bvh.itemIndices.empty())
+        return;
+
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const u32 nodeIdx = stack[--stackSize];
+        const BvhNode& node = bvh.nodes[nodeIdx];
+
+        const FrustumOverlap overlap = TestFrustumBox(frustum, node.aabbMin, node.aabbMax);
+        if (overlap == FrustumOverlap_Outside)
+            continue;
+
+        if (overlap == FrustumOverlap_Inside)
+        {
+            AddSubtreeItems(bvh, nodeIdx, items);
+        }
+        else if (node.count > 0)
+        {
+            for (u32 i = 0; i < node.count; ++i)
+            {
+                const u32 item = bvh.itemIndices[node.leftFirst + i];
+                if (TestFrustumBox(frustum, bvh.itemMin[item], bvh.itemMax[item]) != FrustumOverlap_Outside)
+                    items.push_back(item);
+            }
+        }
+        else
+        {
+            stack[stackSize++] = node.leftFirst;
+            stack[stackSize++] = node.leftFirst + 1;
+        }
+    }
+}
+
+void QueryBvhBox(const Bvh& bvh, const glm::vec3& aabbMin, const glm::vec3& aabbMax, std::vector<u32>& items)
+{
+    if (bvh.itemIndices.empty())
+        return;
+
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+        if (!BoxesOverlap(node.aabbMin, node.aabbMax, aabbMin, aabbMax))
+            continue;
+
+        if (node.count > 0)
+        {
+            for (u32 i = 0; i < node.count; ++i)
+            {
+                const u32 item = bvh.itemIndices[node.leftFirst + i];
+                if (BoxesOverlap(bvh.itemMin[item], bvh.itemMax[item], aabbMin, aabbMax))
+                    items.push_back(item);
+            }
+        }
+        else
+        {
+            stack[stackSize++] = node.leftFirst;
+            stack[stackSize++] = node.leftFirst + 1;
+        }
+    }
+}
+
+bool IntersectRayBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const glm::vec3& aabbMin, const glm::vec3& aabbMax, f32 maxDistance, f32& distance)
+{
+    f32 enter = 0.0f;
+    f32 exit = maxDistance;
+    for (u32 axis = 0; axis < 3; ++axis)
+    {
+        // Parallel to the slab, the ray is in it (its planes included) everywhere or
+        // nowhere. The slab distances would be 0 * inf = NaN with the origin on a plane.
+        if (isinf(inverseDirection[axis]))
+        {
+            if (origin[axis] < aabbMin[axis] || origin[axis] > aabbMax[axis])
+                return false;
+            continue;
+        }
+
+        const f32 t0 = (aabbMin[axis] - origin[axis]) * inverseDirection[axis];
+        const f32 t1 = (aabbMax[axis] - origin[axis]) * inverseDirection[axis];
+        enter = glm::max(enter, glm::min(t0, t1));
+        exit = glm::min(exit, glm::max(t0, t1));
+    }
+    distance = enter;
+    return enter <= exit;
+}
+
+void QueryBvhRay(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, f32 maxDistance, std::vector<u32>& items)
+{
+    if (bvh.itemIndices.empty())
+        return;
+
+    const glm::vec3 inverseDirection = 1.0f / direction;
+
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+        f32 distance;
+        if (!IntersectRayBox(origin, inverseDirection, node.aabbMin, node.aabbMax, maxDistance, distance))
+            continue;
+
+        if (node.count > 0)
+        {
+            for (u32 i = 0; i < node.count; ++i)
+            {
+                const u32 item = bvh.itemIndices[node.leftFirst + i];
+                if (IntersectRayBox(origin, inverseDirection, bvh.itemMin[item], bvh.itemMax[item], maxDistance, distance))
+                    items.push_back(item);
+            }
+        }
+        else
+        {
+            stack[stackSize++] = node.leftFirst;
+            stack[stackSize++] = node.leftFirst + 1;
+        }
+    }
+}
+
+bool RaycastBvh(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, f32 maxDistance, u32& hitItem, f32& hitDistance)
+{
+    if (bvh.itemIndices.empty())
+        return false;
+
+    const glm::vec3 inverseDirection = 1.0f / direction;
+    hitItem = UINT32_MAX;
+    hitDistance = maxDistance;
+
+    f32 distance;
+    if (!IntersectRayBox(origin, inverseDirection, bvh.nodes[0].aabbMin, bvh.nodes[0].aabbMax, hitDistance, distance))
+        return false;
+
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+
+        if (node.count > 0)
+        {
+            for (u32 i = 0; i < node.count; ++i)
+            {
+                const u32 item = bvh.itemIndices[node.leftFirst + i];
+                if (IntersectRayBox(origin, inverseDirection, bvh.itemMin[item], bvh.itemMax[item], hitDistance, distance) && distance < hitDistance)
+                {
+                    hitItem = item;
+                    hitDistance = distance;
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearest child first, so the farther one is often skipped
+        u32 nearIdx = node.leftFirst;
+        u32 farIdx = node.leftFirst + 1;
+        f32 nearDistance, farDistance;
+        bool hitNear = IntersectRayBox(origin, inverseDirection, bvh.nodes[nearIdx].aabbMin, bvh.nodes[nearIdx].aabbMax, hitDistance, nearDistance);
+        bool hitFar = IntersectRayBox(origin, inverseDirection, bvh.nodes[farIdx].aabbMin, bvh.nodes[farIdx].aabbMax, hitDistance, farDistance);
+        if (hitNear && hitFar && farDistance < nearDistance)
+        {
+            std::swap(nearIdx, farIdx);
+            std::swap(nearDistance, farDistance);
+        }
+
+        if (hitFar)
+            stack[stackSize++] = farIdx;
+        if (hitNear)
+            stack[stackSize++] = nearIdx;
+    }
+
+    return hitItem != UINT32_MAX;
+}
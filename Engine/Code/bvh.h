@@ -0,0 +1,87 @@
+//
+// bvh.h: Bounding volume hierarchy over axis aligned boxes, for the queries that would
+// otherwise walk every item: frustum culling, picking and other ray/box queries.
+//
+// The tree is built with the surface area heuristic (binned). When items move their
+// boxes are updated and the tree is refitted bottom-up, keeping its topology; the
+// caller rebuilds it when the refitted tree gets too expensive (GetBvhCost).
+//
+// Nodes are stored in an array with the root first and the two children of a node
+// next to each other, always after their parent.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "frustum_culling.h"
+
+// A refitted tree whose cost grows past this factor of its build cost should be rebuilt
+#define BVH_REBUILD_COST_RATIO 1.5f
+
+struct BvhNode
+{
+    glm::vec3 aabbMin;
+    u32       leftFirst; // First child if count is 0, else first item in Bvh::itemIndices
+    glm::vec3 aabbMax;
+    u32       count;     // Items of a leaf, 0 for the inner nodes
+};
+
+struct Bvh
+{
+    std::vector<BvhNode>   nodes;
+    std::vector<u32>       itemIndices; // Items of the leaves, contiguous per leaf
+    std::vector<glm::vec3> itemMin;
+    std::vector<glm::vec3> itemMax;
+    f32                    buildCost;   // GetBvhCost right after the last build
+};
+
+/**
+ * Builds the tree over count boxes. The item indices returned by the queries are
+ * indices in these arrays.
+ */
+void BuildBvh(Bvh& bvh, const glm::vec3* aabbMin, const glm::vec3* aabbMax, u32 count);
+
+u32 GetBvhItemCount(const Bvh& bvh);
+
+/**
+ * Changes the box of an item. The tree is not valid until RefitBvh is called.
+ */
+void SetBvhItemBounds(Bvh& bvh, u32 item, const glm::vec3& aabbMin, const glm::vec3& aabbMax);
+
+/**
+ * Recomputes the boxes of all the nodes from the boxes of the items.
+ */
+void RefitBvh(Bvh& bvh);
+
+/**
+ * SAH cost of the tree, relative to the area of the root.
+ */
+f32 GetBvhCost(const Bvh& bvh);
+
+/**
+ * Appends the items whose box is at least partially inside the frustum. The subtrees
+ * completely inside are added without testing their items.
+ */
+void QueryBvhFrustum(const Bvh& bvh, const Frustum& frustum, std::vector<u32>& items);
+
+/**
+ * Appends the items whose box overlaps the box.
+ */
+void QueryBvhBox(const Bvh& bvh, const glm::vec3& aabbMin, const glm::vec3& aabbMax, std::vector<u32>& items);
+
+/**
+ * Appends the items whose box is hit by the ray before maxDistance.
+ */
+void QueryBvhRay(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, f32 maxDistance, std::vector<u32>& items);
+
+/**
+ * Nearest item whose box is hit by the ray before maxDistance. Returns false if none is.
+ */
+bool RaycastBvh(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, f32 maxDistance, u32& hitItem, f32& hitDistance);
+
+/**
+ * Slab test of a ray (with the inverse of its direction) against a box. The distance
+ * is 0 if the origin is inside. The components of the direction may be 0 (an infinite
+ * inverse), the ray is then tested against that slab by its origin.
+ */
+bool IntersectRayBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const glm::vec3& aabbMin, const glm::vec3& aabbMax, f32 maxDistance, f32& distance);
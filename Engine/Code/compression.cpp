@@ -0,0 +1,185 @@
+#include "compression.h"
+
+#include <string.h>
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5   // The last bytes of a block are always literals
+#define LZ4_MF_LIMIT      12  // The last match must start before this many bytes from the end
+#define LZ4_MAX_OFFSET    65535
+#define LZ4_HASH_LOG      12
+
+static inline u32 Read32(const u8* ptr)
+{
+    u32 value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline u32 HashSequence(u32 sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline u8* WriteLength(u8* out, u32 length)
+{
+    while (length >= 255)
+    {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (u8)length;
+    return out;
+}
+
+u32 LZ4CompressBound(u32 size)
+{
+    return size + size / 255 + 16;
+}
+
+u32 LZ4Compress(const void* src, u32 srcSize, void* dst, u32 dstCapacity)
+{
+    const u8* in     = (const u8*)src;
+    const u8* inEnd  = in + srcSize;
+    const u8* anchor = in;
+    const u8* ip     = in;
+    u8*       out    = (u8*)dst;
+    u8*       outEnd = out + dstCapacity;
+
+    if (srcSize > LZ4_MF_LIMIT)
+    {
+        u32 hashTable[1 << LZ4_HASH_LOG] = {};
+        const u8* matchLimit = inEnd - LZ4_LAST_LITERALS;
+        const u8* mfLimit    = inEnd - LZ4_MF_LIMIT;
+
+        while (ip < mfLimit)
+        {
+            const u32 sequence = Read32(ip);
+            const u32 hash     = HashSequence(sequence);
+            const u8* ref      = in + hashTable[hash];
+            hashTable[hash]    = (u32)(ip - in);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || Read32(ref) != sequence)
+            {
+                // Skip faster through data that does not compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            const u8* matchEnd = ip + LZ4_MIN_MATCH;
+            const u8* refEnd   = ref + LZ4_MIN_MATCH;
+            while (matchEnd < matchLimit && *matchEnd == *refEnd)
+            {
+                matchEnd++;
+                refEnd++;
+            }
+
+            const u32 literalLength = (u32)(ip - anchor);
+            const u32 matchLength   = (u32)(matchEnd - ip) - LZ4_MIN_MATCH;
+
+            if (out + 1 + literalLength + literalLength / 255 + 1 + 2 + matchLength / 255 + 1 > outEnd)
+                return 0;
+
+            u8* token = out++;
+            *token = (u8)((literalLength >= 15 ? 15 : literalLength) << 4);
+            if (literalLength >= 15)
+                out = WriteLength(out, literalLength - 15);
+            memcpy(out, anchor, literalLength);
+            out += literalLength;
+
+            const u32 offset = (u32)(ip - ref);
+            *out++ = (u8)(offset & 0xFF);
+            *out++ = (u8)(offset >> 8);
+
+            *token |= (u8)(matchLength >= 15 ? 15 : matchLength);
+            if (matchLength >= 15)
+                out = WriteLength(out, matchLength - 15);
+
+            ip = anchor = matchEnd;
+        }
+    }
+
+    // Last literals
+    const u32 literalLength = (u32)(inEnd - anchor);
+    if (out + 1 + literalLength + literalLength / 255 + 1 > outEnd)
+        return 0;
+
+    u8* token = out++;
+    *token = (u8)((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15)
+        out = WriteLength(out, literalLength - 15);
+    memcpy(out, anchor, literalLength);
+    out += literalLength;
+
+    return (u32)(out - (u8*)dst);
+}
+
+i32 LZ4Decompress(const void* src, u32 srcSize, void* dst, u32 dstCapacity)
+{
+    const u8* ip    = (const u8*)src;
+    const u8* ipEnd = ip + srcSize;
+    u8*       op    = (u8*)dst;
+    u8*       opEnd = op + dstCapacity;
+
+    while (ip < ipEnd)
+    {
+        const u32 token = *ip++;
+
+        u32 literalLength = token >> 4;
+        if (literalLength == 15)
+        {
+            u8 byte;
+            do {
+                if (ip >= ipEnd) return -1;
+                byte = *ip++;
+                literalLength += byte;
+            } while (byte == 255);
+        }
+
+        if (literalLength > (u32)(ipEnd - ip) || literalLength > (u32)(opEnd - op))
+            return -1;
+        memcpy(op, ip, literalLength);
+        op += literalLength;
+        ip += literalLength;
+
+        // The last sequence only has literals
+        if (ip >= ipEnd)
+            break;
+
+        if (ipEnd - ip < 2)
+            return -1;
+        const u32 offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (u32)(op - (u8*)dst))
+            return -1;
+
+        u32 matchLength = token & 15;
+        if (matchLength == 15)
+        {
+            u8 byte;
+            do {
+                if (ip >= ipEnd) return -1;
+                byte = *ip++;
+                matchLength += byte;
+            } while (byte == 255);
+        }
+        matchLength += LZ4_MIN_MATCH;
+
+        if (matchLength > (u32)(opEnd - op))
+            return -1;
+
+        // Matches can overlap the bytes being written (e.g. runs), copy forward
+        const u8* match = op - offset;
+        if (offset >= matchLength)
+        {
+            memcpy(op, match, matchLength);
+            op += matchLength;
+        }
+        else
+        {
+            while (matchLength--)
+                *op++ = *match++;
+        }
+    }
+
+    return (i32)(op - (u8*)dst);
+}
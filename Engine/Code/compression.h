@@ -0,0 +1,25 @@
+//
+// compression.h: LZ4 block format compression. Blocks are independent of each other
+// so several of them can be compressed/decompressed in parallel.
+//
+
+#pragma once
+
+#include "platform.h"
+
+/**
+ * Worst case size of the compressed data for an input of the given size.
+ */
+u32 LZ4CompressBound(u32 size);
+
+/**
+ * Compresses srcSize bytes into dst. Returns the compressed size, or 0 if the
+ * result would not fit in dstCapacity bytes.
+ */
+u32 LZ4Compress(const void* src, u32 srcSize, void* dst, u32 dstCapacity);
+
+/**
+ * Decompresses a whole block into dst. Returns the number of bytes written, or -1
+ * if the block is malformed or does not fit in dstCapacity bytes.
+ */
+i32 LZ4Decompress(const void* src, u32 srcSize, void* dst, u32 dstCapacity);
@@ -0,0 +1,362 @@
+#include "cooked_assets.h"
+#include "file_system.h"
+#include "asset_pack.h"
+
+#include <stb_image.h>
+#include <string.h>
+
+struct BinaryWriter
+{
+    std::vector<u8> data;
+};
+
+struct BinaryReader
+{
+    const u8* data;
+    u64       size;
+    u64       cursor;
+    bool      error;
+};
+
+static void Write(BinaryWriter& writer, const void* data, u64 size)
+{
+    writer.data.insert(writer.data.end(), (const u8*)data, (const u8*)data + size);
+}
+
+static void WriteU32(BinaryWriter& writer, u32 value)
+{
+    Write(writer, &value, sizeof(value));
+}
+
+static void WriteString(BinaryWriter& writer, const std::string& str)
+{
+    WriteU32(writer, (u32)str.size());
+    Write(writer, str.data(), str.size());
+}
+
+static void Read(BinaryReader& reader, void* dst, u64 size)
+{
+    if (reader.error || reader.cursor + size > reader.size)
+    {
+        reader.error = true;
+        memset(dst, 0, size);
+        return;
+    }
+    memcpy(dst, reader.data + reader.cursor, size);
+    reader.cursor += size;
+}
+
+static u32 ReadU32(BinaryReader& reader)
+{
+    u32 value;
+    Read(reader, &value, sizeof(value));
+    return value;
+}
+
+static std::string ReadString(BinaryReader& reader)
+{
+    u32 length = ReadU32(reader);
+    if (reader.error || reader.cursor + length > reader.size)
+    {
+        reader.error = true;
+        return std::string();
+    }
+    std::string str((const char*)reader.data + reader.cursor, length);
+    reader.cursor += length;
+    return str;
+}
+
+/**
+ * Reads an element count and checks that the bytes left could hold that many elements
+ * of at least minElementSize bytes, so corrupted counts never reach a resize.
+ */
+static u32 ReadCount(BinaryReader& reader, u64 minElementSize)
+{
+    u32 count = ReadU32(reader);
+    if (reader.error || reader.cursor + (u64)count * minElementSize > reader.size)
+    {
+        reader.error = true;
+        return 0;
+    }
+    return count;
+}
+
+template <typename T>
+static void WriteArray(BinaryWriter& writer, const std::vector<T>& array)
+{
+    WriteU32(writer, (u32)array.size());
+    Write(writer, array.data(), array.size() * sizeof(T));
+}
+
+template <typename T>
+static void ReadArray(BinaryReader& reader, std::vector<T>& array)
+{
+    u32 count = ReadU32(reader);
+    if (reader.error || reader.cursor + (u64)count * sizeof(T) > reader.size)
+    {
+        reader.error = true;
+        return;
+    }
+    array.resize(count);
+    Read(reader, array.data(), (u64)count * sizeof(T));
+}
+
+std::string GetCookedModelPath(const char* sourcePath)
+{
+    return std::string(COOKED_DIRECTORY "/") + NormalizeAssetPath(sourcePath) + ".smdl";
+}
+
+std::string GetCookedTexturePath(const char* sourcePath)
+{
+    return std::string(COOKED_DIRECTORY "/") + NormalizeAssetPath(sourcePath) + ".stex";
+}
+
+static bool WriteCookedFile(const char* filepath, const BinaryWriter& writer)
+{
+    std::string directory = filepath;
+    size_t separator = directory.find_last_of("/\\");
+    if (separator != std::string::npos)
+        CreateDirectories(directory.substr(0, separator).c_str());
+
+    return WriteBinaryFile(filepath, writer.data.data(), writer.data.size());
+}
+
+static bool OpenCookedFile(const char* filepath, u32 magic, FileData& file, BinaryReader& reader)
+{
+    if (!FileExists(filepath))
+        return false;
+
+    file = ReadBinaryFile(filepath);
+    reader = { file.data, file.size, 0, file.data == NULL };
+
+    u32 fileMagic = ReadU32(reader);
+    u32 fileVersion = ReadU32(reader);
+    if (reader.error || fileMagic != magic || fileVersion != COOKED_ASSET_VERSION)
+    {
+        ELOG("%s is not a valid cooked asset or was cooked by an older version, cook it again", filepath);
+        FreeFileData(file);
+        return false;
+    }
+    return true;
+}
+
+bool WriteCookedModel(const char* filepath, const ImportedModel& model)
+{
+    BinaryWriter writer;
+    WriteU32(writer, COOKED_MODEL_MAGIC);
+    WriteU32(writer, COOKED_ASSET_VERSION);
+
+    WriteU32(writer, (u32)model.materials.size());
+    for (const ImportedMaterial& material : model.materials)
+    {
+        WriteString(writer, material.name);
+        Write(writer, &material.albedo, sizeof(material.albedo));
+        Write(writer, &material.emissive, sizeof(material.emissive));
+        Write(writer, &material.smoothness, sizeof(material.smoothness));
+        WriteString(writer, material.albedoTexture);
+        WriteString(writer, material.emissiveTexture);
+        WriteString(writer, material.specularTexture);
+        WriteString(writer, material.normalsTexture);
+        WriteString(writer, material.bumpTexture);
+    }
+
+    WriteU32(writer, (u32)model.submeshes.size());
+    for (const ImportedSubmesh& submesh : model.submeshes)
+    {
+        WriteU32(writer, submesh.materialIdx);
+        WriteU32(writer, submesh.vertexBufferLayout.stride);
+        WriteArray(writer, submesh.vertexBufferLayout.attributes);
+        WriteArray(writer, submesh.vertices);
+        WriteArray(writer, submesh.indices);
+    }
+
+    WriteU32(writer, (u32)model.nodes.size());
+    for (const ImportedNode& node : model.nodes)
+    {
+        WriteString(writer, node.name);
+        WriteU32(writer, node.parent);
+        Write(writer, &node.transform, sizeof(node.transform));
+        WriteArray(writer, node.submeshes);
+    }
+
+    return WriteCookedFile(filepath, writer);
+}
+
+bool ReadCookedModel(const char* filepath, ImportedModel& model)
+{
+    FileData file;
+    BinaryReader reader;
+    if (!OpenCookedFile(filepath, COOKED_MODEL_MAGIC, file, reader))
+        return false;
+
+    // Minimum serialized sizes: every string and array is at least its u32 length
+    const u64 minMaterialSize = 6 * sizeof(u32) + sizeof(ImportedMaterial::albedo) + sizeof(ImportedMaterial::emissive) + sizeof(ImportedMaterial::smoothness);
+    const u64 minSubmeshSize = 5 * sizeof(u32);
+    const u64 minNodeSize = 3 * sizeof(u32) + sizeof(ImportedNode::transform);
+
+    model.materials.resize(ReadCount(reader, minMaterialSize));
+    for (u32 i = 0; i < model.materials.size() && !reader.error; ++i)
+    {
+        ImportedMaterial& material = model.materials[i];
+        material.name = ReadString(reader);
+        Read(reader, &material.albedo, sizeof(material.albedo));
+        Read(reader, &material.emissive, sizeof(material.emissive));
+        Read(reader, &material.smoothness, sizeof(material.smoothness));
+        material.albedoTexture = ReadString(reader);
+        material.emissiveTexture = ReadString(reader);
+        material.specularTexture = ReadString(reader);
+        material.normalsTexture = ReadString(reader);
+        material.bumpTexture = ReadString(reader);
+    }
+
+    model.submeshes.resize(ReadCount(reader, minSubmeshSize));
+    for (u32 i = 0; i < model.submeshes.size() && !reader.error; ++i)
+    {
+        ImportedSubmesh& submesh = model.submeshes[i];
+        submesh.materialIdx = ReadU32(reader);
+        submesh.vertexBufferLayout.stride = (u8)ReadU32(reader);
+        ReadArray(reader, submesh.vertexBufferLayout.attributes);
+        ReadArray(reader, submesh.vertices);
+        ReadArray(reader, submesh.indices);
+
+        if (submesh.materialIdx >= model.materials.size())
+            reader.error = true;
+    }
+
+    model.nodes.resize(ReadCount(reader, minNodeSize));
+    for (u32 i = 0; i < model.nodes.size() && !reader.error; ++i)
+    {
+        ImportedNode& node = model.nodes[i];
+        node.name = ReadString(reader);
+        node.parent = ReadU32(reader);
+        Read(reader, &node.transform, sizeof(node.transform));
+        ReadArray(reader, node.submeshes);
+
+        // Parents must come before their children
+        if ((i == 0) != (node.parent == UINT32_MAX) || (node.parent != UINT32_MAX && node.parent >= i))
+            reader.error = true;
+        for (u32 submeshIdx : node.submeshes)
+            if (submeshIdx >= model.submeshes.size())
+                reader.error = true;
+    }
+
+    FreeFileData(file);
+
+    if (reader.error)
+    {
+        ELOG("Cooked model %s is corrupted", filepath);
+        model = {};
+        return false;
+    }
+    return true;
+}
+
+bool CookTexture(const char* sourcePath, CookedTexture& texture)
+{
+    FileData file = ReadBinaryFile(sourcePath);
+    if (!file.data)
+        return false;
+
+    int width, height, nchannels;
+    stbi_set_flip_vertically_on_load_thread(true);
+    u8* pixels = stbi_load_from_memory(file.data, (int)file.size, &width, &height, &nchannels, 0);
+    FreeFileData(file);
+
+    if (!pixels)
+    {
+        ELOG("Could not decode image %s: %s", sourcePath, stbi_failure_reason());
+        return false;
+    }
+
+    texture.width = (u32)width;
+    texture.height = (u32)height;
+    texture.nchannels = (u32)nchannels;
+    texture.mipOffsets.clear();
+    texture.pixels.assign(pixels, pixels + (u64)width * height * nchannels);
+    texture.mipOffsets.push_back(0);
+    stbi_image_free(pixels);
+
+    // Every level averages 2x2 texels of the previous one (clamped at the borders
+    // of odd sized levels)
+    for (u32 level = 1; GetMipWidth(texture, level - 1) > 1 || GetMipHeight(texture, level - 1) > 1; ++level)
+    {
+        const u32 srcWidth  = GetMipWidth(texture, level - 1);
+        const u32 srcHeight = GetMipHeight(texture, level - 1);
+        const u32 dstWidth  = GetMipWidth(texture, level);
+        const u32 dstHeight = GetMipHeight(texture, level);
+        const u32 n = texture.nchannels;
+
+        const u32 dstOffset = (u32)texture.pixels.size();
+        texture.mipOffsets.push_back(dstOffset);
+        texture.pixels.resize(dstOffset + dstWidth * dstHeight * n);
+
+        const u8* src = texture.pixels.data() + texture.mipOffsets[level - 1];
+        u8* dst = texture.pixels.data() + dstOffset;
+
+        for (u32 y = 0; y < dstHeight; ++y)
+        {
+            const u32 y0 = glm::min(y * 2, srcHeight - 1);
+            const u32 y1 = glm::min(y * 2 + 1, srcHeight - 1);
+            for (u32 x = 0; x < dstWidth; ++x)
+            {
+                const u32 x0 = glm::min(x * 2, srcWidth - 1);
+                const u32 x1 = glm::min(x * 2 + 1, srcWidth - 1);
+                for (u32 c = 0; c < n; ++c)
+                {
+                    u32 sum = src[(y0 * srcWidth + x0) * n + c] + src[(y0 * srcWidth + x1) * n + c] +
+                              src[(y1 * srcWidth + x0) * n + c] + src[(y1 * srcWidth + x1) * n + c];
+                    dst[(y * dstWidth + x) * n + c] = (u8)((sum + 2) / 4);
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+bool WriteCookedTexture(const char* filepath, const CookedTexture& texture)
+{
+    BinaryWriter writer;
+    WriteU32(writer, COOKED_TEXTURE_MAGIC);
+    WriteU32(writer, COOKED_ASSET_VERSION);
+    WriteU32(writer, texture.width);
+    WriteU32(writer, texture.height);
+    WriteU32(writer, texture.nchannels);
+    WriteArray(writer, texture.mipOffsets);
+    WriteArray(writer, texture.pixels);
+
+    return WriteCookedFile(filepath, writer);
+}
+
+bool ReadCookedTexture(const char* filepath, CookedTexture& texture)
+{
+    FileData file;
+    BinaryReader reader;
+    if (!OpenCookedFile(filepath, COOKED_TEXTURE_MAGIC, file, reader))
+        return false;
+
+    texture.width = ReadU32(reader);
+    texture.height = ReadU32(reader);
+    texture.nchannels = ReadU32(reader);
+    ReadArray(reader, texture.mipOffsets);
+    ReadArray(reader, texture.pixels);
+
+    FreeFileData(file);
+
+    // The last mip level must be inside the pixel data
+    if (!reader.error && !texture.mipOffsets.empty())
+    {
+        const u32 lastLevel = (u32)texture.mipOffsets.size() - 1;
+        const u64 lastLevelEnd = (u64)texture.mipOffsets[lastLevel] +
+            (u64)GetMipWidth(texture, lastLevel) * GetMipHeight(texture, lastLevel) * texture.nchannels;
+        reader.error = lastLevelEnd > texture.pixels.size();
+    }
+
+    if (reader.error || texture.mipOffsets.empty())
+    {
+        ELOG("Cooked texture %s is corrupted", filepath);
+        texture = {};
+        return false;
+    }
+    return true;
+}
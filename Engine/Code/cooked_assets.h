@@ -0,0 +1,55 @@
+//
+// cooked_assets.h: Binary formats written by the AssetCooker tool and loaded by the
+// engine instead of the source assets. Cooked files live in WorkingDir/Cooked, with
+// the path of their source plus an extension (e.g. Cooked/Patrick/Patrick.obj.smdl).
+//
+// Cooked model (.smdl): the result of ImportModel (with its node hierarchy), ready to
+// be uploaded.
+// Cooked texture (.stex): decoded pixels, already flipped for OpenGL, with the whole
+// mip chain generated offline.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "model_import.h"
+
+#define COOKED_DIRECTORY      "Cooked"
+#define COOKED_MODEL_MAGIC    0x4C444D53 // "SMDL"
+#define COOKED_TEXTURE_MAGIC  0x58455453 // "STEX"
+#define COOKED_ASSET_VERSION  3
+
+struct CookedTexture
+{
+    u32 width;
+    u32 height;
+    u32 nchannels;
+    std::vector<u32> mipOffsets; // Byte offset of every mip level into pixels, level 0 first
+    std::vector<u8>  pixels;
+};
+
+std::string GetCookedModelPath(const char* sourcePath);
+
+std::string GetCookedTexturePath(const char* sourcePath);
+
+bool WriteCookedModel(const char* filepath, const ImportedModel& model);
+
+/**
+ * Returns false without logging errors if the cooked file does not exist.
+ */
+bool ReadCookedModel(const char* filepath, ImportedModel& model);
+
+/**
+ * Decodes an image file and generates its mip chain (box filter).
+ */
+bool CookTexture(const char* sourcePath, CookedTexture& texture);
+
+bool WriteCookedTexture(const char* filepath, const CookedTexture& texture);
+
+/**
+ * Returns false without logging errors if the cooked file does not exist.
+ */
+bool ReadCookedTexture(const char* filepath, CookedTexture& texture);
+
+inline u32 GetMipWidth(const CookedTexture& texture, u32 level)  { return glm::max(texture.width >> level, 1u); }
+inline u32 GetMipHeight(const CookedTexture& texture, u32 level) { return glm::max(texture.height >> level, 1u); }
@@ -12,11 +12,32 @@
 
 #include "assimp_model_loading.h"
 #include "buffer_management.h"
-
-#define BINDING(b) b
+#include "cooked_assets.h"
+#include "file_system.h"
+#include "geometry_storage.h"
+#include "gl_state.h"
+#include "gpu_culling.h"
+#include "gpu_timer.h"
+#include "hashing.h"
+#include "render_queue.h"
+#include "ring_buffer.h"
 
 float Camera::moveSpeed;
 
+// The name may have several space separated defines (e.g. "FORWARD_SHADING MULTI_DRAW")
+static void GetShaderNameDefines(const char* shaderName, char* defines)
+{
+	defines[0] = '\0';
+	for (const char* name = shaderName; *name; ) {
+		size_t nameLength = strcspn(name, " ");
+		if (nameLength > 0)
+			sprintf(defines + strlen(defines), "#define %.*s\n", (int)nameLength, name);
+		name += nameLength;
+		if (*name == ' ')
+			++name;
+	}
+}
+
 GLuint CreateProgramFromSource(String programSource, const char* shaderName)
 {
 	GLchar  infoLogBuffer[1024] = {};
@@ -25,8 +46,8 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
 	GLint   success;
 
 	char versionString[] = "#version 430\n";
-	char shaderNameDefine[128];
-	sprintf(shaderNameDefine, "#define %s\n", shaderName);
+	char shaderNameDefine[256];
+	GetShaderNameDefines(shaderName, shaderNameDefine);
 	char vertexShaderDefine[] = "#define VERTEX\n";
 	char fragmentShaderDefine[] = "#define FRAGMENT\n";
 
@@ -96,6 +117,57 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
 	return programHandle;
 }
 
+GLuint CreateComputeProgramFromSource(String programSource, const char* shaderName)
+{
+	GLchar  infoLogBuffer[1024] = {};
+	GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
+	GLsizei infoLogSize;
+	GLint   success;
+
+	char versionString[] = "#version 430\n";
+	char shaderNameDefine[256];
+	GetShaderNameDefines(shaderName, shaderNameDefine);
+	char computeShaderDefine[] = "#define COMPUTE\n";
+
+	const GLchar* computeShaderSource[] = {
+		versionString,
+		shaderNameDefine,
+		computeShaderDefine,
+		programSource.str
+	};
+	const GLint computeShaderLengths[] = {
+		(GLint)strlen(versionString),
+		(GLint)strlen(shaderNameDefine),
+		(GLint)strlen(computeShaderDefine),
+		(GLint)programSource.len
+	};
+
+	GLuint cshader = glCreateShader(GL_COMPUTE_SHADER);
+	glShaderSource(cshader, ARRAY_COUNT(computeShaderSource), computeShaderSource, computeShaderLengths);
+	glCompileShader(cshader);
+	glGetShaderiv(cshader, GL_COMPILE_STATUS, &success);
+	if (!success)
+	{
+		glGetShaderInfoLog(cshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+		ELOG("glCompileShader() failed with compute shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+	}
+
+	GLuint programHandle = glCreateProgram();
+	glAttachShader(programHandle, cshader);
+	glLinkProgram(programHandle);
+	glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
+	if (!success)
+	{
+		glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+		ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+	}
+
+	glDetachShader(programHandle, cshader);
+	glDeleteShader(cshader);
+
+	return programHandle;
+}
+
 u32 LoadProgram(App* app, const char* filepath, const char* programName)
 {
 	String programSource = ReadTextFile(filepath);
@@ -110,11 +182,31 @@ u32 LoadProgram(App* app, const char* filepath, const char* programName)
 	return app->programs.size() - 1;
 }
 
+u32 LoadComputeProgram(App* app, const char* filepath, const char* programName)
+{
+	String programSource = ReadTextFile(filepath);
+
+	Program program = {};
+	program.handle = CreateComputeProgramFromSource(programSource, programName);
+	program.filepath = filepath;
+	program.programName = programName;
+	program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+	program.isCompute = true;
+	app->programs.push_back(program);
+
+	return app->programs.size() - 1;
+}
+
 Image LoadImage(const char* filename)
 {
 	Image img = {};
-	stbi_set_flip_vertically_on_load(true);
-	img.pixels = stbi_load(filename, &img.size.x, &img.size.y, &img.nchannels, 0);
+	FileData file = ReadBinaryFile(filename);
+	if (file.data)
+	{
+		stbi_set_flip_vertically_on_load(true);
+		img.pixels = stbi_load_from_memory(file.data, (int)file.size, &img.size.x, &img.size.y, &img.nchannels, 0);
+		FreeFileData(file);
+	}
 	if (img.pixels)
 	{
 		img.stride = img.size.x * img.nchannels;
@@ -148,8 +240,8 @@ GLuint CreateTexture2DFromImage(Image image, GLenum wrapTex)
 	glGenTextures(1, &texHandle);
 	glBindTexture(GL_TEXTURE_2D, texHandle);
 	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.size.x, image.size.y, 0, dataFormat, dataType, image.pixels);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, wrapTex);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapTex);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapTex);
@@ -159,24 +251,99 @@ GLuint CreateTexture2DFromImage(Image image, GLenum wrapTex)
 	return texHandle;
 }
 
+GLuint CreateTexture2DFromCookedTexture(const CookedTexture& texture, GLenum wrapTex)
+{
+	GLenum internalFormat = GL_RGB8;
+	GLenum dataFormat = GL_RGB;
+	GLenum dataType = GL_UNSIGNED_BYTE;
+
+	switch (texture.nchannels)
+	{
+	case 3: dataFormat = GL_RGB; internalFormat = GL_RGB8; break;
+	case 4: dataFormat = GL_RGBA; internalFormat = GL_RGBA8; break;
+	default: ELOG("LoadTexture2D() - Unsupported number of channels");
+	}
+
+	GLuint texHandle;
+	glGenTextures(1, &texHandle);
+	glBindTexture(GL_TEXTURE_2D, texHandle);
+
+	// Small mip levels of RGB textures have rows that are not 4 byte aligned
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (u32 level = 0; level < texture.mipOffsets.size(); ++level)
+	{
+		glTexImage2D(GL_TEXTURE_2D, level, internalFormat, GetMipWidth(texture, level), GetMipHeight(texture, level), 0,
+			dataFormat, dataType, texture.pixels.data() + texture.mipOffsets[level]);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)texture.mipOffsets.size() - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, wrapTex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapTex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapTex);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return texHandle;
+}
+
 u32 LoadTexture2D(App* app, const char* filepath, GLenum wrapTex)
 {
 	for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
 		if (app->textures[texIdx].filepath == filepath)
 			return texIdx;
 
-	Image image = LoadImage(filepath);
+	// Textures are cooked offline with their mip chain by the AssetCooker, decoding
+	// the source image is only a fallback for textures that have not been cooked yet
+	CookedTexture cookedTexture = {};
+	Image image = {};
+	std::string cookedPath = GetCookedTexturePath(filepath);
+	const bool isCooked = ReadCookedTexture(cookedPath.c_str(), cookedTexture);
+	if (isCooked)
+	{
+		image.pixels = cookedTexture.pixels.data();
+		image.size = ivec2(cookedTexture.width, cookedTexture.height);
+		image.nchannels = cookedTexture.nchannels;
+		image.stride = image.size.x * image.nchannels;
+	}
+	else
+	{
+		image = LoadImage(filepath);
+	}
 
 	if (image.pixels)
 	{
+		// Identical pixels (and sampling) loaded from another path share the GL texture
+		u32 imageSize = image.stride * image.size.y;
+		u64 hash = HashBytes(image.pixels, imageSize);
+		hash = HashCombine(hash, HashValue(image.size));
+		hash = HashCombine(hash, HashValue(image.nchannels));
+		hash = HashCombine(hash, HashValue(wrapTex));
+
 		Texture tex = {};
-		tex.handle = CreateTexture2DFromImage(image, wrapTex);
 		tex.filepath = filepath;
+		tex.contentHash = hash;
+
+		auto it = app->textureHashes.find(hash);
+		if (it != app->textureHashes.end())
+		{
+			tex.handle = app->textures[it->second].handle;
+			app->dedupStats.sharedTextures++;
+			app->dedupStats.textureBytesSaved += imageSize;
+			ILOG("Texture %s shares its content with %s", filepath, app->textures[it->second].filepath.c_str());
+		}
+		else
+		{
+			tex.handle = isCooked ? CreateTexture2DFromCookedTexture(cookedTexture, wrapTex) : CreateTexture2DFromImage(image, wrapTex);
+			app->textureHashes[hash] = app->textures.size();
+		}
 
 		u32 texIdx = app->textures.size();
 		app->textures.push_back(tex);
 
-		FreeImage(image);
+		if (!isCooked)
+			FreeImage(image);
 		return texIdx;
 	}
 	else
@@ -185,6 +352,28 @@ u32 LoadTexture2D(App* app, const char* filepath, GLenum wrapTex)
 	}
 }
 
+static bool HasGLExtension(const char* name)
+{
+	GLint extensionCount = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+	for (GLint i = 0; i < extensionCount; ++i) {
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+			return true;
+	}
+	return false;
+}
+
+// Uniform bytes a frame writes at most: the views, a few GlobalParms and pass LocalParms
+// blocks, the LocalParms of every entity in the scene pass and one block per light sphere
+static u32 GetUniformFrameSize(const App* app)
+{
+	const u32 alignment = app->uniformBlockAligment;
+	const u32 viewBlock = Align(4 * sizeof(glm::mat4) + 8 * sizeof(vec4), alignment);
+	const u32 block = Align(sizeof(glm::mat4) + sizeof(vec4), alignment);
+	const u32 passBlocks = 8;
+	return View_Count * viewBlock + (passBlocks + (u32)app->entities.size() + (u32)app->lights.size()) * block;
+}
+
 void Init(App* app)
 {
 	// Initialize your resources here!
@@ -232,11 +421,7 @@ void Init(App* app)
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->embeddedElements);
 	glBindVertexArray(0);
 
-	GLint maxsize;
-
 	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &app->uniformBlockAligment);
-	glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &maxsize);
-	app->cBuffer = CreateBuffer(maxsize, GL_UNIFORM_BUFFER, GL_STREAM_DRAW);
 
 	// - programs (and retrieve uniform indices)
 	app->texturedGeometryProgramIdx = LoadProgram(app, "shaders.glsl", "TEXTURED_GEOMETRY");
@@ -247,7 +432,6 @@ void Init(App* app)
 
 	app->texturedForwardProgramIdx = LoadProgram(app, "shaders.glsl", "FORWARD_SHADING");
 	Program& texturedForwardProgram = app->programs[app->texturedForwardProgramIdx];
-	app->texturedMeshProgramIdx_uTexture = glGetUniformLocation(texturedForwardProgram.handle, "uAlbedoTexture");
 	texturedForwardProgram.vertexInputLayout.attributes.push_back({ 0, 3 });
 	texturedForwardProgram.vertexInputLayout.attributes.push_back({ 1, 3 });
 	texturedForwardProgram.vertexInputLayout.attributes.push_back({ 2, 2 });
@@ -256,14 +440,19 @@ void Init(App* app)
 
 	app->texturedMeshProgramIdx = LoadProgram(app, "shaders.glsl", "SHOW_TEXTURED_MESH");
 	Program& texturedMeshProgram = app->programs[app->texturedMeshProgramIdx];
-	app->texturedMeshProgramIdx_uTexture2 = glGetUniformLocation(texturedMeshProgram.handle, "uAlbedoTexture");
-	app->texturedMeshProgramIdx_uTexture3 = glGetUniformLocation(texturedMeshProgram.handle, "uNormalTexture");
 	texturedMeshProgram.vertexInputLayout.attributes.push_back({ 0, 3 });
 	texturedMeshProgram.vertexInputLayout.attributes.push_back({ 1, 3 });
 	texturedMeshProgram.vertexInputLayout.attributes.push_back({ 2, 2 });
 	texturedMeshProgram.vertexInputLayout.attributes.push_back({ 3, 3 });
 	texturedMeshProgram.vertexInputLayout.attributes.push_back({ 4, 3 });
 
+	// Variants that take the world matrix and material of every draw from storage buffers
+	app->texturedForwardMultiDrawProgramIdx = LoadProgram(app, "shaders.glsl", "FORWARD_SHADING MULTI_DRAW");
+	app->programs[app->texturedForwardMultiDrawProgramIdx].vertexInputLayout = app->programs[app->texturedForwardProgramIdx].vertexInputLayout;
+
+	app->texturedMeshMultiDrawProgramIdx = LoadProgram(app, "shaders.glsl", "SHOW_TEXTURED_MESH MULTI_DRAW");
+	app->programs[app->texturedMeshMultiDrawProgramIdx].vertexInputLayout = app->programs[app->texturedMeshProgramIdx].vertexInputLayout;
+
 	app->texturedLightProgramIdx = LoadProgram(app, "shaders.glsl", "SHOW_LIGHTS");
 	Program& texturedLightProgram = app->programs[app->texturedLightProgramIdx];
 	app->texturedMeshProgramIdx_uNormals = glGetUniformLocation(texturedLightProgram.handle, "uNormalsTexture");
@@ -284,14 +473,46 @@ void Init(App* app)
 
 	app->baseModelProgramIdx = LoadProgram(app, "shaders.glsl", "DRAW_BASE_MODEL");
 	Program& texturedBaseProgram = app->programs[app->baseModelProgramIdx];
-	app->BaseModelProgramIdx_uViewProjection = glGetUniformLocation(texturedBaseProgram.handle, "uWorldViewProjectionMatrix");
-	app->BaseModelProgramIdx_uPlane = glGetUniformLocation(texturedBaseProgram.handle, "plane");
-	app->BaseModelProgramIdx_uFaceColor = glGetUniformLocation(texturedBaseProgram.handle, "faceColor");
 	app->BaseModelProgramIdx_uLightPos = glGetUniformLocation(texturedBaseProgram.handle, "lightPos");
 	app->BaseModelProgramIdx_uLightColor = glGetUniformLocation(texturedBaseProgram.handle, "lightColor");
 	texturedBaseProgram.vertexInputLayout.attributes.push_back({ 0, 3 });
 	texturedBaseProgram.vertexInputLayout.attributes.push_back({ 1, 3 });
 
+	app->baseModelMultiDrawProgramIdx = LoadProgram(app, "shaders.glsl", "DRAW_BASE_MODEL MULTI_DRAW");
+	app->programs[app->baseModelMultiDrawProgramIdx].vertexInputLayout = app->programs[app->baseModelProgramIdx].vertexInputLayout;
+
+	app->frustumCullingProgramIdx = LoadComputeProgram(app, "shaders.glsl", "FRUSTUM_CULLING");
+	app->tiledLightingProgramIdx = LoadComputeProgram(app, "shaders.glsl", "TILED_LIGHTING");
+
+	app->directionalLightProgramIdx = LoadProgram(app, "shaders.glsl", "SHOW_LIGHTS DIRECTIONAL_ONLY");
+	app->programs[app->directionalLightProgramIdx].vertexInputLayout = app->programs[app->texturedLightProgramIdx].vertexInputLayout;
+	app->lightVolumeProgramIdx = LoadProgram(app, "shaders.glsl", "LIGHT_VOLUME");
+	app->programs[app->lightVolumeProgramIdx].vertexInputLayout.attributes.push_back({ 0, 3 });
+
+	app->compactGBufferProgramIdx = LoadProgram(app, "shaders.glsl", "SHOW_TEXTURED_MESH COMPACT_GBUFFER");
+	app->programs[app->compactGBufferProgramIdx].vertexInputLayout = app->programs[app->texturedMeshProgramIdx].vertexInputLayout;
+	app->compactGBufferMultiDrawProgramIdx = LoadProgram(app, "shaders.glsl", "SHOW_TEXTURED_MESH MULTI_DRAW COMPACT_GBUFFER");
+	app->programs[app->compactGBufferMultiDrawProgramIdx].vertexInputLayout = app->programs[app->texturedMeshProgramIdx].vertexInputLayout;
+	app->compactLightingProgramIdx[DeferredLighting_FullScreen] = LoadProgram(app, "shaders.glsl", "SHOW_LIGHTS COMPACT_GBUFFER");
+	app->programs[app->compactLightingProgramIdx[DeferredLighting_FullScreen]].vertexInputLayout = app->programs[app->texturedLightProgramIdx].vertexInputLayout;
+	app->compactLightingProgramIdx[DeferredLighting_Tiled] = LoadComputeProgram(app, "shaders.glsl", "TILED_LIGHTING COMPACT_GBUFFER");
+	app->compactLightingProgramIdx[DeferredLighting_LightVolumes] = LoadProgram(app, "shaders.glsl", "LIGHT_VOLUME COMPACT_GBUFFER");
+	app->programs[app->compactLightingProgramIdx[DeferredLighting_LightVolumes]].vertexInputLayout = app->programs[app->lightVolumeProgramIdx].vertexInputLayout;
+	app->compactDirectionalLightProgramIdx = LoadProgram(app, "shaders.glsl", "SHOW_LIGHTS DIRECTIONAL_ONLY COMPACT_GBUFFER");
+	app->programs[app->compactDirectionalLightProgramIdx].vertexInputLayout = app->programs[app->texturedLightProgramIdx].vertexInputLayout;
+	for (GpuTimer& timer : app->lightingTimers)
+		CreateGpuTimer(timer);
+	CreateGpuTimer(app->frameTimer);
+
+	app->depthPrepassProgramIdx = LoadProgram(app, "shaders.glsl", "DEPTH_ONLY");
+	app->programs[app->depthPrepassProgramIdx].vertexInputLayout.attributes.push_back({ 0, 3 });
+	app->depthPrepassMultiDrawProgramIdx = LoadProgram(app, "shaders.glsl", "DEPTH_ONLY MULTI_DRAW");
+	app->programs[app->depthPrepassMultiDrawProgramIdx].vertexInputLayout = app->programs[app->depthPrepassProgramIdx].vertexInputLayout;
+
+	app->hasPipelineStatistics = HasGLExtension("GL_ARB_pipeline_statistics_query");
+	if (app->hasPipelineStatistics)
+		glGenQueries(ARRAY_COUNT(app->fragmentQueries), app->fragmentQueries);
+
 	app->waterProgramIdx = LoadProgram(app, "shaders.glsl", "WATER_SHADER");
 	Program& texturedWaterProgram = app->programs[app->waterProgramIdx];
 	app->WaterProgramIdx_uViewProjection = glGetUniformLocation(texturedWaterProgram.handle, "uWorldViewProjectionMatrix");
@@ -309,6 +530,8 @@ void Init(App* app)
 	app->WaterProgramIdx_uShineDamper = glGetUniformLocation(texturedWaterProgram.handle, "shineDamper");
 	app->WaterProgramIdx_uReflectivity = glGetUniformLocation(texturedWaterProgram.handle, "reflectivity");
 	app->WaterProgramIdx_uTiling = glGetUniformLocation(texturedWaterProgram.handle, "tiling");
+	app->WaterProgramIdx_uReflectionViewProjection = glGetUniformLocation(texturedWaterProgram.handle, "uReflectionViewProjection");
+	app->WaterProgramIdx_uRefractionViewProjection = glGetUniformLocation(texturedWaterProgram.handle, "uRefractionViewProjection");
 	texturedWaterProgram.vertexInputLayout.attributes.push_back({ 0, 3 });
 	texturedWaterProgram.vertexInputLayout.attributes.push_back({ 1, 2 });
 
@@ -322,7 +545,6 @@ void Init(App* app)
 	app->normalMapIdx = LoadTexture2D(app, "3/Textures/Normal.png", GL_REPEAT);
 	app->bumpMapIdx = LoadTexture2D(app, "3/Textures/Height.png", GL_REPEAT);
 	app->albedoMapIdx = LoadTexture2D(app, "3/Textures/Color.png", GL_REPEAT);
-	u32 pat = LoadModel(app, "Patrick/Patrick.obj");
 
 
 	//u32 cliff = LoadModel(app, "Cliff2/rocks.obj");
@@ -335,14 +557,21 @@ void Init(App* app)
 	app->cliff = Entity(glm::mat4(1.f), LoadModel(app, "Plane/Plane.obj"));
 	app->box = Entity(glm::mat4(1.f), LoadModel(app, "Plane2/Plane2.obj"));
 
-	app->entities.push_back(Entity(glm::translate(glm::mat4(1.f), vec3(0.0f, 0.1f, 5.f)), pat));
-	app->entities.push_back(Entity(glm::translate(glm::mat4(1.f), vec3(0.0f, 0.1f, 10.f)), pat));
-	app->entities.push_back(Entity(glm::translate(glm::mat4(1.f), vec3(-12.1f, 0.1f, 1.f)), pat));
-	app->entities.push_back(Entity(glm::translate(glm::mat4(1.f), vec3(12.1f, 0.1f, 1.f)), pat));
-	app->entities.push_back(Entity(glm::translate(glm::mat4(1.f), vec3(-12.1f, 0.1f, 5.f)), pat));
-	app->entities.push_back(Entity(glm::translate(glm::mat4(1.f), vec3(12.1f, 0.1f, 5.f)), pat));
-	app->entities.push_back(Entity(glm::translate(glm::mat4(1.f), vec3(-12.1f, 0.1f, 10.f)), pat));
-	app->entities.push_back(Entity(glm::translate(glm::mat4(1.f), vec3(12.1f, 0.1f, 10.f)), pat));
+	// The Patricks keep the node hierarchy of the file: each one is a root SceneNode and
+	// the entities of its meshes follow it. The meshes are uploaded once, so the entities
+	// of every Patrick share the same models (and are instanced together).
+	const vec3 patrickPositions[] = {
+		vec3(0.0f, 0.1f, 5.f), vec3(0.0f, 0.1f, 10.f),
+		vec3(-12.1f, 0.1f, 1.f), vec3(12.1f, 0.1f, 1.f),
+		vec3(-12.1f, 0.1f, 5.f), vec3(12.1f, 0.1f, 5.f),
+		vec3(-12.1f, 0.1f, 10.f), vec3(12.1f, 0.1f, 10.f),
+	};
+	for (const vec3& position : patrickPositions) {
+		if (LoadModelHierarchy(app, "Patrick/Patrick.obj", glm::translate(glm::mat4(1.f), position)) == UINT32_MAX) {
+			ELOG("Could not load Patrick/Patrick.obj");
+			break;
+		}
+	}
 
 	app->lights.push_back(Light(LightType::LightType_Directional, vec3(1.f, 1.f, 1.f), vec3(0.89, -1.0, -1.0), vec3(0.f, 10.f, 11.5f), 0.9f));
 	app->lights.push_back(Light(LightType::LightType_Point, vec3(0.0, 0.0, 1.0), vec3(0.0, 1.0, 1.0), vec3(0.f, 2.1f, 1.9f), 2.f));
@@ -361,127 +590,14 @@ void Init(App* app)
 	app->wTexNormalMap = LoadTexture2D(app, "WaterScene/normalMap.png", GL_REPEAT);
 	app->water = WaterTile(vec3(4.7f, 2.534f, 2.5f), vec2(4.f, 6.f));
 
-	//Framebuffer
-	for (int i = 0; i < (int)FrameBuffer::MAX; ++i) {
-		app->framebuffer[(FrameBuffer)i] = 0;
-	}
-
-	for (int i = (int)FrameBuffer::FinalRender; i < (int)FrameBuffer::Depth; ++i) {
-		glGenTextures(1, &app->framebuffer[(FrameBuffer)i]);
-		glBindTexture(GL_TEXTURE_2D, app->framebuffer[(FrameBuffer)i]);
-		if (i == (int)FrameBuffer::Position || i == (int)FrameBuffer::Normals) {
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-		}
-		else {
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-		}
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glBindTexture(GL_TEXTURE_2D, 0);
-	}
-
-	glGenTextures(1, &app->framebuffer[FrameBuffer::Depth]);
-	glBindTexture(GL_TEXTURE_2D, app->framebuffer[FrameBuffer::Depth]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	ILOG("Asset deduplication: %u meshes, %u models, %u materials and %u textures shared, %llu bytes saved",
+		app->dedupStats.sharedMeshes, app->dedupStats.sharedModels, app->dedupStats.sharedMaterials, app->dedupStats.sharedTextures,
+		app->dedupStats.meshBytesSaved + app->dedupStats.materialBytesSaved + app->dedupStats.textureBytesSaved);
 
-	glGenFramebuffers(1, &app->framebuffer[FrameBuffer::Framebuffer]);
-	glBindFramebuffer(GL_FRAMEBUFFER, app->framebuffer[FrameBuffer::Framebuffer]);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->framebuffer[FrameBuffer::FinalRender], 0);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, app->framebuffer[FrameBuffer::Normals], 0);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, app->framebuffer[FrameBuffer::Albedo], 0);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, app->framebuffer[FrameBuffer::Light], 0);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, app->framebuffer[FrameBuffer::Position], 0);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->framebuffer[FrameBuffer::Depth], 0);
-
-	CheckFramebufferStatus();
-
-	glDrawBuffers(5, &app->framebuffer[FrameBuffer::FinalRender]);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-	// WATER =============================================================================
-	int size[] = { app->displaySize.x, app->displaySize.y };
-	glGenTextures(1, &app->wTexReflection);
-	glBindTexture(GL_TEXTURE_2D, app->wTexReflection);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size[0], size[1], 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
-
-	glGenTextures(1, &app->wTexRefraction);
-	glBindTexture(GL_TEXTURE_2D, app->wTexRefraction);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size[0], size[1], 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	UploadMaterials(app);
 
-	glGenTextures(1, &app->wDepthReflection);
-	glBindTexture(GL_TEXTURE_2D, app->wDepthReflection);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size[0], size[1], 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-
-	glGenTextures(1, &app->wDepthRefraction);
-	glBindTexture(GL_TEXTURE_2D, app->wDepthRefraction);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size[0], size[1], 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-
-	glGenTextures(1, &app->wTexBase);
-	glBindTexture(GL_TEXTURE_2D, app->wTexBase);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size[0], size[1], 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
-
-	glGenTextures(1, &app->wDepthBase);
-	glBindTexture(GL_TEXTURE_2D, app->wDepthBase);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size[0], size[1], 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	glGenFramebuffers(1, &app->wFboBase);
-	glBindFramebuffer(GL_FRAMEBUFFER, app->wFboBase);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->wTexBase, 0);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->wDepthBase, 0);
-	CheckFramebufferStatus();
-	glDrawBuffers(1, &app->wFboBase);
-	glBindFramebuffer(GL_FRAMEBUFFER, NULL);
-
-	glGenFramebuffers(1, &app->wFboReflect);
-	glBindFramebuffer(GL_FRAMEBUFFER, app->wFboReflect);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->wTexReflection, 0);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->wDepthReflection, 0);
-	CheckFramebufferStatus();
-	glDrawBuffers(1, &app->wFboReflect);
-	glBindFramebuffer(GL_FRAMEBUFFER, NULL);
-
-	glGenFramebuffers(1, &app->wFboRefract);
-	glBindFramebuffer(GL_FRAMEBUFFER, app->wFboRefract);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->wTexRefraction, 0);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->wDepthRefraction, 0);
-	CheckFramebufferStatus();
-	glDrawBuffers(1, &app->wFboReflect);
-	glBindFramebuffer(GL_FRAMEBUFFER, NULL);
+	// Sized for the scene, Render reserves more when the entities or lights grow
+	CreateRingBuffer(app->uniformRing, GetUniformFrameSize(app), GL_UNIFORM_BUFFER, app->uniformBlockAligment);
 }
 
 void CheckFramebufferStatus()
@@ -503,6 +619,48 @@ void CheckFramebufferStatus()
 	}
 }
 
+// The multi-draw and instanced submissions read the world matrices and materials of the
+// draws from storage buffers, with the MULTI_DRAW variants of the programs
+static bool UsesDrawParams(const App* app)
+{
+	return app->useMultiDrawIndirect || app->useInstancing;
+}
+
+// Adds count point lights at random around the scene, or removes them if count is 0,
+// to stress the clustered shading
+static void AddStressLights(App* app, u32 count)
+{
+	if (count == 0) {
+		app->lights.erase(app->lights.end() - app->stressLightCount, app->lights.end());
+		app->stressLightCount = 0;
+		return;
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		const vec3 random(rand() / (f32)RAND_MAX, rand() / (f32)RAND_MAX, rand() / (f32)RAND_MAX);
+		const vec3 position = vec3(-20.f, 0.5f, -10.f) + random * vec3(40.f, 7.5f, 35.f);
+		const vec3 color = glm::normalize(vec3(rand() / (f32)RAND_MAX, rand() / (f32)RAND_MAX, rand() / (f32)RAND_MAX) + 0.1f);
+		const f32 intensity = 0.02f + 0.08f * rand() / (f32)RAND_MAX;
+		app->lights.push_back(Light(LightType_Point, color, vec3(0.f, -1.f, 0.f), position, intensity));
+	}
+	app->stressLightCount += count;
+}
+
+// Bytes per pixel of the G-buffer pass (color attachments and depth) and read by the
+// lighting, Depth24 counted as 4 bytes. The render graph leaves out the color and light
+// outputs of the full layout, nothing reads them.
+static void GetGBufferBytesPerPixel(bool compact, u32& written, u32& read)
+{
+	if (compact) {
+		written = 4 /* normals RG16 */ + 4 /* albedo RGBA8 */ + 4 /* depth */;
+		read = written;
+	}
+	else {
+		written = 8 /* normals RGBA16F */ + 4 /* albedo RGBA8 */ + 8 /* position RGBA16F */ + 4 /* depth */;
+		read = 8 /* position */ + 8 /* normals */ + 4 /* albedo */ + 4 /* depth */;
+	}
+}
+
 void Gui(App* app)
 {
 	ImGui::Begin("Info");
@@ -518,6 +676,202 @@ void Gui(App* app)
 
 	ImGui::Separator();
 
+	if (ImGui::CollapsingHeader("Asset Deduplication")) {
+		const AssetDedupStats& stats = app->dedupStats;
+		ImGui::Text("Meshes shared: %u (%.2f KB saved)", stats.sharedMeshes, stats.meshBytesSaved / 1024.f);
+		ImGui::Text("Models shared: %u", stats.sharedModels);
+		ImGui::Text("Materials shared: %u (%.2f KB saved)", stats.sharedMaterials, stats.materialBytesSaved / 1024.f);
+		ImGui::Text("Textures shared: %u (%.2f KB saved)", stats.sharedTextures, stats.textureBytesSaved / 1024.f);
+		ImGui::Text("Total saved: %.2f KB", (stats.meshBytesSaved + stats.materialBytesSaved + stats.textureBytesSaved) / 1024.f);
+	}
+
+	if (ImGui::CollapsingHeader("Scene Nodes")) {
+		u32 nodeEntities = 0;
+		for (const Entity& e : app->entities)
+			nodeEntities += e.node != UINT32_MAX ? 1 : 0;
+		ImGui::Text("Nodes: %u, entities that follow them: %u", (u32)app->sceneNodes.size(), nodeEntities);
+
+		// Moving a root moves its children, UpdateSceneNodes propagates it every frame
+		for (u32 i = 0; i < app->sceneNodes.size(); ++i) {
+			SceneNode& node = app->sceneNodes[i];
+			if (node.parent != UINT32_MAX)
+				continue;
+			ImGui::PushID(i);
+			ImGui::DragFloat3(node.name.empty() ? "Root" : node.name.c_str(), glm::value_ptr(node.localTransform[3]), 0.05f);
+			ImGui::PopID();
+		}
+	}
+
+	if (ImGui::CollapsingHeader("Render Queue")) {
+		const RenderQueueStats& stats = app->renderQueueStats;
+		const u32 totalBinds = stats.stateChanges + stats.stateChangesSaved;
+		ImGui::Text("Draw calls: %u", stats.drawCalls);
+		ImGui::Text("State changes: %u", stats.stateChanges);
+		ImGui::Text("State changes saved: %u (%.1f%%)", stats.stateChangesSaved, totalBinds ? 100.f * stats.stateChangesSaved / totalBinds : 0.f);
+		ImGui::Checkbox("Multi-draw indirect", &app->useMultiDrawIndirect);
+		if (app->useMultiDrawIndirect)
+			ImGui::Text("Indirect commands: %u", stats.indirectCommands);
+		ImGui::Checkbox("Instancing", &app->useInstancing);
+		if (UsesDrawParams(app))
+			ImGui::Text("Instances: %u", stats.instances);
+	}
+
+	if (ImGui::CollapsingHeader("Depth Pre-pass")) {
+		ImGui::Checkbox("Depth pre-pass (forward)", &app->useDepthPrepass);
+		if (app->hasPipelineStatistics) {
+			// Measured in the forward mode, the last frames with and without the pre-pass
+			ImGui::Text("Fragment shader invocations:");
+			for (u32 prepass = 0; prepass < 2; ++prepass) {
+				const GLuint64* invocations = app->fragmentInvocations[prepass];
+				ImGui::Text("%s: %llu shading, %llu depth only", prepass ? "With pre-pass" : "Without pre-pass", (unsigned long long)invocations[1], (unsigned long long)invocations[0]);
+			}
+		}
+		else {
+			ImGui::Text("Fragment shader invocations need GL_ARB_pipeline_statistics_query");
+		}
+	}
+
+	if (ImGui::CollapsingHeader("Clustered Shading")) {
+		const LightClusterStats& stats = app->lightClusters.stats;
+		ImGui::Text("Grid: %u x %u x %u clusters, tiles of %u x %u pixels", CLUSTER_GRID_X, CLUSTER_GRID_Y, CLUSTER_GRID_Z, app->lightClusters.tileSize.x, app->lightClusters.tileSize.y);
+		ImGui::Text("Lights: %u (%u point lights in the view)", (u32)app->lights.size(), stats.pointLights);
+		ImGui::Text("Clusters with lights: %u / %u", stats.usedClusters, CLUSTER_COUNT);
+		ImGui::Text("Light indices: %u, most in a cluster: %u", stats.lightIndices, stats.maxClusterLights);
+
+		static int stressLights = 1024;
+		ImGui::DragInt("Random point lights", &stressLights, 16.f, 1, 65536);
+		if (ImGui::Button("Add"))
+			AddStressLights(app, (u32)stressLights);
+		ImGui::SameLine();
+		if (ImGui::Button("Remove all"))
+			AddStressLights(app, 0);
+		ImGui::Text("Random point lights: %u", app->stressLightCount);
+	}
+
+	if (ImGui::CollapsingHeader("Deferred Lighting")) {
+		static const char* pathNames[DeferredLighting_Count] = { "Full-screen pass", "Tiled compute", "Light volumes" };
+		for (u32 path = 0; path < DeferredLighting_Count; ++path) {
+			if (ImGui::RadioButton(pathNames[path], app->deferredLighting == path))
+				app->deferredLighting = (DeferredLighting)path;
+		}
+		// GPU time of the lighting of the deferred mode, the last frames of each path
+		for (u32 path = 0; path < DeferredLighting_Count; ++path) {
+			const GpuTimer& timer = app->lightingTimers[path];
+			if (timer.samples > 0)
+				ImGui::Text("%s: %.3f ms (last %.3f ms)", pathNames[path], timer.averageMs, timer.lastMs);
+			else
+				ImGui::Text("%s: not measured", pathNames[path]);
+		}
+
+		ImGui::Separator();
+		ImGui::Checkbox("Compact G-buffer", &app->useCompactGBuffer);
+		const f32 megapixels = app->renderSize.x * app->renderSize.y / (1024.f * 1024.f);
+		for (u32 compact = 0; compact < 2; ++compact) {
+			u32 written, read;
+			GetGBufferBytesPerPixel(compact != 0, written, read);
+			ImGui::Text("%s: %u B/pixel written (%.1f MB), %u B/pixel read (%.1f MB)", compact ? "Compact" : "Full", written, written * megapixels, read, read * megapixels);
+		}
+	}
+
+	if (ImGui::CollapsingHeader("Dynamic Resolution")) {
+		ImGui::Checkbox("Dynamic resolution", &app->useDynamicResolution);
+		if (app->useDynamicResolution) {
+			ImGui::DragFloat("Target frame (ms)", &app->targetFrameMs, 0.1f, 1.f, 100.f);
+			ImGui::DragFloat("Min scale", &app->minResolutionScale, 0.01f, 0.25f, app->maxResolutionScale);
+			ImGui::DragFloat("Max scale", &app->maxResolutionScale, 0.01f, app->minResolutionScale, 2.f);
+			ImGui::DragFloat("Hysteresis", &app->resolutionHysteresis, 0.01f, 0.f, 0.5f);
+		}
+		else {
+			ImGui::DragFloat("Scale", &app->resolutionScale, 0.01f, 0.25f, 2.f);
+		}
+		ImGui::Text("Scale: %.2f, %d x %d of %d x %d", app->resolutionScale, app->renderSize.x, app->renderSize.y, app->displaySize.x, app->displaySize.y);
+		if (app->frameTimer.samples > 0)
+			ImGui::Text("GPU frame: %.3f ms (last %.3f ms)", app->frameTimer.averageMs, app->frameTimer.lastMs);
+		else
+			ImGui::Text("GPU frame: not measured");
+	}
+
+	if (ImGui::CollapsingHeader("Render Graph")) {
+		const RenderGraphStats& stats = app->renderGraph.stats;
+		ImGui::Text("Passes: %u (%u culled)", stats.passes - stats.culledPasses, stats.culledPasses);
+		ImGui::Text("Attachments left out: %u, clears: %u", stats.droppedAttachments, stats.clears);
+		ImGui::Text("Render targets: %u, %.2f MB (%.2f MB without aliasing)", stats.targets, stats.frameBytes / (1024.f * 1024.f), stats.targetBytes / (1024.f * 1024.f));
+		for (const RenderGraphPass& pass : app->renderGraph.passes)
+			ImGui::Text("%s%s", pass.name, pass.alive ? "" : " (culled)");
+	}
+
+	if (ImGui::CollapsingHeader("Render Target Pool")) {
+		const RenderTargetPool& pool = app->renderGraph.pool;
+		const RenderTargetPoolStats& stats = pool.stats;
+		ImGui::Text("Textures: %u, %.2f MB", stats.textures, stats.bytes / (1024.f * 1024.f));
+		ImGui::Text("In use: %u, %.2f MB", stats.acquired, stats.acquiredBytes / (1024.f * 1024.f));
+		ImGui::Text("Retiring: %.2f MB", stats.retiredBytes / (1024.f * 1024.f));
+		ImGui::Text("Created: %u, destroyed: %u", stats.created, stats.destroyed);
+		// Last target that had each texture
+		for (const PooledRenderTarget& target : pool.targets) {
+			ImGui::Text("%s: %dx%d, format 0x%04x, %u samples, %.2f MB, %s", target.name, target.desc.size.x, target.desc.size.y, target.desc.format, target.desc.samples,
+				target.bytes / (1024.f * 1024.f), target.acquired ? "in use" : "retiring");
+		}
+	}
+
+	if (ImGui::CollapsingHeader("CPU Culling")) {
+		ImGui::Checkbox("Frustum culling##cpu", &app->useCpuCulling);
+		ImGui::Checkbox("Entity BVH", &app->useBvh);
+		ImGui::Text("BVH: %u nodes, %u builds, %u refits", (u32)app->entityBvh.nodes.size(), app->bvhBuilds, app->bvhRefits);
+		if (app->useCpuCulling && app->useBvh)
+			ImGui::Text("Entities inside the frustum: %u / %u", app->bvhVisibleEntities, (u32)app->entities.size());
+		if (app->pickedEntity != UINT32_MAX)
+			ImGui::Text("Picked entity (right click): %u", app->pickedEntity);
+		else
+			ImGui::Text("Picked entity (right click): none");
+		if (app->useCpuCulling) {
+			static const char* passNames[RenderPass_Count] = { "Forward", "G-buffer", "Water reflection", "Water refraction", "Water base", "Depth pre-pass" };
+			for (u32 pass = 0; pass < RenderPass_Count; ++pass) {
+				const CullingStats& stats = app->cpuCullingStats[pass];
+				if (stats.tested > 0)
+					ImGui::Text("%s: %u visible, %u culled", passNames[pass], stats.visible, stats.tested - stats.visible);
+			}
+		}
+	}
+
+	if (app->useMultiDrawIndirect && ImGui::CollapsingHeader("GPU Culling")) {
+		ImGui::Checkbox("Frustum culling", &app->useGpuCulling);
+		if (app->useGpuCulling) {
+			// Counters of the latest dispatches the GPU has finished, a few frames late
+			static const char* passNames[RenderPass_Count] = { "Forward", "G-buffer", "Water reflection", "Water refraction", "Water base", "Depth pre-pass" };
+			for (u32 pass = 0; pass < RenderPass_Count; ++pass) {
+				const GpuCullingView& view = app->gpuCulling[pass];
+				if (view.commandCount > 0)
+					ImGui::Text("%s: %u / %u draws visible", passNames[pass], GetVisibleDrawCount(app, (RenderPass)pass), view.commandCount);
+			}
+		}
+	}
+
+	if (ImGui::CollapsingHeader("Uniform Ring Buffer")) {
+		const RingBuffer& ring = app->uniformRing;
+		ImGui::Text("Storage: %s", ring.persistent ? "persistent, coherent" : "mapped every frame");
+		ImGui::Text("Regions: %u x %.2f KB", RING_BUFFER_REGIONS, ring.regionSize / 1024.f);
+		ImGui::Text("Last frame: %.2f KB (%.1f%%)", ring.frameUsage / 1024.f, 100.f * ring.frameUsage / ring.regionSize);
+		ImGui::Text("High-water mark: %.2f KB (%.1f%%)", ring.highWaterMark / 1024.f, 100.f * ring.highWaterMark / ring.regionSize);
+		ImGui::Text("Grows: %u", ring.growCount);
+		ImGui::Text("Frames that waited for the GPU: %u", ring.fenceWaits);
+	}
+
+	if (ImGui::CollapsingHeader("GL State Cache")) {
+		const GLStateStats& stats = GetGLStateStats();
+		const u32 totalCalls = stats.issued + stats.elided;
+		ImGui::Text("Calls issued: %u", stats.issued);
+		ImGui::Text("Calls elided: %u (%.1f%%)", stats.elided, totalCalls ? 100.f * stats.elided / totalCalls : 0.f);
+
+		bool validation = IsGLStateValidationEnabled();
+		if (ImGui::Checkbox("Validate against GL state", &validation))
+			SetGLStateValidation(validation);
+		if (validation)
+			ImGui::Text("Validation errors: %u", stats.validationErrors);
+	}
+
+	ImGui::Separator();
+
 	ImGui::Text("Mode");
 	ImGui::PushID("##mode");
 	if (ImGui::BeginCombo("Type", ModeToString(app->mode).c_str())) {
@@ -566,6 +920,33 @@ void Gui(App* app)
 			app->wTexDudvSelected = (app->wTexDudvSelected == app->wTexDudv1) ? app->wTexDudv2 : app->wTexDudv1;
 		}
 
+		ImGui::Separator();
+		ImGui::Text("Reflection and refraction");
+		ImGui::SliderFloat("Reflection scale", &app->wReflectionScale, 0.125f, 1.f);
+		ImGui::SliderFloat("Refraction scale", &app->wRefractionScale, 0.125f, 1.f);
+		int interval = (int)app->wViewInterval;
+		if (ImGui::SliderInt("Update every", &interval, 1, 8))
+			app->wViewInterval = (u32)interval;
+		ImGui::Checkbox("Alternate", &app->wAlternateViews);
+		ImGui::Text("Reflection %d x %d, refraction %d x %d", app->wReflection.size.x, app->wReflection.size.y, app->wRefraction.size.x, app->wRefraction.size.y);
+
+		// GPU frame time and difference of the image against full size views every frame
+		WaterComparison& comparison = app->wComparison;
+		if (comparison.phase == WaterComparison_None) {
+			if (ImGui::Button("Compare with full views")) {
+				comparison = {};
+				comparison.phase = WaterComparison_Reference;
+			}
+		}
+		else {
+			ImGui::Text("Comparing: %s, frame %u / %u", comparison.phase == WaterComparison_Reference ? "full views" : "settings", comparison.phaseFrames, WATER_COMPARISON_FRAMES);
+		}
+		if (comparison.measured) {
+			ImGui::Text("GPU frame: %.3f ms full views, %.3f ms settings (%.1f%%)", comparison.referenceMs, comparison.settingsMs, 100.f * (comparison.settingsMs - comparison.referenceMs) / comparison.referenceMs);
+			ImGui::Text("RMSE: %.2f, PSNR: %.1f dB", comparison.rmse, comparison.psnr);
+			ImGui::Text("Pixels off by more than 8: %.2f%%", 100.f * comparison.differentPixels);
+		}
+
 		ImGui::PopID();
 	}
 	else if (app->mode == Mode::Mode_Forward || app->mode == Mode::Mode_Deferred) {
@@ -585,7 +966,8 @@ void Gui(App* app)
 	}
 	else {
 		if (ImGui::CollapsingHeader("Edit")) {
-			for (int i = 0; i < app->lights.size(); ++i) {
+			// Not the random lights, there may be thousands
+			for (int i = 0; i < app->lights.size() - app->stressLightCount; ++i) {
 				ImGui::PushID(i);
 				if (app->lights[i].type == 0) { //Directional
 					ImGui::DragFloat3("direction", glm::value_ptr(app->lights[i].direction), 0.01f);
@@ -605,41 +987,22 @@ void Gui(App* app)
 
 	ImGui::Separator();
 
+	// Any target of the frame, the graph keeps it until the end of the frame. Shown the
+	// next frame, which has the same targets unless the mode changed.
 	ImGui::Text("Target render");
-	if (app->mode == Mode::Mode_Water) {
-		static int sel = 0;
-		static const char* wtargets[] = { "Final", "Reflection", "Refract" };
-		if (ImGui::BeginCombo("Target", wtargets[sel])) {
-			for (int i = 0; i < 3; ++i)
-				if (ImGui::Selectable(wtargets[i])) sel = i;
-			ImGui::EndCombo();
-		}
-
-		switch (sel)
-		{
-		case 0:
-			ImGui::Image((ImTextureID)app->wTexBase, ImVec2(ImGui::GetWindowWidth(), app->displaySize.y * ImGui::GetWindowWidth() / app->displaySize.x), ImVec2(0.f, 1.f), ImVec2(1.f, 0.f));
-			break;
-		case 1:
-			ImGui::Image((ImTextureID)app->wTexReflection, ImVec2(ImGui::GetWindowWidth(), app->displaySize.y * ImGui::GetWindowWidth() / app->displaySize.x), ImVec2(0.f, 1.f), ImVec2(1.f, 0.f));
-			break;
-		case 2:
-			ImGui::Image((ImTextureID)app->wTexRefraction, ImVec2(ImGui::GetWindowWidth(), app->displaySize.y * ImGui::GetWindowWidth() / app->displaySize.x), ImVec2(0.f, 1.f), ImVec2(1.f, 0.f));
-			break;
-		default:
-			break;
+	RenderGraph& graph = app->renderGraph;
+	if (ImGui::BeginCombo("Target", graph.debugTargetName.empty() ? "None" : graph.debugTargetName.c_str())) {
+		if (ImGui::Selectable("None"))
+			graph.debugTargetName.clear();
+		for (u32 i = 0; i < graph.targets.size(); ++i) {
+			if (i != RENDER_GRAPH_BACKBUFFER && ImGui::Selectable(graph.targets[i].name))
+				graph.debugTargetName = graph.targets[i].name;
 		}
+		ImGui::EndCombo();
 	}
-	else {
-		static int sel = (int)FrameBuffer::FinalRender;
-		if (ImGui::BeginCombo("Target", FrameBufferToString((FrameBuffer)sel).c_str())) {
-			for (int i = (int)FrameBuffer::FinalRender; i < (int)FrameBuffer::MAX; ++i)
-				if (ImGui::Selectable(FrameBufferToString((FrameBuffer)i).c_str())) sel = i;
-			ImGui::EndCombo();
-		}
 
-		ImGui::Image((ImTextureID)app->framebuffer[(FrameBuffer)sel], ImVec2(ImGui::GetWindowWidth(), app->displaySize.y * ImGui::GetWindowWidth() / app->displaySize.x), ImVec2(0.f, 1.f), ImVec2(1.f, 0.f));
-	}
+	if (graph.debugTexture)
+		ImGui::Image((ImTextureID)graph.debugTexture, ImVec2(ImGui::GetWindowWidth(), app->displaySize.y * ImGui::GetWindowWidth() / app->displaySize.x), ImVec2(0.f, 1.f), ImVec2(1.f, 0.f));
 
 	ImGui::End();
 }
@@ -687,6 +1050,12 @@ void Update(App* app)
 		}
 	}
 
+	UpdateSceneNodes(app);
+	UpdateEntityBvh(app);
+
+	if (app->input.mouseButtons[MouseButton::RIGHT] == ButtonState::BUTTON_PRESS && !ImGui::GetIO().WantCaptureMouse)
+		PickEntity(app);
+
 	for (u64 i = 0ULL; i < app->programs.size(); ++i) {
 		Program& program = app->programs[i];
 		u64 currentTimestamp = GetFileLastWriteTimestamp(program.filepath.c_str());
@@ -694,280 +1063,842 @@ void Update(App* app)
 			glDeleteProgram(program.handle);
 			String programSource = ReadTextFile(program.filepath.c_str());
 			const char* programName = program.programName.c_str();
-			program.handle = CreateProgramFromSource(programSource, programName);
+			program.handle = program.isCompute ? CreateComputeProgramFromSource(programSource, programName) : CreateProgramFromSource(programSource, programName);
 			program.lastWriteTimestamp = currentTimestamp;
 		}
 	}
 }
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program) {
-	Submesh& submesh = mesh.submeshes[submeshIndex];
-
-	for (u32 i = 0; i < (u32)submesh.vaos.size(); ++i)
-		if (submesh.vaos[i].programHandle == program.handle)
-			return submesh.vaos[i].handle;
+// World AABB of the model of an entity
+static void GetEntityBounds(App* app, const Entity& e, vec3& aabbMin, vec3& aabbMax)
+{
+	const Mesh& mesh = app->meshes[app->models[e.model].meshIdx];
 
-	GLuint vaoHandle = 0;
+	// Nothing to bound, an empty box at the entity keeps the infinite extents (and the
+	// NaN of 0 * inf) out of the BVH
+	if (mesh.submeshes.empty()) {
+		aabbMin = aabbMax = vec3(e.mat[3]);
+		return;
+	}
 
-	//Create a new vao for this submesh/program
-	{
-		glGenVertexArrays(1, &vaoHandle);
-		glBindVertexArray(vaoHandle);
+	vec3 localMin(FLT_MAX), localMax(-FLT_MAX);
+	for (const Submesh& submesh : mesh.submeshes) {
+		localMin = glm::min(localMin, submesh.aabbMin);
+		localMax = glm::max(localMax, submesh.aabbMax);
+	}
 
-		glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
+	const vec3 center = vec3(e.mat * vec4((localMin + localMax) * 0.5f, 1.f));
+	const glm::mat3 absMat = glm::mat3(glm::abs(vec3(e.mat[0])), glm::abs(vec3(e.mat[1])), glm::abs(vec3(e.mat[2])));
+	const vec3 extents = absMat * ((localMax - localMin) * 0.5f);
+	aabbMin = center - extents;
+	aabbMax = center + extents;
+}
 
-		for (u32 i = 0; i < program.vertexInputLayout.attributes.size(); ++i) {
-			bool attributeWasLinked = false;
+void UpdateEntityBvh(App* app)
+{
+	const u32 entityCount = (u32)app->entities.size();
+	std::vector<vec3> aabbMin(entityCount), aabbMax(entityCount);
+	for (u32 i = 0; i < entityCount; ++i)
+		GetEntityBounds(app, app->entities[i], aabbMin[i], aabbMax[i]);
+
+	if (GetBvhItemCount(app->entityBvh) != entityCount) {
+		BuildBvh(app->entityBvh, aabbMin.data(), aabbMax.data(), entityCount);
+		app->bvhBuilds++;
+		return;
+	}
 
-			for (u32 j = 0; j < submesh.vertexBufferLayout.attributes.size(); ++j) {
-				if (program.vertexInputLayout.attributes[i].location != submesh.vertexBufferLayout.attributes[j].location)
-					continue;
-				const u32 index = submesh.vertexBufferLayout.attributes[j].location;
-				const u32 ncomp = submesh.vertexBufferLayout.attributes[j].componentCount;
-				const u32 offset = submesh.vertexBufferLayout.attributes[j].offset + submesh.vertexOffset;
-				const u32 stride = submesh.vertexBufferLayout.stride;
-				glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)offset);
-				glEnableVertexAttribArray(index);
-
-				attributeWasLinked = true;
-				break;
-			}
-			assert(attributeWasLinked);
+	bool moved = false;
+	for (u32 i = 0; i < entityCount; ++i) {
+		if (aabbMin[i] != app->entityBvh.itemMin[i] || aabbMax[i] != app->entityBvh.itemMax[i]) {
+			SetBvhItemBounds(app->entityBvh, i, aabbMin[i], aabbMax[i]);
+			moved = true;
 		}
+	}
+	if (!moved)
+		return;
+
+	// Refitting keeps the topology, when the entities have moved too far it is rebuilt
+	RefitBvh(app->entityBvh);
+	app->bvhRefits++;
+	if (GetBvhCost(app->entityBvh) > BVH_REBUILD_COST_RATIO * app->entityBvh.buildCost) {
+		BuildBvh(app->entityBvh, aabbMin.data(), aabbMax.data(), entityCount);
+		app->bvhBuilds++;
+	}
+}
+
+void PickEntity(App* app)
+{
+	// Ray from the near to the far plane through the mouse position
+	const glm::mat4 inverseViewMat = glm::inverse(app->camera.GetViewMatrix({ app->displaySize.x, app->displaySize.y }));
+	const vec2 ndc(2.f * app->input.mousePos.x / app->displaySize.x - 1.f, 1.f - 2.f * app->input.mousePos.y / app->displaySize.y);
+	vec4 nearPoint = inverseViewMat * vec4(ndc, -1.f, 1.f);
+	vec4 farPoint = inverseViewMat * vec4(ndc, 1.f, 1.f);
+	nearPoint /= nearPoint.w;
+	farPoint /= farPoint.w;
+
+	const vec3 origin = vec3(nearPoint);
+	const f32 length = glm::distance(vec3(farPoint), origin);
+	const vec3 direction = (vec3(farPoint) - origin) / length;
+
+	f32 distance;
+	if (!RaycastBvh(app->entityBvh, origin, direction, length, app->pickedEntity, distance))
+		app->pickedEntity = UINT32_MAX;
+}
+
+void UpdateSceneNodes(App* app)
+{
+	// Parents are always before their children, so a single pass is enough
+	for (SceneNode& node : app->sceneNodes) {
+		node.worldTransform = (node.parent == UINT32_MAX) ? node.localTransform : app->sceneNodes[node.parent].worldTransform * node.localTransform;
+	}
 
-		glBindVertexArray(0);
+	for (Entity& e : app->entities) {
+		if (e.node != UINT32_MAX)
+			e.mat = app->sceneNodes[e.node].worldTransform;
 	}
+}
 
-	Vao vao = { vaoHandle, program.handle };
-	submesh.vaos.push_back(vao);
+void CheckSubmeshVertexInput(const Submesh& submesh, const Program& program)
+{
+	// Every input of the program must be in the vertex format
+	for (const VertexShaderAttribute& input : program.vertexInputLayout.attributes) {
+		bool attributeFound = false;
+		for (const VertexBufferAttribute& attribute : submesh.vertexBufferLayout.attributes)
+			attributeFound |= (attribute.location == input.location);
+		ASSERT(attributeFound, "The vertex format of the submesh lacks an input of the program");
+	}
+}
 
-	return vaoHandle;
+// std140 layout of the MaterialParms block of the shaders
+static void PushMaterialParams(Buffer& buffer, const Material& material)
+{
+	PushVec3(buffer, material.albedo);
+	PushVec3(buffer, material.emissive);
+	PushFloat(buffer, material.smoothness);
+	PushUInt(buffer, material.hasNormalText);
+	PushUInt(buffer, material.hasBumpText);
 }
 
-void Render(App* app)
+// std430 layout of an element of the MaterialBuffer of the multi-draw shaders
+struct MaterialStorageData
 {
-	// - clear the framebuffer
-	glBindFramebuffer(GL_FRAMEBUFFER, app->framebuffer[FrameBuffer::Framebuffer]);
-	GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4 };
-	glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
+	vec3 albedo;
+	f32  smoothness;
+	vec3 emissive;
+	u32  hasNormalMap;
+	u32  hasBumpMap;
+	u32  padding[3];
+};
+
+static MaterialStorageData GetMaterialStorageData(const Material& material)
+{
+	MaterialStorageData data = {};
+	data.albedo = material.albedo;
+	data.smoothness = material.smoothness;
+	data.emissive = material.emissive;
+	data.hasNormalMap = material.hasNormalText;
+	data.hasBumpMap = material.hasBumpText;
+	return data;
+}
 
-	glClearColor(0.2f, 0.2f, 0.2f, 1.f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+void UploadMaterials(App* app)
+{
+	app->materialBlockStride = Align(MATERIAL_PARAMS_SIZE, app->uniformBlockAligment);
 
-	glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+	const u32 requiredSize = glm::max((u32)app->materials.size(), 1u) * app->materialBlockStride;
+	if (app->materialBuffer.size < requiredSize) {
+		if (app->materialBuffer.handle)
+			glDeleteBuffers(1, &app->materialBuffer.handle);
+		app->materialBuffer = CreateBuffer(requiredSize, GL_UNIFORM_BUFFER, GL_STATIC_DRAW);
+	}
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	MapBuffer(app->materialBuffer, GL_WRITE_ONLY);
+	for (u32 i = 0; i < app->materials.size(); ++i) {
+		app->materialBuffer.head = i * app->materialBlockStride;
+		PushMaterialParams(app->materialBuffer, app->materials[i]);
+	}
+	UnmapBuffer(app->materialBuffer);
 
-	glEnable(GL_DEPTH_TEST);
-	switch (app->mode)
-	{
-	case Mode_TexturedQuad: {
-		glBindFramebuffer(GL_FRAMEBUFFER, NULL);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	std::vector<MaterialStorageData> storageData;
+	for (const Material& material : app->materials)
+		storageData.push_back(GetMaterialStorageData(material));
 
-		glUniform1i(app->programUniformTexture, 0);
-		glActiveTexture(GL_TEXTURE0);
-		GLuint textureHandle = app->textures[app->diceTexIdx].handle;
-		glBindTexture(GL_TEXTURE_2D, textureHandle);
+	const u32 requiredStorageSize = glm::max((u32)app->materials.size(), 1u) * sizeof(MaterialStorageData);
+	if (app->materialStorageBuffer.size < requiredStorageSize) {
+		if (app->materialStorageBuffer.handle)
+			glDeleteBuffers(1, &app->materialStorageBuffer.handle);
+		app->materialStorageBuffer = CreateBuffer(requiredStorageSize, GL_SHADER_STORAGE_BUFFER, GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, app->materialStorageBuffer.handle);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, storageData.size() * sizeof(MaterialStorageData), storageData.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-		const Program& programTexturedGeometry = app->programs[app->texturedGeometryProgramIdx];
-		glUseProgram(programTexturedGeometry.handle);
+	app->uploadedMaterialCount = (u32)app->materials.size();
+}
 
-		renderQuad();
-		break;
+void UpdateMaterial(App* app, u32 materialIdx)
+{
+	if (materialIdx >= app->uploadedMaterialCount) {
+		UploadMaterials(app);
+		return;
 	}
-	case Mode_Forward: {
-		Program& texturedMeshProgram = app->programs[app->texturedForwardProgramIdx];
-		glUseProgram(texturedMeshProgram.handle);
 
-		MapBuffer(app->cBuffer, GL_WRITE_ONLY);
+	// Map only the block of the material, the Push* helpers write from its start
+	Buffer block = app->materialBuffer;
+	glBindBuffer(GL_UNIFORM_BUFFER, block.handle);
+	block.data = glMapBufferRange(GL_UNIFORM_BUFFER, materialIdx * app->materialBlockStride, MATERIAL_PARAMS_SIZE, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	block.head = 0;
+	PushMaterialParams(block, app->materials[materialIdx]);
+	UnmapBuffer(block);
+
+	const MaterialStorageData storageData = GetMaterialStorageData(app->materials[materialIdx]);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, app->materialStorageBuffer.handle);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, materialIdx * sizeof(MaterialStorageData), sizeof(storageData), &storageData);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
 
-		app->globlaParamsOffset = app->cBuffer.head;
+void BindMaterialParams(App* app, u32 materialIdx)
+{
+	BindUniformBufferRange(BINDING(2), app->materialBuffer.handle, materialIdx * app->materialBlockStride, MATERIAL_PARAMS_SIZE);
+}
 
-		PushVec3(app->cBuffer, app->camera.pos);
+void BindMaterial(App* app, u32 materialIdx)
+{
+	const Material& material = app->materials[materialIdx];
+	BindMaterialParams(app, materialIdx);
 
-		PushUInt(app->cBuffer, app->lights.size());
-		for (auto& light : app->lights)
-		{
-			AlignHead(app->cBuffer, sizeof(glm::vec4));
+	// Texture units match the sampler bindings of the shaders
+	BindTexture(0, app->textures[material.albedoTextureIdx].handle);
+	if (material.hasNormalText) {
+		BindTexture(1, app->textures[material.normalsTextureIdx].handle);
+	}
+	if (material.hasBumpText) {
+		BindTexture(2, app->textures[material.bumpTextureIdx].handle);
+	}
+}
 
-			PushUInt(app->cBuffer, light.type);
-			PushVec3(app->cBuffer, light.color);
-			PushVec3(app->cBuffer, light.direction);
-			PushVec3(app->cBuffer, light.position);
-			float constant = 0.5f;
-			float linear = 0.5f;
-			float quadratic = 1.f;
+// Adds the world bounding spheres of the submeshes of a model to the culling set and
+// returns the index of the first one
+static u32 AddModelBounds(App* app, u32 modelIdx, const glm::mat4& transform)
+{
+	const u32 firstBounds = app->cullingSet.count;
+	if (!app->useCpuCulling)
+		return firstBounds;
 
-			PushFloat(app->cBuffer, light.radius);
-			PushFloat(app->cBuffer, linear);
-			PushFloat(app->cBuffer, quadratic);
+	// The radius grows with the largest scale of the transform
+	const f32 scaleSquared = glm::max(glm::max(glm::dot(transform[0], transform[0]), glm::dot(transform[1], transform[1])), glm::dot(transform[2], transform[2]));
+	const f32 scale = sqrtf(scaleSquared);
 
+	const Mesh& mesh = app->meshes[app->models[modelIdx].meshIdx];
+	for (const Submesh& submesh : mesh.submeshes)
+		AddBoundingSphere(app->cullingSet, vec3(transform * vec4(submesh.sphereCenter, 1.f)), submesh.sphereRadius * scale);
 
-		}
-		app->globalParamsSize = app->cBuffer.head - app->globlaParamsOffset;
+	return firstBounds;
+}
 
-		for (auto& e : app->entities) {
+// Culls the bounds of the culling set against the view of a pass
+static void CullView(App* app, RenderPass pass, const RenderView& view)
+{
+	if (!app->useCpuCulling)
+		return;
 
-			DrawEntity(app, e, texturedMeshProgram);
-		}
+	CullingStats& stats = app->cpuCullingStats[pass];
+	stats.tested = app->cullingSet.count;
+	stats.visible = CullBoundingSpheres(app->cullingSet, view.frustum);
+}
 
-		DrawEntity(app, (app->showCliff) ? app->cliff : app->box, texturedMeshProgram);
+// Visibility of the submeshes whose bounds start at firstBounds, NULL (all visible) without culling
+static const u8* GetSubmeshVisibility(App* app, u32 firstBounds)
+{
+	return app->useCpuCulling ? app->cullingSet.visible.data() + firstBounds : NULL;
+}
 
+// Entities drawn by the forward and deferred modes, without the ones outside the
+// frustum if the BVH is used
+static void GetSceneEntities(App* app, const RenderView& view, std::vector<Entity*>& entities)
+{
+	entities.clear();
+	if (app->useCpuCulling && app->useBvh) {
+		app->bvhQueryItems.clear();
+		QueryBvhFrustum(app->entityBvh, view.frustum, app->bvhQueryItems);
+		for (u32 entityIdx : app->bvhQueryItems)
+			entities.push_back(&app->entities[entityIdx]);
+		app->bvhVisibleEntities = (u32)app->bvhQueryItems.size();
+	}
+	else {
+		for (auto& e : app->entities)
+			entities.push_back(&e);
+	}
+	entities.push_back((app->showCliff) ? &app->cliff : &app->box);
+}
 
-		UnmapBuffer(app->cBuffer);
+// Adds a draw item per visible submesh of a model (all if visibleSubmeshes is NULL),
+// sorted by the distance from viewPos to its origin
+static void QueueModel(App* app, RenderPass pass, u32 programIdx, u32 modelIdx, const glm::mat4& transform, const vec3& viewPos, u32 localParamsOffset, u32 localParamsSize, const u8* visibleSubmeshes)
+{
+	const Model& model = app->models[modelIdx];
+	const Mesh& mesh = app->meshes[model.meshIdx];
+	const f32 viewDepth = glm::distance(vec3(transform[3]), viewPos);
 
-		glBindFramebuffer(GL_FRAMEBUFFER, NULL);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	const u32 transformIdx = (u32)app->renderQueue.transforms.size();
+	app->renderQueue.transforms.push_back(transform);
 
-		const Program& programTexturedGeometry = app->programs[app->texturedGeometryProgramIdx];
-		glUseProgram(programTexturedGeometry.handle);
+	for (u32 i = 0; i < mesh.submeshes.size(); ++i) {
+		if (visibleSubmeshes && !visibleSubmeshes[i])
+			continue;
+
+		DrawItem item;
+		item.key = MakeDrawKey(pass, programIdx, model.materialIdx[i], model.meshIdx, viewDepth);
+		item.programIdx = programIdx;
+		item.materialIdx = model.materialIdx[i];
+		item.meshIdx = model.meshIdx;
+		item.submeshIdx = i;
+		item.transformIdx = transformIdx;
+		item.instanceCount = 1;
+		item.localParamsOffset = localParamsOffset;
+		item.localParamsSize = localParamsSize;
+		app->renderQueue.items.push_back(item);
+	}
+}
 
-		glActiveTexture(GL_TEXTURE0);
-		glUniform1i(app->programUniformTexture, 0);
-		GLuint textureHandle = app->framebuffer[FrameBuffer::FinalRender];
-		glBindTexture(GL_TEXTURE_2D, textureHandle);
+// Adds a draw item per submesh of a model drawn by several entities, with an instance per
+// entity that sees it. The depth of the items is the one of the nearest instance.
+static void QueueModelInstances(App* app, RenderPass pass, u32 programIdx, u32 modelIdx, const std::vector<Entity*>& entities, const std::vector<const u8*>& visibility, const vec3& viewPos)
+{
+	const Model& model = app->models[modelIdx];
+	const Mesh& mesh = app->meshes[model.meshIdx];
+	std::vector<glm::mat4>& transforms = app->renderQueue.transforms;
+
+	// The instances of the submeshes that every entity sees share the same transforms
+	const u32 sharedTransformIdx = (u32)transforms.size();
+	f32 sharedDepth = FLT_MAX;
+	for (Entity* e : entities) {
+		transforms.push_back(e->mat);
+		sharedDepth = glm::min(sharedDepth, glm::distance(vec3(e->mat[3]), viewPos));
+		e->localParamsOffset = 0;
+		e->localParamsSize = 0;
+	}
 
-		renderQuad();
+	for (u32 i = 0; i < mesh.submeshes.size(); ++i) {
+		u32 transformIdx = sharedTransformIdx;
+		u32 instanceCount = (u32)entities.size();
+		f32 viewDepth = sharedDepth;
+
+		bool allVisible = true;
+		for (u32 j = 0; j < entities.size() && allVisible; ++j)
+			allVisible = !visibility[j] || visibility[j][i];
+
+		if (!allVisible) {
+			transformIdx = (u32)transforms.size();
+			instanceCount = 0;
+			viewDepth = FLT_MAX;
+			for (u32 j = 0; j < entities.size(); ++j) {
+				if (visibility[j] && !visibility[j][i])
+					continue;
+				transforms.push_back(entities[j]->mat);
+				viewDepth = glm::min(viewDepth, glm::distance(vec3(entities[j]->mat[3]), viewPos));
+				instanceCount++;
+			}
+			if (instanceCount == 0)
+				continue;
+		}
 
-		break;
+		DrawItem item;
+		item.key = MakeDrawKey(pass, programIdx, model.materialIdx[i], model.meshIdx, viewDepth);
+		item.programIdx = programIdx;
+		item.materialIdx = model.materialIdx[i];
+		item.meshIdx = model.meshIdx;
+		item.submeshIdx = i;
+		item.transformIdx = transformIdx;
+		item.instanceCount = instanceCount;
+		item.localParamsOffset = 0;
+		item.localParamsSize = 0;
+		app->renderQueue.items.push_back(item);
 	}
-	case Mode::Mode_Deferred: {
-		Program& texturedMeshProgram = app->programs[app->texturedMeshProgramIdx];
-		glUseProgram(texturedMeshProgram.handle);
+}
 
-		MapBuffer(app->cBuffer, GL_WRITE_ONLY);
+// Writes the local params (the world matrix) of the entity to the cBuffer and queues its
+// model. The multi-draw programs read the world matrix from the queue transforms instead.
+static void QueueEntity(App* app, RenderPass pass, u32 programIdx, Entity& e, const vec3& viewPos, const u8* visibleSubmeshes)
+{
+	e.localParamsOffset = 0;
+	e.localParamsSize = 0;
+
+	// Nothing to write for an entity that is completely culled
+	if (visibleSubmeshes) {
+		const u32 submeshCount = (u32)app->meshes[app->models[e.model].meshIdx].submeshes.size();
+		bool anyVisible = false;
+		for (u32 i = 0; i < submeshCount && !anyVisible; ++i)
+			anyVisible = visibleSubmeshes[i] != 0;
+		if (!anyVisible)
+			return;
+	}
+	if (!UsesDrawParams(app)) {
+		AlignHead(app->cBuffer, app->uniformBlockAligment);
+		e.localParamsOffset = app->cBuffer.head;
+		PushMat4(app->cBuffer, e.mat);
+		e.localParamsSize = app->cBuffer.head - e.localParamsOffset;
+	}
 
-		app->globlaParamsOffset = app->cBuffer.head;
+	QueueModel(app, pass, programIdx, e.model, e.mat, viewPos, e.localParamsOffset, e.localParamsSize, visibleSubmeshes);
+}
 
-		PushVec3(app->cBuffer, app->camera.pos);
+// Culls and queues the scene entities for a pass seen from a view
+static void QueueSceneEntities(App* app, RenderPass pass, u32 programIdx, const RenderView& view)
+{
+	std::vector<Entity*> entities;
+	GetSceneEntities(app, view, entities);
+
+	std::vector<u32> firstBounds(entities.size());
+	ClearCullingSet(app->cullingSet);
+	for (u32 i = 0; i < entities.size(); ++i)
+		firstBounds[i] = AddModelBounds(app, entities[i]->model, entities[i]->mat);
+	CullView(app, pass, view);
+
+	if (!app->useInstancing) {
+		for (u32 i = 0; i < entities.size(); ++i)
+			QueueEntity(app, pass, programIdx, *entities[i], view.position, GetSubmeshVisibility(app, firstBounds[i]));
+		return;
+	}
 
-		PushUInt(app->cBuffer, app->lights.size());
+	// The entities of a model (its materials are part of it) are drawn as instances of the
+	// same draws, skipping the ones that are completely culled
+	std::map<u32, std::vector<u32>> modelEntities;
+	for (u32 i = 0; i < entities.size(); ++i) {
+		const u8* visibleSubmeshes = GetSubmeshVisibility(app, firstBounds[i]);
+		bool anyVisible = !visibleSubmeshes;
+		const u32 submeshCount = (u32)app->meshes[app->models[entities[i]->model].meshIdx].submeshes.size();
+		for (u32 j = 0; j < submeshCount && !anyVisible; ++j)
+			anyVisible = visibleSubmeshes[j] != 0;
+		if (anyVisible)
+			modelEntities[entities[i]->model].push_back(i);
+	}
 
-		app->globalParamsSize = app->cBuffer.head - app->globlaParamsOffset;
+	std::vector<Entity*> instances;
+	std::vector<const u8*> visibility;
+	for (auto& group : modelEntities) {
+		instances.clear();
+		visibility.clear();
+		for (u32 i : group.second) {
+			instances.push_back(entities[i]);
+			visibility.push_back(GetSubmeshVisibility(app, firstBounds[i]));
+		}
+		QueueModelInstances(app, pass, programIdx, group.first, instances, visibility, view.position);
+	}
+}
 
-		/*glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, app->textures[app->albedoMapIdx].handle);
-		glUniform1i(app->texturedMeshProgramIdx_uTexture2, 0);*/
+// Computes the views of the frame and writes their ViewParms blocks to the cBuffer
+static void UpdateRenderViews(App* app)
+{
+	const glm::mat4 projection = app->camera.GetProjection({ app->displaySize.x, app->displaySize.y });
+	const glm::mat4 view = app->camera.GetView();
+	app->views[View_Main] = MakeRenderView(view, projection, app->camera.pos, NULL);
+
+	// The reflection is rendered from the camera mirrored below the water plane
+	Camera reflectionCamera = app->camera;
+	reflectionCamera.pos.y -= 2.f * (app->camera.pos.y - app->water.pos.y);
+	reflectionCamera.phi = -reflectionCamera.phi;
+
+	const vec4 reflectionPlane(0.f, 1.f, 0.f, -app->water.pos.y);
+	const vec4 refractionPlane(0.f, -1.f, 0.f, app->water.pos.y);
+	app->views[View_WaterReflection] = MakeRenderView(reflectionCamera.GetView(), projection, reflectionCamera.pos, &reflectionPlane);
+	app->views[View_WaterRefraction] = MakeRenderView(view, projection, app->camera.pos, &refractionPlane);
+
+	for (RenderView& renderView : app->views)
+		PushRenderView(app->cBuffer, app->uniformBlockAligment, renderView);
+}
 
-		////manual
-		//glActiveTexture(GL_TEXTURE1);
-		//glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uhasNormalMap"), 1);
-		//glBindTexture(GL_TEXTURE_2D, app->textures[app->normalMapIdx].handle);
-		//glUniform1i(app->texturedMeshProgramIdx_uTexture3, 1);
+// Submits a pass of the scene entities with the multi-draw, instanced or per draw path
+static void SubmitScenePass(App* app, RenderPass pass, const RenderView& view)
+{
+	if (app->useMultiDrawIndirect)
+		SubmitRenderQueueIndirect(app, app->renderQueue, pass, app->useGpuCulling ? &view : NULL);
+	else if (app->useInstancing)
+		SubmitRenderQueueInstanced(app, app->renderQueue, pass);
+	else
+		SubmitRenderQueue(app, app->renderQueue, pass);
+}
+
+// Reads the fragment shader invocations of the last measured forward passes, if the GPU
+// has finished them, so a new measure can start
+static void ReadFragmentQueries(App* app)
+{
+	if (!app->fragmentQueriesPending)
+		return;
 
-		//glActiveTexture(GL_TEXTURE2);
-		//glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uhasBumpMap"), 1);
-		//glBindTexture(GL_TEXTURE_2D, app->textures[app->bumpMapIdx].handle);
-		//glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uBumpTexture"), 2);
+	GLuint available = 0;
+	glGetQueryObjectuiv(app->fragmentQueries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return;
 
-		for (auto& e : app->entities) {
+	GLuint64* invocations = app->fragmentInvocations[app->fragmentQueriesPrepass ? 1 : 0];
+	invocations[0] = 0;
+	if (app->fragmentQueriesPrepass)
+		glGetQueryObjectui64v(app->fragmentQueries[0], GL_QUERY_RESULT, &invocations[0]);
+	glGetQueryObjectui64v(app->fragmentQueries[1], GL_QUERY_RESULT, &invocations[1]);
+	app->fragmentQueriesPending = false;
+}
 
-			Model& model = app->models[e.model];
-			Mesh& mesh = app->meshes[model.meshIdx];
+// Bins the lights in the clusters of the view, uploads them and writes the GlobalParms
+// block of the lighting shaders
+static void BindLightParams(App* app, const RenderView& view)
+{
+	LightClusters& clusters = app->lightClusters;
+	BuildLightClusters(clusters, app->lights, view, app->renderSize);
 
-			glm::mat4 viewMat = app->camera.GetViewMatrix({ app->displaySize.x, app->displaySize.y });
+	if (!clusters.lights.empty())
+		UploadBufferData(app->lightBuffer, GL_SHADER_STORAGE_BUFFER, clusters.lights.data(), (u32)(clusters.lights.size() * sizeof(GpuLight)));
+	UploadBufferData(app->lightClusterBuffer, GL_SHADER_STORAGE_BUFFER, clusters.clusterData.data(), (u32)(clusters.clusterData.size() * sizeof(u32)));
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_BUFFER_BINDING, app->lightBuffer.handle);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_CLUSTER_BINDING, app->lightClusterBuffer.handle);
 
-			AlignHead(app->cBuffer, app->uniformBlockAligment);
-			e.localParamsOffset = app->cBuffer.head;
-			PushMat4(app->cBuffer, e.mat);
-			PushMat4(app->cBuffer, viewMat);
-			e.localParamsSize = app->cBuffer.head - e.localParamsOffset;
+	AlignHead(app->cBuffer, app->uniformBlockAligment);
+	app->globlaParamsOffset = app->cBuffer.head;
+
+	PushVec3(app->cBuffer, app->camera.pos);
+	PushUInt(app->cBuffer, clusters.directionalLightCount);
+	PushUInt(app->cBuffer, clusters.tileSize.x);
+	PushUInt(app->cBuffer, clusters.tileSize.y);
+	PushFloat(app->cBuffer, clusters.sliceScale);
+	PushFloat(app->cBuffer, clusters.sliceBias);
+	AlignHead(app->cBuffer, sizeof(vec4));
+	PushUInt(app->cBuffer, CLUSTER_GRID_X);
+	PushUInt(app->cBuffer, CLUSTER_GRID_Y);
+	PushUInt(app->cBuffer, CLUSTER_GRID_Z);
+	PushUInt(app->cBuffer, (u32)clusters.lights.size());
+
+	app->globalParamsSize = app->cBuffer.head - app->globlaParamsOffset;
+	if (IsRangeInBuffer(app->cBuffer, app->globlaParamsOffset, app->globalParamsSize))
+		BindUniformBufferRange(BINDING(0), app->cBuffer.handle, app->globlaParamsOffset, app->globalParamsSize);
+}
 
-			glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cBuffer.handle, app->globlaParamsOffset, app->globalParamsSize);
-			glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->cBuffer.handle, e.localParamsOffset, e.localParamsSize);
+// Writes the LocalParms block of the DRAW_BASE_MODEL multi-draw program for the water passes
+static void BindWaterPassParams(App* app)
+{
+	AlignHead(app->cBuffer, app->uniformBlockAligment);
+	const u32 passParamsOffset = app->cBuffer.head;
+	PushVec3(app->cBuffer, app->wLigthPos);
+	PushVec3(app->cBuffer, app->wLigthColor);
+	if (IsRangeInBuffer(app->cBuffer, passParamsOffset, app->cBuffer.head - passParamsOffset))
+		BindUniformBufferRange(BINDING(1), app->cBuffer.handle, passParamsOffset, app->cBuffer.head - passParamsOffset);
+}
 
-			for (u32 i = 0; i < mesh.submeshes.size(); ++i) {
-				GLuint vao = FindVAO(mesh, i, texturedMeshProgram);
-				glBindVertexArray(vao);
+// Copies a target to the backbuffer
+static void AddPresentPass(App* app, u32 source)
+{
+	RenderGraphPass& pass = AddRenderGraphPass(app->renderGraph, "Present", [=](RenderGraph& graph, const RenderGraphPass&) {
+		SetCapability(GL_DEPTH_TEST, false);
+		UseProgram(app->programs[app->texturedGeometryProgramIdx].handle);
+		glUniform1i(app->programUniformTexture, 0);
+		BindTexture(0, GetRenderTargetTexture(graph, source));
+		renderQuad();
+		SetCapability(GL_DEPTH_TEST, true);
+	});
+	AddPassRead(pass, source);
+	AddPassColorOutput(pass, RENDER_GRAPH_BACKBUFFER, RenderGraphLoad_Clear);
+}
 
+// The depth of a target in another one, or in the backbuffer for what is drawn after
+// the lighting. Scaled if their sizes differ.
+static void AddDepthBlitPass(App* app, u32 source, u32 destination)
+{
+	RenderGraphPass& pass = AddRenderGraphPass(app->renderGraph, "Depth blit", [=](RenderGraph& graph, const RenderGraphPass&) {
+		const ivec2 sourceSize = graph.targets[source].desc.size;
+		const ivec2 destinationSize = graph.targets[destination].desc.size;
+		BindFramebuffer(GL_READ_FRAMEBUFFER, GetRenderTargetFramebuffer(graph, source));
+		glBlitFramebuffer(0, 0, sourceSize.x, sourceSize.y, 0, 0, destinationSize.x, destinationSize.y, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	});
+	AddPassRead(pass, source);
+	// The color of the backbuffer is attached with it, the blit leaves it as is
+	if (destination == RENDER_GRAPH_BACKBUFFER)
+		AddPassColorOutput(pass, RENDER_GRAPH_BACKBUFFER, RenderGraphLoad_Load);
+	SetPassDepthOutput(pass, destination, RenderGraphLoad_DontCare);
+}
 
-				u32 submeshMaterialIdx = model.materialIdx[i];
-				Material& submeshmaterial = app->materials[submeshMaterialIdx];
-				glActiveTexture(GL_TEXTURE0);
-				glBindTexture(GL_TEXTURE_2D, app->textures[submeshmaterial.albedoTextureIdx].handle);
-				glUniform1i(app->texturedMeshProgramIdx_uTexture2, 0);
+static void AddTexturedQuadPasses(App* app)
+{
+	RenderGraphPass& pass = AddRenderGraphPass(app->renderGraph, "Textured quad", [=](RenderGraph&, const RenderGraphPass&) {
+		const Program& programTexturedGeometry = app->programs[app->texturedGeometryProgramIdx];
+		UseProgram(programTexturedGeometry.handle);
+		glUniform1i(app->programUniformTexture, 0);
+		BindTexture(0, app->textures[app->diceTexIdx].handle);
 
-				//automatic
-				glActiveTexture(GL_TEXTURE2);
-				glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uhasBumpMap"), submeshmaterial.hasBumpText);
-				if (submeshmaterial.hasBumpText) {
-					glBindTexture(GL_TEXTURE_2D, app->textures[submeshmaterial.bumpTextureIdx].handle);
-					glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uBumpTexture"), 2);
-				}
+		renderQuad();
+	});
+	AddPassColorOutput(pass, RENDER_GRAPH_BACKBUFFER, RenderGraphLoad_Clear);
+	SetPassDepthOutput(pass, RENDER_GRAPH_BACKBUFFER, RenderGraphLoad_Clear);
+}
 
-				glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uhasNormalMap"), submeshmaterial.hasNormalText);
-				glActiveTexture(GL_TEXTURE1);
-				if (submeshmaterial.hasNormalText) {
-					glBindTexture(GL_TEXTURE_2D, app->textures[submeshmaterial.normalsTextureIdx].handle);
-					glUniform1i(app->texturedMeshProgramIdx_uTexture3, 1);
-				}
+static void AddForwardPasses(App* app)
+{
+	RenderGraph& graph = app->renderGraph;
+	const RenderView* view = &app->views[View_Main];
 
-				Submesh& submesh = mesh.submeshes[i];
-				glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)submesh.indexOffset);
-			}
-			DrawEntity(app, (app->showCliff) ? app->cliff : app->box, texturedMeshProgram);
-		}
+	const u32 programIdx = UsesDrawParams(app) ? app->texturedForwardMultiDrawProgramIdx : app->texturedForwardProgramIdx;
 
+	ClearRenderQueue(app->renderQueue);
+	QueueSceneEntities(app, RenderPass_Forward, programIdx, *view);
+	if (app->useDepthPrepass)
+		AddDepthPrepassItems(app, app->renderQueue, RenderPass_Forward, UsesDrawParams(app) ? app->depthPrepassMultiDrawProgramIdx : app->depthPrepassProgramIdx);
+	SortRenderQueue(app->renderQueue);
 
-		glBindFramebuffer(GL_FRAMEBUFFER, NULL);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	BindLightParams(app, *view);
 
-		glUseProgram(app->programs[app->texturedLightProgramIdx].handle);
+	ReadFragmentQueries(app);
+	const bool measureFragments = app->hasPipelineStatistics && !app->fragmentQueriesPending;
+	if (measureFragments) {
+		app->fragmentQueriesPending = true;
+		app->fragmentQueriesPrepass = app->useDepthPrepass;
+	}
 
-		glUniform1i(app->texturedMeshProgramIdx_uPosition, 0);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, app->framebuffer[FrameBuffer::Position]);
-		glUniform1i(app->texturedMeshProgramIdx_uNormals, 1);
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, app->framebuffer[FrameBuffer::Normals]);
-		glUniform1i(app->texturedMeshProgramIdx_uAlbedo, 2);
-		glActiveTexture(GL_TEXTURE2);
-		glBindTexture(GL_TEXTURE_2D, app->framebuffer[FrameBuffer::Albedo]);
-		glUniform1i(app->texturedMeshProgramIdx_uDepth, 3);
-		glActiveTexture(GL_TEXTURE3);
-		glBindTexture(GL_TEXTURE_2D, app->framebuffer[FrameBuffer::Depth]);
+	// The outputs of the FORWARD_SHADING program, only the color is read. It is filtered
+	// when presented, to upscale it to the display.
+	const u32 color = CreateRenderTarget(graph, "Color", app->renderSize, GL_RGBA8, GL_LINEAR);
+	const u32 normals = CreateRenderTarget(graph, "Normals", app->renderSize, GL_RGBA16F);
+	const u32 albedo = CreateRenderTarget(graph, "Albedo", app->renderSize, GL_RGBA8);
+	const u32 light = CreateRenderTarget(graph, "Light", app->renderSize, GL_RGBA8);
+	const u32 position = CreateRenderTarget(graph, "Position", app->renderSize, GL_RGBA16F);
+	const u32 depth = CreateRenderTarget(graph, "Depth", app->renderSize, GL_DEPTH_COMPONENT24);
+
+	// Only the depth, the shading pass then runs once per visible fragment. The items
+	// left out of the pre-pass write their depth in the shading pass.
+	const bool depthPrepass = app->useDepthPrepass;
+	if (depthPrepass) {
+		RenderGraphPass& pass = AddRenderGraphPass(graph, "Depth pre-pass", [=](RenderGraph&, const RenderGraphPass&) {
+			BindRenderView(*view, app->cBuffer);
+			if (measureFragments)
+				glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS, app->fragmentQueries[0]);
+			SubmitScenePass(app, RenderPass_DepthPrepass, *view);
+			if (measureFragments)
+				glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS);
+		});
+		SetPassDepthOutput(pass, depth, RenderGraphLoad_Clear);
+	}
 
-		AlignHead(app->cBuffer, app->uniformBlockAligment);
+	RenderGraphPass& pass = AddRenderGraphPass(graph, "Forward", [=](RenderGraph&, const RenderGraphPass&) {
+		BindRenderView(*view, app->cBuffer);
+		if (depthPrepass)
+			SetDepthFunc(GL_LEQUAL);
+
+		if (measureFragments)
+			glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS, app->fragmentQueries[1]);
+		SubmitScenePass(app, RenderPass_Forward, *view);
+		if (measureFragments)
+			glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS);
+
+		if (depthPrepass)
+			SetDepthFunc(GL_LESS);
+	});
+	AddPassColorOutput(pass, color, RenderGraphLoad_Clear);
+	AddPassColorOutput(pass, normals, RenderGraphLoad_Clear);
+	AddPassColorOutput(pass, albedo, RenderGraphLoad_Clear);
+	AddPassColorOutput(pass, light, RenderGraphLoad_Clear);
+	AddPassColorOutput(pass, position, RenderGraphLoad_Clear);
+	SetPassDepthOutput(pass, depth, depthPrepass ? RenderGraphLoad_Load : RenderGraphLoad_Clear);
+
+	AddPresentPass(app, color);
+}
 
-		app->globlaParamsOffset = app->cBuffer.head;
+// Targets of the G-buffer, position is RENDER_GRAPH_NONE in the compact layout
+struct GBufferTargets
+{
+	u32 position;
+	u32 normals;
+	u32 albedo;
+	u32 depth;
+};
 
-		PushVec3(app->cBuffer, app->camera.pos);
-		PushUInt(app->cBuffer, app->lights.size());
+static void AddGBufferReads(RenderGraphPass& pass, const GBufferTargets& gbuffer)
+{
+	if (gbuffer.position != RENDER_GRAPH_NONE)
+		AddPassRead(pass, gbuffer.position);
+	AddPassRead(pass, gbuffer.normals);
+	AddPassRead(pass, gbuffer.albedo);
+	AddPassRead(pass, gbuffer.depth);
+}
 
-		for (auto& light : app->lights)
-		{
-			AlignHead(app->cBuffer, sizeof(vec4));
+// At the bindings of the samplers of the lighting shaders
+static void BindGBufferTextures(const RenderGraph& graph, const GBufferTargets& gbuffer)
+{
+	if (gbuffer.position != RENDER_GRAPH_NONE)
+		BindTexture(0, GetRenderTargetTexture(graph, gbuffer.position));
+	BindTexture(1, GetRenderTargetTexture(graph, gbuffer.normals));
+	BindTexture(2, GetRenderTargetTexture(graph, gbuffer.albedo));
+	BindTexture(3, GetRenderTargetTexture(graph, gbuffer.depth));
+}
 
-			PushUInt(app->cBuffer, light.type);
-			PushVec3(app->cBuffer, light.color);
-			PushVec3(app->cBuffer, light.direction);
-			PushVec3(app->cBuffer, light.position);
+static void AddDeferredPasses(App* app)
+{
+	RenderGraph& graph = app->renderGraph;
+	const RenderView* view = &app->views[View_Main];
 
-			float constant = 0.5f;
-			float linear = 0.5f;
-			float quadratic = 1.f;
+	const bool compact = app->useCompactGBuffer;
 
-			PushFloat(app->cBuffer, light.radius);
-			PushFloat(app->cBuffer, linear);
-			PushFloat(app->cBuffer, quadratic);
+	u32 programIdx;
+	if (compact)
+		programIdx = UsesDrawParams(app) ? app->compactGBufferMultiDrawProgramIdx : app->compactGBufferProgramIdx;
+	else
+		programIdx = UsesDrawParams(app) ? app->texturedMeshMultiDrawProgramIdx : app->texturedMeshProgramIdx;
+
+	ClearRenderQueue(app->renderQueue);
+	QueueSceneEntities(app, RenderPass_GBuffer, programIdx, *view);
+	SortRenderQueue(app->renderQueue);
+
+	// The same GlobalParms for the G-buffer and the lighting pass
+	BindLightParams(app, *view);
+
+	// The compact variants rebuild the position from the depth
+	u32 lightingProgramIdx[DeferredLighting_Count];
+	lightingProgramIdx[DeferredLighting_FullScreen] = app->texturedLightProgramIdx;
+	lightingProgramIdx[DeferredLighting_Tiled] = app->tiledLightingProgramIdx;
+	lightingProgramIdx[DeferredLighting_LightVolumes] = app->lightVolumeProgramIdx;
+	u32 directionalLightProgramIdx = app->directionalLightProgramIdx;
+	if (compact) {
+		for (u32 i = 0; i < DeferredLighting_Count; ++i)
+			lightingProgramIdx[i] = app->compactLightingProgramIdx[i];
+		directionalLightProgramIdx = app->compactDirectionalLightProgramIdx;
+	}
+	const u32 lightingIdx = lightingProgramIdx[app->deferredLighting];
+
+	GBufferTargets gbuffer;
+	gbuffer.depth = CreateRenderTarget(graph, "Depth", app->renderSize, GL_DEPTH_COMPONENT24);
+	{
+		RenderGraphPass* pass;
+		if (compact) {
+			// The alpha of the albedo holds the smoothness, so it is written as is
+			gbuffer.position = RENDER_GRAPH_NONE;
+			gbuffer.normals = CreateRenderTarget(graph, "Normals", app->renderSize, GL_RG16);
+			gbuffer.albedo = CreateRenderTarget(graph, "Albedo", app->renderSize, GL_RGBA8);
+
+			pass = &AddRenderGraphPass(graph, "G-buffer", [=](RenderGraph&, const RenderGraphPass&) {
+				BindRenderView(*view, app->cBuffer);
+				SetCapability(GL_BLEND, false);
+				SubmitScenePass(app, RenderPass_GBuffer, *view);
+				SetCapability(GL_BLEND, true);
+			});
+			AddPassColorOutput(*pass, gbuffer.normals, RenderGraphLoad_Clear);
+			AddPassColorOutput(*pass, gbuffer.albedo, RenderGraphLoad_Clear);
+		}
+		else {
+			// The color and light outputs of the program are not read, the graph leaves
+			// them out
+			const u32 color = CreateRenderTarget(graph, "Color", app->renderSize, GL_RGBA8);
+			gbuffer.normals = CreateRenderTarget(graph, "Normals", app->renderSize, GL_RGBA16F);
+			gbuffer.albedo = CreateRenderTarget(graph, "Albedo", app->renderSize, GL_RGBA8);
+			const u32 light = CreateRenderTarget(graph, "Light", app->renderSize, GL_RGBA8);
+			gbuffer.position = CreateRenderTarget(graph, "Position", app->renderSize, GL_RGBA16F);
+
+			pass = &AddRenderGraphPass(graph, "G-buffer", [=](RenderGraph&, const RenderGraphPass&) {
+				BindRenderView(*view, app->cBuffer);
+				SubmitScenePass(app, RenderPass_GBuffer, *view);
+			});
+			AddPassColorOutput(*pass, color, RenderGraphLoad_Clear);
+			AddPassColorOutput(*pass, gbuffer.normals, RenderGraphLoad_Clear);
+			AddPassColorOutput(*pass, gbuffer.albedo, RenderGraphLoad_Clear);
+			AddPassColorOutput(*pass, light, RenderGraphLoad_Clear);
+			AddPassColorOutput(*pass, gbuffer.position, RenderGraphLoad_Clear);
 		}
-		app->globalParamsSize = app->cBuffer.head - app->globlaParamsOffset;
+		SetPassDepthOutput(*pass, gbuffer.depth, RenderGraphLoad_Clear);
+	}
 
-		glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cBuffer.handle, app->globlaParamsOffset, app->globalParamsSize);
+	GpuTimer* lightingTimer = &app->lightingTimers[app->deferredLighting];
+
+	// Every path lights the G-buffer in an image of its size, presented like the color of
+	// the forward mode
+	const u32 lit = CreateRenderTarget(graph, "Lit", app->renderSize, GL_RGBA8, GL_LINEAR);
+
+	if (app->deferredLighting == DeferredLighting_Tiled) {
+		RenderGraphPass& pass = AddRenderGraphPass(graph, "Tiled lighting", [=](RenderGraph& graph, const RenderGraphPass&) {
+			BindGBufferTextures(graph, gbuffer);
+			BeginGpuTimer(*lightingTimer);
+			UseProgram(app->programs[lightingIdx].handle);
+			glBindImageTexture(0, GetRenderTargetTexture(graph, lit), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+			glDispatchCompute((app->renderSize.x + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE, (app->renderSize.y + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE, 1);
+			EndGpuTimer(*lightingTimer);
+
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+		});
+		AddGBufferReads(pass, gbuffer);
+		AddPassStorageOutput(pass, lit);
+	}
+	else if (app->deferredLighting == DeferredLighting_LightVolumes) {
+		// The directional lights and the background, full screen without depth
+		{
+			RenderGraphPass& pass = AddRenderGraphPass(graph, "Directional lights", [=](RenderGraph& graph, const RenderGraphPass&) {
+				BindGBufferTextures(graph, gbuffer);
+				BeginGpuTimer(*lightingTimer);
+				SetCapability(GL_DEPTH_TEST, false);
+				UseProgram(app->programs[directionalLightProgramIdx].handle);
+				renderQuad();
+				SetCapability(GL_DEPTH_TEST, true);
+			});
+			AddGBufferReads(pass, gbuffer);
+			AddPassColorOutput(pass, lit, RenderGraphLoad_DontCare);
+		}
 
-		renderQuad();
+		// The volumes test against a copy of the depth, the G-buffer depth is sampled
+		const u32 litDepth = CreateRenderTarget(graph, "Lit depth", app->renderSize, GL_DEPTH_COMPONENT24);
+		AddDepthBlitPass(app, gbuffer.depth, litDepth);
+
+		// The point lights, added where their sphere is. Drawing the far side of the
+		// spheres with GL_GEQUAL rejects the pixels behind the volume, the shader
+		// discards the ones in front of it. Unlike the two sided stencil test it works
+		// for all the lights in a single instanced draw, and with the camera inside a
+		// volume. The triangles of renderSphere face inwards, so the far side is made
+		// of front faces.
+		RenderGraphPass& pass = AddRenderGraphPass(graph, "Light volumes", [=](RenderGraph& graph, const RenderGraphPass&) {
+			BindGBufferTextures(graph, gbuffer);
+			SetDepthMask(false);
+			SetDepthFunc(GL_GEQUAL);
+			SetCapability(GL_CULL_FACE, true);
+			SetBlendFunc(GL_ONE, GL_ONE);
+
+			UseProgram(app->programs[lightingIdx].handle);
+			if (app->lightClusters.stats.pointLights > 0)
+				renderSphere(app->lightClusters.stats.pointLights);
+
+			SetBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			SetCapability(GL_CULL_FACE, false);
+			SetDepthFunc(GL_LESS);
+			SetDepthMask(true);
+
+			EndGpuTimer(*lightingTimer);
+		});
+		AddGBufferReads(pass, gbuffer);
+		AddPassColorOutput(pass, lit, RenderGraphLoad_Load);
+		SetPassDepthOutput(pass, litDepth, RenderGraphLoad_Load);
+	}
+	else {
+		// Every pixel is lit with an alpha of 1, nothing to clear
+		RenderGraphPass& pass = AddRenderGraphPass(graph, "Full-screen lighting", [=](RenderGraph& graph, const RenderGraphPass&) {
+			BindGBufferTextures(graph, gbuffer);
+			BeginGpuTimer(*lightingTimer);
+			SetCapability(GL_DEPTH_TEST, false);
+			UseProgram(app->programs[lightingIdx].handle);
+
+			if (!compact) {
+				glUniform1i(app->texturedMeshProgramIdx_uPosition, 0);
+				glUniform1i(app->texturedMeshProgramIdx_uNormals, 1);
+				glUniform1i(app->texturedMeshProgramIdx_uAlbedo, 2);
+				glUniform1i(app->texturedMeshProgramIdx_uDepth, 3);
+			}
+
+			renderQuad();
+			SetCapability(GL_DEPTH_TEST, true);
+			EndGpuTimer(*lightingTimer);
+		});
+		AddGBufferReads(pass, gbuffer);
+		AddPassColorOutput(pass, lit, RenderGraphLoad_DontCare);
+	}
 
-		glBindFramebuffer(GL_READ_FRAMEBUFFER, app->framebuffer[FrameBuffer::Framebuffer]);
-		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-		glBlitFramebuffer(0, 0, app->displaySize.x, app->displaySize.y, 0, 0, app->displaySize.x, app->displaySize.y, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	AddPresentPass(app, lit);
 
-		if (app->showSpheres) {
-			glUseProgram(app->programs[app->texturedSphereLightsProgramIdx].handle);
-			glUniformMatrix4fv(app->texturedLightProgramIdx_uViewProjection, 1, GL_FALSE, glm::value_ptr(app->camera.GetViewMatrix(app->displaySize)));
+	if (app->showSpheres) {
+		AddDepthBlitPass(app, gbuffer.depth, RENDER_GRAPH_BACKBUFFER);
+
+		RenderGraphPass& pass = AddRenderGraphPass(graph, "Light spheres", [=](RenderGraph&, const RenderGraphPass&) {
+			UseProgram(app->programs[app->texturedSphereLightsProgramIdx].handle);
+			glUniformMatrix4fv(app->texturedLightProgramIdx_uViewProjection, 1, GL_FALSE, glm::value_ptr(view->viewProjection));
 
 			for (unsigned int i = 0; i < app->lights.size(); ++i) {
 				AlignHead(app->cBuffer, app->uniformBlockAligment);
@@ -980,242 +1911,376 @@ void Render(App* app)
 				PushVec3(app->cBuffer, app->lights[i].color);
 				int localParamsSize = app->cBuffer.head - localParamsOffset;
 
-				glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cBuffer.handle, localParamsOffset, localParamsSize);
+				// Not written, the ring grows for the next frame
+				if (!IsRangeInBuffer(app->cBuffer, localParamsOffset, localParamsSize))
+					continue;
+				BindUniformBufferRange(BINDING(0), app->cBuffer.handle, localParamsOffset, localParamsSize);
 
 				if (app->lights[i].type == LightType_Point)
 					renderSphere();
 				else
 					renderCube();
 			}
-		}
-		UnmapBuffer(app->cBuffer);
-		break;
+		});
+		AddPassColorOutput(pass, RENDER_GRAPH_BACKBUFFER, RenderGraphLoad_Load);
+		SetPassDepthOutput(pass, RENDER_GRAPH_BACKBUFFER, RenderGraphLoad_Load);
 	}
-	case Mode::Mode_Water: {
-		//REFLECTION
-		{
-			glBindFramebuffer(GL_FRAMEBUFFER, app->wFboReflect);
-
-			glViewport(0, 0, app->displaySize.x, app->displaySize.y);
-
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-			glEnable(GL_DEPTH_TEST);
-
-			glDrawBuffer(GL_COLOR_ATTACHMENT0);
-			glEnable(GL_CLIP_DISTANCE0);
-
-			glClearColor(0.2f, 0.2f, 0.2f, 1.f);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-			Program& texturedMeshProgram = app->programs[app->baseModelProgramIdx];
-			glUseProgram(texturedMeshProgram.handle);
-
-			Camera reflectionCamera = app->camera;
-			reflectionCamera.pos.y -= 2.f * (app->camera.pos.y - app->water.pos.y);
-			reflectionCamera.phi = -reflectionCamera.phi;
-
-			Model& model = app->models[app->island];
-			Mesh& mesh = app->meshes[model.meshIdx];
-
-			glm::mat4 viewMat = reflectionCamera.GetViewMatrix({ app->displaySize.x, app->displaySize.y });
-			glUniformMatrix4fv(app->BaseModelProgramIdx_uViewProjection, 1, GL_FALSE, glm::value_ptr(viewMat));
+}
 
-			glUniform4f(app->BaseModelProgramIdx_uPlane, 0.f, 1.f, 0.f, -app->water.pos.y);
+// Renders the island seen from the reflection or refraction view, clipped by the plane of
+// the water
+static void AddWaterViewPass(App* app, const char* name, RenderPass renderPass, const RenderView* view, u32 color, u32 depth)
+{
+	RenderGraphPass& pass = AddRenderGraphPass(app->renderGraph, name, [=](RenderGraph&, const RenderGraphPass&) {
+		SetCapability(GL_CLIP_DISTANCE0, true);
 
+		BindRenderView(*view, app->cBuffer);
+		if (app->useMultiDrawIndirect) {
+			BindWaterPassParams(app);
+			SubmitRenderQueueIndirect(app, app->renderQueue, renderPass, app->useGpuCulling ? view : NULL);
+		}
+		else {
+			UseProgram(app->programs[app->baseModelProgramIdx].handle);
 			glUniform3fv(app->BaseModelProgramIdx_uLightPos, 1, glm::value_ptr(app->wLigthPos));
 			glUniform3fv(app->BaseModelProgramIdx_uLightColor, 1, glm::value_ptr(app->wLigthColor));
-
-			for (u32 i = 0; i < mesh.submeshes.size(); ++i) {
-				GLuint vao = FindVAO(mesh, i, texturedMeshProgram);
-				glBindVertexArray(vao);
-
-				u32 submeshMaterialIdx = model.materialIdx[i];
-				Material& submeshmaterial = app->materials[submeshMaterialIdx];
-				glUniform3fv(app->BaseModelProgramIdx_uFaceColor, 1, glm::value_ptr(submeshmaterial.albedo));
-
-				Submesh& submesh = mesh.submeshes[i];
-				glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)submesh.indexOffset);
-			}
+			SubmitRenderQueue(app, app->renderQueue, renderPass);
 		}
 
-		//REFRACTION
-		{
-			glBindFramebuffer(GL_FRAMEBUFFER, app->wFboRefract);
-
-			glViewport(0, 0, app->displaySize.x, app->displaySize.y);
-
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-			glEnable(GL_DEPTH_TEST);
+		SetCapability(GL_CLIP_DISTANCE0, false);
+	});
+	AddPassColorOutput(pass, color, RenderGraphLoad_Clear);
+	SetPassDepthOutput(pass, depth, RenderGraphLoad_Clear);
+}
 
-			glDrawBuffer(GL_COLOR_ATTACHMENT0);
-			glEnable(GL_CLIP_DISTANCE0);
+// The island from the main view and the water on top, with the reflection and refraction
+// rendered with the view projections given
+static void AddWaterBasePass(App* app, const char* name, u32 reflection, u32 refraction, u32 refractionDepth, const glm::mat4& reflectionViewProjection, const glm::mat4& refractionViewProjection, u32 color, u32 depth)
+{
+	const RenderView* mainView = &app->views[View_Main];
 
-			glClearColor(0.2f, 0.2f, 0.2f, 1.f);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	RenderGraphPass& pass = AddRenderGraphPass(app->renderGraph, name, [=](RenderGraph& graph, const RenderGraphPass&) {
+		BindRenderView(*mainView, app->cBuffer);
+		if (app->useMultiDrawIndirect) {
+			BindWaterPassParams(app);
+			SubmitRenderQueueIndirect(app, app->renderQueue, RenderPass_WaterBase, app->useGpuCulling ? mainView : NULL);
+		}
+		else {
+			UseProgram(app->programs[app->baseModelProgramIdx].handle);
+			glUniform3fv(app->BaseModelProgramIdx_uLightPos, 1, glm::value_ptr(app->wLigthPos));
+			glUniform3fv(app->BaseModelProgramIdx_uLightColor, 1, glm::value_ptr(app->wLigthColor));
+			SubmitRenderQueue(app, app->renderQueue, RenderPass_WaterBase);
+		}
 
-			Program& texturedMeshProgram = app->programs[app->baseModelProgramIdx];
-			glUseProgram(texturedMeshProgram.handle);
+		//WATER
+		UseProgram(app->programs[app->waterProgramIdx].handle);
+
+		glUniformMatrix4fv(app->WaterProgramIdx_uViewProjection, 1, GL_FALSE, glm::value_ptr(mainView->viewProjection));
+		glUniformMatrix4fv(app->WaterProgramIdx_uModelMatrix, 1, GL_FALSE, glm::value_ptr(app->water.mat));
+		glUniformMatrix4fv(app->WaterProgramIdx_uReflectionViewProjection, 1, GL_FALSE, glm::value_ptr(reflectionViewProjection));
+		glUniformMatrix4fv(app->WaterProgramIdx_uRefractionViewProjection, 1, GL_FALSE, glm::value_ptr(refractionViewProjection));
+
+		glUniform1f(app->WaterProgramIdx_uMoveFactor, app->wMove);
+		glUniform3fv(app->WaterProgramIdx_uCameraPos, 1, glm::value_ptr(app->camera.pos));
+		glUniform3fv(app->WaterProgramIdx_uLightPos, 1, glm::value_ptr(app->wLigthPos));
+		glUniform3fv(app->WaterProgramIdx_uLightColor, 1, glm::value_ptr(app->wLigthColor));
+		glUniform1f(app->WaterProgramIdx_uShineDamper, app->wuShineDamper);
+		glUniform1f(app->WaterProgramIdx_uTiling, app->tiling);
+		glUniform1f(app->WaterProgramIdx_uWaveStrength, app->wuWaveStrength);
+		glUniform1f(app->WaterProgramIdx_uReflectivity, app->wuReflectivity);
+
+		glUniform1i(app->WaterProgramIdx_uReflectionTex, 0);
+		BindTexture(0, GetRenderTargetTexture(graph, reflection));
+		glUniform1i(app->WaterProgramIdx_uRefractionTex, 1);
+		BindTexture(1, GetRenderTargetTexture(graph, refraction));
+		glUniform1i(app->WaterProgramIdx_uDudvTex, 2);
+		BindTexture(2, app->textures[app->wTexDudvSelected].handle);
+		glUniform1i(app->WaterProgramIdx_uNormalMapTex, 3);
+		BindTexture(3, app->textures[app->wTexNormalMap].handle);
+		glUniform1i(app->WaterProgramIdx_uDepthMap, 4);
+		BindTexture(4, GetRenderTargetTexture(graph, refractionDepth));
+
+		app->water.Render();
+	});
+	AddPassRead(pass, reflection);
+	AddPassRead(pass, refraction);
+	AddPassRead(pass, refractionDepth);
+	AddPassColorOutput(pass, color, RenderGraphLoad_Clear);
+	SetPassDepthOutput(pass, depth, RenderGraphLoad_Clear);
+}
 
-			Model& model = app->models[app->island];
-			Mesh& mesh = app->meshes[model.meshIdx];
+// Recreates the textures of a water view when its size changes, it has to be rendered
+// again. Only the refraction keeps its depth, the water reads it.
+static void ResizeWaterView(App* app, WaterView& view, const ivec2& size, bool keepDepth)
+{
+	if (view.color && view.size == size)
+		return;
 
-			glm::mat4 viewMat = app->camera.GetViewMatrix({ app->displaySize.x, app->displaySize.y });
-			glUniformMatrix4fv(app->BaseModelProgramIdx_uViewProjection, 1, GL_FALSE, glm::value_ptr(viewMat));
+	const GLuint textures[] = { view.color, view.depth };
+	for (GLuint texture : textures) {
+		if (texture) {
+			ReleaseRenderTargetFramebuffers(app->renderGraph, texture);
+			glDeleteTextures(1, &texture);
+		}
+	}
 
-			glUniform4f(app->BaseModelProgramIdx_uPlane, 0.f, -1.f, 0.f, app->water.pos.y);
+	view.size = size;
+	view.color = CreateRenderTargetTexture({ size, GL_RGBA8, 1, GL_LINEAR });
+	view.depth = keepDepth ? CreateRenderTargetTexture({ size, GL_DEPTH_COMPONENT24, 1, GL_LINEAR }) : 0;
+	view.valid = false;
+}
 
-			for (u32 i = 0; i < mesh.submeshes.size(); ++i) {
-				GLuint vao = FindVAO(mesh, i, texturedMeshProgram);
-				glBindVertexArray(vao);
+// Whether a water view is rendered this frame: every interval frames, at its phase, or
+// when there is nothing recent to reproject
+static bool IsWaterViewDue(const App* app, const WaterView& view, u32 interval, u32 phase)
+{
+	if (!view.valid || app->frameIndex - view.frame > interval)
+		return true;
+	return (app->frameIndex + phase) % interval == 0;
+}
 
-				u32 submeshMaterialIdx = model.materialIdx[i];
-				Material& submeshmaterial = app->materials[submeshMaterialIdx];
-				glUniform3fv(app->BaseModelProgramIdx_uFaceColor, 1, glm::value_ptr(submeshmaterial.albedo));
+static void ReadTargetPixels(RenderGraph& graph, u32 target, std::vector<u8>& pixels)
+{
+	const ivec2 size = graph.targets[target].desc.size;
+	pixels.resize(size.x * size.y * 4);
+	BindFramebuffer(GL_READ_FRAMEBUFFER, GetRenderTargetFramebuffer(graph, target));
+	glReadPixels(0, 0, size.x, size.y, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+}
 
-				Submesh& submesh = mesh.submeshes[i];
-				glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)submesh.indexOffset);
-			}
+// Difference of the RGB of two RGBA8 images of the same size
+static void CompareImages(const std::vector<u8>& image, const std::vector<u8>& reference, WaterComparison& comparison)
+{
+	const u32 pixelCount = (u32)image.size() / 4;
+	u64 squaredError = 0;
+	u32 differentPixels = 0;
+	for (u32 i = 0; i < pixelCount; ++i) {
+		bool different = false;
+		for (u32 c = 0; c < 3; ++c) {
+			const i32 error = (i32)image[i * 4 + c] - (i32)reference[i * 4 + c];
+			squaredError += error * error;
+			different |= abs(error) > 8;
 		}
+		differentPixels += different ? 1 : 0;
+	}
 
-		//BASE
-		{
-			glBindFramebuffer(GL_FRAMEBUFFER, app->wFboBase);
-			glDisable(GL_CLIP_DISTANCE0);
-
-			glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+	const f64 mse = squaredError / (3.0 * pixelCount);
+	comparison.rmse = (f32)sqrt(mse);
+	comparison.psnr = mse > 0.0 ? (f32)(10.0 * log10(255.0 * 255.0 / mse)) : INFINITY;
+	comparison.differentPixels = differentPixels / (f32)pixelCount;
+}
 
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+static void AddWaterPasses(App* app)
+{
+	RenderGraph& graph = app->renderGraph;
+	const RenderView* mainView = &app->views[View_Main];
+	const RenderView* reflectionView = &app->views[View_WaterReflection];
+	const RenderView* refractionView = &app->views[View_WaterRefraction];
+
+	const u32 programIdx = app->useMultiDrawIndirect ? app->baseModelMultiDrawProgramIdx : app->baseModelProgramIdx;
+
+	// The island bounds are the same for the three views
+	ClearCullingSet(app->cullingSet);
+	const u32 islandBounds = AddModelBounds(app, app->island, glm::mat4(1.f));
+
+	ClearRenderQueue(app->renderQueue);
+	CullView(app, RenderPass_WaterReflection, *reflectionView);
+	QueueModel(app, RenderPass_WaterReflection, programIdx, app->island, glm::mat4(1.f), reflectionView->position, 0, 0, GetSubmeshVisibility(app, islandBounds));
+	CullView(app, RenderPass_WaterRefraction, *refractionView);
+	QueueModel(app, RenderPass_WaterRefraction, programIdx, app->island, glm::mat4(1.f), refractionView->position, 0, 0, GetSubmeshVisibility(app, islandBounds));
+	CullView(app, RenderPass_WaterBase, *mainView);
+	QueueModel(app, RenderPass_WaterBase, programIdx, app->island, glm::mat4(1.f), mainView->position, 0, 0, GetSubmeshVisibility(app, islandBounds));
+	SortRenderQueue(app->renderQueue);
+
+	app->wMove += app->wMoveSpeed * app->deltaTime;
+
+	// The reference of the comparison renders the views at full size every frame, and
+	// the last frame of the settings also renders them to compare the images
+	WaterComparison& comparison = app->wComparison;
+	const bool reference = comparison.phase == WaterComparison_Reference;
+	const bool compare = comparison.phase == WaterComparison_Settings && comparison.phaseFrames == WATER_COMPARISON_FRAMES - 1;
+	if (comparison.phase != WaterComparison_None)
+		comparison.phaseFrames++;
+
+	const f32 reflectionScale = reference ? 1.f : app->wReflectionScale;
+	const f32 refractionScale = reference ? 1.f : app->wRefractionScale;
+	const bool alternate = !reference && app->wAlternateViews;
+	const u32 interval = reference ? 1 : (alternate ? glm::max(app->wViewInterval, 2u) : glm::max(app->wViewInterval, 1u));
+
+	const ivec2 reflectionSize = glm::max(ivec2(glm::round(vec2(app->renderSize) * reflectionScale)), ivec2(1));
+	const ivec2 refractionSize = glm::max(ivec2(glm::round(vec2(app->renderSize) * refractionScale)), ivec2(1));
+	ResizeWaterView(app, app->wReflection, reflectionSize, false);
+	ResizeWaterView(app, app->wRefraction, refractionSize, true);
+
+	// Kept from one frame to the next, the depth of the reflection is only used by its pass
+	const u32 reflection = ImportRenderTarget(graph, "Reflection", app->wReflection.color, { reflectionSize, GL_RGBA8, 1, GL_LINEAR });
+	const u32 refraction = ImportRenderTarget(graph, "Refraction", app->wRefraction.color, { refractionSize, GL_RGBA8, 1, GL_LINEAR });
+	const u32 refractionDepth = ImportRenderTarget(graph, "Refraction depth", app->wRefraction.depth, { refractionSize, GL_DEPTH_COMPONENT24, 1, GL_LINEAR });
+	const u32 water = CreateRenderTarget(graph, "Water", app->renderSize, GL_RGBA8, GL_LINEAR);
+	const u32 waterDepth = CreateRenderTarget(graph, "Water depth", app->renderSize, GL_DEPTH_COMPONENT24, GL_LINEAR);
+
+	//REFLECTION
+	if (IsWaterViewDue(app, app->wReflection, interval, 0)) {
+		const u32 reflectionDepth = CreateRenderTarget(graph, "Reflection depth", reflectionSize, GL_DEPTH_COMPONENT24, GL_LINEAR);
+		AddWaterViewPass(app, "Water reflection", RenderPass_WaterReflection, reflectionView, reflection, reflectionDepth);
+
+		app->wReflection.viewProjection = reflectionView->viewProjection;
+		app->wReflection.frame = app->frameIndex;
+		app->wReflection.valid = true;
+	}
 
-			glEnable(GL_DEPTH_TEST);
+	//REFRACTION
+	if (IsWaterViewDue(app, app->wRefraction, interval, alternate ? interval / 2 : 0)) {
+		AddWaterViewPass(app, "Water refraction", RenderPass_WaterRefraction, refractionView, refraction, refractionDepth);
 
-			glDrawBuffer(GL_COLOR_ATTACHMENT0);
+		app->wRefraction.viewProjection = refractionView->viewProjection;
+		app->wRefraction.frame = app->frameIndex;
+		app->wRefraction.valid = true;
+	}
 
-			glClearColor(0.2f, 0.2f, 0.2f, 1.f);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	//BASE
+	AddWaterBasePass(app, "Water", reflection, refraction, refractionDepth, app->wReflection.viewProjection, app->wRefraction.viewProjection, water, waterDepth);
+
+	AddPresentPass(app, water);
+
+	if (compare) {
+		const u32 referenceReflection = CreateRenderTarget(graph, "Reference reflection", app->renderSize, GL_RGBA8, GL_LINEAR);
+		const u32 referenceReflectionDepth = CreateRenderTarget(graph, "Reference reflection depth", app->renderSize, GL_DEPTH_COMPONENT24, GL_LINEAR);
+		const u32 referenceRefraction = CreateRenderTarget(graph, "Reference refraction", app->renderSize, GL_RGBA8, GL_LINEAR);
+		const u32 referenceRefractionDepth = CreateRenderTarget(graph, "Reference refraction depth", app->renderSize, GL_DEPTH_COMPONENT24, GL_LINEAR);
+		const u32 referenceWater = CreateRenderTarget(graph, "Reference water", app->renderSize, GL_RGBA8, GL_LINEAR);
+		const u32 referenceWaterDepth = CreateRenderTarget(graph, "Reference water depth", app->renderSize, GL_DEPTH_COMPONENT24, GL_LINEAR);
+
+		AddWaterViewPass(app, "Reference reflection", RenderPass_WaterReflection, reflectionView, referenceReflection, referenceReflectionDepth);
+		AddWaterViewPass(app, "Reference refraction", RenderPass_WaterRefraction, refractionView, referenceRefraction, referenceRefractionDepth);
+		AddWaterBasePass(app, "Reference water", referenceReflection, referenceRefraction, referenceRefractionDepth, reflectionView->viewProjection, refractionView->viewProjection, referenceWater, referenceWaterDepth);
+
+		// Read back once, at the end of the comparison, the wait for the GPU does not matter
+		RenderGraphPass& pass = AddRenderGraphPass(graph, "Water comparison", [=](RenderGraph& graph, const RenderGraphPass&) {
+			std::vector<u8> image, referenceImage;
+			ReadTargetPixels(graph, water, image);
+			ReadTargetPixels(graph, referenceWater, referenceImage);
+			CompareImages(image, referenceImage, app->wComparison);
+		});
+		AddPassRead(pass, water);
+		AddPassRead(pass, referenceWater);
+		SetPassSideEffects(pass);
+	}
+}
 
-			glm::mat4 viewMat = app->camera.GetViewMatrix({ app->displaySize.x, app->displaySize.y });
-			glUniformMatrix4fv(app->BaseModelProgramIdx_uViewProjection, 1, GL_FALSE, glm::value_ptr(viewMat));
+// Advances the comparison of the water views, before the passes of the frame. The
+// moving average of the frame timer has forgotten the previous phase by the end of one.
+static void UpdateWaterComparison(App* app)
+{
+	WaterComparison& comparison = app->wComparison;
+	if (comparison.phase == WaterComparison_None)
+		return;
 
-			Model& model = app->models[app->island];
-			Mesh& mesh = app->meshes[model.meshIdx];
-			Program& texturedMeshProgram = app->programs[app->baseModelProgramIdx];
+	if (app->mode != Mode::Mode_Water) {
+		comparison.phase = WaterComparison_None;
+		return;
+	}
+	if (comparison.phaseFrames < WATER_COMPARISON_FRAMES)
+		return;
 
-			for (u32 i = 0; i < mesh.submeshes.size(); ++i) {
-				GLuint vao = FindVAO(mesh, i, texturedMeshProgram);
-				glBindVertexArray(vao);
+	if (comparison.phase == WaterComparison_Reference) {
+		comparison.referenceMs = app->frameTimer.averageMs;
+		comparison.phase = WaterComparison_Settings;
+	}
+	else {
+		comparison.settingsMs = app->frameTimer.averageMs;
+		comparison.phase = WaterComparison_None;
+		comparison.measured = true;
+	}
+	comparison.phaseFrames = 0;
+}
 
-				u32 submeshMaterialIdx = model.materialIdx[i];
-				Material& submeshmaterial = app->materials[submeshMaterialIdx];
-				glUniform3fv(app->BaseModelProgramIdx_uFaceColor, 1, glm::value_ptr(submeshmaterial.albedo));
+// Step of the resolution scale, the scene targets are only recreated when it moves
+#define RESOLUTION_SCALE_STEP 0.05f
 
-				Submesh& submesh = mesh.submeshes[i];
-				glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)submesh.indexOffset);
+// Scale of the scene targets of the frame, from the last GPU time of the frame
+static void UpdateResolutionScale(App* app)
+{
+	const GpuTimer& timer = app->frameTimer;
+
+	// Only the frames rendered at the current scale, not the ones in flight when it changed
+	if (app->useDynamicResolution && timer.samples > app->resolutionSamples + GPU_TIMER_QUERIES) {
+		const f32 slower = app->targetFrameMs * (1.f + app->resolutionHysteresis);
+		const f32 faster = app->targetFrameMs * (1.f - app->resolutionHysteresis);
+		if (timer.lastMs > slower || timer.lastMs < faster) {
+			// The time goes with the pixels, the square of the scale
+			f32 scale = app->resolutionScale * sqrtf(app->targetFrameMs / glm::max(timer.lastMs, 0.01f));
+			scale = glm::round(scale / RESOLUTION_SCALE_STEP) * RESOLUTION_SCALE_STEP;
+			scale = glm::clamp(scale, app->minResolutionScale, app->maxResolutionScale);
+			if (scale != app->resolutionScale) {
+				app->resolutionScale = scale;
+				app->resolutionSamples = timer.samples;
 			}
-
-			//WATER
-			glUseProgram(app->programs[app->waterProgramIdx].handle);
-
-			glUniformMatrix4fv(app->WaterProgramIdx_uViewProjection, 1, GL_FALSE, glm::value_ptr(viewMat));
-			glUniformMatrix4fv(app->WaterProgramIdx_uModelMatrix, 1, GL_FALSE, glm::value_ptr(app->water.mat));
-
-			app->wMove += app->wMoveSpeed * app->deltaTime;
-			glUniform1f(app->WaterProgramIdx_uMoveFactor, app->wMove);
-			glUniform3fv(app->WaterProgramIdx_uCameraPos, 1, glm::value_ptr(app->camera.pos));
-			glUniform3fv(app->WaterProgramIdx_uLightPos, 1, glm::value_ptr(app->wLigthPos));
-			glUniform3fv(app->WaterProgramIdx_uLightColor, 1, glm::value_ptr(app->wLigthColor));
-			glUniform1f(app->WaterProgramIdx_uShineDamper, app->wuShineDamper);
-			glUniform1f(app->WaterProgramIdx_uTiling, app->tiling);
-			glUniform1f(app->WaterProgramIdx_uWaveStrength, app->wuWaveStrength);
-			glUniform1f(app->WaterProgramIdx_uReflectivity, app->wuReflectivity);
-
-			glUniform1i(app->WaterProgramIdx_uReflectionTex, 0);
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, app->wTexReflection);
-			glUniform1i(app->WaterProgramIdx_uRefractionTex, 1);
-			glActiveTexture(GL_TEXTURE1);
-			glBindTexture(GL_TEXTURE_2D, app->wTexRefraction);
-			glUniform1i(app->WaterProgramIdx_uDudvTex, 2);
-			glActiveTexture(GL_TEXTURE2);
-			glBindTexture(GL_TEXTURE_2D, app->textures[app->wTexDudvSelected].handle);
-			glUniform1i(app->WaterProgramIdx_uNormalMapTex, 3);
-			glActiveTexture(GL_TEXTURE3);
-			glBindTexture(GL_TEXTURE_2D, app->textures[app->wTexNormalMap].handle);
-			glUniform1i(app->WaterProgramIdx_uDepthMap, 4);
-			glActiveTexture(GL_TEXTURE4);
-			glBindTexture(GL_TEXTURE_2D, app->wDepthRefraction);
-
-			app->water.Render();
 		}
-
-		glBindFramebuffer(GL_FRAMEBUFFER, NULL);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		const Program& programTexturedGeometry = app->programs[app->texturedGeometryProgramIdx];
-		glUseProgram(programTexturedGeometry.handle);
-
-		glActiveTexture(GL_TEXTURE0);
-		glUniform1i(app->programUniformTexture, 0);
-		glBindTexture(GL_TEXTURE_2D, app->wTexBase);
-
-		renderQuad();
-		break;
-	}
-	default:
-		break;
 	}
+	if (app->useDynamicResolution)
+		app->resolutionScale = glm::clamp(app->resolutionScale, app->minResolutionScale, app->maxResolutionScale);
+
+	app->renderSize = glm::max(ivec2(glm::round(vec2(app->displaySize) * app->resolutionScale)), ivec2(1));
 }
 
-void DrawEntity(App* app, Entity& e, Program& texturedMeshProgram)
+void Render(App* app)
 {
-	Model& model = app->models[e.model];
-	Mesh& mesh = app->meshes[model.meshIdx];
+	// Minimized, the render targets cannot be empty
+	if (app->displaySize.x <= 0 || app->displaySize.y <= 0)
+		return;
 
-	glm::mat4 viewMat = app->camera.GetViewMatrix({ app->displaySize.x, app->displaySize.y });
+	app->frameIndex++;
+	UpdateResolutionScale(app);
+	UpdateWaterComparison(app);
 
-	AlignHead(app->cBuffer, app->uniformBlockAligment);
-	e.localParamsOffset = app->cBuffer.head;
-	PushMat4(app->cBuffer, e.mat);
-	PushMat4(app->cBuffer, viewMat);
+	// Materials loaded after Init
+	if (app->uploadedMaterialCount != app->materials.size())
+		UploadMaterials(app);
 
+	// Resources created since the last frame and ImGui change the state behind the cache
+	ResetGLStateCache();
+	ResetGLStateStats();
+	app->renderQueueStats = {};
+	for (GpuCullingView& cullingView : app->gpuCulling)
+		cullingView.commandCount = 0;
+	for (CullingStats& cullingStats : app->cpuCullingStats)
+		cullingStats = {};
 
+	// Uniform blocks of the frame, in its own region of the ring
+	ReserveRingBufferFrame(app->uniformRing, GetUniformFrameSize(app));
+	app->cBuffer = BeginRingBufferFrame(app->uniformRing);
+	UpdateRenderViews(app);
 
-	e.localParamsSize = app->cBuffer.head - e.localParamsOffset;
+	SetCapability(GL_BLEND, true);
+	SetBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cBuffer.handle, app->globlaParamsOffset, app->globalParamsSize);
-	glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->cBuffer.handle, e.localParamsOffset, e.localParamsSize);
+	SetCapability(GL_DEPTH_TEST, true);
 
-	for (u32 i = 0; i < mesh.submeshes.size(); ++i) {
-		GLuint vao = FindVAO(mesh, i, texturedMeshProgram);
-		glBindVertexArray(vao);
-
-		u32 submeshMaterialIdx = model.materialIdx[i];
-		Material& submeshmaterial = app->materials[submeshMaterialIdx];
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, app->textures[submeshmaterial.albedoTextureIdx].handle);
-		glUniform1i(app->texturedMeshProgramIdx_uTexture, 0);
-
-		glActiveTexture(GL_TEXTURE2);
-		glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uhasBumpMap"), submeshmaterial.hasBumpText);
-		if (submeshmaterial.hasBumpText) {
-			glBindTexture(GL_TEXTURE_2D, app->textures[submeshmaterial.bumpTextureIdx].handle);
-			glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uBumpTexture"), 2);
-		}
+	// The passes of the mode, the graph gives them their render targets
+	BeginRenderGraph(app->renderGraph, app->displaySize);
+	switch (app->mode)
+	{
+	case Mode_TexturedQuad:
+		AddTexturedQuadPasses(app);
+		break;
+	case Mode_Forward:
+		AddForwardPasses(app);
+		break;
+	case Mode::Mode_Deferred:
+		AddDeferredPasses(app);
+		break;
+	case Mode::Mode_Water:
+		AddWaterPasses(app);
+		break;
+	default:
+		break;
+	}
 
-		glUniform1i(glGetUniformLocation(texturedMeshProgram.handle, "uhasNormalMap"), submeshmaterial.hasNormalText);
-		glActiveTexture(GL_TEXTURE1);
-		if (submeshmaterial.hasNormalText) {
-			glBindTexture(GL_TEXTURE_2D, app->textures[submeshmaterial.normalsTextureIdx].handle);
-			glUniform1i(app->texturedMeshProgramIdx_uTexture3, 1);
-		}
+	CompileRenderGraph(app->renderGraph);
+	BeginGpuTimer(app->frameTimer);
+	ExecuteRenderGraph(app->renderGraph);
+	EndGpuTimer(app->frameTimer);
 
-		Submesh& submesh = mesh.submeshes[i];
-		glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)submesh.indexOffset);
-	}
+	EndRingBufferFrame(app->uniformRing, app->cBuffer);
 }
 
 void WaterTile::Render() const
@@ -1235,7 +2300,7 @@ void WaterTile::Render() const
 		// setup plane VAO
 		glGenVertexArrays(1, &quadVAO);
 		glGenBuffers(1, &quadVBO);
-		glBindVertexArray(quadVAO);
+		BindVertexArray(quadVAO);
 		glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
 		glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
 		glEnableVertexAttribArray(0);
@@ -1243,9 +2308,9 @@ void WaterTile::Render() const
 		glEnableVertexAttribArray(1);
 		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
 	}
-	glBindVertexArray(quadVAO);
+	BindVertexArray(quadVAO);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glBindVertexArray(0);
+	BindVertexArray(0);
 }
 
 void renderQuad()
@@ -1265,7 +2330,7 @@ void renderQuad()
 		// setup plane VAO
 		glGenVertexArrays(1, &quadVAO);
 		glGenBuffers(1, &quadVBO);
-		glBindVertexArray(quadVAO);
+		BindVertexArray(quadVAO);
 		glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
 		glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
 		glEnableVertexAttribArray(0);
@@ -1273,9 +2338,9 @@ void renderQuad()
 		glEnableVertexAttribArray(1);
 		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
 	}
-	glBindVertexArray(quadVAO);
+	BindVertexArray(quadVAO);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glBindVertexArray(0);
+	BindVertexArray(0);
 }
 
 void renderCube()
@@ -1335,7 +2400,7 @@ void renderCube()
 		glBindBuffer(GL_ARRAY_BUFFER, cubeVBO);
 		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 		// link vertex attributes
-		glBindVertexArray(cubeVAO);
+		BindVertexArray(cubeVAO);
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
 		glEnableVertexAttribArray(1);
@@ -1343,15 +2408,15 @@ void renderCube()
 		glEnableVertexAttribArray(2);
 		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindVertexArray(0);
+		BindVertexArray(0);
 	}
 	// render Cube
-	glBindVertexArray(cubeVAO);
+	BindVertexArray(cubeVAO);
 	glDrawArrays(GL_TRIANGLES, 0, 36);
-	glBindVertexArray(0);
+	BindVertexArray(0);
 }
 
-void renderSphere()
+void renderSphere(u32 instanceCount)
 {
 	static unsigned int sphereVAO = 0;
 	static unsigned int indexCount;
@@ -1428,7 +2493,7 @@ void renderSphere()
 				data.push_back(normals[i].z);
 			}
 		}
-		glBindVertexArray(sphereVAO);
+		BindVertexArray(sphereVAO);
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
 		glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(float), &data[0], GL_STATIC_DRAW);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
@@ -1442,8 +2507,8 @@ void renderSphere()
 		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void*)(5 * sizeof(float)));
 	}
 
-	glBindVertexArray(sphereVAO);
-	glDrawElements(GL_TRIANGLE_STRIP, indexCount, GL_UNSIGNED_INT, 0);
+	BindVertexArray(sphereVAO);
+	glDrawElementsInstanced(GL_TRIANGLE_STRIP, indexCount, GL_UNSIGNED_INT, 0, instanceCount);
 }
 
 void CheckOpenGLError(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam)
@@ -1544,23 +2609,3 @@ void CheckOpenGLError(GLenum source, GLenum type, GLuint id, GLenum severity, GL
 	printf("%d: %s of %s severity, raised from %s: %s\n",
 		id, _type.c_str(), _severity.c_str(), _source.c_str(), message);
 }
-
-std::string FrameBufferToString(FrameBuffer fb)
-{
-	switch (fb)
-	{
-	case FrameBuffer::Framebuffer:
-		return "Framebuffer";
-	case FrameBuffer::FinalRender:
-		return "Final Render";
-	case FrameBuffer::Albedo:
-		return "Albedo";
-	case FrameBuffer::Normals:
-		return "Normals";
-	case FrameBuffer::Light:
-		return "Lights";
-	case FrameBuffer::Depth:
-		return "Depth";
-	}
-	return std::string("Unknown");
-}
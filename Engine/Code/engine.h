@@ -8,8 +8,24 @@
 #include <glad/glad.h>
 
 #include "assimp_model_loading.h"
+#include "bvh.h"
+#include "frustum_culling.h"
+#include "gpu_timer.h"
+#include "light_clusters.h"
+#include "model_import.h"
+#include "render_graph.h"
+#include "render_queue.h"
+#include "render_view.h"
+#include "ring_buffer.h"
 #include <map>
 
+#define BINDING(b) b
+
+// Query target of GL_ARB_pipeline_statistics_query (core in 4.6), not in the glad headers
+#ifndef GL_FRAGMENT_SHADER_INVOCATIONS
+#define GL_FRAGMENT_SHADER_INVOCATIONS 0x82F4
+#endif
+
 typedef glm::vec2  vec2;
 typedef glm::vec3  vec3;
 typedef glm::vec4  vec4;
@@ -17,17 +33,6 @@ typedef glm::ivec2 ivec2;
 typedef glm::ivec3 ivec3;
 typedef glm::ivec4 ivec4;
 
-struct VertexBufferAttribute {
-    u8 location;
-    u8 componentCount;
-    u8 offset;
-};
-
-struct VertexBufferLayout {
-    std::vector<VertexBufferAttribute> attributes;
-    u8 stride;
-};
-
 struct VertexShaderAttribute {
     u8 location;
     u8 componentCount;
@@ -37,11 +42,6 @@ struct VertexShaderLayout {
     std::vector<VertexShaderAttribute> attributes;
 };
 
-struct Vao {
-    GLuint handle;
-    GLuint programHandle;
-};
-
 struct Buffer {
     GLuint  handle;
     GLenum  type;
@@ -59,18 +59,54 @@ struct Submesh {
     VertexBufferLayout	vertexBufferLayout;
     std::vector<float>	vertices;
     std::vector<u32>	indices;
-    u32					vertexOffset;
-    u32					indexOffset;
-
-    std::vector<Vao>	vaos;
+    u32					vertexPoolIdx; // Where the geometry is stored, see geometry_storage.h
+    u32					baseVertex;
+    u32					firstIndex;
+    u64					contentHash;
+    GLuint				vao; // VAO of the vertex pool
+    vec3				aabbMin; // Local space bounds, computed when the geometry is added
+    vec3				aabbMax;
+    vec3				sphereCenter;
+    f32					sphereRadius;
 };
 
 struct Mesh {
     std::vector<Submesh>	submeshes;
-    GLuint					vertexBufferHandle;
-    GLuint					indexBufferHandle;
+    u64						contentHash;
+};
+
+// Vertices of all the submeshes with the same vertex format. Its VAO has the format and
+// all the buffers attached, so it is the only binding a draw of these submeshes needs.
+struct VertexPool {
+    VertexBufferLayout	layout;
+    GLuint				vao;
+    Buffer				vertexBuffer;
+    u32					vertexCount;
+};
+
+// Copy of the batch counters of a culling dispatch, read once its fence has signaled
+struct CullingReadback {
+    Buffer	buffer;
+    GLsync	fence;		// NULL once read
+    u32		batchCount;
 };
 
+// Buffers of the GPU culling of a pass, see gpu_culling.h
+struct GpuCullingView {
+    Buffer	outputCommands;
+    Buffer	batches;
+    u32		commandCount;
+    u32		batchCount;
+
+    CullingReadback	readbacks[RING_BUFFER_REGIONS];
+    u32				nextReadback;
+    u32				visibleCount;	// Last counters read
+};
+
+// Size of the MaterialParms uniform block (std140): albedo, emissive, smoothness,
+// hasNormalMap and hasBumpMap
+#define MATERIAL_PARAMS_SIZE 40
+
 struct Material {
     std::string name;
     vec3 albedo;
@@ -97,6 +133,20 @@ struct Texture
 {
     GLuint      handle;
     std::string filepath;
+    u64         contentHash;
+};
+
+// Counters of the assets that were found to be identical to an already loaded one
+// (by content hash) and therefore shared instead of being created again.
+struct AssetDedupStats
+{
+    u32 sharedMeshes;
+    u32 sharedModels;
+    u32 sharedMaterials;
+    u32 sharedTextures;
+    u64 meshBytesSaved;
+    u64 materialBytesSaved;
+    u64 textureBytesSaved;
 };
 
 struct Program
@@ -105,6 +155,7 @@ struct Program
     std::string        filepath;
     std::string        programName;
     u64                lastWriteTimestamp; // What is this for?
+    bool               isCompute;
     VertexShaderLayout vertexInputLayout;
 };
 
@@ -142,6 +193,7 @@ static std::string ModeToString(Mode m) {
 struct Entity {
     glm::mat4 mat = glm::mat4(1.0f);
     u32 model = 0U;
+    u32 node = UINT32_MAX; // If set, mat follows the world transform of this scene node
     u32 localParamsOffset = 0U;
     u32 localParamsSize = 0U;
 
@@ -149,6 +201,25 @@ struct Entity {
     Entity(const glm::mat4& m, u32 mod) : mat(m), model(mod){}
 };
 
+// Transform hierarchy of the models loaded with LoadModelHierarchy. Parents are always
+// before their children in App::sceneNodes.
+struct SceneNode {
+    std::string name;
+    u32 parent = UINT32_MAX;
+    glm::mat4 localTransform = glm::mat4(1.0f);
+    glm::mat4 worldTransform = glm::mat4(1.0f);
+};
+
+// Node of a model file loaded with LoadModelHierarchy, with the models (one per mesh
+// of the file, shared by all the nodes that reference it) it instances. It is kept so
+// the file can be instantiated again without importing it.
+struct ModelHierarchyNode {
+    std::string name;
+    u32 parent;
+    glm::mat4 transform;
+    std::vector<u32> models;
+};
+
 struct WaterTile {
     glm::vec3 pos;
     glm::vec2 size;
@@ -162,23 +233,58 @@ struct WaterTile {
     }
 };
 
+// The reflection or refraction of the water, kept from one frame to the next so it can
+// be rendered only every few frames
+struct WaterView
+{
+    GLuint    color;
+    GLuint    depth;            // 0 for the reflection, only the refraction depth is read
+    ivec2     size;
+    glm::mat4 viewProjection;   // The one it was rendered with, the water reprojects it
+    u64       frame;            // Frame it was rendered
+    bool      valid;            // Rendered since its textures were created
+};
+
+// Frames of each phase of the water comparison
+#define WATER_COMPARISON_FRAMES 60
+
+enum WaterComparisonPhase
+{
+    WaterComparison_None,
+    WaterComparison_Reference,  // Full size views every frame
+    WaterComparison_Settings,   // The views of the Gui, then the images are compared
+};
+
+// GPU frame time of the water with full size views rendered every frame and with the
+// settings of the Gui, and the difference of the images
+struct WaterComparison
+{
+    WaterComparisonPhase phase;
+    u32 phaseFrames;            // Frames rendered in the phase
+
+    f32 referenceMs;            // Moving average of the frame timer at the end of a phase
+    f32 settingsMs;
+    f32 rmse;                   // Root mean square error of the RGB, 0 to 255
+    f32 psnr;                   // Peak signal to noise ratio, dB
+    f32 differentPixels;        // Fraction of the pixels with a channel off by more than 8
+    bool measured;
+};
+
 enum LightType
 {
     LightType_Directional,
     LightType_Point
 };
 
-enum class FrameBuffer {
-    Framebuffer,
-    FinalRender, Albedo, Normals, Light, Position,
-    Depth,
-    MAX
+// How the deferred mode lights the G-buffer
+enum DeferredLighting
+{
+    DeferredLighting_FullScreen,    // SHOW_LIGHTS, the lights of the cluster of each pixel
+    DeferredLighting_Tiled,         // TILED_LIGHTING compute shader
+    DeferredLighting_LightVolumes,  // Directional lights full screen, a sphere per point light
+    DeferredLighting_Count
 };
 
-/*struct FrameBuffer {
-    Attachment ids[(int)Attachment::MAX];
-};*/
-
 struct Light
 {
     LightType type;
@@ -217,13 +323,14 @@ struct Camera {
 
     static float moveSpeed;
 
-    glm::mat4 GetViewMatrix(const vec2& size) {
+    // Updates the vectors (and the position in orbit mode) from the angles
+    glm::mat4 GetView() {
         float Phi = glm::radians(phi);
         float Theta = glm::radians(theta);
         if (mode == CameraMode::ORBIT) {
             pos = { distanceToOrigin * sin(Phi) * cos(Theta), distanceToOrigin * cos(Phi), distanceToOrigin * sin(Phi) * sin(Theta) };
 
-            return glm::perspective(glm::radians(60.f), size.x / size.y, 0.1f, 1000.f) * glm::lookAt(pos, vec3(0.f), vec3(0.f, 1.f, 0.f));
+            return glm::lookAt(pos, vec3(0.f), vec3(0.f, 1.f, 0.f));
         }
         else {
             front.x = cos(Theta) * cos(Phi);
@@ -234,9 +341,19 @@ struct Camera {
             right = glm::normalize(glm::cross(front, vec3(0.f, 1.f, 0.f)));  // normalize the vectors, because their length gets closer to 0 the more you look up or down which results in slower movement.
             up = glm::normalize(glm::cross(right, front));
 
-            return glm::perspective(glm::radians(60.f), size.x / size.y, 0.1f, 1000.f) * glm::lookAt(pos, pos + front, up);
+            return glm::lookAt(pos, pos + front, up);
         }
     }
+
+    glm::mat4 GetProjection(const vec2& size) const {
+        return glm::perspective(glm::radians(60.f), size.x / size.y, 0.1f, 1000.f);
+    }
+
+    // View projection, the passes use the ones of app->views computed once per frame
+    glm::mat4 GetViewMatrix(const vec2& size) {
+        const glm::mat4 view = GetView();
+        return GetProjection(size) * view;
+    }
 };
 
 struct App
@@ -284,13 +401,9 @@ struct App
 
     // Location of the texture uniform in the textured quad shader
     GLuint programUniformTexture;
-    GLuint texturedMeshProgramIdx_uTexture;
     GLuint texturedMeshProgramIdx_uViewProjection;
     GLuint texturedMeshProgramIdx_uWorldMatrix;
 
-    GLuint texturedMeshProgramIdx_uTexture2;
-    GLuint texturedMeshProgramIdx_uTexture3;
-
     GLuint texturedMeshProgramIdx_uAlbedo;
     GLuint texturedMeshProgramIdx_uPosition;
     GLuint texturedMeshProgramIdx_uNormals;
@@ -300,7 +413,6 @@ struct App
     GLuint texturedLightProgramIdx_uViewProjection;
     GLuint texturedLightProgramIdx_uModel;
 
-    GLuint BaseModelProgramIdx_uViewProjection;
 
     // VAO object to link our screen filling quad with our textured quad shader
     GLuint vao;
@@ -311,18 +423,132 @@ struct App
     std::vector<Model> models;
     std::vector<Program> programs;
 
+    // MaterialParms uniform blocks of all the materials, one every materialBlockStride bytes,
+    // and the same parameters packed in a storage buffer for the multi-draw programs
+    Buffer materialBuffer = {};
+    Buffer materialStorageBuffer = {};
+    u32 materialBlockStride = 0;
+    u32 uploadedMaterialCount = 0;
+
+    // Shared geometry storage (see geometry_storage.h)
+    std::vector<VertexPool> vertexPools;
+    std::map<u64, u32> vertexPoolIndices; // By hash of the VertexBufferLayout
+    Buffer indexStorage = {};
+    u32 indexCount = 0;
+    Buffer drawIndexBuffer = {};
+
+    // Content hash -> index in the vectors above
+    std::map<u64, u32> meshHashes;
+    std::map<u64, u32> materialHashes;
+    std::map<u64, u32> textureHashes;
+    AssetDedupStats dedupStats = {};
+
     std::vector<Entity> entities;
+    std::vector<SceneNode> sceneNodes;
+    std::map<std::string, std::vector<ModelHierarchyNode>> modelHierarchies; // By filename
 
     Camera camera;
     std::vector<Light> lights;
 
-    //Framebuffer
-    std::map<FrameBuffer, u32> framebuffer;
+    // Lights of the frame and the point lights of each cluster of the main view, in the
+    // storage buffers the forward and deferred lighting read
+    LightClusters lightClusters;
+    Buffer lightBuffer = {};
+    Buffer lightClusterBuffer = {};
+    u32 stressLightCount = 0;   // Random point lights added from the Gui, at the end of lights
+
+    // Lighting of the G-buffer, the GPU time of every path is measured to compare them
+    DeferredLighting deferredLighting = DeferredLighting_Tiled;
+    u32 tiledLightingProgramIdx;
+    u32 directionalLightProgramIdx;
+    u32 lightVolumeProgramIdx;
+    GpuTimer lightingTimers[DeferredLighting_Count];
+
+    // G-buffer of the deferred mode with only what the lighting reads: depth, octahedral
+    // normals (RG16) and albedo with the material bits (RGBA8). The position is rebuilt
+    // from the depth.
+    bool useCompactGBuffer = false;
+    u32 compactGBufferProgramIdx;
+    u32 compactGBufferMultiDrawProgramIdx;
+    u32 compactLightingProgramIdx[DeferredLighting_Count]; // Variants of the lighting paths
+    u32 compactDirectionalLightProgramIdx;
+
+    // Passes and render targets of the frame, built by Render for the mode
+    RenderGraph renderGraph;
+    u64 frameIndex = 0;             // Frames rendered
+
+    // The scene targets are renderSize, the display scaled by resolutionScale, and the
+    // present pass upscales them. With dynamic resolution the scale follows the GPU time
+    // of the frame: it only changes when the time leaves targetFrameMs by more than the
+    // hysteresis (a fraction of the target), then waits for the new size to be measured.
+    bool useDynamicResolution = false;
+    f32 targetFrameMs = 16.6f;
+    f32 minResolutionScale = 0.5f;
+    f32 maxResolutionScale = 1.f;
+    f32 resolutionHysteresis = 0.1f;
+    f32 resolutionScale = 1.f;
+    u32 resolutionSamples = 0;      // Samples of frameTimer when the scale last changed
+    ivec2 renderSize;
+    GpuTimer frameTimer;            // The passes of the render graph
+    // View of the region of the frame in uniformRing, see BeginRingBufferFrame
     Buffer cBuffer;
+    RingBuffer uniformRing = {};
     GLuint globlaParamsOffset;
     GLuint globalParamsSize;
     int uniformBlockAligment;
 
+    // Views of the frame, their ViewParms blocks are in the cBuffer
+    RenderView views[View_Count];
+
+    // Draws of the scene passes of the frame, sorted to minimize the state changes
+    RenderQueue renderQueue;
+    RenderQueueStats renderQueueStats = {};
+
+    // Submit the forward and G-buffer passes with glMultiDrawElementsIndirect
+    bool useMultiDrawIndirect = true;
+    u32 texturedForwardMultiDrawProgramIdx;
+    u32 texturedMeshMultiDrawProgramIdx;
+    Buffer indirectBuffer = {};
+    Buffer drawParamsBuffer = {};
+    Buffer transformBuffer = {};
+
+    // Draw the entities that share a model as instances of the same draws
+    bool useInstancing = true;
+
+    // Render the depth of the forward pass first, so it only shades the visible fragments
+    bool useDepthPrepass = false;
+    u32 depthPrepassProgramIdx;
+    u32 depthPrepassMultiDrawProgramIdx;
+
+    // Fragment shader invocations of the forward passes, read a few frames later
+    bool hasPipelineStatistics = false;
+    GLuint fragmentQueries[2] = {};          // Depth pre-pass, shading
+    bool fragmentQueriesPending = false;
+    bool fragmentQueriesPrepass = false;     // Whether the pending queries had the pre-pass
+    GLuint64 fragmentInvocations[2][2] = {}; // [without, with pre-pass][pre-pass, shading]
+
+    // Cull the multi-draw passes against their view in a compute shader
+    bool useGpuCulling = true;
+    u32 frustumCullingProgramIdx;
+    u32 baseModelMultiDrawProgramIdx;
+    Buffer drawBoundsBuffer = {};
+    GpuCullingView gpuCulling[RenderPass_Count] = {};
+
+    // Cull the submeshes of the entities against every view before queueing them
+    bool useCpuCulling = true;
+    CullingSet cullingSet = {};
+    CullingStats cpuCullingStats[RenderPass_Count] = {};
+
+    // BVH over the world bounds of app->entities, refitted when they move. It culls whole
+    // entities before their submeshes and answers the picking ray of the right button.
+    bool useBvh = true;
+    Bvh entityBvh = {};
+    std::vector<u32> bvhQueryItems;
+    u32 bvhBuilds = 0;
+    u32 bvhRefits = 0;
+    u32 bvhVisibleEntities = 0;
+    u32 pickedEntity = UINT32_MAX;
+
     //Relief
     Entity cliff;
     Entity box;
@@ -347,28 +573,17 @@ struct App
     GLuint WaterProgramIdx_uShineDamper;
     GLuint WaterProgramIdx_uReflectivity;
     GLuint WaterProgramIdx_uTiling;
-    GLuint BaseModelProgramIdx_uPlane;
-    GLuint BaseModelProgramIdx_uFaceColor;
+    GLuint WaterProgramIdx_uReflectionViewProjection;
+    GLuint WaterProgramIdx_uRefractionViewProjection;
     GLuint BaseModelProgramIdx_uLightPos;
     GLuint BaseModelProgramIdx_uLightColor;
 
-    GLuint wTexBase = 0U;
-    GLuint wDepthBase = 0U;
-    GLuint wTexReflection = 0U;
-    GLuint wTexRefraction = 0U;
-    GLuint wDepthReflection = 0U;
-    GLuint wDepthRefraction = 0U;
-
     GLuint wTexDudv1 = 0U;
     GLuint wTexDudv2 = 0U;
     GLuint wTexDudvSelected = 0U;
 
     GLuint wTexNormalMap = 0U;
 
-    GLuint wFboBase = 0U;
-    GLuint wFboReflect = 0U;
-    GLuint wFboRefract = 0U;
-
     u32 island = 0U;
     float wMove = 0.f;
     float wMoveSpeed = 0.05f;
@@ -381,6 +596,17 @@ struct App
     float wuShineDamper = 6.f;
     float wuReflectivity = 0.6f;
     float tiling = 12.f;
+
+    // The reflection and refraction are rendered at a scale of the render size, each one
+    // every wViewInterval frames. Alternated, they are never rendered the same frame.
+    // In between the water reprojects the last ones.
+    float wReflectionScale = 0.5f;
+    float wRefractionScale = 0.5f;
+    u32 wViewInterval = 1;
+    bool wAlternateViews = false;
+    WaterView wReflection = {};
+    WaterView wRefraction = {};
+    WaterComparison wComparison = {};
 };
 
 u32 LoadTexture2D(App* app, const char* filepath, GLenum wrapTex = GL_CLAMP_TO_EDGE);
@@ -395,11 +621,48 @@ void Update(App* app);
 
 void Render(App* app);
 
-void DrawEntity(App* app, Entity& e, Program& texturedMeshProgram);
+
+/**
+ * Writes the MaterialParms blocks of all the materials. Called once all the models are
+ * loaded (and again if materials are added later).
+ */
+void UploadMaterials(App* app);
+
+/**
+ * Updates the block of a material after changing it.
+ */
+void UpdateMaterial(App* app, u32 materialIdx);
+
+/**
+ * Selects the MaterialParms block of a material (binding 2).
+ */
+void BindMaterialParams(App* app, u32 materialIdx);
+
+/**
+ * Selects the MaterialParms block and binds the textures of a material.
+ */
+void BindMaterial(App* app, u32 materialIdx);
+
+/**
+ * Asserts that the vertex format of the submesh has all the inputs of the program.
+ */
+void CheckSubmeshVertexInput(const Submesh& submesh, const Program& program);
+
+void UpdateSceneNodes(App* app);
+
+/**
+ * Builds the entity BVH, or refits it if only the bounds of the entities changed.
+ */
+void UpdateEntityBvh(App* app);
+
+/**
+ * Casts a ray through the mouse position and sets pickedEntity to the nearest entity hit.
+ */
+void PickEntity(App* app);
 
 void renderQuad();
 void renderCube();
-void renderSphere();
+void renderSphere(u32 instanceCount = 1);
 
 void APIENTRY CheckOpenGLError(GLenum source,
     GLenum type,
@@ -409,4 +672,3 @@ void APIENTRY CheckOpenGLError(GLenum source,
     const GLchar* message,
     const void* userParam);
 
-static std::string FrameBufferToString(FrameBuffer fb);
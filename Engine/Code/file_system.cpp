@@ -0,0 +1,249 @@
+#ifdef _WIN32
+#define VC_EXTRALEAN
+#define WIN32_LEAN_AND_MEAN
+#define _CRT_SECURE_NO_WARNINGS
+#include <Windows.h>
+#include <direct.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+#include "file_system.h"
+#include "asset_pack.h"
+
+#include <stdlib.h>
+
+MappedFile MapFile(const char* filepath)
+{
+    MappedFile file = {};
+
+#ifdef _WIN32
+    HANDLE fileHandle = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+        return file;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(fileHandle);
+        return file;
+    }
+
+    HANDLE mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mappingHandle == NULL)
+    {
+        CloseHandle(fileHandle);
+        return file;
+    }
+
+    file.data = (u8*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (file.data == NULL)
+    {
+        CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+        return file;
+    }
+
+    file.size = (u64)fileSize.QuadPart;
+    file.fileHandle = fileHandle;
+    file.mappingHandle = mappingHandle;
+#else
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
+        return file;
+
+    struct stat attrib;
+    if (fstat(fd, &attrib) != 0 || attrib.st_size == 0)
+    {
+        close(fd);
+        return file;
+    }
+
+    void* data = mmap(NULL, attrib.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return file;
+
+    file.data = (u8*)data;
+    file.size = (u64)attrib.st_size;
+#endif
+
+    return file;
+}
+
+void UnmapFile(MappedFile& file)
+{
+    if (file.data == NULL)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(file.data);
+    CloseHandle((HANDLE)file.mappingHandle);
+    CloseHandle((HANDLE)file.fileHandle);
+#else
+    munmap(file.data, file.size);
+#endif
+
+    file = {};
+}
+
+bool FileExists(const char* filepath)
+{
+    if (FindAssetPackEntry(filepath))
+        return true;
+
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(filepath);
+    return attributes != INVALID_FILE_ATTRIBUTES && !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat attrib;
+    return stat(filepath, &attrib) == 0 && S_ISREG(attrib.st_mode);
+#endif
+}
+
+FileData ReadBinaryFile(const char* filepath)
+{
+    FileData file = {};
+
+    const AssetPackEntry* entry = FindAssetPackEntry(filepath);
+    if (entry)
+    {
+        file.size = entry->size;
+        file.data = (u8*)malloc(file.size + 1);
+        if (ReadAssetPackEntry(entry, file.data))
+        {
+            file.data[file.size] = 0;
+            return file;
+        }
+        FreeFileData(file);
+    }
+
+    FILE* fp = fopen(filepath, "rb");
+    if (fp)
+    {
+        fseek(fp, 0, SEEK_END);
+        file.size = (u64)ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        // One extra zero byte so text files can be used as C strings
+        file.data = (u8*)malloc(file.size + 1);
+        fread(file.data, 1, file.size, fp);
+        file.data[file.size] = 0;
+
+        fclose(fp);
+    }
+    else
+    {
+        ELOG("fopen() failed reading file %s", filepath);
+    }
+
+    return file;
+}
+
+void FreeFileData(FileData& file)
+{
+    free(file.data);
+    file = {};
+}
+
+bool WriteBinaryFile(const char* filepath, const void* data, u64 size)
+{
+    FILE* fp = fopen(filepath, "wb");
+    if (!fp)
+    {
+        ELOG("fopen() failed writing file %s", filepath);
+        return false;
+    }
+
+    bool success = fwrite(data, 1, size, fp) == size;
+    fclose(fp);
+    return success;
+}
+
+void CreateDirectories(const char* directory)
+{
+    std::string path;
+    for (const char* c = directory; ; ++c)
+    {
+        if ((*c == '/' || *c == '\\' || *c == 0) && !path.empty())
+        {
+#ifdef _WIN32
+            CreateDirectoryA(path.c_str(), NULL);
+#else
+            mkdir(path.c_str(), 0755);
+#endif
+        }
+
+        if (*c == 0)
+            break;
+        path += *c;
+    }
+}
+
+bool ChangeWorkingDirectory(const char* directory)
+{
+#ifdef _WIN32
+    return _chdir(directory) == 0;
+#else
+    return chdir(directory) == 0;
+#endif
+}
+
+static void ListFilesRecursive(const std::string& root, const std::string& relative, std::vector<std::string>& files)
+{
+    std::string directory = relative.empty() ? root : root + "/" + relative;
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA findData;
+    HANDLE findHandle = FindFirstFileA((directory + "/*").c_str(), &findData);
+    if (findHandle == INVALID_HANDLE_VALUE)
+        return;
+
+    do {
+        std::string name = findData.cFileName;
+        if (name == "." || name == "..")
+            continue;
+
+        std::string path = relative.empty() ? name : relative + "/" + name;
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            ListFilesRecursive(root, path, files);
+        else
+            files.push_back(path);
+    } while (FindNextFileA(findHandle, &findData));
+
+    FindClose(findHandle);
+#else
+    DIR* dir = opendir(directory.c_str());
+    if (!dir)
+        return;
+
+    while (dirent* dirEntry = readdir(dir))
+    {
+        std::string name = dirEntry->d_name;
+        if (name == "." || name == "..")
+            continue;
+
+        std::string path = relative.empty() ? name : relative + "/" + name;
+        struct stat attrib;
+        if (stat((root + "/" + path).c_str(), &attrib) != 0)
+            continue;
+
+        if (S_ISDIR(attrib.st_mode))
+            ListFilesRecursive(root, path, files);
+        else if (S_ISREG(attrib.st_mode))
+            files.push_back(path);
+    }
+
+    closedir(dir);
+#endif
+}
+
+void ListFilesRecursive(const char* directory, std::vector<std::string>& files)
+{
+    ListFilesRecursive(std::string(directory), std::string(), files);
+}
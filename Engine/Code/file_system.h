@@ -0,0 +1,57 @@
+//
+// file_system.h: Binary file access for the engine and its tools. Reads go through the
+// asset pack first (see asset_pack.h) and fall back to the loose files on disk.
+//
+
+#pragma once
+
+#include "platform.h"
+
+struct MappedFile
+{
+    u8*   data;
+    u64   size;
+    void* fileHandle;
+    void* mappingHandle;
+};
+
+struct FileData
+{
+    u8* data;
+    u64 size;
+};
+
+/**
+ * Maps a whole file in memory for reading. On failure the returned data is NULL.
+ */
+MappedFile MapFile(const char* filepath);
+
+void UnmapFile(MappedFile& file);
+
+/**
+ * True if the file is in the asset pack (when it is open) or on disk.
+ */
+bool FileExists(const char* filepath);
+
+/**
+ * Reads a whole file, from the asset pack if it is open and contains it or from disk
+ * otherwise. The data is heap allocated and has to be released with FreeFileData.
+ */
+FileData ReadBinaryFile(const char* filepath);
+
+void FreeFileData(FileData& file);
+
+bool WriteBinaryFile(const char* filepath, const void* data, u64 size);
+
+/**
+ * Creates the directory and all its missing parents.
+ */
+void CreateDirectories(const char* directory);
+
+bool ChangeWorkingDirectory(const char* directory);
+
+/**
+ * Appends to files the paths (relative to directory and using '/' as separator)
+ * of all the regular files found under directory.
+ */
+void ListFilesRecursive(const char* directory, std::vector<std::string>& files);
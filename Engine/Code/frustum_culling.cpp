@@ -0,0 +1,163 @@
+//
+// frustum_culling.cpp: SoA sphere/frustum tests with SSE, run in the job system.
+//
+
+#include "frustum_culling.h"
+#include "job_system.h"
+
+#include <atomic>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define FRUSTUM_CULLING_SSE
+#endif
+
+// Spheres tested by each job, a multiple of 4
+#define CULLING_BATCH_SIZE 1024
+
+void GetFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6])
+{
+    const glm::mat4 m = glm::transpose(viewProjection);
+    planes[0] = m[3] + m[0]; // Left
+    planes[1] = m[3] - m[0]; // Right
+    planes[2] = m[3] + m[1]; // Bottom
+    planes[3] = m[3] - m[1]; // Top
+    planes[4] = m[3] + m[2]; // Near
+    planes[5] = m[3] - m[2]; // Far
+
+    for (u32 i = 0; i < 6; ++i)
+        planes[i] /= glm::length(glm::vec3(planes[i]));
+}
+
+Frustum MakeFrustum(const glm::mat4& viewProjection)
+{
+    Frustum frustum = {};
+    GetFrustumPlanes(viewProjection, frustum.planes);
+    frustum.planeCount = 6;
+    return frustum;
+}
+
+void AddFrustumPlane(Frustum& frustum, const glm::vec4& plane)
+{
+    ASSERT(frustum.planeCount < FRUSTUM_MAX_PLANES, "Too many frustum planes");
+    frustum.planes[frustum.planeCount++] = plane / glm::length(glm::vec3(plane));
+}
+
+FrustumOverlap TestFrustumBox(const Frustum& frustum, const glm::vec3& aabbMin, const glm::vec3& aabbMax)
+{
+    const glm::vec3 center = (aabbMin + aabbMax) * 0.5f;
+    const glm::vec3 extents = (aabbMax - aabbMin) * 0.5f;
+
+    FrustumOverlap overlap = FrustumOverlap_Inside;
+    for (u32 p = 0; p < frustum.planeCount; ++p)
+    {
+        const glm::vec4& plane = frustum.planes[p];
+        const f32 distance = glm::dot(glm::vec3(plane), center) + plane.w;
+        const f32 radius = glm::dot(glm::abs(glm::vec3(plane)), extents);
+        if (distance + radius < 0.0f)
+            return FrustumOverlap_Outside;
+        if (distance - radius < 0.0f)
+            overlap = FrustumOverlap_Intersects;
+    }
+    return overlap;
+}
+
+void ClearCullingSet(CullingSet& set)
+{
+    set.centerX.clear();
+    set.centerY.clear();
+    set.centerZ.clear();
+    set.radius.clear();
+    set.visible.clear();
+    set.count = 0;
+}
+
+u32 AddBoundingSphere(CullingSet& set, const glm::vec3& center, f32 radius)
+{
+    // Drop the padding of the last cull
+    set.centerX.resize(set.count);
+    set.centerY.resize(set.count);
+    set.centerZ.resize(set.count);
+    set.radius.resize(set.count);
+
+    set.centerX.push_back(center.x);
+    set.centerY.push_back(center.y);
+    set.centerZ.push_back(center.z);
+    set.radius.push_back(radius);
+    return set.count++;
+}
+
+// Tests the spheres [begin, end), begin is a multiple of 4 and the arrays are padded
+static u32 CullRange(CullingSet& set, const Frustum& frustum, u32 begin, u32 end)
+{
+    u32 visibleCount = 0;
+
+#ifdef FRUSTUM_CULLING_SSE
+    __m128 planeX[FRUSTUM_MAX_PLANES], planeY[FRUSTUM_MAX_PLANES], planeZ[FRUSTUM_MAX_PLANES], planeW[FRUSTUM_MAX_PLANES];
+    for (u32 p = 0; p < frustum.planeCount; ++p)
+    {
+        planeX[p] = _mm_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm_set1_ps(frustum.planes[p].z);
+        planeW[p] = _mm_set1_ps(frustum.planes[p].w);
+    }
+
+    for (u32 i = begin; i < end; i += 4)
+    {
+        const __m128 x = _mm_loadu_ps(&set.centerX[i]);
+        const __m128 y = _mm_loadu_ps(&set.centerY[i]);
+        const __m128 z = _mm_loadu_ps(&set.centerZ[i]);
+        const __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&set.radius[i]));
+
+        // Inside while the signed distance to every plane is greater than -radius
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (u32 p = 0; p < frustum.planeCount; ++p)
+        {
+            __m128 distance = _mm_add_ps(_mm_mul_ps(x, planeX[p]), planeW[p]);
+            distance = _mm_add_ps(distance, _mm_mul_ps(y, planeY[p]));
+            distance = _mm_add_ps(distance, _mm_mul_ps(z, planeZ[p]));
+            inside = _mm_and_ps(inside, _mm_cmpgt_ps(distance, negativeRadius));
+        }
+
+        const int mask = _mm_movemask_ps(inside);
+        const u32 laneCount = glm::min(end - i, 4u);
+        for (u32 lane = 0; lane < laneCount; ++lane)
+        {
+            const u8 visible = (mask >> lane) & 1;
+            set.visible[i + lane] = visible;
+            visibleCount += visible;
+        }
+    }
+#else
+    for (u32 i = begin; i < end; ++i)
+    {
+        bool inside = true;
+        for (u32 p = 0; p < frustum.planeCount && inside; ++p)
+        {
+            const glm::vec4& plane = frustum.planes[p];
+            inside = plane.x * set.centerX[i] + plane.y * set.centerY[i] + plane.z * set.centerZ[i] + plane.w > -set.radius[i];
+        }
+        set.visible[i] = inside;
+        visibleCount += inside;
+    }
+#endif
+
+    return visibleCount;
+}
+
+u32 CullBoundingSpheres(CullingSet& set, const Frustum& frustum)
+{
+    // Pad to a multiple of 4 so the last group of the SSE loop reads valid memory
+    const u32 paddedCount = (set.count + 3) & ~3u;
+    set.centerX.resize(paddedCount, 0.0f);
+    set.centerY.resize(paddedCount, 0.0f);
+    set.centerZ.resize(paddedCount, 0.0f);
+    set.radius.resize(paddedCount, 0.0f);
+    set.visible.resize(set.count);
+
+    std::atomic<u32> visibleCount(0);
+    ParallelFor(set.count, CULLING_BATCH_SIZE, [&](u32 begin, u32 end) {
+        visibleCount += CullRange(set, frustum, begin, end);
+    });
+    return visibleCount;
+}
@@ -0,0 +1,74 @@
+//
+// frustum_culling.h: Visibility of bounding spheres against the frustum of a view,
+// tested on the CPU four spheres at a time with SSE.
+//
+// The spheres are stored as structure of arrays (all the x, then all the y...) so a
+// single load reads the same component of four spheres. The set is split in batches
+// that run in the job system.
+//
+
+#pragma once
+
+#include "platform.h"
+
+#define FRUSTUM_MAX_PLANES 8
+
+struct Frustum
+{
+    glm::vec4 planes[FRUSTUM_MAX_PLANES]; // Normalized, pointing inside
+    u32       planeCount;
+};
+
+enum FrustumOverlap
+{
+    FrustumOverlap_Outside,
+    FrustumOverlap_Intersects,
+    FrustumOverlap_Inside
+};
+
+struct CullingSet
+{
+    std::vector<f32> centerX;
+    std::vector<f32> centerY;
+    std::vector<f32> centerZ;
+    std::vector<f32> radius;
+    std::vector<u8>  visible; // Result of the last CullBoundingSpheres
+    u32              count;
+};
+
+struct CullingStats
+{
+    u32 tested;
+    u32 visible;
+};
+
+/**
+ * Planes of the frustum of a view projection matrix (Gribb/Hartmann): left, right,
+ * bottom, top, near and far, normalized and pointing inside.
+ */
+void GetFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6]);
+
+Frustum MakeFrustum(const glm::mat4& viewProjection);
+
+/**
+ * Adds a plane that culls what is completely behind it, as the clip plane of the water.
+ */
+void AddFrustumPlane(Frustum& frustum, const glm::vec4& plane);
+
+/**
+ * Whether a box is completely outside, partially inside or completely inside.
+ */
+FrustumOverlap TestFrustumBox(const Frustum& frustum, const glm::vec3& aabbMin, const glm::vec3& aabbMax);
+
+void ClearCullingSet(CullingSet& set);
+
+/**
+ * Adds a sphere and returns its index in the set (and in CullingSet::visible).
+ */
+u32 AddBoundingSphere(CullingSet& set, const glm::vec3& center, f32 radius);
+
+/**
+ * Sets CullingSet::visible of every sphere that is at least partially inside the
+ * frustum. Returns how many are.
+ */
+u32 CullBoundingSpheres(CullingSet& set, const Frustum& frustum);
@@ -0,0 +1,197 @@
+//
+// geometry_storage.cpp: Vertex pools, shared index buffer and draw indices.
+//
+
+#include "geometry_storage.h"
+#include "buffer_management.h"
+#include "engine.h"
+#include "gl_state.h"
+#include "hashing.h"
+
+#include <vector>
+
+#define GEOMETRY_STORAGE_MIN_SIZE MB(1)
+#define DRAW_INDEX_MIN_COUNT      4096
+#define DRAW_INDEX_BINDING        1
+
+/**
+ * Reallocates a buffer with room for at least requiredSize bytes, keeping the first
+ * usedSize bytes. Buffers are bound to their own target (never GL_ELEMENT_ARRAY_BUFFER,
+ * which would change the bound VAO).
+ */
+static void GrowBuffer(Buffer& buffer, GLenum type, u32 usedSize, u32 requiredSize)
+{
+    if (buffer.handle && buffer.size >= requiredSize)
+        return;
+
+    const u32 newSize = glm::max(glm::max(buffer.size * 2, requiredSize), (u32)GEOMETRY_STORAGE_MIN_SIZE);
+    Buffer newBuffer = CreateBuffer(newSize, type, GL_STATIC_DRAW);
+
+    if (buffer.handle)
+    {
+        if (usedSize > 0)
+        {
+            glBindBuffer(GL_COPY_READ_BUFFER, buffer.handle);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer.handle);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, usedSize);
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        }
+        glDeleteBuffers(1, &buffer.handle);
+    }
+    buffer = newBuffer;
+}
+
+// The buffers are attached to the VAO, so they are attached again when one is reallocated
+static void AttachBuffers(App* app, const VertexPool& pool)
+{
+    BindVertexArray(pool.vao);
+    glBindVertexBuffer(0, pool.vertexBuffer.handle, 0, pool.layout.stride);
+    glBindVertexBuffer(DRAW_INDEX_BINDING, app->drawIndexBuffer.handle, 0, sizeof(u32));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->indexStorage.handle);
+    BindVertexArray(0);
+}
+
+void ReserveDrawIndices(App* app, u32 drawCount)
+{
+    const u32 currentCount = app->drawIndexBuffer.size / sizeof(u32);
+    if (app->drawIndexBuffer.handle && currentCount >= drawCount)
+        return;
+
+    const u32 newCount = glm::max(glm::max(currentCount * 2, drawCount), (u32)DRAW_INDEX_MIN_COUNT);
+    std::vector<u32> drawIndices(newCount);
+    for (u32 i = 0; i < newCount; ++i)
+        drawIndices[i] = i;
+
+    if (app->drawIndexBuffer.handle)
+        glDeleteBuffers(1, &app->drawIndexBuffer.handle);
+    app->drawIndexBuffer = CreateBuffer(newCount * sizeof(u32), GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, app->drawIndexBuffer.handle);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, newCount * sizeof(u32), drawIndices.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    for (const VertexPool& pool : app->vertexPools)
+        AttachBuffers(app, pool);
+}
+
+u32 GetVertexPool(App* app, const VertexBufferLayout& layout)
+{
+    u64 formatHash = HashValue(layout.stride);
+    for (const VertexBufferAttribute& attribute : layout.attributes)
+        formatHash = HashCombine(formatHash, HashValue(attribute));
+
+    auto it = app->vertexPoolIndices.find(formatHash);
+    if (it != app->vertexPoolIndices.end())
+        return it->second;
+
+    if (!app->drawIndexBuffer.handle)
+        ReserveDrawIndices(app, DRAW_INDEX_MIN_COUNT);
+
+    VertexPool pool = {};
+    pool.layout = layout;
+
+    glGenVertexArrays(1, &pool.vao);
+    BindVertexArray(pool.vao);
+
+    for (const VertexBufferAttribute& attribute : layout.attributes)
+    {
+        glVertexAttribFormat(attribute.location, attribute.componentCount, GL_FLOAT, GL_FALSE, attribute.offset);
+        glVertexAttribBinding(attribute.location, 0);
+        glEnableVertexAttribArray(attribute.location);
+    }
+
+    glVertexAttribIFormat(DRAW_INDEX_LOCATION, 1, GL_UNSIGNED_INT, 0);
+    glVertexAttribBinding(DRAW_INDEX_LOCATION, DRAW_INDEX_BINDING);
+    glVertexBindingDivisor(DRAW_INDEX_BINDING, 1);
+    glEnableVertexAttribArray(DRAW_INDEX_LOCATION);
+
+    BindVertexArray(0);
+
+    GrowBuffer(pool.vertexBuffer, GL_ARRAY_BUFFER, 0, GEOMETRY_STORAGE_MIN_SIZE);
+    GrowBuffer(app->indexStorage, GL_COPY_WRITE_BUFFER, app->indexCount * sizeof(u32), GEOMETRY_STORAGE_MIN_SIZE);
+    AttachBuffers(app, pool);
+
+    const u32 poolIdx = (u32)app->vertexPools.size();
+    app->vertexPools.push_back(pool);
+    app->vertexPoolIndices[formatHash] = poolIdx;
+    return poolIdx;
+}
+
+// Bounds of the positions (attribute at location 0) of the submesh: the AABB and a
+// sphere centered in it that contains all the vertices
+static void ComputeSubmeshBounds(Submesh& submesh)
+{
+    submesh.aabbMin = vec3(0.0f);
+    submesh.aabbMax = vec3(0.0f);
+    submesh.sphereCenter = vec3(0.0f);
+    submesh.sphereRadius = 0.0f;
+
+    const VertexBufferLayout& layout = submesh.vertexBufferLayout;
+    for (const VertexBufferAttribute& attribute : layout.attributes)
+    {
+        if (attribute.location != 0 || attribute.componentCount != 3)
+            continue;
+
+        const u32 floatStride = layout.stride / sizeof(float);
+        const u32 vertexCount = (u32)submesh.vertices.size() / floatStride;
+        const float* positions = submesh.vertices.data() + attribute.offset / sizeof(float);
+
+        for (u32 i = 0; i < vertexCount; ++i)
+        {
+            const vec3 position = glm::make_vec3(positions + i * floatStride);
+            submesh.aabbMin = (i == 0) ? position : glm::min(submesh.aabbMin, position);
+            submesh.aabbMax = (i == 0) ? position : glm::max(submesh.aabbMax, position);
+        }
+
+        submesh.sphereCenter = (submesh.aabbMin + submesh.aabbMax) * 0.5f;
+        f32 radiusSquared = 0.0f;
+        for (u32 i = 0; i < vertexCount; ++i)
+        {
+            const vec3 offset = glm::make_vec3(positions + i * floatStride) - submesh.sphereCenter;
+            radiusSquared = glm::max(radiusSquared, glm::dot(offset, offset));
+        }
+        submesh.sphereRadius = sqrtf(radiusSquared);
+    }
+}
+
+void AddSubmeshGeometry(App* app, Submesh& submesh)
+{
+    ComputeSubmeshBounds(submesh);
+
+    submesh.vertexPoolIdx = GetVertexPool(app, submesh.vertexBufferLayout);
+    VertexPool& pool = app->vertexPools[submesh.vertexPoolIdx];
+    submesh.vao = pool.vao;
+
+    const u32 stride = submesh.vertexBufferLayout.stride;
+    const u32 verticesSize = (u32)(submesh.vertices.size() * sizeof(float));
+    const u32 indicesSize = (u32)(submesh.indices.size() * sizeof(u32));
+
+    // Vertices
+    const GLuint vertexBufferHandle = pool.vertexBuffer.handle;
+    GrowBuffer(pool.vertexBuffer, GL_ARRAY_BUFFER, pool.vertexCount * stride, (pool.vertexCount * stride) + verticesSize);
+
+    submesh.baseVertex = pool.vertexCount;
+    glBindBuffer(GL_ARRAY_BUFFER, pool.vertexBuffer.handle);
+    glBufferSubData(GL_ARRAY_BUFFER, submesh.baseVertex * stride, verticesSize, submesh.vertices.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    pool.vertexCount += verticesSize / stride;
+
+    if (pool.vertexBuffer.handle != vertexBufferHandle)
+        AttachBuffers(app, pool);
+
+    // Indices, relative to the first vertex of the submesh
+    const GLuint indexStorageHandle = app->indexStorage.handle;
+    GrowBuffer(app->indexStorage, GL_COPY_WRITE_BUFFER, app->indexCount * sizeof(u32), (app->indexCount * sizeof(u32)) + indicesSize);
+
+    submesh.firstIndex = app->indexCount;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, app->indexStorage.handle);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, submesh.firstIndex * sizeof(u32), indicesSize, submesh.indices.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    app->indexCount += (u32)submesh.indices.size();
+
+    if (app->indexStorage.handle != indexStorageHandle)
+    {
+        for (const VertexPool& vertexPool : app->vertexPools)
+            AttachBuffers(app, vertexPool);
+    }
+}
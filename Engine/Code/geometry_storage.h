@@ -0,0 +1,41 @@
+//
+// geometry_storage.h: Vertex and index storage shared by all the meshes.
+//
+// Submeshes do not have buffers of their own: their vertices are appended to the vertex
+// pool of their vertex format and their indices to a single index buffer. A submesh is
+// drawn binding the VAO of its pool with its baseVertex and firstIndex, so all the
+// submeshes of a format can be drawn by one glMultiDrawElementsIndirect.
+//
+// The VAOs also have an instanced attribute at DRAW_INDEX_LOCATION that reads 0, 1, 2...
+// from App::drawIndexBuffer. With the baseInstance of an indirect command set to the
+// index of the draw, the shaders get the index of the draw they are in (gl_DrawID and
+// gl_BaseInstance need GL 4.6). Instanced draws get baseInstance + gl_InstanceID, an
+// index per instance.
+//
+
+#pragma once
+
+#include "platform.h"
+
+struct App;
+struct Submesh;
+struct VertexBufferLayout;
+
+#define DRAW_INDEX_LOCATION 5
+
+/**
+ * Returns the index in App::vertexPools of the pool of a vertex format, creating it
+ * (and its VAO) the first time.
+ */
+u32 GetVertexPool(App* app, const VertexBufferLayout& layout);
+
+/**
+ * Copies the vertices and indices of the submesh to the shared storage, growing it if
+ * needed, and sets its vertexPoolIdx, vao, baseVertex, firstIndex and bounds.
+ */
+void AddSubmeshGeometry(App* app, Submesh& submesh);
+
+/**
+ * Makes sure there are draw indices for drawCount draws (or instances) of a single multi-draw.
+ */
+void ReserveDrawIndices(App* app, u32 drawCount);
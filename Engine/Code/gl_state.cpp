@@ -0,0 +1,359 @@
+//
+// gl_state.cpp: Cached OpenGL state and the checks of the validation mode.
+//
+
+#include "gl_state.h"
+
+#include <algorithm>
+#include <map>
+#include <string.h>
+#include <vector>
+
+#define GL_STATE_UNKNOWN       0xFFFFFFFF
+#define GL_STATE_TEXTURE_UNITS 16
+#define GL_STATE_UBO_BINDINGS  16
+
+static const GLenum CachedCapabilities[] = { GL_BLEND, GL_DEPTH_TEST, GL_CULL_FACE, GL_STENCIL_TEST, GL_SCISSOR_TEST, GL_CLIP_DISTANCE0 };
+
+struct UniformBufferRange
+{
+    GLuint buffer = GL_STATE_UNKNOWN;
+    u32    offset = 0;
+    u32    size = 0;
+};
+
+// Every value starts unknown, so the first call of each kind is issued
+struct GLStateCache
+{
+    GLuint program = GL_STATE_UNKNOWN;
+    GLuint vao = GL_STATE_UNKNOWN;
+    GLuint drawFramebuffer = GL_STATE_UNKNOWN;
+    GLuint readFramebuffer = GL_STATE_UNKNOWN;
+    std::map<GLuint, std::vector<GLenum>> drawBuffers; // By framebuffer
+
+    u32    activeTextureUnit = GL_STATE_UNKNOWN;
+    GLuint textures[GL_STATE_TEXTURE_UNITS];
+    UniformBufferRange uniformBuffers[GL_STATE_UBO_BINDINGS];
+
+    i8     capabilities[ARRAY_COUNT(CachedCapabilities)]; // -1 unknown
+    GLenum blendSourceFactor = GL_STATE_UNKNOWN;
+    GLenum blendDestinationFactor = GL_STATE_UNKNOWN;
+    GLenum depthFunc = GL_STATE_UNKNOWN;
+    i8     depthMask = -1;
+
+    bool   viewportKnown = false;
+    i32    viewport[4];
+    bool   clearColorKnown = false;
+    f32    clearColor[4];
+
+    GLStateCache()
+    {
+        for (u32 i = 0; i < GL_STATE_TEXTURE_UNITS; ++i)
+            textures[i] = GL_STATE_UNKNOWN;
+        for (u32 i = 0; i < ARRAY_COUNT(CachedCapabilities); ++i)
+            capabilities[i] = -1;
+    }
+};
+
+struct GLState
+{
+    GLStateCache cache;
+    GLStateStats stats = {};
+#ifdef _DEBUG
+    bool validation = true;
+#else
+    bool validation = false;
+#endif
+};
+
+static GLState GlobalGLState;
+
+static GLint GetInteger(GLenum name)
+{
+    GLint value = 0;
+    glGetIntegerv(name, &value);
+    return value;
+}
+
+static GLint GetIndexedInteger(GLenum name, GLuint index)
+{
+    GLint value = 0;
+    glGetIntegeri_v(name, index, &value);
+    return value;
+}
+
+/**
+ * Decides if a call can be skipped because the cache says it would not change the state.
+ * In validation mode matchesRealState is called to confirm it; if the real state is
+ * different the call is issued.
+ */
+template <typename MatchesRealState>
+static bool Elide(bool cacheMatches, const char* stateName, MatchesRealState matchesRealState)
+{
+    GLStateStats& stats = GlobalGLState.stats;
+    if (!cacheMatches)
+    {
+        stats.issued++;
+        return false;
+    }
+
+    if (GlobalGLState.validation && !matchesRealState())
+    {
+        ELOG("GL state cache: cached %s does not match the OpenGL state", stateName);
+        stats.validationErrors++;
+        stats.issued++;
+        return false;
+    }
+
+    stats.elided++;
+    return true;
+}
+
+void ResetGLStateCache()
+{
+    GlobalGLState.cache = GLStateCache();
+}
+
+void SetGLStateValidation(bool enabled)
+{
+    GlobalGLState.validation = enabled;
+}
+
+bool IsGLStateValidationEnabled()
+{
+    return GlobalGLState.validation;
+}
+
+const GLStateStats& GetGLStateStats()
+{
+    return GlobalGLState.stats;
+}
+
+void ResetGLStateStats()
+{
+    GlobalGLState.stats = {};
+}
+
+void UseProgram(GLuint program)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+    if (Elide(cache.program == program, "program", [&] { return GetInteger(GL_CURRENT_PROGRAM) == (GLint)program; }))
+        return;
+
+    cache.program = program;
+    glUseProgram(program);
+}
+
+void BindVertexArray(GLuint vao)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+    if (Elide(cache.vao == vao, "vertex array", [&] { return GetInteger(GL_VERTEX_ARRAY_BINDING) == (GLint)vao; }))
+        return;
+
+    cache.vao = vao;
+    glBindVertexArray(vao);
+}
+
+void BindFramebuffer(GLenum target, GLuint framebuffer)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+    const bool bindsDraw = (target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER);
+    const bool bindsRead = (target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER);
+
+    const bool cacheMatches = (!bindsDraw || cache.drawFramebuffer == framebuffer) && (!bindsRead || cache.readFramebuffer == framebuffer);
+    if (Elide(cacheMatches, "framebuffer", [&] {
+            return (!bindsDraw || GetInteger(GL_DRAW_FRAMEBUFFER_BINDING) == (GLint)framebuffer) &&
+                   (!bindsRead || GetInteger(GL_READ_FRAMEBUFFER_BINDING) == (GLint)framebuffer);
+        }))
+        return;
+
+    if (bindsDraw)
+        cache.drawFramebuffer = framebuffer;
+    if (bindsRead)
+        cache.readFramebuffer = framebuffer;
+    glBindFramebuffer(target, framebuffer);
+}
+
+void SetDrawBuffers(u32 count, const GLenum* buffers)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+
+    // Draw buffers belong to the framebuffer, nothing is known if it is not
+    std::vector<GLenum>* cachedBuffers = NULL;
+    if (cache.drawFramebuffer != GL_STATE_UNKNOWN)
+        cachedBuffers = &cache.drawBuffers[cache.drawFramebuffer];
+
+    const bool cacheMatches = cachedBuffers && cachedBuffers->size() == count && std::equal(buffers, buffers + count, cachedBuffers->begin());
+    if (Elide(cacheMatches, "draw buffers", [&] {
+            for (u32 i = 0; i < count; ++i)
+                if (GetInteger(GL_DRAW_BUFFER0 + i) != (GLint)buffers[i])
+                    return false;
+            return true;
+        }))
+        return;
+
+    if (cachedBuffers)
+        cachedBuffers->assign(buffers, buffers + count);
+    glDrawBuffers(count, buffers);
+}
+
+void SetDrawBuffer(GLenum buffer)
+{
+    SetDrawBuffers(1, &buffer);
+}
+
+static void SetActiveTextureUnit(u32 unit)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+    if (Elide(cache.activeTextureUnit == unit, "active texture", [&] { return GetInteger(GL_ACTIVE_TEXTURE) == (GLint)(GL_TEXTURE0 + unit); }))
+        return;
+
+    cache.activeTextureUnit = unit;
+    glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+void BindTexture(u32 unit, GLuint texture)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+    if (unit >= GL_STATE_TEXTURE_UNITS)
+    {
+        SetActiveTextureUnit(unit);
+        GlobalGLState.stats.issued++;
+        glBindTexture(GL_TEXTURE_2D, texture);
+        return;
+    }
+
+    if (Elide(cache.textures[unit] == texture, "texture", [&] {
+            // Query the unit without changing the active one
+            GLint activeTexture = GetInteger(GL_ACTIVE_TEXTURE);
+            glActiveTexture(GL_TEXTURE0 + unit);
+            GLint boundTexture = GetInteger(GL_TEXTURE_BINDING_2D);
+            glActiveTexture(activeTexture);
+            return boundTexture == (GLint)texture;
+        }))
+        return;
+
+    SetActiveTextureUnit(unit);
+    cache.textures[unit] = texture;
+    glBindTexture(GL_TEXTURE_2D, texture);
+}
+
+void BindUniformBufferRange(u32 binding, GLuint buffer, u32 offset, u32 size)
+{
+    if (binding >= GL_STATE_UBO_BINDINGS)
+    {
+        GlobalGLState.stats.issued++;
+        glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, offset, size);
+        return;
+    }
+
+    UniformBufferRange& range = GlobalGLState.cache.uniformBuffers[binding];
+    const bool cacheMatches = range.buffer == buffer && range.offset == offset && range.size == size;
+    if (Elide(cacheMatches, "uniform buffer range", [&] {
+            return GetIndexedInteger(GL_UNIFORM_BUFFER_BINDING, binding) == (GLint)buffer &&
+                   GetIndexedInteger(GL_UNIFORM_BUFFER_START, binding) == (GLint)offset &&
+                   GetIndexedInteger(GL_UNIFORM_BUFFER_SIZE, binding) == (GLint)size;
+        }))
+        return;
+
+    range.buffer = buffer;
+    range.offset = offset;
+    range.size = size;
+    glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, offset, size);
+}
+
+void SetCapability(GLenum capability, bool enabled)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+
+    i8* cachedValue = NULL;
+    for (u32 i = 0; i < ARRAY_COUNT(CachedCapabilities); ++i)
+        if (CachedCapabilities[i] == capability)
+            cachedValue = &cache.capabilities[i];
+
+    const bool cacheMatches = cachedValue && *cachedValue == (i8)enabled;
+    if (Elide(cacheMatches, "capability", [&] { return (glIsEnabled(capability) == GL_TRUE) == enabled; }))
+        return;
+
+    if (cachedValue)
+        *cachedValue = (i8)enabled;
+    if (enabled)
+        glEnable(capability);
+    else
+        glDisable(capability);
+}
+
+void SetBlendFunc(GLenum sourceFactor, GLenum destinationFactor)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+    const bool cacheMatches = cache.blendSourceFactor == sourceFactor && cache.blendDestinationFactor == destinationFactor;
+    if (Elide(cacheMatches, "blend function", [&] {
+            return GetInteger(GL_BLEND_SRC_RGB) == (GLint)sourceFactor && GetInteger(GL_BLEND_SRC_ALPHA) == (GLint)sourceFactor &&
+                   GetInteger(GL_BLEND_DST_RGB) == (GLint)destinationFactor && GetInteger(GL_BLEND_DST_ALPHA) == (GLint)destinationFactor;
+        }))
+        return;
+
+    cache.blendSourceFactor = sourceFactor;
+    cache.blendDestinationFactor = destinationFactor;
+    glBlendFunc(sourceFactor, destinationFactor);
+}
+
+void SetDepthFunc(GLenum func)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+    if (Elide(cache.depthFunc == func, "depth function", [&] { return GetInteger(GL_DEPTH_FUNC) == (GLint)func; }))
+        return;
+
+    cache.depthFunc = func;
+    glDepthFunc(func);
+}
+
+void SetDepthMask(bool enabled)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+    if (Elide(cache.depthMask == (i8)enabled, "depth mask", [&] {
+            GLboolean writeMask = GL_FALSE;
+            glGetBooleanv(GL_DEPTH_WRITEMASK, &writeMask);
+            return (writeMask == GL_TRUE) == enabled;
+        }))
+        return;
+
+    cache.depthMask = (i8)enabled;
+    glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+}
+
+void SetViewport(i32 x, i32 y, i32 width, i32 height)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+    const i32 viewport[4] = { x, y, width, height };
+
+    const bool cacheMatches = cache.viewportKnown && memcmp(cache.viewport, viewport, sizeof(viewport)) == 0;
+    if (Elide(cacheMatches, "viewport", [&] {
+            GLint realViewport[4];
+            glGetIntegerv(GL_VIEWPORT, realViewport);
+            return memcmp(realViewport, viewport, sizeof(viewport)) == 0;
+        }))
+        return;
+
+    cache.viewportKnown = true;
+    memcpy(cache.viewport, viewport, sizeof(viewport));
+    glViewport(x, y, width, height);
+}
+
+void SetClearColor(f32 r, f32 g, f32 b, f32 a)
+{
+    GLStateCache& cache = GlobalGLState.cache;
+    const f32 color[4] = { r, g, b, a };
+
+    const bool cacheMatches = cache.clearColorKnown && memcmp(cache.clearColor, color, sizeof(color)) == 0;
+    if (Elide(cacheMatches, "clear color", [&] {
+            GLfloat realColor[4];
+            glGetFloatv(GL_COLOR_CLEAR_VALUE, realColor);
+            return memcmp(realColor, color, sizeof(color)) == 0;
+        }))
+        return;
+
+    cache.clearColorKnown = true;
+    memcpy(cache.clearColor, color, sizeof(color));
+    glClearColor(r, g, b, a);
+}
@@ -0,0 +1,69 @@
+//
+// gl_state.h: Shadow copy of the OpenGL state set while rendering, so the calls that
+// would not change it (binding what is already bound, enabling what is already enabled)
+// are not sent to the driver.
+//
+// Only the state set through these functions is known. Anything changed with direct gl*
+// calls (resource creation, ImGui...) must be followed by ResetGLStateCache, which
+// Render does at the start of every frame.
+//
+// With validation enabled, every elided call first checks with glGet* that the real
+// state is the cached one, logs the mismatches and issues the call anyway.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+struct GLStateStats
+{
+    u32 issued;
+    u32 elided;
+    u32 validationErrors;
+};
+
+/**
+ * Forgets all the cached state, the next call of every kind is issued.
+ */
+void ResetGLStateCache();
+
+void SetGLStateValidation(bool enabled);
+bool IsGLStateValidationEnabled();
+
+const GLStateStats& GetGLStateStats();
+void ResetGLStateStats();
+
+void UseProgram(GLuint program);
+void BindVertexArray(GLuint vao);
+
+/**
+ * target is GL_FRAMEBUFFER (both), GL_DRAW_FRAMEBUFFER or GL_READ_FRAMEBUFFER.
+ */
+void BindFramebuffer(GLenum target, GLuint framebuffer);
+
+/**
+ * Draw buffers of the framebuffer bound to GL_DRAW_FRAMEBUFFER (they are kept per
+ * framebuffer, as in GL).
+ */
+void SetDrawBuffers(u32 count, const GLenum* buffers);
+void SetDrawBuffer(GLenum buffer);
+
+/**
+ * Binds a GL_TEXTURE_2D to a texture unit, changing the active unit only if needed.
+ */
+void BindTexture(u32 unit, GLuint texture);
+
+void BindUniformBufferRange(u32 binding, GLuint buffer, u32 offset, u32 size);
+
+/**
+ * glEnable/glDisable. GL_BLEND, GL_DEPTH_TEST, GL_CULL_FACE, GL_STENCIL_TEST,
+ * GL_SCISSOR_TEST and GL_CLIP_DISTANCE0 are cached, other capabilities are always issued.
+ */
+void SetCapability(GLenum capability, bool enabled);
+
+void SetBlendFunc(GLenum sourceFactor, GLenum destinationFactor);
+void SetDepthFunc(GLenum func);
+void SetDepthMask(bool enabled);
+void SetViewport(i32 x, i32 y, i32 width, i32 height);
+void SetClearColor(f32 r, f32 g, f32 b, f32 a);
@@ -0,0 +1,129 @@
+//
+// gpu_culling.cpp: Compute shader frustum culling of the indirect draws.
+//
+
+#include "gpu_culling.h"
+#include "buffer_management.h"
+#include "engine.h"
+#include "gl_state.h"
+#include "render_view.h"
+
+// Uniform locations of the FRUSTUM_CULLING program (explicit in the shader)
+#define CULLING_PLANES_LOCATION      0
+#define CULLING_CLIP_PLANE_LOCATION  6
+#define CULLING_DRAW_COUNT_LOCATION  7
+
+// Storage buffer bindings of the FRUSTUM_CULLING program, the transforms are at 2
+#define CULLING_INPUT_BINDING        3
+#define CULLING_BOUNDS_BINDING       4
+#define CULLING_OUTPUT_BINDING       5
+#define CULLING_BATCHES_BINDING      6
+
+// std430 element of the BatchBuffer, visibleCount is incremented by the shader
+struct CullingBatch
+{
+    u32 firstCommand;
+    u32 visibleCount;
+};
+
+GLuint CullDrawsOnGpu(App* app, RenderPass pass, const RenderView& view, const RenderQueue& queue)
+{
+    GpuCullingView& cullingView = app->gpuCulling[pass];
+    const u32 commandCount = (u32)queue.commands.size();
+    const u32 batchCount = (u32)queue.batches.size();
+
+    std::vector<CullingBatch> batches(batchCount);
+    for (u32 i = 0; i < batchCount; ++i)
+        batches[i] = { queue.batches[i].firstCommand, 0 };
+
+    UploadBufferData(app->indirectBuffer, GL_SHADER_STORAGE_BUFFER, queue.commands.data(), commandCount * sizeof(DrawElementsIndirectCommand));
+    UploadBufferData(app->drawBoundsBuffer, GL_SHADER_STORAGE_BUFFER, queue.drawBounds.data(), commandCount * sizeof(DrawBounds));
+    UploadBufferData(cullingView.batches, GL_SHADER_STORAGE_BUFFER, batches.data(), batchCount * sizeof(CullingBatch));
+
+    // Commands not written by the shader must stay empty
+    const u32 outputSize = commandCount * sizeof(DrawElementsIndirectCommand);
+    if (cullingView.outputCommands.size < outputSize)
+    {
+        if (cullingView.outputCommands.handle)
+            glDeleteBuffers(1, &cullingView.outputCommands.handle);
+        cullingView.outputCommands = CreateBuffer(glm::max(outputSize, cullingView.outputCommands.size * 2), GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cullingView.outputCommands.handle);
+    glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, outputSize, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    cullingView.commandCount = commandCount;
+    cullingView.batchCount = batchCount;
+
+    // The first 6 planes of the view frustum are the ones of the projection, the clip
+    // plane is (0, 0, 0, 1) when there is no clipping
+    UseProgram(app->programs[app->frustumCullingProgramIdx].handle);
+    glUniform4fv(CULLING_PLANES_LOCATION, 6, glm::value_ptr(view.frustum.planes[0]));
+    glUniform4fv(CULLING_CLIP_PLANE_LOCATION, 1, glm::value_ptr(view.clipPlane));
+    glUniform1ui(CULLING_DRAW_COUNT_LOCATION, commandCount);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, app->transformBuffer.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULLING_INPUT_BINDING, app->indirectBuffer.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULLING_BOUNDS_BINDING, app->drawBoundsBuffer.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULLING_OUTPUT_BINDING, cullingView.outputCommands.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULLING_BATCHES_BINDING, cullingView.batches.handle);
+
+    glDispatchCompute((commandCount + CULLING_GROUP_SIZE - 1) / CULLING_GROUP_SIZE, 1, 1);
+
+    // The output is read as indirect commands by the draws that follow, the counters are
+    // copied to the readback buffer
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    // A readback not read yet is replaced by the newer counters
+    CullingReadback& readback = cullingView.readbacks[cullingView.nextReadback];
+    cullingView.nextReadback = (cullingView.nextReadback + 1) % RING_BUFFER_REGIONS;
+    if (readback.fence)
+        glDeleteSync(readback.fence);
+
+    const u32 batchesSize = batchCount * sizeof(CullingBatch);
+    if (readback.buffer.size < batchesSize)
+    {
+        if (readback.buffer.handle)
+            glDeleteBuffers(1, &readback.buffer.handle);
+        readback.buffer = CreateBuffer(glm::max(batchesSize, readback.buffer.size * 2), GL_COPY_WRITE_BUFFER, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, cullingView.batches.handle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, readback.buffer.handle);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, batchesSize);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.batchCount = batchCount;
+
+    return cullingView.outputCommands.handle;
+}
+
+u32 GetVisibleDrawCount(App* app, RenderPass pass)
+{
+    GpuCullingView& cullingView = app->gpuCulling[pass];
+
+    // From the oldest readback, the first one not finished means the newer ones are not
+    // either
+    for (u32 i = 0; i < RING_BUFFER_REGIONS; ++i)
+    {
+        CullingReadback& readback = cullingView.readbacks[(cullingView.nextReadback + i) % RING_BUFFER_REGIONS];
+        if (!readback.fence)
+            continue;
+
+        const GLenum status = glClientWaitSync(readback.fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+        glDeleteSync(readback.fence);
+        readback.fence = NULL;
+
+        std::vector<CullingBatch> batches(readback.batchCount);
+        glBindBuffer(GL_COPY_READ_BUFFER, readback.buffer.handle);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, batches.size() * sizeof(CullingBatch), batches.data());
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+        cullingView.visibleCount = 0;
+        for (const CullingBatch& batch : batches)
+            cullingView.visibleCount += batch.visibleCount;
+    }
+    return cullingView.visibleCount;
+}
@@ -0,0 +1,38 @@
+//
+// gpu_culling.h: Frustum culling of the draws of a multi-draw in a compute shader.
+//
+// Each thread of the FRUSTUM_CULLING program tests the world AABB of one draw against
+// the planes of the view frustum and, in the water passes, the clip plane. The visible
+// draws are appended with an atomic counter to the range of their batch in the output
+// command buffer of the view, which is cleared beforehand, so the commands left at the
+// end of each range have no instances and draw nothing.
+//
+// Every view (pass) has its own output, so the reflection, refraction and base passes
+// of the water do not wait for each other. GL 4.3 has no glMultiDrawElementsIndirectCount,
+// the draw count of a batch is still the one of the CPU.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "render_queue.h"
+#include <glad/glad.h>
+
+struct App;
+struct RenderView;
+
+#define CULLING_GROUP_SIZE 64
+
+/**
+ * Culls the commands of a pass against the view and returns the buffer with the visible
+ * ones, with the same layout as the input: the batches start at the same command.
+ */
+GLuint CullDrawsOnGpu(App* app, RenderPass pass, const RenderView& view, const RenderQueue& queue);
+
+/**
+ * Visible draws of the latest culling of a pass that the GPU has finished. Each dispatch
+ * copies its counters to one of RING_BUFFER_REGIONS readback buffers with a fence, and
+ * only the ones whose fence has signaled are read, so it never waits for the GPU. Until
+ * then it returns the last count read.
+ */
+u32 GetVisibleDrawCount(App* app, RenderPass pass);
@@ -0,0 +1,67 @@
+//
+// gpu_timer.cpp: Non blocking GL_TIMESTAMP queries.
+//
+
+#include "gpu_timer.h"
+
+// Weight of a new result in the moving average
+#define GPU_TIMER_AVERAGE_WEIGHT 0.1f
+
+void CreateGpuTimer(GpuTimer& timer)
+{
+    timer = {};
+    glGenQueries(GPU_TIMER_QUERIES * 2, &timer.queries[0][0]);
+}
+
+void DestroyGpuTimer(GpuTimer& timer)
+{
+    glDeleteQueries(GPU_TIMER_QUERIES * 2, &timer.queries[0][0]);
+    timer = {};
+}
+
+// Reads the results of the oldest queries, in order, until one is not available
+static void ReadGpuTimer(GpuTimer& timer)
+{
+    while (timer.pending > 0)
+    {
+        const GLuint* pair = timer.queries[(timer.next + GPU_TIMER_QUERIES - timer.pending) % GPU_TIMER_QUERIES];
+
+        // The end timestamp is written after the begin one
+        GLuint available = 0;
+        glGetQueryObjectuiv(pair[1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(pair[0], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(pair[1], GL_QUERY_RESULT, &end);
+        timer.pending--;
+
+        timer.lastMs = (end - begin) / 1000000.0f;
+        timer.averageMs = timer.samples == 0 ? timer.lastMs : glm::mix(timer.averageMs, timer.lastMs, GPU_TIMER_AVERAGE_WEIGHT);
+        timer.samples++;
+    }
+}
+
+void BeginGpuTimer(GpuTimer& timer)
+{
+    ASSERT(!timer.measuring, "The timer is already measuring");
+
+    ReadGpuTimer(timer);
+    if (timer.pending == GPU_TIMER_QUERIES)
+        return;
+
+    glQueryCounter(timer.queries[timer.next][0], GL_TIMESTAMP);
+    timer.measuring = true;
+}
+
+void EndGpuTimer(GpuTimer& timer)
+{
+    if (!timer.measuring)
+        return;
+
+    glQueryCounter(timer.queries[timer.next][1], GL_TIMESTAMP);
+    timer.measuring = false;
+    timer.next = (timer.next + 1) % GPU_TIMER_QUERIES;
+    timer.pending++;
+}
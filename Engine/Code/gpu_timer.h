@@ -0,0 +1,40 @@
+//
+// gpu_timer.h: GPU time of a part of the frame, measured with a pair of GL_TIMESTAMP
+// queries.
+//
+// A timer has a few queries in flight and reads them only once the GPU has finished
+// them, so measuring never waits for the GPU. The result is a frame or two late.
+// Timestamps do not bind a query target, so timers can nest (the whole frame around
+// the lighting passes), which GL_TIME_ELAPSED queries cannot.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+#define GPU_TIMER_QUERIES 4
+
+struct GpuTimer
+{
+    GLuint queries[GPU_TIMER_QUERIES][2]; // Begin and end timestamps
+    u32    next;        // Next query to begin
+    u32    pending;     // Queries ended and not read yet
+    bool   measuring;   // Between Begin and End, if a query was free
+
+    f32    lastMs;      // Last result read
+    f32    averageMs;   // Moving average of the results
+    u32    samples;
+};
+
+void CreateGpuTimer(GpuTimer& timer);
+
+void DestroyGpuTimer(GpuTimer& timer);
+
+/**
+ * Reads the finished queries and starts measuring, unless all the queries are still in
+ * flight, then this frame is not measured.
+ */
+void BeginGpuTimer(GpuTimer& timer);
+
+void EndGpuTimer(GpuTimer& timer);
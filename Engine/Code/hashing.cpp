@@ -0,0 +1,116 @@
+#include "hashing.h"
+
+#include <string.h>
+
+static const u64 Prime64_1 = 0x9E3779B185EBCA87ULL;
+static const u64 Prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const u64 Prime64_3 = 0x165667B19E3779F9ULL;
+static const u64 Prime64_4 = 0x85EBCA77C2B2AE63ULL;
+static const u64 Prime64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline u64 RotateLeft(u64 value, u32 amount)
+{
+    return (value << amount) | (value >> (64 - amount));
+}
+
+static inline u64 Read64(const u8* ptr)
+{
+    u64 value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline u32 Read32(const u8* ptr)
+{
+    u32 value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline u64 Round(u64 acc, u64 input)
+{
+    acc += input * Prime64_2;
+    acc  = RotateLeft(acc, 31);
+    acc *= Prime64_1;
+    return acc;
+}
+
+static inline u64 MergeRound(u64 acc, u64 value)
+{
+    acc ^= Round(0, value);
+    acc  = acc * Prime64_1 + Prime64_4;
+    return acc;
+}
+
+static inline u64 Avalanche(u64 hash)
+{
+    hash ^= hash >> 33;
+    hash *= Prime64_2;
+    hash ^= hash >> 29;
+    hash *= Prime64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+u64 HashBytes(const void* data, u64 size, u64 seed)
+{
+    const u8* ptr = (const u8*)data;
+    const u8* end = ptr + size;
+    u64 hash;
+
+    if (size >= 32)
+    {
+        const u8* limit = end - 32;
+        u64 v1 = seed + Prime64_1 + Prime64_2;
+        u64 v2 = seed + Prime64_2;
+        u64 v3 = seed;
+        u64 v4 = seed - Prime64_1;
+
+        do {
+            v1 = Round(v1, Read64(ptr)); ptr += 8;
+            v2 = Round(v2, Read64(ptr)); ptr += 8;
+            v3 = Round(v3, Read64(ptr)); ptr += 8;
+            v4 = Round(v4, Read64(ptr)); ptr += 8;
+        } while (ptr <= limit);
+
+        hash = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+        hash = MergeRound(hash, v1);
+        hash = MergeRound(hash, v2);
+        hash = MergeRound(hash, v3);
+        hash = MergeRound(hash, v4);
+    }
+    else
+    {
+        hash = seed + Prime64_5;
+    }
+
+    hash += size;
+
+    while (ptr + 8 <= end)
+    {
+        hash ^= Round(0, Read64(ptr));
+        hash  = RotateLeft(hash, 27) * Prime64_1 + Prime64_4;
+        ptr  += 8;
+    }
+
+    if (ptr + 4 <= end)
+    {
+        hash ^= (u64)Read32(ptr) * Prime64_1;
+        hash  = RotateLeft(hash, 23) * Prime64_2 + Prime64_3;
+        ptr  += 4;
+    }
+
+    while (ptr < end)
+    {
+        hash ^= (*ptr) * Prime64_5;
+        hash  = RotateLeft(hash, 11) * Prime64_1;
+        ptr++;
+    }
+
+    return Avalanche(hash);
+}
+
+u64 HashCombine(u64 hash, u64 value)
+{
+    return HashBytes(&value, sizeof(value), hash);
+}
@@ -0,0 +1,22 @@
+//
+// hashing.h: Fast non-cryptographic content hashing (XXH64 algorithm) used to
+// identify identical asset blobs (vertex/index data, material parameters, pixels...).
+//
+
+#pragma once
+
+#include "platform.h"
+
+/**
+ * Hashes a block of memory using the XXH64 algorithm. The same bytes and seed always
+ * produce the same value, so it can be used as a content identifier for assets.
+ */
+u64 HashBytes(const void* data, u64 size, u64 seed = 0);
+
+/**
+ * Mixes a new value into an existing hash. Useful to build a hash out of several
+ * independently hashed parts (e.g. all the submeshes of a mesh).
+ */
+u64 HashCombine(u64 hash, u64 value);
+
+#define HashValue(value) HashBytes(&(value), sizeof(value))
@@ -0,0 +1,131 @@
+#include "job_system.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+
+struct JobBatch
+{
+    const std::function<void(u32, u32)>* job;
+    u32                                  begin;
+    u32                                  end;
+    std::atomic<u32>*                    pending;
+};
+
+struct JobSystem
+{
+    std::vector<std::thread> workers;
+    std::deque<JobBatch>     queue;
+    std::mutex               mutex;
+    std::condition_variable  wakeUp;
+    bool                     running = false;
+};
+
+static JobSystem GlobalJobSystem;
+
+static bool PopBatch(JobBatch& batch)
+{
+    std::lock_guard<std::mutex> lock(GlobalJobSystem.mutex);
+    if (GlobalJobSystem.queue.empty())
+        return false;
+    batch = GlobalJobSystem.queue.front();
+    GlobalJobSystem.queue.pop_front();
+    return true;
+}
+
+static void RunBatch(const JobBatch& batch)
+{
+    (*batch.job)(batch.begin, batch.end);
+    batch.pending->fetch_sub(1, std::memory_order_release);
+}
+
+static void WorkerLoop()
+{
+    for (;;)
+    {
+        JobBatch batch;
+        {
+            std::unique_lock<std::mutex> lock(GlobalJobSystem.mutex);
+            GlobalJobSystem.wakeUp.wait(lock, [] { return !GlobalJobSystem.running || !GlobalJobSystem.queue.empty(); });
+            if (!GlobalJobSystem.running && GlobalJobSystem.queue.empty())
+                return;
+            batch = GlobalJobSystem.queue.front();
+            GlobalJobSystem.queue.pop_front();
+        }
+        RunBatch(batch);
+    }
+}
+
+void InitJobSystem(u32 threadCount)
+{
+    ASSERT(!GlobalJobSystem.running, "The job system is already running");
+
+    if (threadCount == 0)
+    {
+        u32 hardwareThreads = std::thread::hardware_concurrency();
+        threadCount = hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+    }
+
+    GlobalJobSystem.running = true;
+    for (u32 i = 0; i < threadCount; ++i)
+        GlobalJobSystem.workers.push_back(std::thread(WorkerLoop));
+}
+
+void ShutdownJobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(GlobalJobSystem.mutex);
+        GlobalJobSystem.running = false;
+    }
+    GlobalJobSystem.wakeUp.notify_all();
+
+    for (std::thread& worker : GlobalJobSystem.workers)
+        worker.join();
+    GlobalJobSystem.workers.clear();
+}
+
+u32 GetJobThreadCount()
+{
+    return (u32)GlobalJobSystem.workers.size() + 1;
+}
+
+void ParallelFor(u32 count, u32 batchSize, const std::function<void(u32 begin, u32 end)>& job)
+{
+    if (count == 0)
+        return;
+
+    if (batchSize == 0)
+        batchSize = 1;
+
+    // Not worth (or not possible) to go wide
+    if (GlobalJobSystem.workers.empty() || count <= batchSize)
+    {
+        job(0, count);
+        return;
+    }
+
+    const u32 batchCount = (count + batchSize - 1) / batchSize;
+    std::atomic<u32> pending(batchCount);
+
+    {
+        std::lock_guard<std::mutex> lock(GlobalJobSystem.mutex);
+        for (u32 begin = 0; begin < count; begin += batchSize)
+        {
+            u32 end = begin + batchSize < count ? begin + batchSize : count;
+            GlobalJobSystem.queue.push_back(JobBatch{ &job, begin, end, &pending });
+        }
+    }
+    GlobalJobSystem.wakeUp.notify_all();
+
+    // Help with the work (ours or any other queued one) until our batches are finished
+    while (pending.load(std::memory_order_acquire) > 0)
+    {
+        JobBatch batch;
+        if (PopBatch(batch))
+            RunBatch(batch);
+        else
+            std::this_thread::yield();
+    }
+}
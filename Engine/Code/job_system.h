@@ -0,0 +1,28 @@
+//
+// job_system.h: A minimal pool of worker threads to split data-parallel work
+// (decompression, parsing, culling...) across all the available cores.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <functional>
+
+/**
+ * Starts the worker threads. If threadCount is 0, one worker per hardware thread
+ * (minus the calling thread) is created. Until this is called ParallelFor runs serially.
+ */
+void InitJobSystem(u32 threadCount = 0);
+
+void ShutdownJobSystem();
+
+/**
+ * Number of threads that execute jobs, including the calling thread.
+ */
+u32 GetJobThreadCount();
+
+/**
+ * Calls job(begin, end) for consecutive ranges of at most batchSize elements covering
+ * [0, count) and returns when all of them are done. The calling thread also runs jobs.
+ */
+void ParallelFor(u32 count, u32 batchSize, const std::function<void(u32 begin, u32 end)>& job);
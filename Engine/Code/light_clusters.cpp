@@ -0,0 +1,274 @@
+//
+// light_clusters.cpp: Cluster bounds and per frame light binning, with SSE in the job system.
+//
+
+#include "light_clusters.h"
+#include "engine.h"
+#include "job_system.h"
+
+#include <cfloat>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define LIGHT_CLUSTERS_SSE
+#endif
+
+#define CLUSTERS_PER_SLICE (CLUSTER_GRID_X * CLUSTER_GRID_Y)
+
+static_assert(CLUSTERS_PER_SLICE % 4 == 0, "The clusters of a slice are tested in groups of 4");
+
+f32 GetLightRange(const Light& light)
+{
+    // Brightest the light can be at a distance: diffuse, specular and ambient of the color
+    const f32 brightness = 3.0f * light.radius * glm::max(light.color.r, glm::max(light.color.g, light.color.b));
+    if (brightness <= LIGHT_CUTOFF)
+        return 0.0f;
+
+    // brightness / (1 + l * d + q * d^2) = cutoff
+    const f32 l = LIGHT_ATTENUATION_LINEAR;
+    const f32 q = LIGHT_ATTENUATION_QUADRATIC;
+    const f32 c = 1.0f - brightness / LIGHT_CUTOFF;
+    return (-l + sqrtf(l * l - 4.0f * q * c)) / (2.0f * q);
+}
+
+static u32 GetSlice(const LightClusters& clusters, f32 depth)
+{
+    if (depth < CLUSTER_FIRST_SLICE_DEPTH)
+        return 0;
+    const i32 slice = (i32)floorf(logf(depth) * clusters.sliceScale + clusters.sliceBias);
+    return (u32)glm::clamp(slice, 0, CLUSTER_GRID_Z - 1);
+}
+
+// Bounds in view space of every cluster, from the rays of the corners of its tile
+static void BuildClusterBounds(LightClusters& clusters, const glm::mat4& projection, const glm::ivec2& displaySize)
+{
+    ASSERT(displaySize.x > 0 && displaySize.y > 0, "The display must not be empty");
+
+    clusters.projection = projection;
+    clusters.displaySize = displaySize;
+    clusters.tileSize.x = (displaySize.x + CLUSTER_GRID_X - 1) / CLUSTER_GRID_X;
+    clusters.tileSize.y = (displaySize.y + CLUSTER_GRID_Y - 1) / CLUSTER_GRID_Y;
+
+    // Planes of a glm::perspective projection
+    const f32 zNear = projection[3][2] / (projection[2][2] - 1.0f);
+    const f32 zFar = projection[3][2] / (projection[2][2] + 1.0f);
+
+    const f32 firstSliceDepth = glm::min(CLUSTER_FIRST_SLICE_DEPTH, zFar);
+    clusters.sliceScale = (CLUSTER_GRID_Z - 1) / logf(zFar / firstSliceDepth);
+    clusters.sliceBias = 1.0f - logf(firstSliceDepth) * clusters.sliceScale;
+
+    f32 sliceDepths[CLUSTER_GRID_Z + 1];
+    sliceDepths[0] = zNear;
+    for (u32 z = 1; z <= CLUSTER_GRID_Z; ++z)
+        sliceDepths[z] = firstSliceDepth * powf(zFar / firstSliceDepth, (f32)(z - 1) / (CLUSTER_GRID_Z - 1));
+
+    clusters.minX.resize(CLUSTER_COUNT);
+    clusters.minY.resize(CLUSTER_COUNT);
+    clusters.minZ.resize(CLUSTER_COUNT);
+    clusters.maxX.resize(CLUSTER_COUNT);
+    clusters.maxY.resize(CLUSTER_COUNT);
+    clusters.maxZ.resize(CLUSTER_COUNT);
+
+    const glm::mat4 inverseProjection = glm::inverse(projection);
+    for (u32 y = 0; y < CLUSTER_GRID_Y; ++y)
+    {
+        for (u32 x = 0; x < CLUSTER_GRID_X; ++x)
+        {
+            // Corners of the tile on the near plane, the last tiles may end past the screen
+            glm::vec2 corners[4];
+            for (u32 i = 0; i < 4; ++i)
+            {
+                const glm::vec2 pixel((x + (i & 1)) * clusters.tileSize.x, (y + (i >> 1)) * clusters.tileSize.y);
+                const glm::vec2 ndc = pixel / glm::vec2(displaySize) * 2.0f - 1.0f;
+                const glm::vec4 corner = inverseProjection * glm::vec4(ndc, -1.0f, 1.0f);
+                corners[i] = glm::vec2(corner) / corner.w / zNear;
+            }
+
+            for (u32 z = 0; z < CLUSTER_GRID_Z; ++z)
+            {
+                glm::vec2 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+                for (u32 i = 0; i < 4; ++i)
+                {
+                    for (u32 d = 0; d < 2; ++d)
+                    {
+                        const glm::vec2 point = corners[i] * sliceDepths[z + d];
+                        boundsMin = glm::min(boundsMin, point);
+                        boundsMax = glm::max(boundsMax, point);
+                    }
+                }
+
+                const u32 cluster = x + y * CLUSTER_GRID_X + z * CLUSTERS_PER_SLICE;
+                clusters.minX[cluster] = boundsMin.x;
+                clusters.minY[cluster] = boundsMin.y;
+                clusters.minZ[cluster] = sliceDepths[z];
+                clusters.maxX[cluster] = boundsMax.x;
+                clusters.maxY[cluster] = boundsMax.y;
+                clusters.maxZ[cluster] = sliceDepths[z + 1];
+            }
+        }
+    }
+}
+
+// Writes the light indices of the clusters of a slice, cluster after cluster
+static void BinSliceLights(LightClusters& clusters, u32 slice, const f32* lightX, const f32* lightY, const f32* lightZ, const f32* lightRangeSquared)
+{
+    const std::vector<u32>& sliceLights = clusters.sliceLights[slice];
+    std::vector<u32>& indices = clusters.sliceIndices[slice];
+    indices.clear();
+
+    const u32 lightCount = (u32)sliceLights.size();
+    std::vector<u8> masks(lightCount);
+
+    for (u32 group = 0; group < CLUSTERS_PER_SLICE; group += 4)
+    {
+        const u32 first = slice * CLUSTERS_PER_SLICE + group;
+
+        // Bit i of the mask of a light is set if it overlaps the cluster first + i
+#ifdef LIGHT_CLUSTERS_SSE
+        const __m128 minX = _mm_loadu_ps(&clusters.minX[first]);
+        const __m128 minY = _mm_loadu_ps(&clusters.minY[first]);
+        const __m128 minZ = _mm_loadu_ps(&clusters.minZ[first]);
+        const __m128 maxX = _mm_loadu_ps(&clusters.maxX[first]);
+        const __m128 maxY = _mm_loadu_ps(&clusters.maxY[first]);
+        const __m128 maxZ = _mm_loadu_ps(&clusters.maxZ[first]);
+        const __m128 zero = _mm_setzero_ps();
+
+        for (u32 i = 0; i < lightCount; ++i)
+        {
+            const u32 light = sliceLights[i];
+            const __m128 x = _mm_set1_ps(lightX[light]);
+            const __m128 y = _mm_set1_ps(lightY[light]);
+            const __m128 z = _mm_set1_ps(lightZ[light]);
+
+            // Distance from the center of the light to the boxes
+            const __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minX, x), _mm_sub_ps(x, maxX)), zero);
+            const __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minY, y), _mm_sub_ps(y, maxY)), zero);
+            const __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minZ, z), _mm_sub_ps(z, maxZ)), zero);
+            __m128 distanceSquared = _mm_mul_ps(dx, dx);
+            distanceSquared = _mm_add_ps(distanceSquared, _mm_mul_ps(dy, dy));
+            distanceSquared = _mm_add_ps(distanceSquared, _mm_mul_ps(dz, dz));
+
+            masks[i] = (u8)_mm_movemask_ps(_mm_cmple_ps(distanceSquared, _mm_set1_ps(lightRangeSquared[light])));
+        }
+#else
+        for (u32 i = 0; i < lightCount; ++i)
+        {
+            const u32 light = sliceLights[i];
+            masks[i] = 0;
+            for (u32 lane = 0; lane < 4; ++lane)
+            {
+                const u32 cluster = first + lane;
+                const f32 dx = glm::max(glm::max(clusters.minX[cluster] - lightX[light], lightX[light] - clusters.maxX[cluster]), 0.0f);
+                const f32 dy = glm::max(glm::max(clusters.minY[cluster] - lightY[light], lightY[light] - clusters.maxY[cluster]), 0.0f);
+                const f32 dz = glm::max(glm::max(clusters.minZ[cluster] - lightZ[light], lightZ[light] - clusters.maxZ[cluster]), 0.0f);
+                if (dx * dx + dy * dy + dz * dz <= lightRangeSquared[light])
+                    masks[i] |= 1 << lane;
+            }
+        }
+#endif
+
+        for (u32 lane = 0; lane < 4; ++lane)
+        {
+            const u32 indexCount = (u32)indices.size();
+            for (u32 i = 0; i < lightCount; ++i)
+            {
+                if (masks[i] & (1 << lane))
+                    indices.push_back(sliceLights[i]);
+            }
+            clusters.clusterLightCounts[first + lane] = (u32)indices.size() - indexCount;
+        }
+    }
+}
+
+void BuildLightClusters(LightClusters& clusters, const std::vector<Light>& lights, const RenderView& view, const glm::ivec2& displaySize)
+{
+    if (clusters.projection != view.projection || clusters.displaySize != displaySize || clusters.minX.empty())
+        BuildClusterBounds(clusters, view.projection, displaySize);
+
+    clusters.stats = {};
+    clusters.lights.clear();
+    clusters.sliceLights.resize(CLUSTER_GRID_Z);
+    clusters.sliceIndices.resize(CLUSTER_GRID_Z);
+    clusters.clusterLightCounts.resize(CLUSTER_COUNT);
+    for (std::vector<u32>& sliceLights : clusters.sliceLights)
+        sliceLights.clear();
+
+    // Directional lights first, they light every fragment
+    for (const Light& light : lights)
+    {
+        if (light.type != LightType_Directional)
+            continue;
+        GpuLight gpuLight = { light.position, light.radius, light.color, (u32)light.type, light.direction, 0.0f };
+        clusters.lights.push_back(gpuLight);
+    }
+    clusters.directionalLightCount = (u32)clusters.lights.size();
+
+    // Point lights in view space (depth positive) and the slices they overlap
+    std::vector<f32> lightX(lights.size()), lightY(lights.size()), lightZ(lights.size()), lightRangeSquared(lights.size());
+    const f32 zNear = clusters.minZ[0];
+    const f32 zFar = clusters.maxZ[CLUSTER_COUNT - 1];
+
+    for (const Light& light : lights)
+    {
+        if (light.type != LightType_Point || light.radius <= 0.0f)
+            continue;
+
+        const f32 range = GetLightRange(light);
+        if (range <= 0.0f)
+            continue;
+
+        bool visible = true;
+        for (u32 p = 0; p < view.frustum.planeCount && visible; ++p)
+            visible = glm::dot(glm::vec3(view.frustum.planes[p]), light.position) + view.frustum.planes[p].w > -range;
+        if (!visible)
+            continue;
+
+        const glm::vec3 position = glm::vec3(view.view * glm::vec4(light.position, 1.0f));
+        const f32 depth = -position.z;
+        if (depth + range < zNear || depth - range > zFar)
+            continue;
+
+        const u32 lightIdx = (u32)clusters.lights.size();
+        GpuLight gpuLight = { light.position, light.radius, light.color, (u32)light.type, light.direction, range };
+        clusters.lights.push_back(gpuLight);
+
+        lightX[lightIdx] = position.x;
+        lightY[lightIdx] = position.y;
+        lightZ[lightIdx] = depth;
+        lightRangeSquared[lightIdx] = range * range;
+
+        const u32 firstSlice = GetSlice(clusters, glm::max(depth - range, zNear));
+        const u32 lastSlice = GetSlice(clusters, glm::min(depth + range, zFar));
+        for (u32 slice = firstSlice; slice <= lastSlice; ++slice)
+            clusters.sliceLights[slice].push_back(lightIdx);
+
+        clusters.stats.pointLights++;
+    }
+
+    ParallelFor(CLUSTER_GRID_Z, 1, [&](u32 begin, u32 end) {
+        for (u32 slice = begin; slice < end; ++slice)
+            BinSliceLights(clusters, slice, lightX.data(), lightY.data(), lightZ.data(), lightRangeSquared.data());
+    });
+
+    // (offset, count) of every cluster and then the indices of all the slices in order
+    clusters.clusterData.resize(2 * CLUSTER_COUNT);
+    u32 offset = 2 * CLUSTER_COUNT;
+    for (u32 slice = 0; slice < CLUSTER_GRID_Z; ++slice)
+    {
+        for (u32 i = 0; i < CLUSTERS_PER_SLICE; ++i)
+        {
+            const u32 cluster = slice * CLUSTERS_PER_SLICE + i;
+            const u32 count = clusters.clusterLightCounts[cluster];
+            clusters.clusterData[2 * cluster + 0] = offset;
+            clusters.clusterData[2 * cluster + 1] = count;
+            offset += count;
+
+            clusters.stats.usedClusters += count > 0;
+            clusters.stats.maxClusterLights = glm::max(clusters.stats.maxClusterLights, count);
+        }
+
+        const std::vector<u32>& indices = clusters.sliceIndices[slice];
+        clusters.clusterData.insert(clusters.clusterData.end(), indices.begin(), indices.end());
+    }
+    clusters.stats.lightIndices = offset - 2 * CLUSTER_COUNT;
+}
@@ -0,0 +1,99 @@
+//
+// light_clusters.h: Clustered shading, the lights of the scene binned per frame in a 3D
+// grid of clusters (froxels) of the view frustum.
+//
+// The grid splits the screen in CLUSTER_GRID_X x CLUSTER_GRID_Y tiles and the depth in
+// CLUSTER_GRID_Z slices, exponential so the clusters are about as deep as they are wide.
+// The view space bounds of the clusters only change with the projection, so they are
+// kept until it does. Every frame the point lights are transformed to view space, put
+// in the slices their sphere of influence overlaps, and each slice tests its clusters
+// against its lights four at a time with SSE, one slice per job.
+//
+// The lights go to an unbounded storage buffer (LIGHT_BUFFER_BINDING), the directional
+// ones first, which every fragment shades. The cluster buffer (LIGHT_CLUSTER_BINDING)
+// starts with an (offset, count) pair per cluster into the light indices that follow,
+// so a fragment only iterates the point lights of its cluster.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <vector>
+
+struct Light;
+struct RenderView;
+
+#define CLUSTER_GRID_X 16
+#define CLUSTER_GRID_Y 9
+#define CLUSTER_GRID_Z 24
+#define CLUSTER_COUNT  (CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z)
+
+// End of the first slice, which takes everything closer to the camera. The near plane
+// (0.1) is much closer than anything in the scene and would waste most of the slices.
+#define CLUSTER_FIRST_SLICE_DEPTH 1.0f
+
+// Attenuation of the point lights, 1 / (1 + linear * d + quadratic * d^2), the same as
+// the shaders. The range of a light ends where its contribution is below LIGHT_CUTOFF.
+#define LIGHT_ATTENUATION_LINEAR    0.5f
+#define LIGHT_ATTENUATION_QUADRATIC 1.0f
+#define LIGHT_CUTOFF                (1.0f / 256.0f)
+
+// Tiles of the TILED_LIGHTING compute shader, which culls the lights per tile itself
+#define LIGHT_TILE_SIZE 16
+
+// Past the 8 bindings GL 4.3 guarantees, but every driver with 4.3 has at least 16
+#define LIGHT_BUFFER_BINDING  7
+#define LIGHT_CLUSTER_BINDING 8
+
+// A light of the light buffer (std430), see Light in the FORWARD_SHADING shader
+struct GpuLight
+{
+    glm::vec3 position;
+    f32       intensity;
+    glm::vec3 color;
+    u32       type;
+    glm::vec3 direction;
+    f32       range;
+};
+
+struct LightClusterStats
+{
+    u32 pointLights;          // Point lights that may light something on screen
+    u32 lightIndices;         // Light indices of all the clusters
+    u32 usedClusters;         // Clusters with at least a light
+    u32 maxClusterLights;     // Most lights in a cluster
+};
+
+struct LightClusters
+{
+    // Bounds of the clusters in view space (depth positive), x first, then y, then the
+    // slice, so the clusters of a slice are consecutive
+    glm::mat4        projection;
+    glm::ivec2       displaySize;
+    glm::uvec2       tileSize;    // In pixels
+    f32              sliceScale;  // slice = log(depth) * sliceScale + sliceBias
+    f32              sliceBias;
+    std::vector<f32> minX, minY, minZ;
+    std::vector<f32> maxX, maxY, maxZ;
+
+    // Data of the frame
+    std::vector<GpuLight>         lights;
+    u32                           directionalLightCount;
+    std::vector<std::vector<u32>> sliceLights;  // Point lights that overlap each slice
+    std::vector<std::vector<u32>> sliceIndices; // Light indices of the clusters of each slice
+    std::vector<u32>              clusterLightCounts;
+    std::vector<u32>              clusterData;  // Content of the cluster buffer
+
+    LightClusterStats stats;
+};
+
+/**
+ * Fills the lights and the cluster data of the frame for the view. The view must have
+ * the projection of the camera, the bounds of the clusters are rebuilt if it changed.
+ */
+void BuildLightClusters(LightClusters& clusters, const std::vector<Light>& lights, const RenderView& view, const glm::ivec2& displaySize);
+
+/**
+ * Range of a point light, how far its contribution is over LIGHT_CUTOFF.
+ */
+f32 GetLightRange(const Light& light);
@@ -0,0 +1,470 @@
+#include <assimp/cimport.h>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+#include <assimp/cfileio.h>
+
+#include "model_import.h"
+#include "obj_loader.h"
+#include "file_system.h"
+#include "asset_pack.h"
+
+#include <algorithm>
+#include <string.h>
+
+// Assimp reads the model and the files it references (e.g. the .mtl of an .obj)
+// through these callbacks, so they come from the asset pack when it is open and
+// the files that were opened can be tracked as dependencies
+struct AssimpMemoryFile
+{
+    FileData data;
+    size_t   cursor;
+};
+
+size_t AssimpFileRead(aiFile* file, char* buffer, size_t size, size_t count)
+{
+    AssimpMemoryFile* memFile = (AssimpMemoryFile*)file->UserData;
+    if (size == 0)
+        return 0;
+
+    size_t available = (size_t)memFile->data.size - memFile->cursor;
+    size_t readCount = std::min(count, available / size);
+    memcpy(buffer, memFile->data.data + memFile->cursor, readCount * size);
+    memFile->cursor += readCount * size;
+    return readCount;
+}
+
+size_t AssimpFileWrite(aiFile* file, const char* buffer, size_t size, size_t count)
+{
+    return 0;
+}
+
+size_t AssimpFileTell(aiFile* file)
+{
+    return ((AssimpMemoryFile*)file->UserData)->cursor;
+}
+
+size_t AssimpFileSize(aiFile* file)
+{
+    return (size_t)((AssimpMemoryFile*)file->UserData)->data.size;
+}
+
+aiReturn AssimpFileSeek(aiFile* file, size_t offset, aiOrigin origin)
+{
+    AssimpMemoryFile* memFile = (AssimpMemoryFile*)file->UserData;
+    size_t base = 0;
+    switch (origin)
+    {
+    case aiOrigin_SET: base = 0; break;
+    case aiOrigin_CUR: base = memFile->cursor; break;
+    case aiOrigin_END: base = (size_t)memFile->data.size; break;
+    default: return aiReturn_FAILURE;
+    }
+
+    if (base + offset > memFile->data.size)
+        return aiReturn_FAILURE;
+
+    memFile->cursor = base + offset;
+    return aiReturn_SUCCESS;
+}
+
+void AssimpFileFlush(aiFile* file)
+{
+}
+
+aiFile* AssimpFileOpen(aiFileIO* fileIO, const char* filename, const char* mode)
+{
+    if (strchr(mode, 'w') || strchr(mode, 'a'))
+        return NULL;
+
+    // Assimp also probes for files that may not exist, those are dependencies too
+    std::vector<std::string>* dependencies = (std::vector<std::string>*)fileIO->UserData;
+    if (dependencies)
+        dependencies->push_back(NormalizeAssetPath(filename));
+
+    if (!FileExists(filename))
+        return NULL;
+
+    FileData data = ReadBinaryFile(filename);
+    if (!data.data)
+        return NULL;
+
+    AssimpMemoryFile* memFile = new AssimpMemoryFile{ data, 0 };
+
+    aiFile* file = new aiFile;
+    file->ReadProc = AssimpFileRead;
+    file->WriteProc = AssimpFileWrite;
+    file->TellProc = AssimpFileTell;
+    file->FileSizeProc = AssimpFileSize;
+    file->SeekProc = AssimpFileSeek;
+    file->FlushProc = AssimpFileFlush;
+    file->UserData = (aiUserData)memFile;
+    return file;
+}
+
+void AssimpFileClose(aiFileIO* fileIO, aiFile* file)
+{
+    AssimpMemoryFile* memFile = (AssimpMemoryFile*)file->UserData;
+    FreeFileData(memFile->data);
+    delete memFile;
+    delete file;
+}
+
+void ProcessAssimpMesh(const aiScene* scene, aiMesh *mesh, ImportedModel& model)
+{
+    std::vector<float> vertices;
+    std::vector<u32> indices;
+
+    bool hasTexCoords = false;
+    bool hasTangentSpace = false;
+
+    // process vertices
+    for(unsigned int i = 0; i < mesh->mNumVertices; i++)
+    {
+        vertices.push_back(mesh->mVertices[i].x);
+        vertices.push_back(mesh->mVertices[i].y);
+        vertices.push_back(mesh->mVertices[i].z);
+        vertices.push_back(mesh->mNormals[i].x);
+        vertices.push_back(mesh->mNormals[i].y);
+        vertices.push_back(mesh->mNormals[i].z);
+
+        if(mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
+        {
+            hasTexCoords = true;
+            vertices.push_back(mesh->mTextureCoords[0][i].x);
+            vertices.push_back(mesh->mTextureCoords[0][i].y);
+        }
+
+        if(mesh->mTangents != nullptr && mesh->mBitangents)
+        {
+            hasTangentSpace = true;
+            vertices.push_back(mesh->mTangents[i].x);
+            vertices.push_back(mesh->mTangents[i].y);
+            vertices.push_back(mesh->mTangents[i].z);
+
+            // For some reason ASSIMP gives me the bitangents flipped.
+            // Maybe it's my fault, but when I generate my own geometry
+            // in other files (see the generation of standard assets)
+            // and all the bitangents have the orientation I expect,
+            // everything works ok.
+            // I think that (even if the documentation says the opposite)
+            // it returns a left-handed tangent space matrix.
+            // SOLUTION: I invert the components of the bitangent here.
+            vertices.push_back(-mesh->mBitangents[i].x);
+            vertices.push_back(-mesh->mBitangents[i].y);
+            vertices.push_back(-mesh->mBitangents[i].z);
+        }
+
+    }
+
+    // process indices
+    for(unsigned int i = 0; i < mesh->mNumFaces; i++)
+    {
+        aiFace face = mesh->mFaces[i];
+        for(unsigned int j = 0; j < face.mNumIndices; j++)
+        {
+            indices.push_back(face.mIndices[j]);
+        }
+    }
+
+    // create the vertex format
+    VertexBufferLayout vertexBufferLayout = {};
+    vertexBufferLayout.attributes.push_back( VertexBufferAttribute{ 0, 3, 0 } );
+    vertexBufferLayout.attributes.push_back( VertexBufferAttribute{ 1, 3, 3*sizeof(float) } );
+    vertexBufferLayout.stride = 6 * sizeof(float);
+    if (hasTexCoords)
+    {
+        vertexBufferLayout.attributes.push_back( VertexBufferAttribute{ 2, 2, vertexBufferLayout.stride } );
+        vertexBufferLayout.stride += 2 * sizeof(float);
+    }
+    if (hasTangentSpace)
+    {
+        vertexBufferLayout.attributes.push_back( VertexBufferAttribute{ 3, 3, vertexBufferLayout.stride } );
+        vertexBufferLayout.stride += 3 * sizeof(float);
+
+        vertexBufferLayout.attributes.push_back( VertexBufferAttribute{ 4, 3, vertexBufferLayout.stride } );
+        vertexBufferLayout.stride += 3 * sizeof(float);
+    }
+
+    // add the submesh into the model, with the index of its material
+    ImportedSubmesh submesh = {};
+    submesh.vertexBufferLayout = vertexBufferLayout;
+    submesh.vertices.swap(vertices);
+    submesh.indices.swap(indices);
+    submesh.materialIdx = mesh->mMaterialIndex;
+    model.submeshes.push_back( submesh );
+}
+
+static std::string GetTexturePath(aiMaterial* material, aiTextureType type, const std::string& directory)
+{
+    aiString aiFilename;
+    material->GetTexture(type, 0, &aiFilename);
+    return NormalizeAssetPath((directory + "/" + aiFilename.C_Str()).c_str());
+}
+
+// Textures that are used when the material does not define one, if they exist
+// in the same directory as the model
+static std::string GetFallbackTexturePath(const char* filename, const std::string& directory, std::vector<std::string>* dependencies)
+{
+    std::string filepath = NormalizeAssetPath((directory + "/" + filename).c_str());
+    if (dependencies)
+        dependencies->push_back(filepath);
+    return FileExists(filepath.c_str()) ? filepath : std::string();
+}
+
+void ResolveMaterialTextures(ImportedMaterial& material, const std::string& directory, std::vector<std::string>* dependencies)
+{
+    if (material.normalsTexture.empty())
+        material.normalsTexture = GetFallbackTexturePath("Normal.png", directory, dependencies);
+    if (material.bumpTexture.empty())
+        material.bumpTexture = GetFallbackTexturePath("Height.png", directory, dependencies);
+
+    if (dependencies)
+    {
+        const std::string* textures[] = {
+            &material.albedoTexture, &material.emissiveTexture, &material.specularTexture,
+            &material.normalsTexture, &material.bumpTexture
+        };
+        for (u32 i = 0; i < ARRAY_COUNT(textures); ++i)
+            if (!textures[i]->empty())
+                dependencies->push_back(*textures[i]);
+    }
+}
+
+void ProcessAssimpMaterial(aiMaterial *material, ImportedMaterial& myMaterial, const std::string& directory, std::vector<std::string>* dependencies)
+{
+    aiString name;
+    aiColor3D diffuseColor;
+    aiColor3D emissiveColor;
+    aiColor3D specularColor;
+    ai_real shininess;
+    material->Get(AI_MATKEY_NAME, name);
+    material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuseColor);
+    material->Get(AI_MATKEY_COLOR_EMISSIVE, emissiveColor);
+    material->Get(AI_MATKEY_COLOR_SPECULAR, specularColor);
+    material->Get(AI_MATKEY_SHININESS, shininess);
+
+    myMaterial.name = name.C_Str();
+    myMaterial.albedo = glm::vec3(diffuseColor.r, diffuseColor.g, diffuseColor.b);
+    myMaterial.emissive = glm::vec3(emissiveColor.r, emissiveColor.g, emissiveColor.b);
+    myMaterial.smoothness = shininess / 256.0f;
+
+    if (material->GetTextureCount(aiTextureType_DIFFUSE) > 0)
+        myMaterial.albedoTexture = GetTexturePath(material, aiTextureType_DIFFUSE, directory);
+    if (material->GetTextureCount(aiTextureType_EMISSIVE) > 0)
+        myMaterial.emissiveTexture = GetTexturePath(material, aiTextureType_EMISSIVE, directory);
+    if (material->GetTextureCount(aiTextureType_SPECULAR) > 0)
+        myMaterial.specularTexture = GetTexturePath(material, aiTextureType_SPECULAR, directory);
+
+    if (material->GetTextureCount(aiTextureType_NORMALS) > 0)
+        myMaterial.normalsTexture = GetTexturePath(material, aiTextureType_NORMALS, directory);
+    if (material->GetTextureCount(aiTextureType_HEIGHT) > 0)
+        myMaterial.bumpTexture = GetTexturePath(material, aiTextureType_HEIGHT, directory);
+
+    ResolveMaterialTextures(myMaterial, directory, dependencies);
+}
+
+static glm::mat4 ToGlm(const aiMatrix4x4& m)
+{
+    // Assimp matrices are row major
+    return glm::transpose(glm::make_mat4(&m.a1));
+}
+
+void ProcessAssimpNode(const aiScene* scene, aiNode *node, u32 parentIdx, ImportedModel& model)
+{
+    ImportedNode myNode = {};
+    myNode.name = node->mName.C_Str();
+    myNode.parent = parentIdx;
+    myNode.transform = ToGlm(node->mTransformation);
+    myNode.submeshes.assign(node->mMeshes, node->mMeshes + node->mNumMeshes);
+
+    u32 nodeIdx = (u32)model.nodes.size();
+    model.nodes.push_back(myNode);
+
+    // then do the same for each of its children
+    for(unsigned int i = 0; i < node->mNumChildren; i++)
+    {
+        ProcessAssimpNode(scene, node->mChildren[i], nodeIdx, model);
+    }
+}
+
+static bool IsObjFile(const char* filename)
+{
+    size_t length = strlen(filename);
+    if (length < 4)
+        return false;
+
+    const char* extension = filename + length - 4;
+    return extension[0] == '.' && tolower(extension[1]) == 'o' && tolower(extension[2]) == 'b' && tolower(extension[3]) == 'j';
+}
+
+bool ImportModel(const char* filename, ImportedModel& model, std::vector<std::string>* dependencies)
+{
+    // OBJ files go through the native loader, Assimp is only used if it fails
+    if (IsObjFile(filename))
+    {
+        size_t dependencyCount = dependencies ? dependencies->size() : 0;
+        if (ImportObjModel(filename, model, dependencies))
+            return true;
+
+        ELOG("Native OBJ import of %s failed, trying with Assimp", filename);
+        model = {};
+        if (dependencies)
+            dependencies->resize(dependencyCount);
+    }
+
+    return ImportModelAssimp(filename, model, dependencies);
+}
+
+bool ImportModelAssimp(const char* filename, ImportedModel& model, std::vector<std::string>* dependencies)
+{
+    aiFileIO fileIO = { AssimpFileOpen, AssimpFileClose, (aiUserData)dependencies };
+
+    const aiScene* scene = aiImportFileEx(filename,
+                                        aiProcess_Triangulate           |
+                                        aiProcess_GenSmoothNormals      |
+                                        aiProcess_CalcTangentSpace      |
+                                        aiProcess_JoinIdenticalVertices |
+                                        aiProcess_ImproveCacheLocality  |
+                                        aiProcess_OptimizeMeshes        |
+                                        aiProcess_SortByPType,
+                                        &fileIO);
+
+    if (!scene)
+    {
+        ELOG("Error loading mesh %s: %s", filename, aiGetErrorString());
+        return false;
+    }
+
+    std::string directory = filename;
+    size_t separator = directory.find_last_of("/\\");
+    directory = (separator != std::string::npos) ? directory.substr(0, separator) : std::string(".");
+
+    model.materials.resize(scene->mNumMaterials);
+    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+    {
+        ProcessAssimpMaterial(scene->mMaterials[i], model.materials[i], directory, dependencies);
+    }
+
+    // every mesh is processed once, nodes reference them by index
+    for (unsigned int i = 0; i < scene->mNumMeshes; ++i)
+    {
+        ProcessAssimpMesh(scene, scene->mMeshes[i], model);
+    }
+
+    ProcessAssimpNode(scene, scene->mRootNode, UINT32_MAX, model);
+
+    aiReleaseImport(scene);
+
+    if (dependencies)
+    {
+        std::sort(dependencies->begin(), dependencies->end());
+        dependencies->erase(std::unique(dependencies->begin(), dependencies->end()), dependencies->end());
+    }
+
+    return true;
+}
+
+// Transforms the attribute at the given location of all the vertices (directions are
+// normalized after the transform)
+static void TransformAttribute(ImportedSubmesh& submesh, u32 firstVertex, u8 location, const glm::mat4& transform, bool isDirection)
+{
+    const VertexBufferLayout& layout = submesh.vertexBufferLayout;
+    for (const VertexBufferAttribute& attribute : layout.attributes)
+    {
+        if (attribute.location != location || attribute.componentCount != 3)
+            continue;
+
+        const u32 floatsPerVertex = layout.stride / sizeof(float);
+        const u32 vertexCount = (u32)submesh.vertices.size() / floatsPerVertex;
+        for (u32 i = firstVertex; i < vertexCount; ++i)
+        {
+            float* value = &submesh.vertices[i * floatsPerVertex + attribute.offset / sizeof(float)];
+            glm::vec3 v = glm::vec3(transform * glm::vec4(value[0], value[1], value[2], isDirection ? 0.0f : 1.0f));
+            if (isDirection && glm::dot(v, v) > 0.0f)
+                v = glm::normalize(v);
+            value[0] = v.x;
+            value[1] = v.y;
+            value[2] = v.z;
+        }
+    }
+}
+
+static bool SameVertexFormat(const VertexBufferLayout& a, const VertexBufferLayout& b)
+{
+    if (a.stride != b.stride || a.attributes.size() != b.attributes.size())
+        return false;
+
+    for (u32 i = 0; i < a.attributes.size(); ++i)
+    {
+        if (a.attributes[i].location != b.attributes[i].location ||
+            a.attributes[i].componentCount != b.attributes[i].componentCount ||
+            a.attributes[i].offset != b.attributes[i].offset)
+            return false;
+    }
+    return true;
+}
+
+void PreTransformModel(ImportedModel& model)
+{
+    // Nothing to bake for models with a single node without transform (e.g. all the
+    // .obj files)
+    if (model.nodes.size() == 1 && model.nodes[0].transform == glm::mat4(1.0f))
+        return;
+
+    std::vector<glm::mat4> worldTransforms(model.nodes.size());
+    for (u32 i = 0; i < model.nodes.size(); ++i)
+    {
+        const ImportedNode& node = model.nodes[i];
+        worldTransforms[i] = (node.parent == UINT32_MAX) ? node.transform : worldTransforms[node.parent] * node.transform;
+    }
+
+    std::vector<ImportedSubmesh> submeshes;
+    for (u32 nodeIdx = 0; nodeIdx < model.nodes.size(); ++nodeIdx)
+    {
+        const glm::mat4& transform = worldTransforms[nodeIdx];
+        const glm::mat4 normalTransform = glm::transpose(glm::inverse(transform));
+
+        for (u32 submeshIdx : model.nodes[nodeIdx].submeshes)
+        {
+            const ImportedSubmesh& source = model.submeshes[submeshIdx];
+
+            ImportedSubmesh* target = NULL;
+            for (ImportedSubmesh& submesh : submeshes)
+            {
+                if (submesh.materialIdx == source.materialIdx && SameVertexFormat(submesh.vertexBufferLayout, source.vertexBufferLayout))
+                {
+                    target = &submesh;
+                    break;
+                }
+            }
+
+            if (!target)
+            {
+                submeshes.push_back(ImportedSubmesh());
+                target = &submeshes.back();
+                target->vertexBufferLayout = source.vertexBufferLayout;
+                target->materialIdx = source.materialIdx;
+            }
+
+            const u32 firstVertex = (u32)(target->vertices.size() * sizeof(float) / target->vertexBufferLayout.stride);
+            target->vertices.insert(target->vertices.end(), source.vertices.begin(), source.vertices.end());
+            for (u32 index : source.indices)
+                target->indices.push_back(firstVertex + index);
+
+            TransformAttribute(*target, firstVertex, 0, transform, false);
+            TransformAttribute(*target, firstVertex, 1, normalTransform, true);
+            TransformAttribute(*target, firstVertex, 3, normalTransform, true);
+            TransformAttribute(*target, firstVertex, 4, normalTransform, true);
+        }
+    }
+
+    ImportedNode root = {};
+    root.name = model.nodes.empty() ? std::string() : model.nodes[0].name;
+    root.parent = UINT32_MAX;
+    root.transform = glm::mat4(1.0f);
+    for (u32 i = 0; i < submeshes.size(); ++i)
+        root.submeshes.push_back(i);
+
+    model.submeshes.swap(submeshes);
+    model.nodes.assign(1, root);
+}
@@ -0,0 +1,91 @@
+//
+// model_import.h: CPU side import of model files, through Assimp or the native OBJ
+// loader (see obj_loader.h). It does not touch OpenGL so it is shared by the engine
+// and the offline tools (see AssetCooker).
+//
+
+#pragma once
+
+#include "platform.h"
+
+struct VertexBufferAttribute {
+    u8 location;
+    u8 componentCount;
+    u8 offset;
+};
+
+struct VertexBufferLayout {
+    std::vector<VertexBufferAttribute> attributes;
+    u8 stride;
+};
+
+struct ImportedSubmesh
+{
+    VertexBufferLayout vertexBufferLayout;
+    std::vector<float> vertices;
+    std::vector<u32>   indices;
+    u32                materialIdx; // Index in ImportedModel::materials
+};
+
+// Texture paths are relative to the WorkingDir and empty when the material has no
+// texture in that slot
+struct ImportedMaterial
+{
+    std::string name;
+    glm::vec3   albedo;
+    glm::vec3   emissive;
+    f32         smoothness;
+    std::string albedoTexture;
+    std::string emissiveTexture;
+    std::string specularTexture;
+    std::string normalsTexture;
+    std::string bumpTexture;
+};
+
+// Node of the model hierarchy (an aiNode). Nodes are stored depth first, so parents
+// always come before their children and nodes[0] is the root.
+struct ImportedNode
+{
+    std::string      name;
+    u32              parent;    // Index in ImportedModel::nodes, UINT32_MAX for the root
+    glm::mat4        transform; // Relative to the parent
+    std::vector<u32> submeshes; // Indices in ImportedModel::submeshes
+};
+
+// Submeshes are the meshes of the file, stored once even if several nodes reference
+// them (e.g. the trees of a forest)
+struct ImportedModel
+{
+    std::vector<ImportedSubmesh>  submeshes;
+    std::vector<ImportedMaterial> materials;
+    std::vector<ImportedNode>     nodes;
+};
+
+/**
+ * Imports a model file (triangulated, with tangent space), keeping its node hierarchy.
+ * If dependencies is not NULL, the paths of all the files the result depends on are
+ * appended to it: the model, the files it references (e.g. the .mtl of an .obj) and
+ * the textures of its materials, including the ones that were looked for but do not
+ * exist.
+ * OBJ files are imported with ImportObjModel, falling back to Assimp if it fails.
+ */
+bool ImportModel(const char* filename, ImportedModel& model, std::vector<std::string>* dependencies = NULL);
+
+/**
+ * Same as ImportModel, but always through Assimp.
+ */
+bool ImportModelAssimp(const char* filename, ImportedModel& model, std::vector<std::string>* dependencies = NULL);
+
+/**
+ * Bakes the node transforms into the vertices, as aiProcess_PreTransformVertices does.
+ * Every node reference becomes a copy of the submesh and copies that share material
+ * and vertex format are merged, leaving a single root node.
+ */
+void PreTransformModel(ImportedModel& model);
+
+/**
+ * Fills the normals and bump textures that the material does not define with the
+ * Normal.png and Height.png of the model directory (if they exist), and appends all
+ * the textures of the material to dependencies.
+ */
+void ResolveMaterialTextures(ImportedMaterial& material, const std::string& directory, std::vector<std::string>* dependencies);
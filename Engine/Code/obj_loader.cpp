@@ -0,0 +1,940 @@
+#include "obj_loader.h"
+#include "file_system.h"
+#include "asset_pack.h"
+#include "job_system.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string.h>
+
+#define OBJ_MIN_CHUNK_SIZE KB(64)
+#define OBJ_MAX_FACE_CORNERS 64
+
+struct ObjCorner
+{
+    i32 position; // 0 based, -1 if missing
+    i32 texcoord;
+    i32 normal;
+};
+
+struct ObjMaterialSpan
+{
+    u32         firstTriangle;
+    std::string material;
+};
+
+struct ObjChunk
+{
+    const char* begin;
+    const char* end;
+
+    std::vector<glm::vec3>       positions;
+    std::vector<glm::vec2>       texcoords;
+    std::vector<glm::vec3>       normals;
+    std::vector<ObjCorner>       corners; // 3 per triangle
+    std::vector<u32>             relativeIndices; // Component indices (corner * 3 + i) relative to the chunk
+    std::vector<ObjMaterialSpan> materialSpans;
+    std::vector<std::string>     materialLibraries;
+
+    u32  positionBase;
+    u32  texcoordBase;
+    u32  normalBase;
+    bool error;
+};
+
+// Triangle range of a chunk that uses the same material
+struct ObjTriangleRange
+{
+    u32 chunk;
+    u32 firstTriangle;
+    u32 triangleCount;
+};
+
+//
+// Number parsing
+//
+
+static inline bool IsDigit(char c)
+{
+    return (u8)(c - '0') < 10;
+}
+
+static inline const char* SkipSpaces(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        ++p;
+    return p;
+}
+
+// True if the 8 bytes are all ASCII digits
+static inline bool AreEightDigits(u64 chunk)
+{
+    return (((chunk & 0xF0F0F0F0F0F0F0F0ULL) | (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL);
+}
+
+// Converts 8 ASCII digits (little endian, first digit in the lowest byte) at once
+static inline u32 ParseEightDigits(u64 chunk)
+{
+    chunk -= 0x3030303030303030ULL;
+    chunk = (chunk * 10) + (chunk >> 8);
+    chunk = (((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+             (((chunk >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return (u32)chunk;
+}
+
+// Accumulates the digits at p into value (up to 19 significant digits, the rest only
+// count towards digitCount so the caller can scale the result)
+static inline const char* ParseDigits(const char* p, const char* end, u64& value, i32& digitCount)
+{
+    while (end - p >= 8 && digitCount <= 11)
+    {
+        u64 chunk;
+        memcpy(&chunk, p, sizeof(chunk));
+        if (!AreEightDigits(chunk))
+            break;
+        value = value * 100000000ULL + ParseEightDigits(chunk);
+        digitCount += 8;
+        p += 8;
+    }
+
+    while (p < end && IsDigit(*p))
+    {
+        if (digitCount < 19)
+            value = value * 10 + (u64)(*p - '0');
+        digitCount++;
+        p++;
+    }
+    return p;
+}
+
+static const f64 PowersOf10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline f64 Scale(f64 value, i32 exponent)
+{
+    if (exponent >= 0)
+        return exponent <= 22 ? value * PowersOf10[exponent] : value * pow(10.0, exponent);
+    return exponent >= -22 ? value / PowersOf10[-exponent] : value * pow(10.0, exponent);
+}
+
+static inline const char* ParseFloat(const char* p, const char* end, f32& result)
+{
+    p = SkipSpaces(p, end);
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    u64 mantissa = 0;
+    i32 integerDigits = 0;
+    const char* start = p;
+    p = ParseDigits(p, end, mantissa, integerDigits);
+
+    // Digits of the integer part that did not fit in the mantissa scale it up
+    i32 exponent = integerDigits > 19 ? integerDigits - 19 : 0;
+
+    if (p < end && *p == '.')
+    {
+        ++p;
+
+        // Leading zeros of small numbers are not significant digits
+        if (mantissa == 0)
+        {
+            while (p < end && *p == '0')
+            {
+                exponent--;
+                p++;
+            }
+        }
+
+        i32 digitCount = integerDigits;
+        p = ParseDigits(p, end, mantissa, digitCount);
+        exponent -= std::min(digitCount, 19) - std::min(integerDigits, 19);
+    }
+
+    if (p == start)
+    {
+        // Not a number (e.g. nan or inf), let the C library deal with it
+        char* strEnd;
+        char buffer[64] = {};
+        memcpy(buffer, p, std::min<size_t>(end - p, sizeof(buffer) - 1));
+        result = strtof(buffer, &strEnd);
+        return p + (strEnd - buffer);
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char* q = p + 1;
+        bool negativeExponent = false;
+        if (q < end && (*q == '-' || *q == '+'))
+            negativeExponent = (*q++ == '-');
+
+        if (q < end && IsDigit(*q))
+        {
+            i32 value = 0;
+            while (q < end && IsDigit(*q))
+            {
+                if (value < 10000)
+                    value = value * 10 + (*q - '0');
+                q++;
+            }
+            exponent += negativeExponent ? -value : value;
+            p = q;
+        }
+    }
+
+    f64 value = Scale((f64)mantissa, exponent);
+    result = (f32)(negative ? -value : value);
+    return p;
+}
+
+static inline const char* ParseInt(const char* p, const char* end, i32& result, bool& valid)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    u64 value = 0;
+    i32 digitCount = 0;
+    p = ParseDigits(p, end, value, digitCount);
+
+    valid = digitCount > 0 && digitCount < 10;
+    result = negative ? -(i32)value : (i32)value;
+    return p;
+}
+
+static inline const char* NextLine(const char* p, const char* end)
+{
+    const char* newLine = (const char*)memchr(p, '\n', end - p);
+    return newLine ? newLine + 1 : end;
+}
+
+static std::string ReadRestOfLine(const char* p, const char* end)
+{
+    p = SkipSpaces(p, end);
+    const char* lineEnd = p;
+    while (lineEnd < end && *lineEnd != '\n' && *lineEnd != '\r')
+        ++lineEnd;
+    while (lineEnd > p && (lineEnd[-1] == ' ' || lineEnd[-1] == '\t'))
+        --lineEnd;
+    return std::string(p, lineEnd);
+}
+
+static inline bool StartsWithKeyword(const char* p, const char* end, const char* keyword, u32 length)
+{
+    return end - p > length && memcmp(p, keyword, length) == 0 && (p[length] == ' ' || p[length] == '\t');
+}
+
+//
+// OBJ parsing
+//
+
+// Resolves an OBJ index (1 based, or negative to count from the last element) of a
+// corner component. Negative indices are relative to the elements of the chunk seen so
+// far, they are made absolute when the chunks are merged.
+static inline i32 ResolveIndex(ObjChunk& chunk, i32 index, u32 localCount, u32 component)
+{
+    if (index > 0)
+        return index - 1;
+
+    chunk.relativeIndices.push_back((u32)chunk.corners.size() * 3 + component);
+    return (i32)localCount + index;
+}
+
+static const char* ParseFace(ObjChunk& chunk, const char* p, const char* end)
+{
+    ObjCorner face[OBJ_MAX_FACE_CORNERS];
+    u32 cornerCount = 0;
+
+    for (;;)
+    {
+        p = SkipSpaces(p, end);
+        if (p >= end || *p == '\n' || *p == '\r' || *p == '#')
+            break;
+
+        ObjCorner corner = { -1, -1, -1 };
+        i32 index;
+        bool valid;
+
+        // Faces with more corners than the fixed array holds are left to the Assimp fallback
+        if (cornerCount == OBJ_MAX_FACE_CORNERS)
+        {
+            chunk.error = true;
+            return p;
+        }
+
+        p = ParseInt(p, end, index, valid);
+        if (!valid || index == 0)
+        {
+            chunk.error = true;
+            return p;
+        }
+        // Negative indices are kept as they are until the triangles are emitted. Texture
+        // coordinates and normals use 0 when missing, as OBJ indices start at 1
+        corner.position = index;
+
+        if (p < end && *p == '/')
+        {
+            ++p;
+            if (p < end && *p != '/')
+            {
+                p = ParseInt(p, end, index, valid);
+                if (!valid || index == 0) { chunk.error = true; return p; }
+                corner.texcoord = index;
+            }
+            else
+            {
+                corner.texcoord = 0;
+            }
+
+            if (p < end && *p == '/')
+            {
+                ++p;
+                p = ParseInt(p, end, index, valid);
+                if (!valid || index == 0) { chunk.error = true; return p; }
+                corner.normal = index;
+            }
+            else
+            {
+                corner.normal = 0;
+            }
+        }
+        else
+        {
+            corner.texcoord = 0;
+            corner.normal = 0;
+        }
+
+        face[cornerCount] = corner;
+        cornerCount++;
+    }
+
+    // Fan triangulation, as the Assimp triangulation does for convex polygons
+    for (u32 i = 2; i < cornerCount; ++i)
+    {
+        const ObjCorner* triangle[3] = { &face[0], &face[i - 1], &face[i] };
+        for (u32 c = 0; c < 3; ++c)
+        {
+            ObjCorner corner;
+            corner.position = ResolveIndex(chunk, triangle[c]->position, (u32)chunk.positions.size(), 0);
+            corner.texcoord = triangle[c]->texcoord == 0 ? -1 : ResolveIndex(chunk, triangle[c]->texcoord, (u32)chunk.texcoords.size(), 1);
+            corner.normal   = triangle[c]->normal   == 0 ? -1 : ResolveIndex(chunk, triangle[c]->normal,   (u32)chunk.normals.size(),   2);
+            chunk.corners.push_back(corner);
+        }
+    }
+
+    return p;
+}
+
+static void ParseChunk(ObjChunk& chunk)
+{
+    const char* p = chunk.begin;
+    const char* end = chunk.end;
+
+    // Rough guess of the number of elements to avoid most reallocations
+    const size_t estimatedLines = (end - p) / 24;
+    chunk.positions.reserve(estimatedLines / 3);
+    chunk.corners.reserve(estimatedLines);
+
+    while (p < end && !chunk.error)
+    {
+        p = SkipSpaces(p, end);
+        if (p >= end)
+            break;
+
+        if (p[0] == 'v')
+        {
+            if (p + 1 < end && (p[1] == ' ' || p[1] == '\t'))
+            {
+                glm::vec3 position;
+                p = ParseFloat(p + 2, end, position.x);
+                p = ParseFloat(p, end, position.y);
+                p = ParseFloat(p, end, position.z);
+                chunk.positions.push_back(position);
+            }
+            else if (p + 2 < end && p[1] == 't' && (p[2] == ' ' || p[2] == '\t'))
+            {
+                glm::vec2 texcoord;
+                p = ParseFloat(p + 3, end, texcoord.x);
+                p = ParseFloat(p, end, texcoord.y);
+                chunk.texcoords.push_back(texcoord);
+            }
+            else if (p + 2 < end && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+            {
+                glm::vec3 normal;
+                p = ParseFloat(p + 3, end, normal.x);
+                p = ParseFloat(p, end, normal.y);
+                p = ParseFloat(p, end, normal.z);
+                chunk.normals.push_back(normal);
+            }
+        }
+        else if (p[0] == 'f' && p + 1 < end && (p[1] == ' ' || p[1] == '\t'))
+        {
+            p = ParseFace(chunk, p + 2, end);
+        }
+        else if (StartsWithKeyword(p, end, "usemtl", 6))
+        {
+            chunk.materialSpans.push_back(ObjMaterialSpan{ (u32)chunk.corners.size() / 3, ReadRestOfLine(p + 6, end) });
+        }
+        else if (StartsWithKeyword(p, end, "mtllib", 6))
+        {
+            chunk.materialLibraries.push_back(ReadRestOfLine(p + 6, end));
+        }
+
+        p = NextLine(p, end);
+    }
+}
+
+//
+// MTL parsing
+//
+
+// Texture statements may have options before the filename (e.g. map_bump -bm 1 file.png)
+static std::string GetTextureFilename(const std::string& statement)
+{
+    size_t separator = statement.find_last_of(" \t");
+    return separator == std::string::npos ? statement : statement.substr(separator + 1);
+}
+
+static void ParseMtlFile(const char* filepath, const std::string& directory, std::vector<ImportedMaterial>& materials)
+{
+    if (!FileExists(filepath))
+    {
+        ELOG("Material library %s not found", filepath);
+        return;
+    }
+
+    FileData file = ReadBinaryFile(filepath);
+    const char* p = (const char*)file.data;
+    const char* end = p + file.size;
+
+    ImportedMaterial* material = NULL;
+    while (p < end)
+    {
+        p = SkipSpaces(p, end);
+        if (p >= end)
+            break;
+
+        if (StartsWithKeyword(p, end, "newmtl", 6))
+        {
+            materials.push_back(ImportedMaterial());
+            material = &materials.back();
+            material->name = ReadRestOfLine(p + 6, end);
+            material->albedo = glm::vec3(0.6f); // Same defaults as the Assimp importer
+            material->emissive = glm::vec3(0.0f);
+            material->smoothness = 0.0f;
+        }
+        else if (material)
+        {
+            std::string* texture = NULL;
+            if (StartsWithKeyword(p, end, "Kd", 2))
+            {
+                p = ParseFloat(p + 2, end, material->albedo.x);
+                p = ParseFloat(p, end, material->albedo.y);
+                p = ParseFloat(p, end, material->albedo.z);
+            }
+            else if (StartsWithKeyword(p, end, "Ke", 2))
+            {
+                p = ParseFloat(p + 2, end, material->emissive.x);
+                p = ParseFloat(p, end, material->emissive.y);
+                p = ParseFloat(p, end, material->emissive.z);
+            }
+            else if (StartsWithKeyword(p, end, "Ns", 2))
+            {
+                f32 shininess;
+                p = ParseFloat(p + 2, end, shininess);
+                material->smoothness = shininess / 256.0f;
+            }
+            else if (StartsWithKeyword(p, end, "map_Kd", 6))
+                texture = &material->albedoTexture;
+            else if (StartsWithKeyword(p, end, "map_Ke", 6))
+                texture = &material->emissiveTexture;
+            else if (StartsWithKeyword(p, end, "map_Ks", 6))
+                texture = &material->specularTexture;
+            else if (StartsWithKeyword(p, end, "map_bump", 8) || StartsWithKeyword(p, end, "map_Bump", 8) || StartsWithKeyword(p, end, "bump", 4))
+                texture = &material->bumpTexture;
+            else if (end - p > 4 && memcmp(p, "norm", 4) == 0) // Any keyword starting with norm, as Assimp does
+                texture = &material->normalsTexture;
+
+            if (texture)
+            {
+                const char* statement = p;
+                while (statement < end && *statement != ' ' && *statement != '\t')
+                    ++statement;
+                std::string filename = GetTextureFilename(ReadRestOfLine(statement, end));
+                *texture = NormalizeAssetPath((directory + "/" + filename).c_str());
+            }
+        }
+
+        p = NextLine(p, end);
+    }
+
+    FreeFileData(file);
+}
+
+//
+// Vertex welding
+//
+
+// Open addressing hash table from corners to vertex indices. Keys and values are
+// stored together so a lookup touches a single cache line.
+struct WeldEntry
+{
+    ObjCorner key;
+    u32       value; // UINT32_MAX if the slot is empty
+};
+
+struct WeldTable
+{
+    std::vector<WeldEntry> entries;
+    u32                    mask;
+};
+
+static void InitWeldTable(WeldTable& table, u32 maxCount)
+{
+    u32 capacity = 16;
+    while (capacity < maxCount * 2)
+        capacity *= 2;
+
+    table.entries.assign(capacity, WeldEntry{ { -1, -1, -1 }, UINT32_MAX });
+    table.mask = capacity - 1;
+}
+
+static inline u32 HashCorner(const ObjCorner& corner)
+{
+    u64 hash = (u64)(u32)corner.position * 0x9E3779B97F4A7C15ULL;
+    hash ^= (u64)(u32)corner.texcoord * 0xC2B2AE3D27D4EB4FULL;
+    hash ^= (u64)(u32)corner.normal * 0x165667B19E3779F9ULL;
+    return (u32)(hash >> 32) ^ (u32)hash;
+}
+
+// Returns the value of the corner, inserting newValue if it was not in the table
+static inline u32 FindOrInsert(WeldTable& table, const ObjCorner& corner, u32 newValue)
+{
+    u32 slot = HashCorner(corner) & table.mask;
+    for (;;)
+    {
+        WeldEntry& entry = table.entries[slot];
+        if (entry.value == UINT32_MAX)
+        {
+            entry.key = corner;
+            entry.value = newValue;
+            return newValue;
+        }
+
+        if (entry.key.position == corner.position && entry.key.texcoord == corner.texcoord && entry.key.normal == corner.normal)
+            return entry.value;
+
+        slot = (slot + 1) & table.mask;
+    }
+}
+
+static void BuildSubmesh(const std::vector<ObjChunk>& chunks, const std::vector<ObjTriangleRange>& ranges,
+                         const std::vector<glm::vec3>& positions, const std::vector<glm::vec2>& texcoords,
+                         const std::vector<glm::vec3>& normals, ImportedSubmesh& submesh)
+{
+    u32 cornerCount = 0;
+    for (const ObjTriangleRange& range : ranges)
+        cornerCount += range.triangleCount * 3;
+
+    // Weld the corners that use the same position, texcoord and normal
+    WeldTable weldTable;
+    InitWeldTable(weldTable, cornerCount);
+
+    std::vector<ObjCorner> vertices;
+    std::vector<u32>& indices = submesh.indices;
+    indices.reserve(cornerCount);
+
+    bool hasTexCoords = false;
+    bool hasNormals = true;
+    for (const ObjTriangleRange& range : ranges)
+    {
+        const ObjCorner* corners = chunks[range.chunk].corners.data() + range.firstTriangle * 3;
+        for (u32 i = 0; i < range.triangleCount * 3; ++i)
+        {
+            u32 vertexIdx = FindOrInsert(weldTable, corners[i], (u32)vertices.size());
+            if (vertexIdx == vertices.size())
+            {
+                vertices.push_back(corners[i]);
+                hasTexCoords |= corners[i].texcoord >= 0;
+                hasNormals &= corners[i].normal >= 0;
+            }
+            indices.push_back(vertexIdx);
+        }
+    }
+
+    const u32 vertexCount = (u32)vertices.size();
+    const u32 triangleCount = (u32)indices.size() / 3;
+
+    // Smooth normals for the files without them: the normals of all the faces that
+    // share a position are averaged (as aiProcess_GenSmoothNormals)
+    std::vector<glm::vec3> vertexNormals(vertexCount);
+    if (hasNormals)
+    {
+        for (u32 i = 0; i < vertexCount; ++i)
+            vertexNormals[i] = normals[vertices[i].normal];
+    }
+    else
+    {
+        WeldTable positionTable;
+        InitWeldTable(positionTable, vertexCount);
+
+        std::vector<u32> vertexPositionSlots(vertexCount);
+        std::vector<glm::vec3> positionNormals;
+        for (u32 i = 0; i < vertexCount; ++i)
+        {
+            ObjCorner key = { vertices[i].position, -1, -1 };
+            vertexPositionSlots[i] = FindOrInsert(positionTable, key, (u32)positionNormals.size());
+            if (vertexPositionSlots[i] == positionNormals.size())
+                positionNormals.push_back(glm::vec3(0.0f));
+        }
+
+        for (u32 t = 0; t < triangleCount; ++t)
+        {
+            const u32* triangle = &indices[t * 3];
+            const glm::vec3& p0 = positions[vertices[triangle[0]].position];
+            const glm::vec3& p1 = positions[vertices[triangle[1]].position];
+            const glm::vec3& p2 = positions[vertices[triangle[2]].position];
+            glm::vec3 faceNormal = glm::cross(p1 - p0, p2 - p0);
+            f32 length = glm::length(faceNormal);
+            if (length <= 0.0f)
+                continue;
+            faceNormal /= length;
+
+            for (u32 c = 0; c < 3; ++c)
+                positionNormals[vertexPositionSlots[triangle[c]]] += faceNormal;
+        }
+
+        for (u32 i = 0; i < vertexCount; ++i)
+        {
+            const glm::vec3& normal = positionNormals[vertexPositionSlots[i]];
+            f32 length = glm::length(normal);
+            vertexNormals[i] = length > 0.0f ? normal / length : glm::vec3(0.0f, 1.0f, 0.0f);
+        }
+    }
+
+    // Tangent space (only possible with texture coordinates), computed per triangle as
+    // aiProcess_CalcTangentSpace and accumulated on the welded vertices
+    std::vector<glm::vec3> tangents;
+    std::vector<glm::vec3> bitangents;
+    if (hasTexCoords)
+    {
+        tangents.assign(vertexCount, glm::vec3(0.0f));
+        bitangents.assign(vertexCount, glm::vec3(0.0f));
+
+        for (u32 t = 0; t < triangleCount; ++t)
+        {
+            const u32* triangle = &indices[t * 3];
+            const ObjCorner& c0 = vertices[triangle[0]];
+            const ObjCorner& c1 = vertices[triangle[1]];
+            const ObjCorner& c2 = vertices[triangle[2]];
+
+            const glm::vec2 uv0 = c0.texcoord >= 0 ? texcoords[c0.texcoord] : glm::vec2(0.0f);
+            const glm::vec2 uv1 = c1.texcoord >= 0 ? texcoords[c1.texcoord] : glm::vec2(0.0f);
+            const glm::vec2 uv2 = c2.texcoord >= 0 ? texcoords[c2.texcoord] : glm::vec2(0.0f);
+
+            const glm::vec3 v = positions[c1.position] - positions[c0.position];
+            const glm::vec3 w = positions[c2.position] - positions[c0.position];
+
+            f32 sx = uv1.x - uv0.x, sy = uv1.y - uv0.y;
+            f32 tx = uv2.x - uv0.x, ty = uv2.y - uv0.y;
+            f32 dirCorrection = (tx * sy - ty * sx) < 0.0f ? -1.0f : 1.0f;
+
+            // When the three texture coordinates are the same, use the default UV direction
+            if (sx * ty == sy * tx)
+            {
+                sx = 0.0f; sy = 1.0f;
+                tx = 1.0f; ty = 0.0f;
+            }
+
+            const glm::vec3 tangent   = (w * sy - v * ty) * dirCorrection;
+            const glm::vec3 bitangent = (w * sx - v * tx) * dirCorrection;
+            for (u32 c = 0; c < 3; ++c)
+            {
+                tangents[triangle[c]] += tangent;
+                bitangents[triangle[c]] += bitangent;
+            }
+        }
+
+        for (u32 i = 0; i < vertexCount; ++i)
+        {
+            const glm::vec3& n = vertexNormals[i];
+            glm::vec3 tangent = tangents[i] - n * glm::dot(tangents[i], n);
+            glm::vec3 bitangent = bitangents[i] - n * glm::dot(bitangents[i], n);
+
+            f32 tangentLength = glm::length(tangent);
+            f32 bitangentLength = glm::length(bitangent);
+            if (tangentLength > 0.0f && bitangentLength > 0.0f)
+            {
+                tangents[i] = tangent / tangentLength;
+                bitangents[i] = bitangent / bitangentLength;
+            }
+            else
+            {
+                // Any orthonormal basis around the normal
+                glm::vec3 axis = fabsf(n.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+                tangents[i] = glm::normalize(glm::cross(axis, n));
+                bitangents[i] = glm::cross(n, tangents[i]);
+            }
+        }
+    }
+
+    // Same vertex format as the Assimp import (see ProcessAssimpMesh)
+    VertexBufferLayout& layout = submesh.vertexBufferLayout;
+    layout.attributes.push_back( VertexBufferAttribute{ 0, 3, 0 } );
+    layout.attributes.push_back( VertexBufferAttribute{ 1, 3, 3*sizeof(float) } );
+    layout.stride = 6 * sizeof(float);
+    if (hasTexCoords)
+    {
+        layout.attributes.push_back( VertexBufferAttribute{ 2, 2, layout.stride } );
+        layout.stride += 2 * sizeof(float);
+        layout.attributes.push_back( VertexBufferAttribute{ 3, 3, layout.stride } );
+        layout.stride += 3 * sizeof(float);
+        layout.attributes.push_back( VertexBufferAttribute{ 4, 3, layout.stride } );
+        layout.stride += 3 * sizeof(float);
+    }
+
+    const u32 floatsPerVertex = layout.stride / sizeof(float);
+    submesh.vertices.resize((size_t)vertexCount * floatsPerVertex);
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        float* vertex = &submesh.vertices[(size_t)i * floatsPerVertex];
+        const glm::vec3& position = positions[vertices[i].position];
+        *vertex++ = position.x;
+        *vertex++ = position.y;
+        *vertex++ = position.z;
+        *vertex++ = vertexNormals[i].x;
+        *vertex++ = vertexNormals[i].y;
+        *vertex++ = vertexNormals[i].z;
+
+        if (hasTexCoords)
+        {
+            const glm::vec2 texcoord = vertices[i].texcoord >= 0 ? texcoords[vertices[i].texcoord] : glm::vec2(0.0f);
+            *vertex++ = texcoord.x;
+            *vertex++ = texcoord.y;
+            *vertex++ = tangents[i].x;
+            *vertex++ = tangents[i].y;
+            *vertex++ = tangents[i].z;
+
+            // The bitangents computed as Assimp does are flipped, they are stored
+            // inverted as in ProcessAssimpMesh
+            *vertex++ = -bitangents[i].x;
+            *vertex++ = -bitangents[i].y;
+            *vertex++ = -bitangents[i].z;
+        }
+    }
+}
+
+bool ImportObjModel(const char* filename, ImportedModel& model, std::vector<std::string>* dependencies)
+{
+    if (dependencies)
+        dependencies->push_back(NormalizeAssetPath(filename));
+
+    // Map the file, unless it comes from the asset pack
+    MappedFile mappedFile = {};
+    FileData packedFile = {};
+    const char* data;
+    u64 size;
+    if (FindAssetPackEntry(filename))
+    {
+        packedFile = ReadBinaryFile(filename);
+        data = (const char*)packedFile.data;
+        size = packedFile.size;
+    }
+    else
+    {
+        mappedFile = MapFile(filename);
+        data = (const char*)mappedFile.data;
+        size = mappedFile.size;
+    }
+
+    if (!data)
+    {
+        ELOG("Could not open file %s", filename);
+        return false;
+    }
+
+    // Split the file in chunks that end at line boundaries
+    u32 chunkCount = (u32)std::min<u64>(std::max<u64>(size / OBJ_MIN_CHUNK_SIZE, 1), GetJobThreadCount() * 4);
+    std::vector<ObjChunk> chunks(chunkCount);
+    const char* fileEnd = data + size;
+    const char* chunkBegin = data;
+    for (u32 i = 0; i < chunkCount; ++i)
+    {
+        const char* chunkEnd = (i + 1 == chunkCount) ? fileEnd : NextLine(data + size * (i + 1) / chunkCount, fileEnd);
+        chunkEnd = std::max(chunkEnd, chunkBegin);
+        chunks[i].begin = chunkBegin;
+        chunks[i].end = chunkEnd;
+        chunkBegin = chunkEnd;
+    }
+
+    ParallelFor(chunkCount, 1, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i)
+            ParseChunk(chunks[i]);
+    });
+
+    UnmapFile(mappedFile);
+    FreeFileData(packedFile);
+
+    // Merge the elements of all the chunks
+    u32 positionCount = 0, texcoordCount = 0, normalCount = 0;
+    for (ObjChunk& chunk : chunks)
+    {
+        if (chunk.error)
+        {
+            ELOG("Malformed face in %s", filename);
+            return false;
+        }
+
+        chunk.positionBase = positionCount;
+        chunk.texcoordBase = texcoordCount;
+        chunk.normalBase = normalCount;
+        positionCount += (u32)chunk.positions.size();
+        texcoordCount += (u32)chunk.texcoords.size();
+        normalCount += (u32)chunk.normals.size();
+    }
+
+    std::vector<glm::vec3> positions(positionCount);
+    std::vector<glm::vec2> texcoords(texcoordCount);
+    std::vector<glm::vec3> normals(normalCount);
+    std::atomic<bool> indicesInRange(true);
+
+    ParallelFor(chunkCount, 1, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i)
+        {
+            ObjChunk& chunk = chunks[i];
+            std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + chunk.positionBase);
+            std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), texcoords.begin() + chunk.texcoordBase);
+            std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + chunk.normalBase);
+
+            const u32 bases[3] = { chunk.positionBase, chunk.texcoordBase, chunk.normalBase };
+            i32* components = (i32*)chunk.corners.data();
+            for (u32 relativeIdx : chunk.relativeIndices)
+                components[relativeIdx] += (i32)bases[relativeIdx % 3];
+
+            for (const ObjCorner& corner : chunk.corners)
+            {
+                if (corner.position < 0 || corner.position >= (i32)positionCount ||
+                    corner.texcoord >= (i32)texcoordCount || corner.normal >= (i32)normalCount ||
+                    corner.texcoord < -1 || corner.normal < -1)
+                    indicesInRange = false;
+            }
+        }
+    });
+
+    if (!indicesInRange)
+    {
+        ELOG("Index out of range in %s", filename);
+        return false;
+    }
+
+    // Materials, in the order of the material libraries
+    std::string directory = filename;
+    size_t separator = directory.find_last_of("/\\");
+    directory = (separator != std::string::npos) ? directory.substr(0, separator) : std::string(".");
+
+    std::vector<ImportedMaterial> materials;
+    for (const ObjChunk& chunk : chunks)
+    {
+        for (const std::string& library : chunk.materialLibraries)
+        {
+            std::string libraryPath = NormalizeAssetPath((directory + "/" + library).c_str());
+            if (dependencies)
+                dependencies->push_back(libraryPath);
+            ParseMtlFile(libraryPath.c_str(), directory, materials);
+        }
+    }
+
+    std::map<std::string, u32> materialIndices;
+    for (u32 i = 0; i < materials.size(); ++i)
+        materialIndices.insert(std::make_pair(materials[i].name, i));
+
+    // Group the triangles by material, one submesh for each material that is used
+    std::vector<std::vector<ObjTriangleRange>> submeshRanges;
+    std::vector<u32> submeshMaterials;
+    std::map<u32, u32> materialSubmeshes;
+    u32 currentMaterial = UINT32_MAX;
+    u32 defaultMaterial = UINT32_MAX;
+
+    for (u32 chunkIdx = 0; chunkIdx < chunkCount; ++chunkIdx)
+    {
+        const ObjChunk& chunk = chunks[chunkIdx];
+        const u32 triangleCount = (u32)chunk.corners.size() / 3;
+
+        u32 spanIdx = 0;
+        u32 triangle = 0;
+        while (triangle < triangleCount || spanIdx < chunk.materialSpans.size())
+        {
+            // Material changes that happen before the current triangle
+            while (spanIdx < chunk.materialSpans.size() && chunk.materialSpans[spanIdx].firstTriangle <= triangle)
+            {
+                auto it = materialIndices.find(chunk.materialSpans[spanIdx].material);
+                currentMaterial = (it != materialIndices.end()) ? it->second : UINT32_MAX;
+                spanIdx++;
+            }
+
+            u32 rangeEnd = spanIdx < chunk.materialSpans.size() ? chunk.materialSpans[spanIdx].firstTriangle : triangleCount;
+            if (rangeEnd > triangle)
+            {
+                // Faces without a (known) material use a default one, as in Assimp
+                u32 material = currentMaterial;
+                if (material == UINT32_MAX)
+                {
+                    if (defaultMaterial == UINT32_MAX)
+                    {
+                        ImportedMaterial defaultMat = {};
+                        defaultMat.name = "DefaultMaterial";
+                        defaultMat.albedo = glm::vec3(0.6f);
+                        defaultMaterial = (u32)materials.size();
+                        materials.push_back(defaultMat);
+                    }
+                    material = defaultMaterial;
+                }
+
+                auto it = materialSubmeshes.find(material);
+                if (it == materialSubmeshes.end())
+                {
+                    it = materialSubmeshes.insert(std::make_pair(material, (u32)submeshRanges.size())).first;
+                    submeshRanges.push_back(std::vector<ObjTriangleRange>());
+                    submeshMaterials.push_back(material);
+                }
+                submeshRanges[it->second].push_back(ObjTriangleRange{ chunkIdx, triangle, rangeEnd - triangle });
+            }
+            triangle = rangeEnd;
+        }
+    }
+
+    model.submeshes.resize(submeshRanges.size());
+    ParallelFor((u32)submeshRanges.size(), 1, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i)
+        {
+            BuildSubmesh(chunks, submeshRanges[i], positions, texcoords, normals, model.submeshes[i]);
+            model.submeshes[i].materialIdx = submeshMaterials[i];
+        }
+    });
+
+    // OBJ files have no hierarchy, everything hangs from the root
+    ImportedNode root = {};
+    root.name = filename;
+    root.parent = UINT32_MAX;
+    root.transform = glm::mat4(1.0f);
+    for (u32 i = 0; i < model.submeshes.size(); ++i)
+        root.submeshes.push_back(i);
+    model.nodes.push_back(root);
+
+    directory = NormalizeAssetPath(directory.c_str());
+    for (ImportedMaterial& material : materials)
+        ResolveMaterialTextures(material, directory, dependencies);
+    model.materials.swap(materials);
+
+    if (dependencies)
+    {
+        std::sort(dependencies->begin(), dependencies->end());
+        dependencies->erase(std::unique(dependencies->begin(), dependencies->end()), dependencies->end());
+    }
+
+    return true;
+}
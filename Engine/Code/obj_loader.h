@@ -0,0 +1,20 @@
+//
+// obj_loader.h: Native loader for Wavefront OBJ/MTL files, used by ImportModel instead
+// of Assimp for .obj models.
+//
+// The file is memory mapped and split in chunks (at line boundaries) that are parsed
+// in parallel. Chunks are merged afterwards, faces are triangulated as a fan, and the
+// vertices of every submesh (one per material) are welded with a hash table. Normals
+// and tangent space are generated like the Assimp post-processes did, so the result
+// is the same as the one of the Assimp import.
+//
+
+#pragma once
+
+#include "model_import.h"
+
+/**
+ * Returns false if the file cannot be read or is malformed (e.g. indices out of range),
+ * in which case ImportModel falls back to Assimp.
+ */
+bool ImportObjModel(const char* filename, ImportedModel& model, std::vector<std::string>* dependencies = NULL);
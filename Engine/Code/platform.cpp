@@ -16,6 +16,8 @@
 #endif
 
 #include "engine.h"
+#include "asset_pack.h"
+#include "job_system.h"
 
 #include <GLFW/glfw3.h>
 #include <stdio.h>
@@ -206,6 +208,11 @@ int main()
 
     GlobalFrameArenaMemory = (u8*)malloc(GLOBAL_FRAME_ARENA_SIZE);
 
+    InitJobSystem();
+
+    // When present, the assets are read from the pack instead of the loose files
+    OpenAssetPack(ASSET_PACK_FILENAME);
+
     Init(&app);
 
     while (app.isRunning)
@@ -269,6 +276,10 @@ int main()
         GlobalFrameArenaHead = 0;
     }
 
+    CloseAssetPack();
+
+    ShutdownJobSystem();
+
     free(GlobalFrameArenaMemory);
 
     ImGui_ImplOpenGL3_Shutdown();
@@ -360,6 +371,18 @@ String ReadTextFile(const char* filepath)
 {
     String fileText = {};
 
+    const AssetPackEntry* entry = FindAssetPackEntry(filepath);
+    if (entry)
+    {
+        fileText.len = (u32)entry->size;
+        fileText.str = (char*)PushSize(fileText.len + 1);
+        if (ReadAssetPackEntry(entry, fileText.str))
+        {
+            fileText.str[fileText.len] = '\0';
+            return fileText;
+        }
+    }
+
     FILE* file = fopen(filepath, "rb");
 
     if (file)
@@ -415,3 +438,8 @@ void LogString(const char* str)
     fprintf(stderr, "%s\n", str);
 #endif
 }
+
+void* GetGLProcAddress(const char* name)
+{
+    return (void*)glfwGetProcAddress(name);
+}
@@ -91,6 +91,12 @@ u64 GetFileLastWriteTimestamp(const char *filepath);
  */
 void LogString(const char* str);
 
+/**
+ * Returns the address of an OpenGL function of the current context, or NULL if it is
+ * not available. For functions newer than the GL version loaded by glad.
+ */
+void* GetGLProcAddress(const char* name);
+
 #define ILOG(...)                 \
 {                                 \
 char logBuffer[1024] = {};        \
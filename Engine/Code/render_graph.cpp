@@ -0,0 +1,440 @@
+//
+// render_graph.cpp: Pass culling, target lifetimes and texture aliasing of the frame graph.
+//
+
+#include "render_graph.h"
+#include "gl_state.h"
+#include <string.h>
+
+// The filter is texture state set when the textures are assigned, before any pass
+// executes, so targets sharing a texture must also share the filter
+static bool DescsAlias(const RenderTargetDesc& a, const RenderTargetDesc& b)
+{
+    return a.size == b.size && a.format == b.format && a.samples == b.samples && a.filter == b.filter;
+}
+
+void BeginRenderGraph(RenderGraph& graph, const glm::ivec2& backbufferSize)
+{
+    graph.passes.clear();
+    graph.targets.clear();
+    graph.backbufferSize = backbufferSize;
+    graph.compiled = false;
+
+    RenderGraphTarget backbuffer = {};
+    backbuffer.name = "Backbuffer";
+    backbuffer.desc.size = backbufferSize;
+    backbuffer.clearColor = glm::vec4(0.2f, 0.2f, 0.2f, 1.f);
+    backbuffer.imported = true;
+    graph.targets.push_back(backbuffer);
+}
+
+u32 CreateRenderTarget(RenderGraph& graph, const char* name, const glm::ivec2& size, GLenum format, GLenum filter, u32 samples, const glm::vec4& clearColor)
+{
+    RenderGraphTarget target = {};
+    target.name = name;
+    target.desc.size = size;
+    target.desc.format = format;
+    target.desc.samples = samples;
+    target.desc.filter = filter;
+    target.clearColor = clearColor;
+    graph.targets.push_back(target);
+    return (u32)graph.targets.size() - 1;
+}
+
+u32 ImportRenderTarget(RenderGraph& graph, const char* name, GLuint texture, const RenderTargetDesc& desc, const glm::vec4& clearColor)
+{
+    RenderGraphTarget target = {};
+    target.name = name;
+    target.desc = desc;
+    target.clearColor = clearColor;
+    target.imported = true;
+    target.texture = texture;
+    graph.targets.push_back(target);
+    return (u32)graph.targets.size() - 1;
+}
+
+RenderGraphPass& AddRenderGraphPass(RenderGraph& graph, const char* name, const RenderGraphExecute& execute)
+{
+    graph.passes.emplace_back();
+    RenderGraphPass& pass = graph.passes.back();
+    pass.name = name;
+    pass.depth = { RENDER_GRAPH_NONE, RenderGraphLoad_DontCare, false };
+    pass.execute = execute;
+    pass.alive = false;
+    return pass;
+}
+
+void AddPassRead(RenderGraphPass& pass, u32 target)
+{
+    pass.reads.push_back(target);
+}
+
+void AddPassColorOutput(RenderGraphPass& pass, u32 target, RenderGraphLoadOp load)
+{
+    ASSERT(pass.colors.size() < RENDER_GRAPH_MAX_COLOR_ATTACHMENTS, "Too many color attachments");
+    pass.colors.push_back({ target, load, false });
+}
+
+void SetPassDepthOutput(RenderGraphPass& pass, u32 target, RenderGraphLoadOp load)
+{
+    pass.depth = { target, load, false };
+}
+
+void AddPassStorageOutput(RenderGraphPass& pass, u32 target)
+{
+    pass.storageWrites.push_back(target);
+}
+
+void SetPassSideEffects(RenderGraphPass& pass)
+{
+    pass.sideEffects = true;
+}
+
+// Walks the passes backwards keeping which targets a later live pass reads. A pass that
+// writes none of them is culled, and so are its color attachments that are not.
+static void CullPasses(RenderGraph& graph, u32 debugTarget)
+{
+    // The imported targets outlive the frame, what is written to them is kept
+    std::vector<bool> live(graph.targets.size(), false);
+    for (u32 i = 0; i < graph.targets.size(); ++i)
+        live[i] = graph.targets[i].imported;
+    if (debugTarget != RENDER_GRAPH_NONE)
+        live[debugTarget] = true;
+
+    for (u32 i = (u32)graph.passes.size(); i-- > 0;)
+    {
+        RenderGraphPass& pass = graph.passes[i];
+
+        pass.alive = pass.sideEffects;
+        for (RenderGraphAttachment& color : pass.colors)
+            pass.alive |= live[color.target];
+        if (pass.depth.target != RENDER_GRAPH_NONE)
+            pass.alive |= live[pass.depth.target];
+        for (u32 target : pass.storageWrites)
+            pass.alive |= live[target];
+
+        if (!pass.alive)
+        {
+            graph.stats.culledPasses++;
+            continue;
+        }
+
+        // Before the pass, what it writes only matters if it loads it
+        for (RenderGraphAttachment& color : pass.colors)
+        {
+            color.dropped = !live[color.target];
+            if (color.dropped)
+                graph.stats.droppedAttachments++;
+            if (color.load != RenderGraphLoad_Load)
+                live[color.target] = false;
+        }
+        if (pass.depth.target != RENDER_GRAPH_NONE)
+            live[pass.depth.target] = pass.depth.load == RenderGraphLoad_Load;
+        for (u32 target : pass.storageWrites)
+            live[target] = false;
+
+        for (u32 target : pass.reads)
+            live[target] = true;
+        for (const RenderGraphAttachment& color : pass.colors)
+        {
+            if (color.load == RenderGraphLoad_Load && !color.dropped)
+                live[color.target] = true;
+        }
+    }
+}
+
+static void UseTarget(RenderGraph& graph, u32 target, u32 passIdx)
+{
+    RenderGraphTarget& t = graph.targets[target];
+    if (t.imported)
+        return;
+    if (!t.needed)
+        t.firstPass = passIdx;
+    t.lastPass = passIdx;
+    t.needed = true;
+}
+
+// Lifetimes of the targets, and checks that the live passes read what an earlier one wrote
+static void ComputeLifetimes(RenderGraph& graph, u32 debugTarget)
+{
+    // The imported targets keep what an earlier frame wrote
+    std::vector<bool> written(graph.targets.size(), false);
+    for (u32 i = 0; i < graph.targets.size(); ++i)
+        written[i] = graph.targets[i].imported;
+
+    for (u32 i = 0; i < graph.passes.size(); ++i)
+    {
+        const RenderGraphPass& pass = graph.passes[i];
+        if (!pass.alive)
+            continue;
+
+        for (u32 target : pass.reads)
+        {
+            if (!written[target])
+            {
+                ELOG("Render graph: %s reads %s before any pass writes it", pass.name, graph.targets[target].name);
+            }
+            UseTarget(graph, target, i);
+        }
+        for (const RenderGraphAttachment& color : pass.colors)
+        {
+            if (color.dropped)
+                continue;
+            UseTarget(graph, color.target, i);
+            written[color.target] = true;
+        }
+        if (pass.depth.target != RENDER_GRAPH_NONE)
+        {
+            UseTarget(graph, pass.depth.target, i);
+            written[pass.depth.target] = true;
+        }
+        for (u32 target : pass.storageWrites)
+        {
+            UseTarget(graph, target, i);
+            written[target] = true;
+        }
+    }
+
+    if (debugTarget != RENDER_GRAPH_NONE && graph.targets[debugTarget].needed)
+        graph.targets[debugTarget].lastPass = (u32)graph.passes.size();
+}
+
+void ReleaseRenderTargetFramebuffers(RenderGraph& graph, GLuint texture)
+{
+    for (u32 i = 0; i < graph.framebuffers.size();)
+    {
+        RenderGraphFramebuffer& framebuffer = graph.framebuffers[i];
+        bool attached = framebuffer.depth == texture;
+        for (GLuint color : framebuffer.colors)
+            attached |= color == texture;
+
+        if (attached)
+        {
+            glDeleteFramebuffers(1, &framebuffer.handle);
+            graph.framebuffers[i] = graph.framebuffers.back();
+            graph.framebuffers.pop_back();
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+// Acquires a texture of the pool for each target when its lifetime starts. A texture the
+// frame already acquired is reused if its last target is dead before this one starts.
+static void AssignTextures(RenderGraph& graph)
+{
+    struct FrameTexture
+    {
+        GLuint           handle;
+        RenderTargetDesc desc;
+        u32              lastPass;
+    };
+    std::vector<FrameTexture> frameTextures;
+
+    BeginRenderTargetPoolFrame(graph.pool);
+
+    for (u32 i = 0; i < graph.passes.size(); ++i)
+    {
+        if (!graph.passes[i].alive)
+            continue;
+
+        for (RenderGraphTarget& target : graph.targets)
+        {
+            if (!target.needed || target.firstPass != i)
+                continue;
+
+            FrameTexture* alias = NULL;
+            for (FrameTexture& texture : frameTextures)
+            {
+                if (texture.lastPass < target.firstPass && DescsAlias(texture.desc, target.desc))
+                {
+                    alias = &texture;
+                    break;
+                }
+            }
+
+            if (alias)
+            {
+                alias->lastPass = target.lastPass;
+                target.texture = alias->handle;
+            }
+            else
+            {
+                target.texture = AcquireRenderTarget(graph.pool, target.desc, target.name);
+                frameTextures.push_back({ target.texture, target.desc, target.lastPass });
+                graph.stats.frameBytes += GetRenderTargetBytes(target.desc);
+            }
+        }
+    }
+
+    // The framebuffers of the textures the pool deleted go with them
+    EndRenderTargetPoolFrame(graph.pool);
+    for (GLuint texture : graph.pool.destroyed)
+        ReleaseRenderTargetFramebuffers(graph, texture);
+}
+
+void CompileRenderGraph(RenderGraph& graph)
+{
+    graph.stats = {};
+    graph.stats.passes = (u32)graph.passes.size();
+
+    u32 debugTarget = RENDER_GRAPH_NONE;
+    for (u32 i = 0; i < graph.targets.size(); ++i)
+    {
+        RenderGraphTarget& target = graph.targets[i];
+        target.needed = false;
+        target.firstPass = RENDER_GRAPH_NONE;
+        target.lastPass = RENDER_GRAPH_NONE;
+        if (!target.imported)
+            target.texture = 0;
+        if (i != RENDER_GRAPH_BACKBUFFER && graph.debugTargetName == target.name)
+            debugTarget = i;
+    }
+
+    CullPasses(graph, debugTarget);
+    ComputeLifetimes(graph, debugTarget);
+    AssignTextures(graph);
+
+    for (const RenderGraphTarget& target : graph.targets)
+    {
+        if (!target.needed)
+            continue;
+        graph.stats.targets++;
+        graph.stats.targetBytes += GetRenderTargetBytes(target.desc);
+    }
+
+    graph.debugTexture = debugTarget != RENDER_GRAPH_NONE ? GetRenderTargetTexture(graph, debugTarget) : 0;
+    graph.compiled = true;
+
+    // Textures and framebuffers were created and deleted behind the state cache
+    ResetGLStateCache();
+}
+
+static GLuint GetFramebuffer(RenderGraph& graph, const GLuint* colors, GLuint depth)
+{
+    for (const RenderGraphFramebuffer& framebuffer : graph.framebuffers)
+    {
+        if (framebuffer.depth == depth && memcmp(framebuffer.colors, colors, sizeof(framebuffer.colors)) == 0)
+            return framebuffer.handle;
+    }
+
+    RenderGraphFramebuffer framebuffer = {};
+    memcpy(framebuffer.colors, colors, sizeof(framebuffer.colors));
+    framebuffer.depth = depth;
+
+    // Built on the read binding, a pass may ask for one to blit from while it draws
+    glGenFramebuffers(1, &framebuffer.handle);
+    BindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer.handle);
+    for (u32 i = 0; i < RENDER_GRAPH_MAX_COLOR_ATTACHMENTS; ++i)
+    {
+        if (colors[i])
+            glFramebufferTexture(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, colors[i], 0);
+    }
+    if (depth)
+        glFramebufferTexture(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth, 0);
+
+    const GLenum status = glCheckFramebufferStatus(GL_READ_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        ELOG("Render graph: incomplete framebuffer (status %x)", status);
+    }
+
+    graph.framebuffers.push_back(framebuffer);
+    return framebuffer.handle;
+}
+
+// Binds the attachments of the pass and clears the ones that ask for it
+static void BeginPass(RenderGraph& graph, const RenderGraphPass& pass)
+{
+    const bool hasDepth = pass.depth.target != RENDER_GRAPH_NONE;
+    if (pass.colors.empty() && !hasDepth)
+        return;
+
+    glm::ivec2 size = graph.backbufferSize;
+    const bool backbuffer = (!pass.colors.empty() && pass.colors[0].target == RENDER_GRAPH_BACKBUFFER) || pass.depth.target == RENDER_GRAPH_BACKBUFFER;
+    if (backbuffer)
+    {
+        ASSERT(pass.colors.size() <= 1 && (!hasDepth || pass.depth.target == RENDER_GRAPH_BACKBUFFER), "The backbuffer cannot be attached with other targets");
+        BindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    else
+    {
+        GLuint colors[RENDER_GRAPH_MAX_COLOR_ATTACHMENTS] = {};
+        GLenum drawBuffers[RENDER_GRAPH_MAX_COLOR_ATTACHMENTS] = {};
+        for (u32 i = 0; i < pass.colors.size(); ++i)
+        {
+            const RenderGraphAttachment& color = pass.colors[i];
+            colors[i] = color.dropped ? 0 : GetRenderTargetTexture(graph, color.target);
+            drawBuffers[i] = color.dropped ? GL_NONE : GL_COLOR_ATTACHMENT0 + i;
+        }
+        const GLuint depth = hasDepth ? GetRenderTargetTexture(graph, pass.depth.target) : 0;
+
+        BindFramebuffer(GL_FRAMEBUFFER, GetFramebuffer(graph, colors, depth));
+        if (pass.colors.empty())
+            SetDrawBuffer(GL_NONE);
+        else
+            SetDrawBuffers((u32)pass.colors.size(), drawBuffers);
+
+        size = graph.targets[pass.colors.empty() ? pass.depth.target : pass.colors[0].target].desc.size;
+    }
+    SetViewport(0, 0, size.x, size.y);
+
+    for (u32 i = 0; i < pass.colors.size(); ++i)
+    {
+        const RenderGraphAttachment& color = pass.colors[i];
+        if (color.load == RenderGraphLoad_Clear && !color.dropped)
+        {
+            glClearBufferfv(GL_COLOR, i, glm::value_ptr(graph.targets[color.target].clearColor));
+            graph.stats.clears++;
+        }
+    }
+    if (hasDepth && pass.depth.load == RenderGraphLoad_Clear)
+    {
+        const f32 depth = 1.f;
+        SetDepthMask(true);
+        glClearBufferfv(GL_DEPTH, 0, &depth);
+        graph.stats.clears++;
+    }
+}
+
+void ExecuteRenderGraph(RenderGraph& graph)
+{
+    ASSERT(graph.compiled, "The render graph must be compiled before it is executed");
+
+    for (const RenderGraphPass& pass : graph.passes)
+    {
+        if (!pass.alive)
+            continue;
+
+        BeginPass(graph, pass);
+        pass.execute(graph, pass);
+    }
+}
+
+GLuint GetRenderTargetTexture(const RenderGraph& graph, u32 target)
+{
+    return graph.targets[target].texture;
+}
+
+GLuint GetRenderTargetFramebuffer(RenderGraph& graph, u32 target)
+{
+    GLuint colors[RENDER_GRAPH_MAX_COLOR_ATTACHMENTS] = {};
+    GLuint depth = 0;
+    if (IsDepthFormat(graph.targets[target].desc.format))
+        depth = GetRenderTargetTexture(graph, target);
+    else
+        colors[0] = GetRenderTargetTexture(graph, target);
+    return GetFramebuffer(graph, colors, depth);
+}
+
+void DestroyRenderGraph(RenderGraph& graph)
+{
+    for (RenderGraphFramebuffer& framebuffer : graph.framebuffers)
+        glDeleteFramebuffers(1, &framebuffer.handle);
+    DestroyRenderTargetPool(graph.pool);
+    graph.framebuffers.clear();
+    graph.passes.clear();
+    graph.targets.clear();
+}
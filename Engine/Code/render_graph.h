@@ -0,0 +1,191 @@
+//
+// render_graph.h: Frame graph, the passes of the frame declared with the render targets
+// they read and write, then compiled and executed.
+//
+// Every frame Render adds the passes of the mode in order: the targets of the frame,
+// then each pass with its reads, its color/depth attachments and the images it writes
+// from a compute shader, and a function that draws it. Compiling the graph:
+//   - culls the passes whose outputs no later pass reads, unless they write an
+//     imported target like the backbuffer (or the target shown in the debug view), or
+//     have effects outside the graph. A color attachment nobody
+//     reads is left out of the framebuffer (GL_NONE), so it costs neither memory nor
+//     bandwidth. The depth attachment is always kept, the pass tests against it.
+//   - schedules the passes that are left in the order they were added, which must
+//     have the writers of a target before its readers (checked).
+//   - gives each transient target the lifetime from its first to its last pass, and a
+//     texture for that lifetime. A texture of the same size, format and samples whose
+//     previous target is dead is reused (GL has no memory aliasing, reusing the texture
+//     object is the alias), otherwise one is acquired from the render target pool,
+//     which releases the textures the frames stop using.
+//
+// Executing binds for each pass a framebuffer with its attachments (cached per set of
+// textures), sets the viewport to their size, clears the attachments whose load op is
+// RenderGraphLoad_Clear and calls the pass. Nothing else is cleared.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "render_target_pool.h"
+#include <glad/glad.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define RENDER_GRAPH_MAX_COLOR_ATTACHMENTS 8
+
+// The default framebuffer, imported in every graph by BeginRenderGraph
+#define RENDER_GRAPH_BACKBUFFER 0
+
+#define RENDER_GRAPH_NONE 0xffffffffu
+
+enum RenderGraphLoadOp
+{
+    RenderGraphLoad_DontCare, // The pass writes every pixel it needs
+    RenderGraphLoad_Clear,
+    RenderGraphLoad_Load,     // The pass adds to what the previous writer left
+};
+
+struct RenderGraphTarget
+{
+    const char*      name;
+    RenderTargetDesc desc;
+    glm::vec4        clearColor; // Depth targets clear to 1
+    bool             imported;
+
+    // Compiled
+    bool   needed;      // Some live pass uses it
+    u32    firstPass;   // Lifetime, in passes
+    u32    lastPass;
+    GLuint texture;
+};
+
+struct RenderGraphAttachment
+{
+    u32               target;
+    RenderGraphLoadOp load;
+    bool              dropped; // Compiled, no later pass reads it (GL_NONE)
+};
+
+struct RenderGraph;
+struct RenderGraphPass;
+
+typedef std::function<void(RenderGraph& graph, const RenderGraphPass& pass)> RenderGraphExecute;
+
+struct RenderGraphPass
+{
+    const char*                        name;
+    std::vector<u32>                   reads;          // Sampled or blit from
+    std::vector<RenderGraphAttachment> colors;         // COLOR_ATTACHMENTi, the fragment output locations
+    RenderGraphAttachment              depth;          // target RENDER_GRAPH_NONE if none
+    std::vector<u32>                   storageWrites;  // Written with imageStore, not attached
+    RenderGraphExecute                 execute;
+    bool                               sideEffects;    // Never culled, see SetPassSideEffects
+
+    // Compiled
+    bool alive;
+};
+
+struct RenderGraphFramebuffer
+{
+    GLuint handle;
+    GLuint colors[RENDER_GRAPH_MAX_COLOR_ATTACHMENTS];
+    GLuint depth;
+};
+
+struct RenderGraphStats
+{
+    u32 passes;
+    u32 culledPasses;
+    u32 targets;           // Transient targets used by the frame
+    u32 droppedAttachments;
+    u32 clears;
+    u64 frameBytes;        // Textures of the frame
+    u64 targetBytes;       // The transient targets with a texture each, without aliasing
+};
+
+struct RenderGraph
+{
+    std::vector<RenderGraphTarget>      targets;
+    std::vector<RenderGraphPass>        passes;
+    glm::ivec2                          backbufferSize;
+    bool                                compiled;
+
+    RenderTargetPool                    pool;
+    std::vector<RenderGraphFramebuffer> framebuffers;
+
+    // Target shown by the debug view, kept alive until the end of the frame
+    std::string                         debugTargetName;
+    GLuint                              debugTexture;
+
+    RenderGraphStats                    stats;
+};
+
+/**
+ * Starts the graph of a frame: forgets the passes and targets of the last one and
+ * imports the default framebuffer as RENDER_GRAPH_BACKBUFFER. The pool is kept.
+ */
+void BeginRenderGraph(RenderGraph& graph, const glm::ivec2& backbufferSize);
+
+/**
+ * A transient target of the frame, which only has a texture between its first and its
+ * last pass. Returns its index, valid until the next BeginRenderGraph.
+ */
+u32 CreateRenderTarget(RenderGraph& graph, const char* name, const glm::ivec2& size, GLenum format, GLenum filter = GL_NEAREST, u32 samples = 1, const glm::vec4& clearColor = glm::vec4(0.2f, 0.2f, 0.2f, 1.f));
+
+/**
+ * A target whose texture is owned outside the graph, kept from one frame to the next. The
+ * passes that write it are not culled and its reads do not need a writer in the frame.
+ * Call ReleaseRenderTargetFramebuffers before the texture is deleted.
+ */
+u32 ImportRenderTarget(RenderGraph& graph, const char* name, GLuint texture, const RenderTargetDesc& desc, const glm::vec4& clearColor = glm::vec4(0.2f, 0.2f, 0.2f, 1.f));
+
+/**
+ * Adds a pass after the others. The reference is valid until the next pass is added.
+ */
+RenderGraphPass& AddRenderGraphPass(RenderGraph& graph, const char* name, const RenderGraphExecute& execute);
+
+void AddPassRead(RenderGraphPass& pass, u32 target);
+void AddPassColorOutput(RenderGraphPass& pass, u32 target, RenderGraphLoadOp load);
+void SetPassDepthOutput(RenderGraphPass& pass, u32 target, RenderGraphLoadOp load);
+void AddPassStorageOutput(RenderGraphPass& pass, u32 target);
+
+/**
+ * The pass does something outside the graph (reads the targets back), it runs even if it
+ * writes no target a later pass reads.
+ */
+void SetPassSideEffects(RenderGraphPass& pass);
+
+/**
+ * Culls the passes, computes the lifetimes of the targets and assigns them the
+ * textures of the pool, creating and releasing textures as needed.
+ */
+void CompileRenderGraph(RenderGraph& graph);
+
+/**
+ * Runs the live passes in order. The graph must be compiled.
+ */
+void ExecuteRenderGraph(RenderGraph& graph);
+
+/**
+ * Texture of a transient target, 0 if the compiled graph does not use it. Only valid
+ * while the passes that use the target run.
+ */
+GLuint GetRenderTargetTexture(const RenderGraph& graph, u32 target);
+
+/**
+ * Framebuffer with only the target attached (as depth if it is a depth format), to
+ * blit from it.
+ */
+GLuint GetRenderTargetFramebuffer(RenderGraph& graph, u32 target);
+
+/**
+ * Deletes the cached framebuffers with the texture attached, the texture is about to be
+ * deleted.
+ */
+void ReleaseRenderTargetFramebuffers(RenderGraph& graph, GLuint texture);
+
+/**
+ * Releases the framebuffers and the render target pool.
+ */
+void DestroyRenderGraph(RenderGraph& graph);
@@ -0,0 +1,416 @@
+//
+// render_queue.cpp: Sorting and submission of the draw items.
+//
+
+#include "render_queue.h"
+#include "buffer_management.h"
+#include "engine.h"
+#include "geometry_storage.h"
+#include "gl_state.h"
+#include "gpu_culling.h"
+
+#include <algorithm>
+#include <string.h>
+
+#define DRAW_KEY_PASS_SHIFT     60
+#define DRAW_KEY_PROGRAM_SHIFT  52
+#define DRAW_KEY_MATERIAL_SHIFT 36
+#define DRAW_KEY_MESH_SHIFT     20
+#define DRAW_KEY_DEPTH_MASK     0xFFFFF
+
+// Texture units of the material samplers (see BindMaterial)
+#define MATERIAL_TEXTURE_UNITS 3
+
+// Passes whose program samples the material textures, the rest only read MaterialParms
+static const bool PassUsesMaterialTextures[RenderPass_Count] = {
+    true,  // RenderPass_Forward
+    true,  // RenderPass_GBuffer
+    false, // RenderPass_WaterReflection
+    false, // RenderPass_WaterRefraction
+    false, // RenderPass_WaterBase
+    false, // RenderPass_DepthPrepass
+};
+
+u64 MakeDrawKey(RenderPass pass, u32 programIdx, u32 materialIdx, u32 meshIdx, f32 viewDepth)
+{
+    const f32 normalizedDepth = glm::clamp(viewDepth / RENDER_QUEUE_MAX_DEPTH, 0.0f, 1.0f);
+    const u64 depth = (u64)(normalizedDepth * DRAW_KEY_DEPTH_MASK);
+
+    return ((u64)(pass & 0xF) << DRAW_KEY_PASS_SHIFT) |
+           ((u64)(programIdx & 0xFF) << DRAW_KEY_PROGRAM_SHIFT) |
+           ((u64)(materialIdx & 0xFFFF) << DRAW_KEY_MATERIAL_SHIFT) |
+           ((u64)(meshIdx & 0xFFFF) << DRAW_KEY_MESH_SHIFT) |
+           depth;
+}
+
+void ClearRenderQueue(RenderQueue& queue)
+{
+    queue.items.clear();
+    queue.transforms.clear();
+}
+
+void AddDepthPrepassItems(App* app, RenderQueue& queue, RenderPass pass, u32 programIdx)
+{
+    const u32 itemCount = (u32)queue.items.size();
+    for (u32 i = 0; i < itemCount; ++i)
+    {
+        if ((RenderPass)(queue.items[i].key >> DRAW_KEY_PASS_SHIFT) != pass)
+            continue;
+        if (app->materials[queue.items[i].materialIdx].hasBumpText)
+            continue;
+
+        // Sorted by mesh and front to back, the material does not matter without shading
+        DrawItem item = queue.items[i];
+        item.key = MakeDrawKey(RenderPass_DepthPrepass, programIdx, 0, item.meshIdx, 0.0f) | (item.key & DRAW_KEY_DEPTH_MASK);
+        item.programIdx = programIdx;
+        queue.items.push_back(item);
+    }
+}
+
+void SortRenderQueue(RenderQueue& queue)
+{
+    const u32 count = (u32)queue.items.size();
+    if (count < 2)
+        return;
+
+    // Histograms of the 8 bytes of the keys in a single read of the items
+    u32 histograms[8][256] = {};
+    for (const DrawItem& item : queue.items)
+        for (u32 byte = 0; byte < 8; ++byte)
+            histograms[byte][(item.key >> (byte * 8)) & 0xFF]++;
+
+    queue.sortScratch.resize(count);
+    DrawItem* source = queue.items.data();
+    DrawItem* destination = queue.sortScratch.data();
+
+    for (u32 byte = 0; byte < 8; ++byte)
+    {
+        u32* histogram = histograms[byte];
+        const u32 shift = byte * 8;
+
+        // All the keys have the same byte, the pass would not move anything
+        if (histogram[(source[0].key >> shift) & 0xFF] == count)
+            continue;
+
+        u32 offset = 0;
+        for (u32 i = 0; i < 256; ++i)
+        {
+            const u32 bucketCount = histogram[i];
+            histogram[i] = offset;
+            offset += bucketCount;
+        }
+
+        for (u32 i = 0; i < count; ++i)
+            destination[histogram[(source[i].key >> shift) & 0xFF]++] = source[i];
+
+        std::swap(source, destination);
+    }
+
+    if (source != queue.items.data())
+        queue.items.swap(queue.sortScratch);
+}
+
+// Bound state while submitting a pass, to skip the binds that would not change it
+struct SubmitState
+{
+    u32    programIdx;
+    u32    materialIdx;
+    GLuint vao;
+    GLuint textures[MATERIAL_TEXTURE_UNITS];
+    u32    localParamsOffset;
+    u32    localParamsSize;
+};
+
+// Counts a bind as issued or, if the state already has the value, as saved
+static bool NeedsBind(bool stateChanged, RenderQueueStats& stats)
+{
+    if (stateChanged)
+        stats.stateChanges++;
+    else
+        stats.stateChangesSaved++;
+    return stateChanged;
+}
+
+// Items of a pass in a sorted queue
+static void FindPassRange(const RenderQueue& queue, RenderPass pass, u32& begin, u32& end)
+{
+    const u64 passBegin = (u64)pass << DRAW_KEY_PASS_SHIFT;
+    const u64 passEnd = (u64)(pass + 1) << DRAW_KEY_PASS_SHIFT;
+    auto compareKey = [](const DrawItem& item, u64 key) { return item.key < key; };
+    auto beginIt = std::lower_bound(queue.items.begin(), queue.items.end(), passBegin, compareKey);
+    auto endIt = std::lower_bound(beginIt, queue.items.end(), passEnd, compareKey);
+
+    begin = (u32)(beginIt - queue.items.begin());
+    end = (u32)(endIt - queue.items.begin());
+}
+
+// Texture of each material unit, 0 for the units the material does not sample
+static void GetMaterialTextures(App* app, u32 materialIdx, GLuint textures[MATERIAL_TEXTURE_UNITS])
+{
+    const Material& material = app->materials[materialIdx];
+    const bool unitUsed[MATERIAL_TEXTURE_UNITS] = { true, material.hasNormalText != 0, material.hasBumpText != 0 };
+    const u32 textureIdx[MATERIAL_TEXTURE_UNITS] = { material.albedoTextureIdx, material.normalsTextureIdx, material.bumpTextureIdx };
+
+    for (u32 unit = 0; unit < MATERIAL_TEXTURE_UNITS; ++unit)
+        textures[unit] = unitUsed[unit] ? app->textures[textureIdx[unit]].handle : 0;
+}
+
+// Units without a texture in the material are not sampled, they keep their texture
+static void BindMaterialTextures(const GLuint textures[MATERIAL_TEXTURE_UNITS], SubmitState& state, RenderQueueStats& stats)
+{
+    for (u32 unit = 0; unit < MATERIAL_TEXTURE_UNITS; ++unit)
+    {
+        if (textures[unit] == 0)
+            continue;
+
+        if (NeedsBind(state.textures[unit] != textures[unit], stats))
+        {
+            state.textures[unit] = textures[unit];
+            BindTexture(unit, textures[unit]);
+        }
+    }
+}
+
+// Binds the program and the VAO of an item
+static void BindPipeline(App* app, const DrawItem& item, SubmitState& state, RenderQueueStats& stats)
+{
+    const Program& program = app->programs[item.programIdx];
+    const Submesh& submesh = app->meshes[item.meshIdx].submeshes[item.submeshIdx];
+
+    if (NeedsBind(state.programIdx != item.programIdx, stats))
+    {
+        state.programIdx = item.programIdx;
+        UseProgram(program.handle);
+    }
+
+#ifdef _DEBUG
+    CheckSubmeshVertexInput(submesh, program);
+#endif
+
+    // The VAO of the vertex pool also has the shared index buffer
+    if (NeedsBind(state.vao != submesh.vao, stats))
+    {
+        state.vao = submesh.vao;
+        BindVertexArray(submesh.vao);
+    }
+}
+
+void SubmitRenderQueue(App* app, const RenderQueue& queue, RenderPass pass)
+{
+    RenderQueueStats& stats = app->renderQueueStats;
+
+    u32 begin, end;
+    FindPassRange(queue, pass, begin, end);
+
+    // The state before the pass is unknown, so the first draw binds everything
+    SubmitState state;
+    memset(&state, 0xFF, sizeof(state));
+
+    const bool bindTextures = PassUsesMaterialTextures[pass];
+
+    for (u32 i = begin; i < end; ++i)
+    {
+        const DrawItem& item = queue.items[i];
+        const Submesh& submesh = app->meshes[item.meshIdx].submeshes[item.submeshIdx];
+
+        // Its LocalParms did not fit in the frame of the ring
+        if (item.localParamsSize > 0 && !IsRangeInBuffer(app->cBuffer, item.localParamsOffset, item.localParamsSize))
+            continue;
+
+        BindPipeline(app, item, state, stats);
+
+        if (NeedsBind(state.materialIdx != item.materialIdx, stats))
+        {
+            state.materialIdx = item.materialIdx;
+            BindMaterialParams(app, item.materialIdx);
+        }
+
+        if (bindTextures)
+        {
+            GLuint textures[MATERIAL_TEXTURE_UNITS];
+            GetMaterialTextures(app, item.materialIdx, textures);
+            BindMaterialTextures(textures, state, stats);
+        }
+
+        if (item.localParamsSize > 0 &&
+            NeedsBind(state.localParamsOffset != item.localParamsOffset || state.localParamsSize != item.localParamsSize, stats))
+        {
+            state.localParamsOffset = item.localParamsOffset;
+            state.localParamsSize = item.localParamsSize;
+            BindUniformBufferRange(BINDING(1), app->cBuffer.handle, item.localParamsOffset, item.localParamsSize);
+        }
+
+        glDrawElementsBaseVertex(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT,
+                                 (void*)(u64)(submesh.firstIndex * sizeof(u32)), submesh.baseVertex);
+        stats.drawCalls++;
+    }
+}
+
+// Draw params of every instance of the items [begin, end), in order. The instances of an
+// item have consecutive transforms.
+static void UploadDrawParams(App* app, RenderQueue& queue, u32 begin, u32 end)
+{
+    RenderQueueStats& stats = app->renderQueueStats;
+
+    queue.drawParams.clear();
+    for (u32 i = begin; i < end; ++i)
+    {
+        const DrawItem& item = queue.items[i];
+        for (u32 instance = 0; instance < item.instanceCount; ++instance)
+            queue.drawParams.push_back({ item.transformIdx + instance, item.materialIdx });
+        stats.instances += item.instanceCount;
+    }
+
+    ReserveDrawIndices(app, (u32)queue.drawParams.size());
+
+    UploadBufferData(app->drawParamsBuffer, GL_SHADER_STORAGE_BUFFER, queue.drawParams.data(), queue.drawParams.size() * sizeof(DrawParams));
+    UploadBufferData(app->transformBuffer, GL_SHADER_STORAGE_BUFFER, queue.transforms.data(), queue.transforms.size() * sizeof(glm::mat4));
+}
+
+static void BindDrawParams(App* app)
+{
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, app->drawParamsBuffer.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, app->materialStorageBuffer.handle);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, app->transformBuffer.handle);
+}
+
+// Whether an item can be drawn in the same glMultiDrawElementsIndirect as the first of a batch
+static bool SameBatch(App* app, const DrawItem& first, const DrawItem& item, bool compareTextures)
+{
+    if (item.programIdx != first.programIdx ||
+        app->meshes[item.meshIdx].submeshes[item.submeshIdx].vao != app->meshes[first.meshIdx].submeshes[first.submeshIdx].vao)
+        return false;
+
+    // Without bindless textures, a change of material textures also ends the batch
+    if (compareTextures)
+    {
+        GLuint firstTextures[MATERIAL_TEXTURE_UNITS];
+        GLuint textures[MATERIAL_TEXTURE_UNITS];
+        GetMaterialTextures(app, first.materialIdx, firstTextures);
+        GetMaterialTextures(app, item.materialIdx, textures);
+        if (memcmp(textures, firstTextures, sizeof(textures)) != 0)
+            return false;
+    }
+    return true;
+}
+
+void SubmitRenderQueueIndirect(App* app, RenderQueue& queue, RenderPass pass, const RenderView* culling)
+{
+    RenderQueueStats& stats = app->renderQueueStats;
+
+    u32 begin, end;
+    FindPassRange(queue, pass, begin, end);
+    if (begin == end)
+        return;
+
+    const bool bindTextures = PassUsesMaterialTextures[pass];
+
+    // A command per item, its baseInstance is the index of its first draw params
+    queue.commands.clear();
+    queue.drawBounds.clear();
+    queue.batches.clear();
+    u32 firstDrawParams = 0;
+    for (u32 i = begin; i < end; ++i)
+    {
+        const DrawItem& item = queue.items[i];
+        const Submesh& submesh = app->meshes[item.meshIdx].submeshes[item.submeshIdx];
+        const u32 commandIdx = i - begin;
+
+        if (queue.batches.empty() || !SameBatch(app, queue.items[queue.batches.back().firstItem], item, bindTextures))
+            queue.batches.push_back({ i, commandIdx, 0 });
+        queue.batches.back().commandCount++;
+
+        DrawElementsIndirectCommand command;
+        command.count = (u32)submesh.indices.size();
+        command.instanceCount = item.instanceCount;
+        command.firstIndex = submesh.firstIndex;
+        command.baseVertex = (i32)submesh.baseVertex;
+        command.baseInstance = firstDrawParams;
+        queue.commands.push_back(command);
+        firstDrawParams += item.instanceCount;
+
+        if (culling)
+            queue.drawBounds.push_back({ submesh.aabbMin, item.transformIdx, submesh.aabbMax, (u32)queue.batches.size() - 1 });
+    }
+
+    UploadDrawParams(app, queue, begin, end);
+
+    GLuint indirectBuffer;
+    if (culling)
+    {
+        indirectBuffer = CullDrawsOnGpu(app, pass, *culling, queue);
+    }
+    else
+    {
+        UploadBufferData(app->indirectBuffer, GL_DRAW_INDIRECT_BUFFER, queue.commands.data(), queue.commands.size() * sizeof(DrawElementsIndirectCommand));
+        indirectBuffer = app->indirectBuffer.handle;
+    }
+
+    // The culling dispatch binds its own buffers
+    BindDrawParams(app);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+
+    SubmitState state;
+    memset(&state, 0xFF, sizeof(state));
+
+    for (const IndirectBatch& batch : queue.batches)
+    {
+        const DrawItem& first = queue.items[batch.firstItem];
+
+        BindPipeline(app, first, state, stats);
+        if (bindTextures)
+        {
+            GLuint textures[MATERIAL_TEXTURE_UNITS];
+            GetMaterialTextures(app, first.materialIdx, textures);
+            BindMaterialTextures(textures, state, stats);
+        }
+
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                    (void*)(u64)(batch.firstCommand * sizeof(DrawElementsIndirectCommand)),
+                                    batch.commandCount, sizeof(DrawElementsIndirectCommand));
+        stats.drawCalls++;
+        stats.indirectCommands += batch.commandCount;
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void SubmitRenderQueueInstanced(App* app, RenderQueue& queue, RenderPass pass)
+{
+    RenderQueueStats& stats = app->renderQueueStats;
+
+    u32 begin, end;
+    FindPassRange(queue, pass, begin, end);
+    if (begin == end)
+        return;
+
+    UploadDrawParams(app, queue, begin, end);
+    BindDrawParams(app);
+
+    SubmitState state;
+    memset(&state, 0xFF, sizeof(state));
+
+    const bool bindTextures = PassUsesMaterialTextures[pass];
+
+    u32 firstDrawParams = 0;
+    for (u32 i = begin; i < end; ++i)
+    {
+        const DrawItem& item = queue.items[i];
+        const Submesh& submesh = app->meshes[item.meshIdx].submeshes[item.submeshIdx];
+
+        BindPipeline(app, item, state, stats);
+        if (bindTextures)
+        {
+            GLuint textures[MATERIAL_TEXTURE_UNITS];
+            GetMaterialTextures(app, item.materialIdx, textures);
+            BindMaterialTextures(textures, state, stats);
+        }
+
+        // The base instance offsets the instanced draw index attribute
+        glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT,
+                                                      (void*)(u64)(submesh.firstIndex * sizeof(u32)),
+                                                      item.instanceCount, submesh.baseVertex, firstDrawParams);
+        firstDrawParams += item.instanceCount;
+        stats.drawCalls++;
+    }
+}
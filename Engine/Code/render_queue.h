@@ -0,0 +1,147 @@
+//
+// render_queue.h: Draw items of the scene passes sorted by a 64-bit key, so draws that
+// share a program, material and mesh are submitted together and the state they have in
+// common is only bound once.
+//
+// Key layout, from the most significant bit:
+//   pass (4) | program (8) | material (16) | mesh (16) | view depth (20)
+//
+// The depth is quantized front-to-back, so within the same state nearer draws go
+// first and occlude the farther ones. The key only decides the order: the indices are
+// also stored in the item, so they are correct even if they do not fit in their bits.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <vector>
+
+struct RenderView;
+
+struct App;
+
+enum RenderPass
+{
+    RenderPass_Forward,
+    RenderPass_GBuffer,
+    RenderPass_WaterReflection,
+    RenderPass_WaterRefraction,
+    RenderPass_WaterBase,
+    RenderPass_DepthPrepass,
+
+    RenderPass_Count
+};
+
+// Distance at which the quantized depth saturates, the far plane of the camera
+#define RENDER_QUEUE_MAX_DEPTH 1000.0f
+
+struct DrawItem
+{
+    u64 key;
+    u32 programIdx;
+    u32 materialIdx;
+    u32 meshIdx;
+    u32 submeshIdx;
+    u32 transformIdx;      // World matrix in RenderQueue::transforms, read by the multi-draw programs
+    u32 instanceCount;     // The instances have consecutive transforms from transformIdx
+    u32 localParamsOffset; // Range of the cBuffer bound at BINDING(1), size 0 if none
+    u32 localParamsSize;
+};
+
+struct DrawElementsIndirectCommand
+{
+    u32 count;
+    u32 instanceCount;
+    u32 firstIndex;
+    i32 baseVertex;
+    u32 baseInstance;
+};
+
+// std430 element of the DrawBuffer of the multi-draw programs
+struct DrawParams
+{
+    u32 transformIdx;
+    u32 materialIdx;
+};
+
+// std430 element of the BoundsBuffer of the FRUSTUM_CULLING program, local space AABB
+struct DrawBounds
+{
+    glm::vec3 aabbMin;
+    u32       transformIdx;
+    glm::vec3 aabbMax;
+    u32       batchIdx;
+};
+
+// Commands drawn by one glMultiDrawElementsIndirect
+struct IndirectBatch
+{
+    u32 firstItem;
+    u32 firstCommand;
+    u32 commandCount;
+};
+
+struct RenderQueue
+{
+    std::vector<DrawItem> items;
+    std::vector<DrawItem> sortScratch;
+    std::vector<glm::mat4> transforms;
+
+    // Built by SubmitRenderQueueIndirect, kept to reuse their memory
+    std::vector<DrawElementsIndirectCommand> commands;
+    std::vector<DrawParams> drawParams;
+    std::vector<DrawBounds> drawBounds;
+    std::vector<IndirectBatch> batches;
+};
+
+// Counters of the binds of the submitted passes, reset every frame
+struct RenderQueueStats
+{
+    u32 drawCalls;
+    u32 stateChanges;      // Binds issued
+    u32 stateChangesSaved; // Binds dropped because the previous draw had already set them
+    u32 indirectCommands;  // Draws submitted inside a glMultiDrawElementsIndirect
+    u32 instances;         // Instances drawn by the multi-draw and instanced submissions
+};
+
+u64 MakeDrawKey(RenderPass pass, u32 programIdx, u32 materialIdx, u32 meshIdx, f32 viewDepth);
+
+void ClearRenderQueue(RenderQueue& queue);
+
+/**
+ * Copies the items of a pass to RenderPass_DepthPrepass with a depth only program, keeping
+ * their view depth. Materials with a bump map are left out: relief mapping discards
+ * fragments, so their depth is only known after shading them. Call it before sorting.
+ */
+void AddDepthPrepassItems(App* app, RenderQueue& queue, RenderPass pass, u32 programIdx);
+
+/**
+ * Sorts the items by key (LSD radix sort, skipping the bytes that are the same in all
+ * the keys). Items of the same pass end up contiguous.
+ */
+void SortRenderQueue(RenderQueue& queue);
+
+/**
+ * Draws the items of a pass of a sorted queue. The framebuffer, the global parameters
+ * and any per-pass uniform are set by the caller beforehand.
+ */
+void SubmitRenderQueue(App* app, const RenderQueue& queue, RenderPass pass);
+
+/**
+ * Draws the items of a pass with one glMultiDrawElementsIndirect per run of items that
+ * share program, vertex pool and material textures. The items must use a MULTI_DRAW
+ * program, which reads its world matrix and material from the storage buffers bound
+ * here (draw params at 0, materials at 1, transforms at 2) and the view of the pass from
+ * ViewParms, bound by the caller.
+ *
+ * With a culling view, the commands are culled on the GPU against its frustum (and clip
+ * plane) before drawing them.
+ */
+void SubmitRenderQueueIndirect(App* app, RenderQueue& queue, RenderPass pass, const RenderView* culling);
+
+/**
+ * Draws each item of a pass with glDrawElementsInstancedBaseVertexBaseInstance, all its
+ * instances at once. The items must use a MULTI_DRAW program, as in
+ * SubmitRenderQueueIndirect.
+ */
+void SubmitRenderQueueInstanced(App* app, RenderQueue& queue, RenderPass pass);
@@ -0,0 +1,163 @@
+//
+// render_target_pool.cpp: Lazy creation and deferred destruction of render target textures.
+//
+
+#include "render_target_pool.h"
+
+static u32 GetFormatBytes(GLenum format)
+{
+    switch (format)
+    {
+    case GL_R8:                 return 1;
+    case GL_RG8:                return 2;
+    case GL_DEPTH_COMPONENT16:  return 2;
+    case GL_RGBA16F:
+    case GL_RGBA16:
+    case GL_RG32F:              return 8;
+    case GL_RGBA32F:            return 16;
+    case GL_DEPTH32F_STENCIL8:  return 8;
+    default:                    return 4; // RGBA8, RG16, R32F, Depth24 (padded)...
+    }
+}
+
+bool IsDepthFormat(GLenum format)
+{
+    return format == GL_DEPTH_COMPONENT16 || format == GL_DEPTH_COMPONENT24 || format == GL_DEPTH_COMPONENT32F ||
+           format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8;
+}
+
+u32 GetRenderTargetBytes(const RenderTargetDesc& desc)
+{
+    return desc.size.x * desc.size.y * desc.samples * GetFormatBytes(desc.format);
+}
+
+static bool SameKey(const RenderTargetDesc& a, const RenderTargetDesc& b)
+{
+    return a.size == b.size && a.format == b.format && a.samples == b.samples;
+}
+
+static void SetFilter(GLuint texture, GLenum filter)
+{
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+GLuint CreateRenderTargetTexture(const RenderTargetDesc& desc)
+{
+    ASSERT(desc.size.x > 0 && desc.size.y > 0 && desc.samples > 0, "Invalid render target description");
+
+    GLuint handle;
+    glGenTextures(1, &handle);
+    if (desc.samples > 1)
+    {
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, handle);
+        glTexStorage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, desc.samples, desc.format, desc.size.x, desc.size.y, GL_TRUE);
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+    }
+    else
+    {
+        glBindTexture(GL_TEXTURE_2D, handle);
+        glTexStorage2D(GL_TEXTURE_2D, 1, desc.format, desc.size.x, desc.size.y);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        SetFilter(handle, desc.filter);
+    }
+    return handle;
+}
+
+static PooledRenderTarget CreatePooledTarget(const RenderTargetDesc& desc)
+{
+    PooledRenderTarget target = {};
+    target.desc = desc;
+    target.bytes = GetRenderTargetBytes(desc);
+    target.handle = CreateRenderTargetTexture(desc);
+    return target;
+}
+
+void BeginRenderTargetPoolFrame(RenderTargetPool& pool)
+{
+    pool.frame++;
+    for (PooledRenderTarget& target : pool.targets)
+        target.acquired = false;
+}
+
+GLuint AcquireRenderTarget(RenderTargetPool& pool, const RenderTargetDesc& desc, const char* name)
+{
+    // The most recently used, the others retire sooner
+    PooledRenderTarget* found = NULL;
+    for (PooledRenderTarget& target : pool.targets)
+    {
+        if (!target.acquired && SameKey(target.desc, desc) && (!found || target.lastFrame > found->lastFrame))
+            found = &target;
+    }
+
+    if (!found)
+    {
+        pool.targets.push_back(CreatePooledTarget(desc));
+        pool.stats.created++;
+        found = &pool.targets.back();
+    }
+    else if (found->desc.filter != desc.filter && desc.samples == 1)
+    {
+        SetFilter(found->handle, desc.filter);
+    }
+
+    found->desc.filter = desc.filter;
+    found->name = name;
+    found->lastFrame = pool.frame;
+    found->acquired = true;
+    return found->handle;
+}
+
+void EndRenderTargetPoolFrame(RenderTargetPool& pool)
+{
+    pool.destroyed.clear();
+
+    for (u32 i = 0; i < pool.targets.size();)
+    {
+        PooledRenderTarget& target = pool.targets[i];
+        if (pool.frame - target.lastFrame <= RENDER_TARGET_POOL_RETIRE_FRAMES)
+        {
+            ++i;
+            continue;
+        }
+
+        glDeleteTextures(1, &target.handle);
+        pool.destroyed.push_back(target.handle);
+        pool.stats.destroyed++;
+
+        pool.targets[i] = pool.targets.back();
+        pool.targets.pop_back();
+    }
+
+    RenderTargetPoolStats& stats = pool.stats;
+    stats.textures = (u32)pool.targets.size();
+    stats.acquired = 0;
+    stats.bytes = 0;
+    stats.acquiredBytes = 0;
+    stats.retiredBytes = 0;
+    for (const PooledRenderTarget& target : pool.targets)
+    {
+        stats.bytes += target.bytes;
+        if (target.acquired)
+        {
+            stats.acquired++;
+            stats.acquiredBytes += target.bytes;
+        }
+        else
+        {
+            stats.retiredBytes += target.bytes;
+        }
+    }
+}
+
+void DestroyRenderTargetPool(RenderTargetPool& pool)
+{
+    for (PooledRenderTarget& target : pool.targets)
+        glDeleteTextures(1, &target.handle);
+    pool.targets.clear();
+    pool.destroyed.clear();
+}
@@ -0,0 +1,94 @@
+//
+// render_target_pool.h: Textures of the render targets, shared by size, format and
+// sample count.
+//
+// Every frame the render graph acquires a texture for each of its transient targets. The
+// pool gives one of the same size, format and samples that no target of the frame has
+// yet, or creates it. Nothing is sized at startup: when the window is resized the
+// targets ask for the new size, so the textures are recreated the first frame they are
+// needed, and reused while the size stays.
+//
+// A texture no frame acquires is not deleted right away. It is kept for
+// RENDER_TARGET_POOL_RETIRE_FRAMES frames, the frames that may still be in flight (and
+// the Gui, which draws the debug view after Render), and can be acquired again in the
+// meantime (a mode toggled back, a resize undone). Then it is deleted.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "ring_buffer.h"
+#include <glad/glad.h>
+#include <vector>
+
+#define RENDER_TARGET_POOL_RETIRE_FRAMES RING_BUFFER_REGIONS
+
+struct RenderTargetDesc
+{
+    glm::ivec2 size;
+    GLenum     format;  // Internal format
+    u32        samples; // 1 for a GL_TEXTURE_2D, more for a GL_TEXTURE_2D_MULTISAMPLE
+    GLenum     filter;  // Min and mag filter when sampled, not part of the key
+};
+
+struct PooledRenderTarget
+{
+    GLuint           handle;
+    RenderTargetDesc desc;
+    u32              bytes;
+    const char*      name;          // Last target that acquired it
+    u64              lastFrame;     // Last frame it was acquired
+    bool             acquired;      // By the current frame
+};
+
+struct RenderTargetPoolStats
+{
+    u32 textures;
+    u32 acquired;           // By the current frame
+    u64 bytes;
+    u64 acquiredBytes;
+    u64 retiredBytes;       // Not acquired, waiting to be deleted
+    u32 created;            // Since the start
+    u32 destroyed;
+};
+
+struct RenderTargetPool
+{
+    std::vector<PooledRenderTarget> targets;
+    u64                             frame;
+    std::vector<GLuint>             destroyed;  // Deleted by the last EndRenderTargetPoolFrame
+    RenderTargetPoolStats           stats;
+};
+
+/**
+ * Starts a frame, no texture is acquired.
+ */
+void BeginRenderTargetPoolFrame(RenderTargetPool& pool);
+
+/**
+ * A texture of the description that the frame has not acquired yet, new if there is
+ * none. The pool keeps the texture until it is not acquired for
+ * RENDER_TARGET_POOL_RETIRE_FRAMES frames.
+ */
+GLuint AcquireRenderTarget(RenderTargetPool& pool, const RenderTargetDesc& desc, const char* name);
+
+/**
+ * Deletes the textures retired long enough ago, their handles are left in
+ * pool.destroyed, and updates the stats.
+ */
+void EndRenderTargetPoolFrame(RenderTargetPool& pool);
+
+/**
+ * A texture of the description outside the pool, for the targets that are kept from one
+ * frame to the next (see ImportRenderTarget). Deleted by its owner.
+ */
+GLuint CreateRenderTargetTexture(const RenderTargetDesc& desc);
+
+bool IsDepthFormat(GLenum format);
+
+/**
+ * Bytes of a texture of the description, Depth24 counted as 4 bytes per sample.
+ */
+u32 GetRenderTargetBytes(const RenderTargetDesc& desc);
+
+void DestroyRenderTargetPool(RenderTargetPool& pool);
@@ -0,0 +1,48 @@
+//
+// render_view.cpp: Per frame views and their uniform blocks.
+//
+
+#include "render_view.h"
+#include "buffer_management.h"
+#include "engine.h"
+#include "gl_state.h"
+
+RenderView MakeRenderView(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& position, const glm::vec4* clipPlane)
+{
+    RenderView renderView = {};
+    renderView.view = view;
+    renderView.projection = projection;
+    renderView.viewProjection = projection * view;
+    renderView.inverseViewProjection = glm::inverse(renderView.viewProjection);
+    renderView.frustum = MakeFrustum(renderView.viewProjection);
+    renderView.position = position;
+    renderView.useClipPlane = clipPlane != NULL;
+    renderView.clipPlane = clipPlane ? *clipPlane : glm::vec4(0.f, 0.f, 0.f, 1.f);
+    if (clipPlane)
+        AddFrustumPlane(renderView.frustum, *clipPlane);
+    return renderView;
+}
+
+// Same layout as the ViewParms block of the shaders (std140)
+void PushRenderView(Buffer& buffer, u32 alignment, RenderView& view)
+{
+    AlignHead(buffer, alignment);
+    view.paramsOffset = buffer.head;
+
+    PushMat4(buffer, view.view);
+    PushMat4(buffer, view.projection);
+    PushMat4(buffer, view.viewProjection);
+    for (u32 i = 0; i < 6; ++i)
+        PushVec4(buffer, view.frustum.planes[i]);
+    PushVec4(buffer, view.clipPlane);
+    PushVec3(buffer, view.position);
+    PushMat4(buffer, view.inverseViewProjection);
+
+    view.paramsSize = buffer.head - view.paramsOffset;
+}
+
+void BindRenderView(const RenderView& view, const Buffer& buffer)
+{
+    if (IsRangeInBuffer(buffer, view.paramsOffset, view.paramsSize))
+        BindUniformBufferRange(VIEW_PARAMS_BINDING, buffer.handle, view.paramsOffset, view.paramsSize);
+}
@@ -0,0 +1,50 @@
+//
+// render_view.h: Views the scene is rendered from, computed once per frame.
+//
+// Every pass renders from a view (the camera, the mirrored camera of the water
+// reflection...). At the start of the frame the matrices, frustum, clip plane and
+// position of each view are computed and written to a ViewParms uniform block in the
+// cBuffer. A pass binds the block of its view at VIEW_PARAMS_BINDING, so the draws only
+// carry their world matrix (or the index of their instance).
+//
+
+#pragma once
+
+#include "platform.h"
+#include "frustum_culling.h"
+
+struct Buffer;
+
+#define VIEW_PARAMS_BINDING 3
+
+enum ViewId
+{
+    View_Main,
+    View_WaterReflection,
+    View_WaterRefraction,
+    View_Count
+};
+
+struct RenderView
+{
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 viewProjection;
+    glm::mat4 inverseViewProjection; // Positions from depth (compact G-buffer)
+    Frustum   frustum;       // With the clip plane as an extra plane, if any
+    glm::vec4 clipPlane;     // (0, 0, 0, 1), that nothing is behind, if none
+    glm::vec3 position;
+    bool      useClipPlane;
+
+    u32       paramsOffset;  // ViewParms block in the cBuffer
+    u32       paramsSize;
+};
+
+RenderView MakeRenderView(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& position, const glm::vec4* clipPlane);
+
+/**
+ * Writes the ViewParms block of the view to the (mapped) buffer and keeps its range.
+ */
+void PushRenderView(Buffer& buffer, u32 alignment, RenderView& view);
+
+void BindRenderView(const RenderView& view, const Buffer& buffer);
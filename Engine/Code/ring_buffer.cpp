@@ -0,0 +1,180 @@
+//
+// ring_buffer.cpp: Fenced, persistently mapped ring buffer.
+//
+
+#include "ring_buffer.h"
+#include "buffer_management.h"
+#include "engine.h"
+
+// GL 4.4 (ARB_buffer_storage), not in the glad headers
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT   0x0080
+#endif
+
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+static PFNGLBUFFERSTORAGEPROC GlobalBufferStorage = NULL;
+static bool GlobalBufferStorageLoaded = false;
+
+static PFNGLBUFFERSTORAGEPROC GetBufferStorage()
+{
+    if (!GlobalBufferStorageLoaded)
+    {
+        GlobalBufferStorage = (PFNGLBUFFERSTORAGEPROC)GetGLProcAddress("glBufferStorage");
+        if (!GlobalBufferStorage)
+            GlobalBufferStorage = (PFNGLBUFFERSTORAGEPROC)GetGLProcAddress("glBufferStorageARB");
+        if (!GlobalBufferStorage)
+        {
+            ILOG("glBufferStorage is not available, the ring buffers are mapped every frame");
+        }
+        GlobalBufferStorageLoaded = true;
+    }
+    return GlobalBufferStorage;
+}
+
+void CreateRingBuffer(RingBuffer& ring, u32 regionSize, GLenum type, u32 alignment)
+{
+    ASSERT(IsPowerOf2(alignment), "The alignment must be a power of 2");
+
+    ring.handle = 0;
+    ring.type = type;
+    ring.alignment = alignment;
+    ring.regionSize = Align(regionSize, alignment);
+    ring.data = NULL;
+    ring.region = 0;
+    for (u32 i = 0; i < RING_BUFFER_REGIONS; ++i)
+        ring.fences[i] = 0;
+
+    const u32 size = ring.regionSize * RING_BUFFER_REGIONS;
+
+    glGenBuffers(1, &ring.handle);
+    glBindBuffer(type, ring.handle);
+
+    PFNGLBUFFERSTORAGEPROC bufferStorage = GetBufferStorage();
+    ring.persistent = bufferStorage != NULL;
+    if (ring.persistent)
+    {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        bufferStorage(type, size, NULL, flags);
+        ring.data = (u8*)glMapBufferRange(type, 0, size, flags);
+        ASSERT(ring.data != NULL, "Could not map the ring buffer");
+    }
+    else
+    {
+        glBufferData(type, size, NULL, GL_STREAM_DRAW);
+    }
+
+    glBindBuffer(type, 0);
+}
+
+void DestroyRingBuffer(RingBuffer& ring)
+{
+    for (u32 i = 0; i < RING_BUFFER_REGIONS; ++i)
+    {
+        if (ring.fences[i])
+            glDeleteSync(ring.fences[i]);
+        ring.fences[i] = 0;
+    }
+
+    // The GL keeps the storage alive until the draws that use it finish
+    if (ring.handle)
+    {
+        if (ring.persistent)
+        {
+            glBindBuffer(ring.type, ring.handle);
+            glUnmapBuffer(ring.type);
+            glBindBuffer(ring.type, 0);
+        }
+        glDeleteBuffers(1, &ring.handle);
+    }
+    ring.handle = 0;
+    ring.data = NULL;
+}
+
+// Reallocates the regions with room for the size the last frame needed, and some more
+static void GrowRingBuffer(RingBuffer& ring)
+{
+    const u32 regionSize = glm::max(ring.requiredSize + ring.requiredSize / 2, ring.regionSize * 2);
+    ILOG("Growing ring buffer regions from %u to %u bytes", ring.regionSize, regionSize);
+
+    DestroyRingBuffer(ring);
+    CreateRingBuffer(ring, regionSize, ring.type, ring.alignment);
+    ring.requiredSize = 0;
+    ring.growCount++;
+}
+
+void ReserveRingBufferFrame(RingBuffer& ring, u32 size)
+{
+    ring.requiredSize = glm::max(ring.requiredSize, size);
+}
+
+Buffer BeginRingBufferFrame(RingBuffer& ring)
+{
+    if (ring.requiredSize > ring.regionSize)
+        GrowRingBuffer(ring);
+
+    // Normally signaled long ago, the GPU is at most a couple of frames behind
+    GLsync& fence = ring.fences[ring.region];
+    if (fence)
+    {
+        GLenum result = glClientWaitSync(fence, 0, 0);
+        if (result == GL_TIMEOUT_EXPIRED)
+        {
+            ring.fenceWaits++;
+            do
+                result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+            while (result == GL_TIMEOUT_EXPIRED);
+        }
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    Buffer frame = {};
+    frame.handle = ring.handle;
+    frame.type = ring.type;
+    frame.head = ring.region * ring.regionSize;
+    frame.size = frame.head + ring.regionSize;
+
+    if (ring.persistent)
+    {
+        frame.data = ring.data;
+    }
+    else
+    {
+        // The whole buffer is mapped so the head is an offset of the buffer, the fences
+        // keep the other regions safe without synchronization
+        glBindBuffer(ring.type, ring.handle);
+        frame.data = glMapBufferRange(ring.type, 0, ring.regionSize * RING_BUFFER_REGIONS, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        glBindBuffer(ring.type, 0);
+    }
+
+    return frame;
+}
+
+void EndRingBufferFrame(RingBuffer& ring, Buffer& frame)
+{
+    const u32 regionStart = ring.region * ring.regionSize;
+    ring.frameUsage = frame.head - regionStart;
+    ring.highWaterMark = glm::max(ring.highWaterMark, ring.frameUsage);
+
+    if (frame.head > frame.size)
+    {
+        ELOG("Ring buffer overflow: the frame needed %u bytes of a %u bytes region", ring.frameUsage, ring.regionSize);
+        ring.requiredSize = ring.frameUsage;
+    }
+
+    if (!ring.persistent)
+    {
+        glBindBuffer(ring.type, ring.handle);
+        glUnmapBuffer(ring.type);
+        glBindBuffer(ring.type, 0);
+    }
+
+    ring.fences[ring.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring.region = (ring.region + 1) % RING_BUFFER_REGIONS;
+
+    frame.data = NULL;
+}
@@ -0,0 +1,72 @@
+//
+// ring_buffer.h: Persistently mapped ring buffer for the data written every frame.
+//
+// The buffer is split in RING_BUFFER_REGIONS regions, one per frame in flight. A frame
+// writes only to its region through a Buffer view (see BeginRingBufferFrame), and ends
+// with a fence. The region is written again RING_BUFFER_REGIONS frames later, after
+// its fence signals, which it has almost always done by then, so the CPU does not wait
+// for the GPU and the buffer is never mapped or unmapped.
+//
+// The storage is created with glBufferStorage (GL 4.4 or ARB_buffer_storage, loaded
+// at runtime, glad is GL 4.3) and mapped persistent and coherent. Without it each
+// region is mapped unsynchronized for its frame instead.
+//
+// The owner reserves the bytes a frame needs before it begins, and the regions grow to
+// fit them. A frame that still writes past its region does not write the data that does
+// not fit (see PushAlignedData), its ranges past the region must not be bound (see
+// IsRangeInBuffer), and the regions are reallocated with room for it the next frame.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+struct Buffer;
+
+#define RING_BUFFER_REGIONS 3
+
+struct RingBuffer
+{
+    GLuint  handle;
+    GLenum  type;
+    u32     regionSize;
+    u32     alignment;
+    u8*     data;        // The whole buffer if it is persistently mapped
+    bool    persistent;
+
+    u32     region;      // Region of the current frame
+    GLsync  fences[RING_BUFFER_REGIONS];
+
+    // Stats
+    u32     frameUsage;      // Bytes used by the last frame
+    u32     highWaterMark;   // Most bytes used by a frame
+    u32     requiredSize;    // Region size needed by a frame that did not fit
+    u32     growCount;
+    u32     fenceWaits;      // Frames that waited for the GPU to release their region
+};
+
+/**
+ * Creates the buffer with RING_BUFFER_REGIONS regions of at least regionSize bytes,
+ * aligned to alignment (a power of 2, e.g. GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT).
+ */
+void CreateRingBuffer(RingBuffer& ring, u32 regionSize, GLenum type, u32 alignment);
+
+void DestroyRingBuffer(RingBuffer& ring);
+
+/**
+ * Grows the regions, at the next BeginRingBufferFrame, if they are smaller than size.
+ */
+void ReserveRingBufferFrame(RingBuffer& ring, u32 size);
+
+/**
+ * Waits for the region of the frame to be released by the GPU and returns a view of it:
+ * the head starts at the beginning of the region (offsets are relative to the whole
+ * buffer, as BindUniformBufferRange expects) and the size is the end of the region.
+ */
+Buffer BeginRingBufferFrame(RingBuffer& ring);
+
+/**
+ * Fences the region written through the view and moves to the next one.
+ */
+void EndRingBufferFrame(RingBuffer& ring, Buffer& frame);
@@ -41,43 +41,71 @@ layout(location=2) in vec2 aTexCoord;
 layout(location=3) in vec3 aTangents;
 layout(location=4) in vec3 aBiTangents;
 
+// Lights and clusters of the frame, see light_clusters.h
+layout(binding = 0, std140) uniform GlobalParms
+{
+	vec3 			uCameraPos;
+	uint 			uDirectionalLightCount;
+	uvec2 			uClusterTileSize;	// In pixels
+	vec2 			uClusterSlice;		// slice = log(depth) * x + y
+	uvec3 			uClusterGrid;
+	uint 			uLightCount;
+};
 
+#ifdef MULTI_DRAW
+// Index of the draw in the multi-draw, see geometry_storage.h
+layout(location=5) in uint aDrawIndex;
 
-struct Light{
-	 unsigned int 	type; // 0: dir, 1: point
-	 vec3			color;
-	 vec3			direction;
-	 vec3			position;
-	 float 			intensity;
-	 float			linear;
-	 float			quadratic;
+// Per draw (transform index, material index), see SubmitRenderQueueIndirect
+layout(binding = 0, std430) readonly buffer DrawBuffer
+{
+	uvec2 uDraws[];
 };
 
-
-layout(binding = 0, std140) uniform GlobalParms
+layout(binding = 2, std430) readonly buffer TransformBuffer
 {
-	vec3 			uCameraPos;
- 	int 			uLightCount;
- 	Light			uLight[16];
+	mat4 uTransforms[];
 };
 
+#define uWorldMatrix uTransforms[uDraws[aDrawIndex].x]
+
+flat out uint vMaterialIdx;
+#else
 layout(binding = 1, std140) uniform LocalParms
 {
 	mat4 uWorldMatrix;
-	mat4 uWorldViewProjectionMatrix;
+};
+#endif
 
+// View of the pass, one block per view (see render_view.h)
+layout(binding = 3, std140) uniform ViewParms
+{
+	mat4 			uView;
+	mat4 			uProjection;
+	mat4 			uViewProjection;
+	vec4 			uFrustumPlanes[6];
+	vec4 			uClipPlane;
+	vec3 			uViewPos;
+	mat4 			uInverseViewProjection;
 };
 
 out vec2 vTexCoord;
 out vec3 vPos;
 out vec3 vNormals;
 out vec3 vViewDir;
+out float vViewDepth;
 out mat3 TBN;
 out mat3 vworldMat;
 
+// Same depth as the DEPTH_ONLY pre-pass, which it is tested against with GL_LEQUAL
+invariant gl_Position;
+
 void main() {
+#ifdef MULTI_DRAW
+	vMaterialIdx = uDraws[aDrawIndex].y;
+#endif
 
-	gl_Position = uWorldViewProjectionMatrix * uWorldMatrix * vec4(aPos, 1.0);
+	gl_Position = uViewProjection * uWorldMatrix * vec4(aPos, 1.0);
 
 	vNormals = mat3(uWorldMatrix) * aNormals;
 	vTexCoord = aTexCoord;
@@ -92,49 +120,100 @@ void main() {
 	vViewDir =  normalize((uCameraPos - aPos));
 	vworldMat = mat3(uWorldMatrix);
 	vPos = vec3(uWorldMatrix * vec4(aPos,1.0));
+	vViewDepth = -(uView * vec4(vPos, 1.0)).z;
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
-
-struct Light{
-	 unsigned int 	type; // 0: dir, 1: point
-	 vec3			color;
-	 vec3			direction;
-	 vec3			position;
-	 float 			intensity;
-	 float			linear;
-	 float			quadratic;
+struct Light
+{
+	vec3 			position;
+	float 			intensity;
+	vec3 			color;
+	uint 			type; // 0: dir, 1: point
+	vec3 			direction;
+	float 			range;
 };
 
-
+// Attenuation of the point lights, the same as the range of light_clusters.h
+#define LIGHT_LINEAR 	0.5
+#define LIGHT_QUADRATIC 1.0
 
 //---------------------------Function declaration--------------------------------------
 vec3 CalculateDirectionalLight(Light light, vec3 normal, vec3 view_dir, vec2 texCoords);
 vec3 CalculatePointLight(Light light, vec3 normal, vec3 frag_pos, vec3 view_dir, vec2 texCoords);
 vec2 reliefMapping(vec2 texCoords, vec3 viewDir);
+uvec2 GetClusterLights(float viewDepth);
 
+// Lights and clusters of the frame, see light_clusters.h
 layout(binding = 0, std140) uniform GlobalParms
 {
 	vec3 			uCameraPos;
-	int 			uLightCount;
-	Light			uLight[16];
+	uint 			uDirectionalLightCount;
+	uvec2 			uClusterTileSize;	// In pixels
+	vec2 			uClusterSlice;		// slice = log(depth) * x + y
+	uvec3 			uClusterGrid;
+	uint 			uLightCount;
+};
+
+// The directional lights first, then the point lights
+layout(binding = 7, std430) readonly buffer LightBuffer
+{
+	Light 			uLights[];
+};
+
+// (offset, count) per cluster, then the light indices they point to
+layout(binding = 8, std430) readonly buffer LightClusterBuffer
+{
+	uint 			uClusterData[];
 };
 
 in vec2 vTexCoord;
 in vec3 vPos;
 in vec3 vNormals;
 in vec3 vViewDir;
+in float vViewDepth;
 in mat3 TBN;
 in mat3 vworldMat;
 
-uniform sampler2D uAlbedoTexture;
+#ifdef MULTI_DRAW
+// All the materials, indexed by the material of the draw (see UploadMaterials)
+struct MaterialData
+{
+	vec3 			albedo;
+	float 			smoothness;
+	vec3 			emissive;
+	int 			hasNormalMap;
+	int 			hasBumpMap;
+};
+
+layout(binding = 1, std430) readonly buffer MaterialBuffer
+{
+	MaterialData 	uMaterials[];
+};
+
+flat in uint vMaterialIdx;
 
-uniform int uhasNormalMap;
-uniform sampler2D uNormalTexture;
+#define uAlbedoColor 	uMaterials[vMaterialIdx].albedo
+#define uEmissiveColor 	uMaterials[vMaterialIdx].emissive
+#define uSmoothness 	uMaterials[vMaterialIdx].smoothness
+#define uhasNormalMap 	uMaterials[vMaterialIdx].hasNormalMap
+#define uhasBumpMap 	uMaterials[vMaterialIdx].hasBumpMap
+#else
+// Parameters of the material being drawn, one block per material (see UploadMaterials)
+layout(binding = 2, std140) uniform MaterialParms
+{
+	vec3 			uAlbedoColor;
+	vec3 			uEmissiveColor;
+	float 			uSmoothness;
+	int 			uhasNormalMap;
+	int 			uhasBumpMap;
+};
+#endif
 
-uniform int uhasBumpMap;
-uniform sampler2D uBumpTexture;
+layout(binding = 0) uniform sampler2D uAlbedoTexture;
+layout(binding = 1) uniform sampler2D uNormalTexture;
+layout(binding = 2) uniform sampler2D uBumpTexture;
 
 layout(location = 0) out vec4 oColor;
 layout(location = 1) out vec4 oNormals;
@@ -161,16 +240,13 @@ void main() {
 		}
 	
 
-	for(int i = 0; i < uLightCount; ++i)
-	{			
-		if(uLight[i].type == 0)
-			result += CalculateDirectionalLight(uLight[i], normals,  vViewDir, tCoords);
-		else{
-			if(uLight[i].intensity > 0){
-			result += CalculatePointLight(uLight[i], normals, vPos, vViewDir, tCoords);
-			} 
-		}
-	}
+	for(uint i = 0; i < uDirectionalLightCount; ++i)
+		result += CalculateDirectionalLight(uLights[i], normals, vViewDir, tCoords);
+
+	// Only the point lights that reach the cluster of the fragment
+	uvec2 clusterLights = GetClusterLights(vViewDepth);
+	for(uint i = 0; i < clusterLights.y; ++i)
+		result += CalculatePointLight(uLights[uClusterData[clusterLights.x + i]], normals, vPos, vViewDir, tCoords);
 
 	oColor 		= vec4(result, 1.0) * texture(uAlbedoTexture, tCoords);
 	oNormals 	= vec4(normals, 1.0);
@@ -212,9 +288,19 @@ vec3 CalculatePointLight(Light light, vec3 normal, vec3 frag_pos, vec3 view_dir,
     vec3 specular = light.color * spec;
     // attenuati
     float distance = length(TBN * (light.position - frag_pos));
-    float attenuation = 1.0 / (1.0 + light.linear * distance + light.quadratic * distance * distance);      
+    float attenuation = 1.0 / (1.0 + LIGHT_LINEAR * distance + LIGHT_QUADRATIC * distance * distance);      
 	return (diffuse + specular + ambient) * light.intensity * attenuation;
 }
+
+// (offset, count) of the light indices of the cluster of the fragment
+uvec2 GetClusterLights(float viewDepth)
+{
+	uvec2 tile = min(uvec2(gl_FragCoord.xy) / uClusterTileSize, uClusterGrid.xy - 1u);
+	int slice = int(floor(log(max(viewDepth, 1e-4)) * uClusterSlice.x + uClusterSlice.y));
+	uint cluster = tile.x + (tile.y + uint(clamp(slice, 0, int(uClusterGrid.z) - 1)) * uClusterGrid.y) * uClusterGrid.x;
+	return uvec2(uClusterData[2u * cluster], uClusterData[2u * cluster + 1u]);
+}
+
 vec2 reliefMapping(vec2 texCoords, vec3 viewDir)
 {
 	float bumpiness = 0.25;
@@ -257,6 +343,62 @@ vec2 reliefMapping(vec2 texCoords, vec3 viewDir)
 #endif
 #endif
 
+#ifdef DEPTH_ONLY
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+// Only the position, the depth must match the one of FORWARD_SHADING exactly
+layout(location=0) in vec3 aPos;
+
+#ifdef MULTI_DRAW
+// Index of the draw in the multi-draw, see geometry_storage.h
+layout(location=5) in uint aDrawIndex;
+
+// Per draw (transform index, material index), see SubmitRenderQueueIndirect
+layout(binding = 0, std430) readonly buffer DrawBuffer
+{
+	uvec2 uDraws[];
+};
+
+layout(binding = 2, std430) readonly buffer TransformBuffer
+{
+	mat4 uTransforms[];
+};
+
+#define uWorldMatrix uTransforms[uDraws[aDrawIndex].x]
+#else
+layout(binding = 1, std140) uniform LocalParms
+{
+	mat4 uWorldMatrix;
+};
+#endif
+
+// View of the pass, one block per view (see render_view.h)
+layout(binding = 3, std140) uniform ViewParms
+{
+	mat4 			uView;
+	mat4 			uProjection;
+	mat4 			uViewProjection;
+	vec4 			uFrustumPlanes[6];
+	vec4 			uClipPlane;
+	vec3 			uViewPos;
+	mat4 			uInverseViewProjection;
+};
+
+invariant gl_Position;
+
+void main() {
+	gl_Position = uViewProjection * uWorldMatrix * vec4(aPos, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+void main() {
+}
+
+#endif
+#endif
+
 #ifdef SHOW_TEXTURED_MESH
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
@@ -273,10 +415,41 @@ layout(binding = 0, std140) uniform GlobalParms
  	int 			uLightCount;
 };
 
+#ifdef MULTI_DRAW
+// Index of the draw in the multi-draw, see geometry_storage.h
+layout(location=5) in uint aDrawIndex;
+
+// Per draw (transform index, material index), see SubmitRenderQueueIndirect
+layout(binding = 0, std430) readonly buffer DrawBuffer
+{
+	uvec2 uDraws[];
+};
+
+layout(binding = 2, std430) readonly buffer TransformBuffer
+{
+	mat4 uTransforms[];
+};
+
+#define uWorldMatrix uTransforms[uDraws[aDrawIndex].x]
+
+flat out uint vMaterialIdx;
+#else
 layout(binding = 1, std140) uniform LocalParms
 {
 	mat4 uWorldMatrix;
-	mat4 uWorldViewProjectionMatrix;
+};
+#endif
+
+// View of the pass, one block per view (see render_view.h)
+layout(binding = 3, std140) uniform ViewParms
+{
+	mat4 			uView;
+	mat4 			uProjection;
+	mat4 			uViewProjection;
+	vec4 			uFrustumPlanes[6];
+	vec4 			uClipPlane;
+	vec3 			uViewPos;
+	mat4 			uInverseViewProjection;
 };
 
 out vec2 vTexCoord;
@@ -287,8 +460,11 @@ out mat3 TBN;
 out mat3 worldViewMatrix;
 
 void main() {
+#ifdef MULTI_DRAW
+	vMaterialIdx = uDraws[aDrawIndex].y;
+#endif
 
-	gl_Position = uWorldViewProjectionMatrix * uWorldMatrix * vec4(aPos, 1.0);
+	gl_Position = uViewProjection * uWorldMatrix * vec4(aPos, 1.0);
 
 	vPos = vec3(uWorldMatrix * vec4(aPos,1.0));
 
@@ -319,11 +495,12 @@ layout(binding = 0, std140) uniform GlobalParms
 	int 			uLightCount;
 };
 
+#ifndef MULTI_DRAW
 layout(binding = 1, std140) uniform LocalParms
 {
 	mat4 uWorldMatrix;
-	mat4 uWorldViewProjectionMatrix;
 };
+#endif
 
 in vec2 vTexCoord;
 in vec3 vPos;
@@ -333,19 +510,69 @@ in mat3 TBN;
 in mat3 worldViewMatrix;
 
 
-uniform sampler2D uAlbedoTexture;
+#ifdef MULTI_DRAW
+// All the materials, indexed by the material of the draw (see UploadMaterials)
+struct MaterialData
+{
+	vec3 			albedo;
+	float 			smoothness;
+	vec3 			emissive;
+	int 			hasNormalMap;
+	int 			hasBumpMap;
+};
+
+layout(binding = 1, std430) readonly buffer MaterialBuffer
+{
+	MaterialData 	uMaterials[];
+};
+
+flat in uint vMaterialIdx;
 
-uniform int uhasNormalMap;
-uniform sampler2D uNormalTexture;
+#define uAlbedoColor 	uMaterials[vMaterialIdx].albedo
+#define uEmissiveColor 	uMaterials[vMaterialIdx].emissive
+#define uSmoothness 	uMaterials[vMaterialIdx].smoothness
+#define uhasNormalMap 	uMaterials[vMaterialIdx].hasNormalMap
+#define uhasBumpMap 	uMaterials[vMaterialIdx].hasBumpMap
+#else
+// Parameters of the material being drawn, one block per material (see UploadMaterials)
+layout(binding = 2, std140) uniform MaterialParms
+{
+	vec3 			uAlbedoColor;
+	vec3 			uEmissiveColor;
+	float 			uSmoothness;
+	int 			uhasNormalMap;
+	int 			uhasBumpMap;
+};
+#endif
 
-uniform int uhasBumpMap;
-uniform sampler2D uBumpTexture;
+layout(binding = 0) uniform sampler2D uAlbedoTexture;
+layout(binding = 1) uniform sampler2D uNormalTexture;
+layout(binding = 2) uniform sampler2D uBumpTexture;
+
+#ifdef COMPACT_GBUFFER
+// Only what the lighting reads, the position comes from the depth
+layout(location = 0) out vec2 oNormals;
+layout(location = 1) out vec4 oAlbedo;
+
+// Octahedral encoding of a unit normal, in [0, 1] for RG16
+vec2 OctahedronWrap(vec2 v)
+{
+	return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
 
+vec2 EncodeNormal(vec3 normal)
+{
+	normal /= abs(normal.x) + abs(normal.y) + abs(normal.z);
+	normal.xy = normal.z >= 0.0 ? normal.xy : OctahedronWrap(normal.xy);
+	return normal.xy * 0.5 + 0.5;
+}
+#else
 layout(location = 0) out vec4 oColor;
 layout(location = 1) out vec4 oNormals;
 layout(location = 2) out vec4 oAlbedo;
 layout(location = 3) out vec4 oLight;
 layout(location = 4) out vec4 oPosition;
+#endif
 
 void main() {
 
@@ -368,12 +595,18 @@ void main() {
 	}
 
 
+#ifdef COMPACT_GBUFFER
+	// Material bits in the alpha. The depth is not offset, the position depends on it.
+	oNormals 	= EncodeNormal(normalize(normals));
+	oAlbedo		= vec4(texture(uAlbedoTexture, tCoords).rgb, uSmoothness);
+#else
 	oColor 		= texture(uAlbedoTexture, tCoords); //same as albedo
 	oNormals 	= vec4(normals, 1.0);
 	oAlbedo		= texture(uAlbedoTexture, tCoords);
 	oLight		= vec4(1.0);
 	oPosition   = vec4( auxvPos, 1.0);
 	gl_FragDepth = gl_FragCoord.z - 0.1;
+#endif
 }
 
 // Parallax occlusion mapping aka. relief mapping
@@ -428,24 +661,6 @@ vec2 reliefMapping(vec2 texCoords, vec3 viewDir)
 layout(location=0) in vec3 aPos;
 layout(location=1) in vec2 aTexCoord;
 
-struct Light{
-	 unsigned int 	type; // 0: dir, 1: point
-	 vec3			color;
-	 vec3			direction;
-	 vec3			position;
-	 float 			intensity;
-	 float			linear;
-	 float			quadratic;
-};
-
-layout(binding = 0, std140) uniform GlobalParms
-{
-	vec3 			uCameraPos;
- 	int 			uLightCount;
- 	Light			uLight[16];
-};
-
-
 out vec2 vTexCoord;
 
 void main() {
@@ -457,60 +672,116 @@ void main() {
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
-struct Light {
-	 unsigned int 	type; // 0: dir, 1: point
-	 vec3			color;
-	 vec3			direction;
-	 vec3			position;
-	 float 			intensity;
-	 float			linear;
-	 float			quadratic;
+struct Light
+{
+	vec3 			position;
+	float 			intensity;
+	vec3 			color;
+	uint 			type; // 0: dir, 1: point
+	vec3 			direction;
+	float 			range;
 };
 
+// Attenuation of the point lights, the same as the range of light_clusters.h
+#define LIGHT_LINEAR 	0.5
+#define LIGHT_QUADRATIC 1.0
+
 //---------------------------Function declaration--------------------------------------
 vec3 CalculateDirectionalLight(Light light, vec3 normal, vec3 view_dir, vec2 texCoords);
 vec3 CalculatePointLight(Light light, vec3 normal, vec3 frag_pos, vec3 view_dir, vec2 texCoords);
+uvec2 GetClusterLights(float viewDepth);
 
-
+// Lights and clusters of the frame, see light_clusters.h
 layout(binding = 0, std140) uniform GlobalParms
 {
 	vec3 			uCameraPos;
-	int 			uLightCount;
-	Light			uLight[16];
+	uint 			uDirectionalLightCount;
+	uvec2 			uClusterTileSize;	// In pixels
+	vec2 			uClusterSlice;		// slice = log(depth) * x + y
+	uvec3 			uClusterGrid;
+	uint 			uLightCount;
 };
 
-uniform sampler2D uPositionTexture;
-uniform sampler2D uNormalsTexture;
-uniform sampler2D uAlbedoTexture;
-uniform sampler2D uDepthTexture;
+// The directional lights first, then the point lights
+layout(binding = 7, std430) readonly buffer LightBuffer
+{
+	Light 			uLights[];
+};
+
+// (offset, count) per cluster, then the light indices they point to
+layout(binding = 8, std430) readonly buffer LightClusterBuffer
+{
+	uint 			uClusterData[];
+};
+
+// View of the G-buffer pass, see render_view.h
+layout(binding = 3, std140) uniform ViewParms
+{
+	mat4 			uView;
+	mat4 			uProjection;
+	mat4 			uViewProjection;
+	vec4 			uFrustumPlanes[6];
+	vec4 			uClipPlane;
+	vec3 			uViewPos;
+	mat4 			uInverseViewProjection;
+};
+
+layout(binding = 0) uniform sampler2D uPositionTexture;
+layout(binding = 1) uniform sampler2D uNormalsTexture;
+layout(binding = 2) uniform sampler2D uAlbedoTexture;
+layout(binding = 3) uniform sampler2D uDepthTexture;
 
 in vec2 vTexCoord;
 
 layout(location = 0) out vec4 oColor;
 
+#ifdef COMPACT_GBUFFER
+// Normal of the compact G-buffer, octahedral encoded in RG16
+vec3 DecodeNormal(vec2 encoded)
+{
+	encoded = encoded * 2.0 - 1.0;
+	vec3 normal = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+	float t = clamp(-normal.z, 0.0, 1.0);
+	normal.xy += vec2(normal.x >= 0.0 ? -t : t, normal.y >= 0.0 ? -t : t);
+	return normalize(normal);
+}
+
+// World position of a pixel of the compact G-buffer, from its depth
+vec3 ReconstructPosition(vec2 uv, float depth)
+{
+	vec4 position = uInverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+	return position.xyz / position.w;
+}
+#endif
+
 void main() {
 
-	vec3 fragPos = texture(uPositionTexture, vTexCoord).rgb;
-	vec3 norms = texture(uNormalsTexture, vTexCoord).rgb;
 	vec3 diffuseCol = texture(uAlbedoTexture, vTexCoord).rgb;
 	float depth = texture(uDepthTexture, vTexCoord).r;
+#ifdef COMPACT_GBUFFER
+	vec3 fragPos = ReconstructPosition(vTexCoord, depth);
+	vec3 norms = DecodeNormal(texture(uNormalsTexture, vTexCoord).rg);
+#else
+	vec3 fragPos = texture(uPositionTexture, vTexCoord).rgb;
+	vec3 norms = texture(uNormalsTexture, vTexCoord).rgb;
+#endif
 
 	vec3 viewDir = normalize(uCameraPos - fragPos);
 	vec3 result = vec3(0.0,0.0,0.0);    
 	
-	for(int i = 0; i < uLightCount; ++i)
-	{			
-		if (depth < 1.0) {
-			if (uLight[i].type == 0) {
-				result += CalculateDirectionalLight(uLight[i], norms, viewDir, vTexCoord);
-			}
-			else if (uLight[i].intensity > 0) {
-					result += CalculatePointLight(uLight[i], norms, fragPos, viewDir, vTexCoord);
-			}
-		}
-		else {
-			result = vec3(0.5);
-		}
+	if (depth < 1.0) {
+		for(uint i = 0; i < uDirectionalLightCount; ++i)
+			result += CalculateDirectionalLight(uLights[i], norms, viewDir, vTexCoord);
+
+#ifndef DIRECTIONAL_ONLY
+		// Only the point lights that reach the cluster of the fragment
+		uvec2 clusterLights = GetClusterLights(-(uView * vec4(fragPos, 1.0)).z);
+		for(uint i = 0; i < clusterLights.y; ++i)
+			result += CalculatePointLight(uLights[uClusterData[clusterLights.x + i]], norms, fragPos, viewDir, vTexCoord);
+#endif
+	}
+	else {
+		result = vec3(0.5);
 	}
 
 	oColor = vec4(result * diffuseCol, 1.0);
@@ -546,14 +817,413 @@ vec3 CalculatePointLight(Light light, vec3 normal, vec3 frag_pos, vec3 view_dir,
     vec3 specular = light.color * spec;
     // attenuati
     float distance = length(light.position - frag_pos);
-    float attenuation = 1.0 / (1.0 + light.linear * distance + light.quadratic * distance * distance);      
+    float attenuation = 1.0 / (1.0 + LIGHT_LINEAR * distance + LIGHT_QUADRATIC * distance * distance);      
+	return (diffuse + specular) * light.intensity * attenuation;
+}
+
+// (offset, count) of the light indices of the cluster of the fragment
+uvec2 GetClusterLights(float viewDepth)
+{
+	uvec2 tile = min(uvec2(gl_FragCoord.xy) / uClusterTileSize, uClusterGrid.xy - 1u);
+	int slice = int(floor(log(max(viewDepth, 1e-4)) * uClusterSlice.x + uClusterSlice.y));
+	uint cluster = tile.x + (tile.y + uint(clamp(slice, 0, int(uClusterGrid.z) - 1)) * uClusterGrid.y) * uClusterGrid.x;
+	return uvec2(uClusterData[2u * cluster], uClusterData[2u * cluster + 1u]);
+}
+
+#endif
+#endif
+
+
+
+#ifdef TILED_LIGHTING
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+// Must match LIGHT_TILE_SIZE, a work group per tile
+#define TILE_SIZE 16
+
+// Lights a tile can keep in shared memory, the ones past it are not shaded
+#define MAX_TILE_LIGHTS 1024
+
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE) in;
+
+struct Light
+{
+	vec3 			position;
+	float 			intensity;
+	vec3 			color;
+	uint 			type; // 0: dir, 1: point
+	vec3 			direction;
+	float 			range;
+};
+
+// Attenuation of the point lights, the same as the range of light_clusters.h
+#define LIGHT_LINEAR 	0.5
+#define LIGHT_QUADRATIC 1.0
+
+// Lights and clusters of the frame, see light_clusters.h
+layout(binding = 0, std140) uniform GlobalParms
+{
+	vec3 			uCameraPos;
+	uint 			uDirectionalLightCount;
+	uvec2 			uClusterTileSize;	// In pixels
+	vec2 			uClusterSlice;		// slice = log(depth) * x + y
+	uvec3 			uClusterGrid;
+	uint 			uLightCount;
+};
+
+// The directional lights first, then the point lights
+layout(binding = 7, std430) readonly buffer LightBuffer
+{
+	Light 			uLights[];
+};
+
+// View of the G-buffer pass, see render_view.h
+layout(binding = 3, std140) uniform ViewParms
+{
+	mat4 			uView;
+	mat4 			uProjection;
+	mat4 			uViewProjection;
+	vec4 			uFrustumPlanes[6];
+	vec4 			uClipPlane;
+	vec3 			uViewPos;
+	mat4 			uInverseViewProjection;
+};
+
+layout(binding = 0) uniform sampler2D uPositionTexture;
+layout(binding = 1) uniform sampler2D uNormalsTexture;
+layout(binding = 2) uniform sampler2D uAlbedoTexture;
+layout(binding = 3) uniform sampler2D uDepthTexture;
+
+layout(binding = 0, rgba8) writeonly uniform image2D uOutput;
+
+// Depth range of the tile as the bits of positive floats, which sort as the floats do
+shared uint sMinDepth;
+shared uint sMaxDepth;
+shared vec4 sPlanes[4];
+shared uint sLightCount;
+shared uint sLights[MAX_TILE_LIGHTS];
+
+#ifdef COMPACT_GBUFFER
+// Normal of the compact G-buffer, octahedral encoded in RG16
+vec3 DecodeNormal(vec2 encoded)
+{
+	encoded = encoded * 2.0 - 1.0;
+	vec3 normal = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+	float t = clamp(-normal.z, 0.0, 1.0);
+	normal.xy += vec2(normal.x >= 0.0 ? -t : t, normal.y >= 0.0 ? -t : t);
+	return normalize(normal);
+}
+
+// World position of a pixel of the compact G-buffer, from its depth
+vec3 ReconstructPosition(vec2 uv, float depth)
+{
+	vec4 position = uInverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+	return position.xyz / position.w;
+}
+#endif
+
+vec3 CalculateDirectionalLight(Light light, vec3 normal, vec3 view_dir, vec2 texCoords) {
+	vec3 ambient = light.color;
+    // Diffuse
+    vec3 lightDir = normalize(-light.direction);
+    float diff = max(dot(lightDir, normal), 0.0);
+    vec3 diffuse = ambient *  diff;
+    
+    // Specular
+    vec3 halfwayDir = normalize(lightDir + view_dir); 
+    float spec = pow(max(dot(normal, halfwayDir), 0.0), 0.0) * 0.01;
+
+    vec3 specular = vec3(0);
+    specular = diffuse * spec;
+    // Final Calculation     
+    return (diffuse + specular) * light.intensity;
+}
+
+vec3 CalculatePointLight(Light light, vec3 normal, vec3 frag_pos, vec3 view_dir, vec2 texCoords) {
+    // Ambient
+    vec3 ambient = light.color;
+    // diffuse shadi
+    vec3 lightDir = normalize(light.position - frag_pos);
+    float diff = max(dot(normal, lightDir), 0.0);
+    vec3 diffuse = ambient * diff;
+     // Specul
+    vec3 halfwayDir = normalize(lightDir + view_dir);  
+    float spec = pow(max(dot(normal, halfwayDir), 0.0), 20.1);
+    vec3 specular = light.color * spec;
+    // attenuati
+    float distance = length(light.position - frag_pos);
+    float attenuation = 1.0 / (1.0 + LIGHT_LINEAR * distance + LIGHT_QUADRATIC * distance * distance);      
+	return (diffuse + specular) * light.intensity * attenuation;
+}
+
+void main() {
+	ivec2 size = textureSize(uDepthTexture, 0);
+	ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+	bool inside = all(lessThan(pixel, size));
+
+	float depth = inside ? texelFetch(uDepthTexture, pixel, 0).r : 1.0;
+	bool background = depth >= 1.0;
+	// Positive view depth, glm::perspective projection
+	float viewDepth = uProjection[3][2] / (depth * 2.0 - 1.0 + uProjection[2][2]);
+
+	if (gl_LocalInvocationIndex == 0u) {
+		sMinDepth = 0xFFFFFFFFu;
+		sMaxDepth = 0u;
+		sLightCount = 0u;
+
+		// Side planes of the tile in view space, pointing inside: a point is right of
+		// the left side when clip.x >= ndcMin.x * clip.w, and so on
+		vec2 ndcMin = vec2(gl_WorkGroupID.xy * TILE_SIZE) / vec2(size) * 2.0 - 1.0;
+		vec2 ndcMax = vec2((gl_WorkGroupID.xy + 1u) * TILE_SIZE) / vec2(size) * 2.0 - 1.0;
+		vec4 rowX = vec4(uProjection[0][0], uProjection[1][0], uProjection[2][0], uProjection[3][0]);
+		vec4 rowY = vec4(uProjection[0][1], uProjection[1][1], uProjection[2][1], uProjection[3][1]);
+		vec4 rowW = vec4(uProjection[0][3], uProjection[1][3], uProjection[2][3], uProjection[3][3]);
+		sPlanes[0] = rowX - ndcMin.x * rowW;
+		sPlanes[1] = ndcMax.x * rowW - rowX;
+		sPlanes[2] = rowY - ndcMin.y * rowW;
+		sPlanes[3] = ndcMax.y * rowW - rowY;
+		for (int i = 0; i < 4; ++i)
+			sPlanes[i] /= length(sPlanes[i].xyz);
+	}
+	barrier();
+
+	if (!background) {
+		atomicMin(sMinDepth, floatBitsToUint(viewDepth));
+		atomicMax(sMaxDepth, floatBitsToUint(viewDepth));
+	}
+	barrier();
+
+	// Point lights that reach the depth range of the tile, a light per thread
+	if (sMaxDepth > 0u) {
+		float minDepth = uintBitsToFloat(sMinDepth);
+		float maxDepth = uintBitsToFloat(sMaxDepth);
+		for (uint i = uDirectionalLightCount + gl_LocalInvocationIndex; i < uLightCount; i += TILE_SIZE * TILE_SIZE) {
+			Light light = uLights[i];
+			vec3 center = (uView * vec4(light.position, 1.0)).xyz;
+			bool visible = -center.z + light.range > minDepth && -center.z - light.range < maxDepth;
+			for (int p = 0; p < 4 && visible; ++p)
+				visible = dot(sPlanes[p].xyz, center) + sPlanes[p].w > -light.range;
+
+			if (visible) {
+				uint slot = atomicAdd(sLightCount, 1u);
+				if (slot < MAX_TILE_LIGHTS)
+					sLights[slot] = i;
+			}
+		}
+	}
+	barrier();
+
+	if (!inside)
+		return;
+
+	vec3 diffuseCol = texelFetch(uAlbedoTexture, pixel, 0).rgb;
+	vec3 result = vec3(0.5);
+
+	if (!background) {
+		vec2 texCoords = (vec2(pixel) + 0.5) / vec2(size);
+#ifdef COMPACT_GBUFFER
+		vec3 fragPos = ReconstructPosition(texCoords, depth);
+		vec3 norms = DecodeNormal(texelFetch(uNormalsTexture, pixel, 0).rg);
+#else
+		vec3 fragPos = texelFetch(uPositionTexture, pixel, 0).rgb;
+		vec3 norms = texelFetch(uNormalsTexture, pixel, 0).rgb;
+#endif
+		vec3 viewDir = normalize(uCameraPos - fragPos);
+
+		result = vec3(0.0);
+		for (uint i = 0; i < uDirectionalLightCount; ++i)
+			result += CalculateDirectionalLight(uLights[i], norms, viewDir, texCoords);
+
+		uint tileLightCount = min(sLightCount, uint(MAX_TILE_LIGHTS));
+		for (uint i = 0; i < tileLightCount; ++i)
+			result += CalculatePointLight(uLights[sLights[i]], norms, fragPos, viewDir, texCoords);
+	}
+
+	imageStore(uOutput, pixel, vec4(result * diffuseCol, 1.0));
+}
+
+#endif
+#endif
+
+#ifdef LIGHT_VOLUME
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location=0) in vec3 aPos;
+
+struct Light
+{
+	vec3 			position;
+	float 			intensity;
+	vec3 			color;
+	uint 			type; // 0: dir, 1: point
+	vec3 			direction;
+	float 			range;
+};
+
+// Lights and clusters of the frame, see light_clusters.h
+layout(binding = 0, std140) uniform GlobalParms
+{
+	vec3 			uCameraPos;
+	uint 			uDirectionalLightCount;
+	uvec2 			uClusterTileSize;	// In pixels
+	vec2 			uClusterSlice;		// slice = log(depth) * x + y
+	uvec3 			uClusterGrid;
+	uint 			uLightCount;
+};
+
+// The directional lights first, then the point lights
+layout(binding = 7, std430) readonly buffer LightBuffer
+{
+	Light 			uLights[];
+};
+
+// View of the G-buffer pass, see render_view.h
+layout(binding = 3, std140) uniform ViewParms
+{
+	mat4 			uView;
+	mat4 			uProjection;
+	mat4 			uViewProjection;
+	vec4 			uFrustumPlanes[6];
+	vec4 			uClipPlane;
+	vec3 			uViewPos;
+	mat4 			uInverseViewProjection;
+};
+
+// The triangles of renderSphere are inside the unit sphere, the volume must contain it
+#define VOLUME_SCALE 1.01
+
+flat out uint vLightIdx;
+
+void main() {
+	// An instance per point light
+	vLightIdx = uDirectionalLightCount + uint(gl_InstanceID);
+	Light light = uLights[vLightIdx];
+
+	gl_Position = uViewProjection * vec4(light.position + aPos * light.range * VOLUME_SCALE, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+struct Light
+{
+	vec3 			position;
+	float 			intensity;
+	vec3 			color;
+	uint 			type; // 0: dir, 1: point
+	vec3 			direction;
+	float 			range;
+};
+
+// Lights and clusters of the frame, see light_clusters.h
+layout(binding = 0, std140) uniform GlobalParms
+{
+	vec3 			uCameraPos;
+	uint 			uDirectionalLightCount;
+	uvec2 			uClusterTileSize;	// In pixels
+	vec2 			uClusterSlice;		// slice = log(depth) * x + y
+	uvec3 			uClusterGrid;
+	uint 			uLightCount;
+};
+
+// The directional lights first, then the point lights
+layout(binding = 7, std430) readonly buffer LightBuffer
+{
+	Light 			uLights[];
+};
+
+// Attenuation of the point lights, the same as the range of light_clusters.h
+#define LIGHT_LINEAR 	0.5
+#define LIGHT_QUADRATIC 1.0
+
+#ifdef COMPACT_GBUFFER
+// View of the G-buffer pass, see render_view.h
+layout(binding = 3, std140) uniform ViewParms
+{
+	mat4 			uView;
+	mat4 			uProjection;
+	mat4 			uViewProjection;
+	vec4 			uFrustumPlanes[6];
+	vec4 			uClipPlane;
+	vec3 			uViewPos;
+	mat4 			uInverseViewProjection;
+};
+#endif
+
+layout(binding = 0) uniform sampler2D uPositionTexture;
+layout(binding = 1) uniform sampler2D uNormalsTexture;
+layout(binding = 2) uniform sampler2D uAlbedoTexture;
+layout(binding = 3) uniform sampler2D uDepthTexture;
+
+flat in uint vLightIdx;
+
+layout(location = 0) out vec4 oColor;
+
+#ifdef COMPACT_GBUFFER
+// Normal of the compact G-buffer, octahedral encoded in RG16
+vec3 DecodeNormal(vec2 encoded)
+{
+	encoded = encoded * 2.0 - 1.0;
+	vec3 normal = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+	float t = clamp(-normal.z, 0.0, 1.0);
+	normal.xy += vec2(normal.x >= 0.0 ? -t : t, normal.y >= 0.0 ? -t : t);
+	return normalize(normal);
+}
+
+// World position of a pixel of the compact G-buffer, from its depth
+vec3 ReconstructPosition(vec2 uv, float depth)
+{
+	vec4 position = uInverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+	return position.xyz / position.w;
+}
+#endif
+
+vec3 CalculatePointLight(Light light, vec3 normal, vec3 frag_pos, vec3 view_dir, vec2 texCoords) {
+    // Ambient
+    vec3 ambient = light.color;
+    // diffuse shadi
+    vec3 lightDir = normalize(light.position - frag_pos);
+    float diff = max(dot(normal, lightDir), 0.0);
+    vec3 diffuse = ambient * diff;
+     // Specul
+    vec3 halfwayDir = normalize(lightDir + view_dir);  
+    float spec = pow(max(dot(normal, halfwayDir), 0.0), 20.1);
+    vec3 specular = light.color * spec;
+    // attenuati
+    float distance = length(light.position - frag_pos);
+    float attenuation = 1.0 / (1.0 + LIGHT_LINEAR * distance + LIGHT_QUADRATIC * distance * distance);      
 	return (diffuse + specular) * light.intensity * attenuation;
 }
 
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+#ifdef COMPACT_GBUFFER
+	vec2 texCoords = gl_FragCoord.xy / vec2(textureSize(uDepthTexture, 0));
+	vec3 fragPos = ReconstructPosition(texCoords, texelFetch(uDepthTexture, pixel, 0).r);
+#else
+	vec3 fragPos = texelFetch(uPositionTexture, pixel, 0).rgb;
 #endif
+
+	// The depth test only rejects what is behind the volume
+	Light light = uLights[vLightIdx];
+	if (distance(fragPos, light.position) > light.range)
+		discard;
+
+#ifdef COMPACT_GBUFFER
+	vec3 norms = DecodeNormal(texelFetch(uNormalsTexture, pixel, 0).rg);
+#else
+	vec3 norms = texelFetch(uNormalsTexture, pixel, 0).rgb;
 #endif
+	vec3 diffuseCol = texelFetch(uAlbedoTexture, pixel, 0).rgb;
+	vec3 viewDir = normalize(uCameraPos - fragPos);
 
+	// Added to the directional lighting
+	oColor = vec4(CalculatePointLight(light, norms, fragPos, viewDir, vec2(0.0)) * diffuseCol, 1.0);
+}
 
+#endif
+#endif
 
 #ifdef DRAW_LIGHTS
 
@@ -600,18 +1270,51 @@ void main() {
 layout(location=0) in vec3 aPos;
 layout(location=1) in vec3 aNormals;
 
-uniform mat4 uWorldViewProjectionMatrix;
+#ifdef MULTI_DRAW
+// Index of the draw in the multi-draw, see geometry_storage.h
+layout(location=5) in uint aDrawIndex;
+
+// Per draw (transform index, material index), see SubmitRenderQueueIndirect
+layout(binding = 0, std430) readonly buffer DrawBuffer
+{
+	uvec2 uDraws[];
+};
+
+layout(binding = 2, std430) readonly buffer TransformBuffer
+{
+	mat4 uTransforms[];
+};
+
+flat out uint vMaterialIdx;
+#endif
 
-uniform vec4 plane = vec4(0.0, 1.0, 0.0, 1.0);
+// View of the pass, one block per view (see render_view.h)
+layout(binding = 3, std140) uniform ViewParms
+{
+	mat4 			uView;
+	mat4 			uProjection;
+	mat4 			uViewProjection;
+	vec4 			uFrustumPlanes[6];
+	vec4 			uClipPlane;
+	vec3 			uViewPos;
+	mat4 			uInverseViewProjection;
+};
 
 out vec3 FragPos;
 out vec3 vNormals;
 
 void main() {
-	gl_Position = uWorldViewProjectionMatrix * vec4(aPos, 1.0);
-	FragPos = aPos;
-	gl_ClipDistance[0] = dot(vec4(aPos, 1.0), plane);
-	vNormals = mat3(transpose(inverse(mat4(1.0)))) * aNormals;
+#ifdef MULTI_DRAW
+	mat4 worldMatrix = uTransforms[uDraws[aDrawIndex].x];
+	vMaterialIdx = uDraws[aDrawIndex].y;
+#else
+	mat4 worldMatrix = mat4(1.0);
+#endif
+	vec4 worldPos = worldMatrix * vec4(aPos, 1.0);
+	gl_Position = uViewProjection * worldPos;
+	FragPos = worldPos.xyz;
+	gl_ClipDistance[0] = dot(worldPos, uClipPlane);
+	vNormals = mat3(transpose(inverse(worldMatrix))) * aNormals;
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -621,11 +1324,47 @@ layout(location = 0) out vec4 oColor;
 in vec3 FragPos;
 in vec3 vNormals;
 
-uniform vec3 faceColor;
+#ifdef MULTI_DRAW
+// All the materials, indexed by the material of the draw (see UploadMaterials)
+struct MaterialData
+{
+	vec3 			albedo;
+	float 			smoothness;
+	vec3 			emissive;
+	int 			hasNormalMap;
+	int 			hasBumpMap;
+};
+
+layout(binding = 1, std430) readonly buffer MaterialBuffer
+{
+	MaterialData 	uMaterials[];
+};
+
+// Lights of the water passes (see BindWaterPassParams)
+layout(binding = 1, std140) uniform LocalParms
+{
+	vec3 lightPos;
+	vec3 lightColor;
+};
+
+flat in uint vMaterialIdx;
+
+#define uAlbedoColor 	uMaterials[vMaterialIdx].albedo
+#else
+// Parameters of the material being drawn, one block per material (see UploadMaterials)
+layout(binding = 2, std140) uniform MaterialParms
+{
+	vec3 			uAlbedoColor;
+	vec3 			uEmissiveColor;
+	float 			uSmoothness;
+	int 			uhasNormalMap;
+	int 			uhasBumpMap;
+};
 
 //move
 uniform vec3 lightPos = vec3(5.0, 15.0, 5.0);
 uniform vec3 lightColor = vec3(1.0, 1.0, 1.0);
+#endif
 
 void main() {
 	// ambient
@@ -637,7 +1376,7 @@ void main() {
 	float diff = max(dot(norm, lightDir), 0.0);
 	vec3 diffuse = diff * lightColor;
 
-	vec3 result = max(min((ambient + diffuse), 0.9), 0.3) * faceColor;
+	vec3 result = max(min((ambient + diffuse), 0.9), 0.3) * uAlbedoColor;
 
 	oColor = vec4(result, 1.0);
 }
@@ -645,6 +1384,109 @@ void main() {
 #endif
 #endif
 
+#ifdef FRUSTUM_CULLING
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+// Must match CULLING_GROUP_SIZE
+layout(local_size_x = 64) in;
+
+struct DrawCommand
+{
+	uint 	count;
+	uint 	instanceCount;
+	uint 	firstIndex;
+	int 	baseVertex;
+	uint 	baseInstance;
+};
+
+struct DrawBounds
+{
+	vec3 	aabbMin;
+	uint 	transformIdx;
+	vec3 	aabbMax;
+	uint 	batchIdx;
+};
+
+struct Batch
+{
+	uint 	firstCommand;
+	uint 	visibleCount;
+};
+
+layout(location = 0) uniform vec4 uFrustumPlanes[6];
+layout(location = 6) uniform vec4 uClipPlane;
+layout(location = 7) uniform uint uDrawCount;
+
+layout(binding = 2, std430) readonly buffer TransformBuffer
+{
+	mat4 uTransforms[];
+};
+
+layout(binding = 3, std430) readonly buffer InputCommandBuffer
+{
+	DrawCommand uInputCommands[];
+};
+
+layout(binding = 4, std430) readonly buffer BoundsBuffer
+{
+	DrawBounds uBounds[];
+};
+
+layout(binding = 5, std430) writeonly buffer OutputCommandBuffer
+{
+	DrawCommand uOutputCommands[];
+};
+
+layout(binding = 6, std430) buffer BatchBuffer
+{
+	Batch uBatches[];
+};
+
+// The box is behind the plane if its nearest corner to the plane side is
+bool IsBehindPlane(vec4 plane, vec3 center, vec3 extents)
+{
+	float distance = dot(plane.xyz, center) + plane.w;
+	float radius = dot(abs(plane.xyz), extents);
+	return distance + radius < 0.0;
+}
+
+void main() {
+	uint drawIdx = gl_GlobalInvocationID.x;
+	if (drawIdx >= uDrawCount)
+		return;
+
+	DrawBounds bounds = uBounds[drawIdx];
+	vec3 localCenter = (bounds.aabbMin + bounds.aabbMax) * 0.5;
+	vec3 localExtents = (bounds.aabbMax - bounds.aabbMin) * 0.5;
+
+	// The instances have consecutive transforms, the command is kept if any is visible
+	bool visible = false;
+	uint instanceCount = uInputCommands[drawIdx].instanceCount;
+	for (uint instance = 0u; instance < instanceCount && !visible; ++instance)
+	{
+		mat4 worldMatrix = uTransforms[bounds.transformIdx + instance];
+
+		// World space AABB of the transformed local AABB
+		vec3 center = (worldMatrix * vec4(localCenter, 1.0)).xyz;
+		mat3 absMatrix = mat3(abs(worldMatrix[0].xyz), abs(worldMatrix[1].xyz), abs(worldMatrix[2].xyz));
+		vec3 extents = absMatrix * localExtents;
+
+		visible = !IsBehindPlane(uClipPlane, center, extents);
+		for (int i = 0; i < 6 && visible; ++i)
+			visible = !IsBehindPlane(uFrustumPlanes[i], center, extents);
+	}
+
+	if (visible)
+	{
+		uint slot = atomicAdd(uBatches[bounds.batchIdx].visibleCount, 1u);
+		uOutputCommands[uBatches[bounds.batchIdx].firstCommand + slot] = uInputCommands[drawIdx];
+	}
+}
+
+#endif
+#endif
+
 #ifdef WATER_SHADER
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
@@ -655,20 +1497,26 @@ layout(location=1) in vec2 aTexCoord;
 uniform mat4 uWorldViewProjectionMatrix;
 uniform mat4 uWorldMatrix;
 
+// Of the frames the reflection and refraction were rendered, which may be earlier ones
+uniform mat4 uReflectionViewProjection;
+uniform mat4 uRefractionViewProjection;
+
 uniform vec3 lightPos = vec3(5.0, 15.0, 5.0);
 uniform vec3 cameraPos;
 
 uniform float tiling = 15.0;
 
-out vec4 clipSpace;
+out vec4 reflectionClipSpace;
+out vec4 refractionClipSpace;
 out vec2 vTexCoord;
 out vec3 cameraVector;
 out vec3 lightVector;
 
 void main() {
 	vec4 worldPosition = uWorldMatrix * vec4(aPos, 1.0);
-	clipSpace = uWorldViewProjectionMatrix * worldPosition;
-	gl_Position = clipSpace;
+	gl_Position = uWorldViewProjectionMatrix * worldPosition;
+	reflectionClipSpace = uReflectionViewProjection * worldPosition;
+	refractionClipSpace = uRefractionViewProjection * worldPosition;
 	vTexCoord = (aTexCoord / 2.0 + 0.5) * tiling;
 	cameraVector = cameraPos - worldPosition.xyz;
 	lightVector = worldPosition.xyz - lightPos;
@@ -678,7 +1526,8 @@ void main() {
 
 layout(location = 0) out vec4 oColor;
 
-in vec4 clipSpace;
+in vec4 reflectionClipSpace;
+in vec4 refractionClipSpace;
 in vec2 vTexCoord;
 in vec3 cameraVector;
 in vec3 lightVector;
@@ -699,9 +1548,10 @@ uniform float reflectivity = 0.6;
 
 void main() {
 
-	vec2 ndc = (clipSpace.xy/clipSpace.w) / 2.0 + 0.5;
-	vec2 reflectTexCoords = vec2(ndc.x, -ndc.y);
-	vec2 refractTexCoords = vec2(ndc.x,  ndc.y);
+	// The water is on the plane of the reflection, so projecting it with the views of
+	// the reflection and refraction finds where they saw it, in whatever frame
+	vec2 reflectTexCoords = (reflectionClipSpace.xy / reflectionClipSpace.w) / 2.0 + 0.5;
+	vec2 refractTexCoords = (refractionClipSpace.xy / refractionClipSpace.w) / 2.0 + 0.5;
 
 	float near = 0.1;
 	float far = 1000.0;
@@ -717,8 +1567,7 @@ void main() {
 	vec2 distortion = (texture(dudvMap, distortedTexCoords).rg * 2.0 - 1.0) * waveStrength * clamp(waterDepth / 20.0, 0.0, 1.0);
 
 	reflectTexCoords += distortion;
-	reflectTexCoords.x = clamp(reflectTexCoords.x, 0.001, 0.999);
-	reflectTexCoords.y = clamp(reflectTexCoords.y, -0.999, -0.001);
+	reflectTexCoords = clamp(reflectTexCoords, 0.001, 0.999);
 
 	refractTexCoords += distortion;
 	refractTexCoords = clamp(refractTexCoords, 0.001, 0.999);